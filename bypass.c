@@ -0,0 +1,71 @@
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include "bypass.h"
+#include "socket.h"
+
+#define FILE_REQUEST_MAGIC "MEMFSFIL"
+
+/**
+ * Sent by mem_fs_bypass_request_file before the path. The path is not null terminated.
+ */
+struct file_request {
+    char magic[8];
+    uint32_t path_length;
+    uint32_t reserved;
+};
+
+/**
+ * Sent by mem_fs_bypass_send_file. If error is 0, the memfd follows.
+ */
+struct file_reply {
+    int32_t error;
+    uint32_t reserved;
+    struct stat stbuf;
+};
+
+int mem_fs_bypass_receive_request(int socket_fd, char *path) {
+    struct file_request request;
+    int result = mem_fs_socket_read(socket_fd, &request, sizeof(request));
+    if (result != 0)
+        return result;
+    if (memcmp(request.magic, FILE_REQUEST_MAGIC, sizeof(request.magic)) != 0)
+        return EPROTO;
+    if (request.path_length >= MEM_FS_BYPASS_MAX_PATH)
+        return ENAMETOOLONG;
+    result = mem_fs_socket_read(socket_fd, path, request.path_length);
+    if (result != 0)
+        return result;
+    path[request.path_length] = '\0';
+    return 0;
+}
+
+int mem_fs_bypass_send_file(int socket_fd, int error, int fd, const struct stat *stbuf) {
+    struct file_reply reply = {.error = error};
+    if (error == 0)
+        reply.stbuf = *stbuf;
+    int result = mem_fs_socket_write(socket_fd, &reply, sizeof(reply));
+    if (result != 0 || error != 0)
+        return result;
+    return mem_fs_socket_send_fds(socket_fd, &fd, 1);
+}
+
+int mem_fs_bypass_request_file(int socket_fd, const char *path, int *fd, struct stat *stbuf) {
+    struct file_request request = {.path_length = strlen(path)};
+    if (request.path_length >= MEM_FS_BYPASS_MAX_PATH)
+        return ENAMETOOLONG;
+    memcpy(request.magic, FILE_REQUEST_MAGIC, sizeof(request.magic));
+    struct file_reply reply;
+    int result;
+    if ((result = mem_fs_socket_write(socket_fd, &request, sizeof(request))) != 0 ||
+        (result = mem_fs_socket_write(socket_fd, path, request.path_length)) != 0 ||
+        (result = mem_fs_socket_read(socket_fd, &reply, sizeof(reply))) != 0)
+        return result;
+    if (reply.error != 0)
+        return reply.error;
+    result = mem_fs_socket_receive_fds(socket_fd, fd, 1);
+    if (result != 0)
+        return result;
+    *stbuf = reply.stbuf;
+    return 0;
+}
@@ -0,0 +1,40 @@
+#include <sys/stat.h>
+
+#ifndef MEMFS_BYPASS_H
+#define MEMFS_BYPASS_H
+
+/**
+ * Maximum length of a path which can be requested with mem_fs_bypass_request_file, including the null terminator
+ */
+#define MEM_FS_BYPASS_MAX_PATH 4096
+
+/**
+ * Receives the path which a process requested with mem_fs_bypass_request_file
+ * @param socket_fd A connected bypass socket
+ * @param path The buffer to receive the path in. Must be MEM_FS_BYPASS_MAX_PATH bytes.
+ * @return 0 if everything is ok. Otherwise the error value.
+ */
+int mem_fs_bypass_receive_request(int socket_fd, char *path);
+
+/**
+ * Answers a request of mem_fs_bypass_request_file
+ * @param socket_fd A connected bypass socket
+ * @param error 0 to send the file. Otherwise the error which the other process receives.
+ * @param fd The memfd of file. Not used if error is not 0.
+ * @param stbuf The attributes of file. Not used if error is not 0.
+ * @return 0 if everything is ok. Otherwise the error value.
+ */
+int mem_fs_bypass_send_file(int socket_fd, int error, int fd, const struct stat *stbuf);
+
+/**
+ * Asks a running process for the memfd of a single file. The file stays owned by the other process, and the content
+ * and size of memfd change along the file.
+ * @param socket_fd A connected bypass socket
+ * @param path Path of file in the file system
+ * @param fd Will be set to the received memfd
+ * @param stbuf Will be set to the attributes of file at the time of request
+ * @return 0 if everything is ok. Otherwise the error value which the other process sent or the error of socket.
+ */
+int mem_fs_bypass_request_file(int socket_fd, const char *path, int *fd, struct stat *stbuf);
+
+#endif //MEMFS_BYPASS_H
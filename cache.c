@@ -0,0 +1,208 @@
+#include <errno.h>
+#include <time.h>
+#include "cache.h"
+
+/**
+ * The overrun limit of a cache is its budget plus this fraction of it
+ */
+#define OVERRUN_FRACTION 4
+
+static bool is_in_lru(const struct mem_fs_cache *cache, const struct mem_fs_file *file) {
+    return file->lru_prev != NULL || cache->lru_head == file;
+}
+
+static void lru_remove(struct mem_fs_cache *cache, struct mem_fs_file *file) {
+    if (file->lru_prev != NULL)
+        file->lru_prev->lru_next = file->lru_next;
+    else
+        cache->lru_head = file->lru_next;
+    if (file->lru_next != NULL)
+        file->lru_next->lru_prev = file->lru_prev;
+    else
+        cache->lru_tail = file->lru_prev;
+    file->lru_prev = NULL;
+    file->lru_next = NULL;
+}
+
+static void lru_push_front(struct mem_fs_cache *cache, struct mem_fs_file *file) {
+    file->lru_prev = NULL;
+    file->lru_next = cache->lru_head;
+    if (cache->lru_head != NULL)
+        cache->lru_head->lru_prev = file;
+    else
+        cache->lru_tail = file;
+    cache->lru_head = file;
+}
+
+static void ttl_remove(struct mem_fs_cache *cache, struct mem_fs_file *file) {
+    if (file->ttl_prev != NULL)
+        file->ttl_prev->ttl_next = file->ttl_next;
+    else
+        cache->ttl_head = file->ttl_next;
+    if (file->ttl_next != NULL)
+        file->ttl_next->ttl_prev = file->ttl_prev;
+    file->ttl_prev = NULL;
+    file->ttl_next = NULL;
+}
+
+static void ttl_push(struct mem_fs_cache *cache, struct mem_fs_file *file) {
+    file->ttl_prev = NULL;
+    file->ttl_next = cache->ttl_head;
+    if (cache->ttl_head != NULL)
+        cache->ttl_head->ttl_prev = file;
+    cache->ttl_head = file;
+}
+
+/**
+ * Checks if a file has lived longer than its time to live since its last modification
+ */
+static bool is_expired(const struct mem_fs_file *file, struct timespec now) {
+    time_t age = now.tv_sec - file->times.mtime.tv_sec;
+    return age > file->ttl || (age == file->ttl && now.tv_nsec >= file->times.mtime.tv_nsec);
+}
+
+/**
+ * Signals the eviction thread if there are too many bytes in the cache. Must be called with the mutex held.
+ */
+static void check_pressure(struct mem_fs_cache *cache) {
+    if (cache->stats.resident_bytes > cache->budget)
+        pthread_cond_signal(&cache->pressure_cond);
+}
+
+void mem_fs_cache_init(struct mem_fs_cache *cache, size_t budget) {
+    cache->budget = budget;
+    cache->overrun_limit = budget + budget / OVERRUN_FRACTION;
+    cache->lru_head = NULL;
+    cache->lru_tail = NULL;
+    cache->ttl_head = NULL;
+    cache->stats = (struct mem_fs_cache_stats) {0};
+    cache->stopping = false;
+    pthread_mutex_init(&cache->mutex, NULL);
+    pthread_cond_init(&cache->pressure_cond, NULL);
+}
+
+void mem_fs_cache_destroy(struct mem_fs_cache *cache) {
+    pthread_mutex_destroy(&cache->mutex);
+    pthread_cond_destroy(&cache->pressure_cond);
+}
+
+void mem_fs_cache_access(struct mem_fs_cache *cache, struct mem_fs_file *file) {
+    pthread_mutex_lock(&cache->mutex);
+    if (cache->lru_head != file) {
+        if (is_in_lru(cache, file))
+            lru_remove(cache, file);
+        lru_push_front(cache, file);
+    }
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+void mem_fs_cache_resized(struct mem_fs_cache *cache, struct mem_fs_file *file, size_t old_capacity) {
+    pthread_mutex_lock(&cache->mutex);
+    cache->stats.resident_bytes += file->capacity - old_capacity;
+    if (!is_in_lru(cache, file))
+        lru_push_front(cache, file);
+    check_pressure(cache);
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+void mem_fs_cache_set_ttl(struct mem_fs_cache *cache, struct mem_fs_file *file, time_t ttl) {
+    pthread_mutex_lock(&cache->mutex);
+    if (file->ttl == 0 && ttl != 0) {
+        ttl_push(cache, file);
+        pthread_cond_signal(&cache->pressure_cond); // the thread might be waiting without a timeout
+    } else if (file->ttl != 0 && ttl == 0) {
+        ttl_remove(cache, file);
+    }
+    file->ttl = ttl;
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+void mem_fs_cache_forget(struct mem_fs_cache *cache, struct mem_fs_file *file) {
+    pthread_mutex_lock(&cache->mutex);
+    if (is_in_lru(cache, file))
+        lru_remove(cache, file);
+    if (file->ttl != 0)
+        ttl_remove(cache, file);
+    cache->stats.resident_bytes -= file->capacity;
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+struct mem_fs_entry *mem_fs_cache_evict(struct mem_fs_cache *cache, struct mem_fs *fs) {
+    struct mem_fs_entry *evicted = NULL;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    // Nothing else changes the lists while we have the write lock, but removing a file takes the mutex to forget it.
+    // So the mutex is released around each removal.
+    pthread_mutex_lock(&cache->mutex);
+    struct mem_fs_file *file = cache->ttl_head;
+    while (file != NULL) {
+        struct mem_fs_file *next_file = file->ttl_next;
+        if (is_expired(file, now)) {
+            size_t size = file->capacity;
+            pthread_mutex_unlock(&cache->mutex);
+            struct mem_fs_entry *entry = mem_fs_detach_links(fs, file);
+            entry->next = evicted;
+            evicted = entry;
+            pthread_mutex_lock(&cache->mutex);
+            cache->stats.expirations++;
+            cache->stats.evicted_bytes += size;
+        }
+        file = next_file;
+    }
+    while (cache->stats.resident_bytes > cache->budget && cache->lru_tail != NULL) {
+        file = cache->lru_tail;
+        if (file->capacity == 0) { // removing it frees nothing. It is added back on next access.
+            lru_remove(cache, file);
+            continue;
+        }
+        size_t size = file->capacity;
+        pthread_mutex_unlock(&cache->mutex);
+        struct mem_fs_entry *entry = mem_fs_detach_links(fs, file);
+        entry->next = evicted;
+        evicted = entry;
+        pthread_mutex_lock(&cache->mutex);
+        cache->stats.evictions++;
+        cache->stats.evicted_bytes += size;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    return evicted;
+}
+
+bool mem_fs_cache_overrun(struct mem_fs_cache *cache) {
+    pthread_mutex_lock(&cache->mutex);
+    bool result = cache->stats.resident_bytes > cache->overrun_limit;
+    pthread_mutex_unlock(&cache->mutex);
+    return result;
+}
+
+bool mem_fs_cache_wait(struct mem_fs_cache *cache) {
+    pthread_mutex_lock(&cache->mutex);
+    if (!cache->stopping && cache->stats.resident_bytes <= cache->budget) {
+        if (cache->ttl_head == NULL) {
+            pthread_cond_wait(&cache->pressure_cond, &cache->mutex);
+        } else { // check the expired files every second
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec++;
+            while (!cache->stopping && cache->stats.resident_bytes <= cache->budget)
+                if (pthread_cond_timedwait(&cache->pressure_cond, &cache->mutex, &deadline) == ETIMEDOUT)
+                    break;
+        }
+    }
+    bool result = !cache->stopping;
+    pthread_mutex_unlock(&cache->mutex);
+    return result;
+}
+
+void mem_fs_cache_stop(struct mem_fs_cache *cache) {
+    pthread_mutex_lock(&cache->mutex);
+    cache->stopping = true;
+    pthread_cond_broadcast(&cache->pressure_cond);
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+void mem_fs_cache_stats(struct mem_fs_cache *cache, struct mem_fs_cache_stats *stats) {
+    pthread_mutex_lock(&cache->mutex);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->mutex);
+}
@@ -0,0 +1,149 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "memfs.h"
+
+#ifndef MEMFS_CACHE_H
+#define MEMFS_CACHE_H
+
+struct mem_fs_cache_stats {
+    /**
+     * Bytes of file storage in the cache. Includes the capacity which files reserved beyond their size.
+     */
+    size_t resident_bytes;
+    /**
+     * Number of files removed because the cache went over its budget
+     */
+    uint64_t evictions;
+    /**
+     * Number of files removed because their time to live has passed
+     */
+    uint64_t expirations;
+    /**
+     * Bytes of file storage removed by evictions and expirations
+     */
+    uint64_t evicted_bytes;
+};
+
+/**
+ * Turns the file system into a cache: instead of running out of memory, the least recently used files are removed
+ * when the storage of files goes over a budget. Files can also be given a time to live.
+ */
+struct mem_fs_cache {
+    /**
+     * When resident bytes go over this value, files are removed until they are at most this value
+     */
+    size_t budget;
+    /**
+     * When resident bytes go over this value, the eviction thread is not keeping up and writers evict right away
+     */
+    size_t overrun_limit;
+    /**
+     * Most recently used file
+     */
+    struct mem_fs_file *lru_head;
+    /**
+     * Least recently used file
+     */
+    struct mem_fs_file *lru_tail;
+    /**
+     * Files which have a time to live, in no order
+     */
+    struct mem_fs_file *ttl_head;
+    struct mem_fs_cache_stats stats;
+    /**
+     * True when mem_fs_cache_wait must return
+     */
+    bool stopping;
+    /**
+     * Protects everything in this struct and the cache fields of files
+     */
+    pthread_mutex_t mutex;
+    /**
+     * Signaled when resident bytes go over the budget or a file gets a time to live
+     */
+    pthread_cond_t pressure_cond;
+};
+
+/**
+ * Initializes a cache. Set it with mem_fs_set_cache before creating any file.
+ * @param cache The cache to initialize
+ * @param budget Bytes of file storage which the cache keeps at most
+ */
+void mem_fs_cache_init(struct mem_fs_cache *cache, size_t budget);
+
+/**
+ * Frees the resources of a cache
+ * @param cache The cache
+ */
+void mem_fs_cache_destroy(struct mem_fs_cache *cache);
+
+/**
+ * Marks a file as the most recently used file. Can be called while holding the file system lock in read mode.
+ * @param cache The cache
+ * @param file The file which is accessed
+ */
+void mem_fs_cache_access(struct mem_fs_cache *cache, struct mem_fs_file *file);
+
+/**
+ * Accounts the change of capacity of a file. New files must be passed to this function as well.
+ * @param cache The cache
+ * @param file The file which is resized
+ * @param old_capacity Capacity of file before the change. Zero for new files.
+ */
+void mem_fs_cache_resized(struct mem_fs_cache *cache, struct mem_fs_file *file, size_t old_capacity);
+
+/**
+ * Changes the time to live of a file
+ * @param cache The cache
+ * @param file The file
+ * @param ttl Seconds which the file lives after its last modification. Zero to keep it until it is evicted.
+ */
+void mem_fs_cache_set_ttl(struct mem_fs_cache *cache, struct mem_fs_file *file, time_t ttl);
+
+/**
+ * Stops tracking a file which is detached from the tree
+ * @param cache The cache
+ * @param file The detached file
+ */
+void mem_fs_cache_forget(struct mem_fs_cache *cache, struct mem_fs_file *file);
+
+/**
+ * Removes the expired files, then the least recently used files until the resident bytes are within the budget.
+ * Every link of a removed file is removed. The file system lock must be held in write mode.
+ * @param cache The cache
+ * @param fs The file system which uses the cache
+ * @return The detached entries, linked by their next field. Free them after the lock is released. NULL if nothing
+ * is removed.
+ */
+struct mem_fs_entry *mem_fs_cache_evict(struct mem_fs_cache *cache, struct mem_fs *fs);
+
+/**
+ * Checks if the resident bytes went so far over the budget that mem_fs_cache_evict must be called before the write
+ * lock is released, instead of waiting for the eviction thread
+ * @param cache The cache
+ * @return True if the cache is over its overrun limit
+ */
+bool mem_fs_cache_overrun(struct mem_fs_cache *cache);
+
+/**
+ * Blocks until the resident bytes go over the budget. If some files have a time to live, waits at most a second.
+ * @param cache The cache
+ * @return True if mem_fs_cache_evict must be called, false if mem_fs_cache_stop was called
+ */
+bool mem_fs_cache_wait(struct mem_fs_cache *cache);
+
+/**
+ * Makes mem_fs_cache_wait return false
+ * @param cache The cache
+ */
+void mem_fs_cache_stop(struct mem_fs_cache *cache);
+
+/**
+ * Gets the statistics of cache
+ * @param cache The cache
+ * @param stats The struct to fill the statistics in
+ */
+void mem_fs_cache_stats(struct mem_fs_cache *cache, struct mem_fs_cache_stats *stats);
+
+#endif //MEMFS_CACHE_H
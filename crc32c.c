@@ -0,0 +1,129 @@
+#include <pthread.h>
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define HAVE_SSE42_CRC32
+#endif
+
+/**
+ * Reversed Castagnoli polynomial
+ */
+#define CRC32C_POLYNOMIAL 0x82f63b78u
+
+/**
+ * Table of the portable implementation
+ */
+static uint32_t crc32c_table[256];
+/**
+ * The implementation which is chosen on first call. Works on raw CRCs which are not inverted.
+ */
+static uint32_t (*crc32c_update)(uint32_t crc, const unsigned char *data, size_t length);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_portable(uint32_t crc, const unsigned char *data, size_t length) {
+    while (length--)
+        crc = crc32c_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef HAVE_SSE42_CRC32
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t length) {
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    while (length >= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += sizeof(word);
+        length -= sizeof(word);
+    }
+    crc = (uint32_t) crc64;
+#endif
+    while (length--)
+        crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+#endif
+
+static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+        crc32c_table[i] = crc;
+    }
+    crc32c_update = crc32c_portable;
+#ifdef HAVE_SSE42_CRC32
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_update = crc32c_sse42;
+#endif
+}
+
+uint32_t mem_fs_crc32c(uint32_t crc, const void *data, size_t length) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_update(~crc, data, length);
+}
+
+/**
+ * Multiplies a 32x32 matrix over GF(2) by a vector
+ */
+static uint32_t gf2_matrix_times(const uint32_t *matrix, uint32_t vector) {
+    uint32_t sum = 0;
+    while (vector) {
+        if (vector & 1)
+            sum ^= *matrix;
+        vector >>= 1;
+        matrix++;
+    }
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *matrix) {
+    for (int n = 0; n < 32; n++)
+        square[n] = gf2_matrix_times(matrix, matrix[n]);
+}
+
+/**
+ * Moves a raw CRC over some zero bytes. Same as the method of zlib.
+ */
+static uint32_t crc32c_shift(uint32_t crc, size_t length) {
+    uint32_t even[32], odd[32];
+    // Operator for one zero bit
+    odd[0] = CRC32C_POLYNOMIAL;
+    for (int n = 1; n < 32; n++)
+        odd[n] = 1u << (n - 1);
+    gf2_matrix_square(even, odd); // two zero bits
+    gf2_matrix_square(odd, even); // four zero bits
+    // Apply the operator of each set bit of length
+    do {
+        gf2_matrix_square(even, odd);
+        if (length & 1)
+            crc = gf2_matrix_times(even, crc);
+        length >>= 1;
+        if (length == 0)
+            break;
+        gf2_matrix_square(odd, even);
+        if (length & 1)
+            crc = gf2_matrix_times(odd, crc);
+        length >>= 1;
+    } while (length != 0);
+    return crc;
+}
+
+uint32_t mem_fs_crc32c_combine(uint32_t crc1, uint32_t crc2, size_t length2) {
+    if (length2 == 0)
+        return crc1;
+    return crc32c_shift(crc1, length2) ^ crc2;
+}
+
+void mem_fs_crc32c_shift_init(struct mem_fs_crc32c_shift *shift, size_t length) {
+    // The shift is linear, so each byte of CRC can be moved on its own
+    for (int byte = 0; byte < 4; byte++)
+        for (uint32_t value = 0; value < 256; value++)
+            shift->table[byte][value] = length == 0 ? value << (8 * byte) :
+                                        crc32c_shift(value << (8 * byte), length);
+}
@@ -0,0 +1,52 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef MEMFS_CRC32C_H
+#define MEMFS_CRC32C_H
+
+/**
+ * Moves a CRC over a fixed number of zero bytes with four table lookups. Used to combine many blocks of same size.
+ */
+struct mem_fs_crc32c_shift {
+    uint32_t table[4][256];
+};
+
+/**
+ * Computes the CRC32C (Castagnoli) of a buffer. Uses the SSE4.2 crc32 instruction if the CPU has it.
+ * @param crc The CRC of previous data to continue from. Zero for the first buffer.
+ * @param data The buffer
+ * @param length Length of buffer
+ * @return CRC of previous data followed by this buffer
+ */
+uint32_t mem_fs_crc32c(uint32_t crc, const void *data, size_t length);
+
+/**
+ * Combines the CRCs of two adjacent buffers without reading them
+ * @param crc1 CRC of first buffer
+ * @param crc2 CRC of second buffer
+ * @param length2 Length of second buffer
+ * @return CRC of both buffers
+ */
+uint32_t mem_fs_crc32c_combine(uint32_t crc1, uint32_t crc2, size_t length2);
+
+/**
+ * Creates the tables to combine CRCs of blocks with a fixed length
+ * @param shift The tables to fill
+ * @param length Length of each block
+ */
+void mem_fs_crc32c_shift_init(struct mem_fs_crc32c_shift *shift, size_t length);
+
+/**
+ * Same as mem_fs_crc32c_combine but the length of second buffer is the one of shift tables
+ * @param shift Tables created with mem_fs_crc32c_shift_init
+ * @param crc1 CRC of first buffer
+ * @param crc2 CRC of second buffer
+ * @return CRC of both buffers
+ */
+static inline uint32_t mem_fs_crc32c_shift_combine(const struct mem_fs_crc32c_shift *shift,
+                                                   uint32_t crc1, uint32_t crc2) {
+    return shift->table[0][crc1 & 0xff] ^ shift->table[1][(crc1 >> 8) & 0xff] ^
+           shift->table[2][(crc1 >> 16) & 0xff] ^ shift->table[3][crc1 >> 24] ^ crc2;
+}
+
+#endif //MEMFS_CRC32C_H
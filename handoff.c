@@ -0,0 +1,351 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "handoff.h"
+#include "socket.h"
+
+#define HANDOFF_MAGIC "MEMFSHND"
+/**
+ * Sent before everything else
+ */
+struct handoff_header {
+    char magic[8];
+    uint32_t state_length;
+    uint32_t reserved;
+    uint64_t records_length;
+    uint64_t file_count;
+};
+
+enum handoff_record_type {
+    HANDOFF_FOLDER = 1,
+    HANDOFF_FILE,
+    HANDOFF_QUOTA,
+    /**
+     * Hard link at path to the file at target
+     */
+    HANDOFF_LINK,
+    /**
+     * Symbolic link at path which points to target
+     */
+    HANDOFF_SYMLINK,
+    /**
+     * Access and modification times of path, packed in size and inodes
+     */
+    HANDOFF_TIMES,
+};
+
+/**
+ * Each record is followed by its path and the target of links. Neither is null terminated.
+ */
+struct handoff_record {
+    uint32_t type;
+    uint32_t path_length;
+    /**
+     * Size of file, the byte quota of folder, the length of target of links or the access time
+     */
+    uint64_t size;
+    /**
+     * The inode quota of folder or the modification time
+     */
+    uint64_t inodes;
+};
+
+/**
+ * A growable buffer of records and the fds of files in the same order
+ */
+struct handoff_buffer {
+    char *records;
+    size_t records_length;
+    size_t records_capacity;
+    int *fds;
+    size_t fd_count;
+    size_t fd_capacity;
+};
+
+/**
+ * Appends a record to the buffer
+ * @param target The target of links which is appended after path. NULL for other records.
+ * @return True if everything is ok
+ */
+static bool append_record(struct handoff_buffer *buffer, enum handoff_record_type type,
+                          const char *path, size_t path_length, const char *target, uint64_t size, uint64_t inodes) {
+    size_t target_length = target == NULL ? 0 : size;
+    size_t needed = buffer->records_length + sizeof(struct handoff_record) + path_length + target_length;
+    if (needed > buffer->records_capacity) {
+        size_t new_capacity = needed * 2;
+        char *new_records = realloc(buffer->records, new_capacity);
+        if (new_records == NULL)
+            return false;
+        buffer->records = new_records;
+        buffer->records_capacity = new_capacity;
+    }
+    struct handoff_record record = {.type = type, .path_length = path_length, .size = size, .inodes = inodes};
+    memcpy(buffer->records + buffer->records_length, &record, sizeof(record));
+    memcpy(buffer->records + buffer->records_length + sizeof(record), path, path_length);
+    if (target_length != 0)
+        memcpy(buffer->records + buffer->records_length + sizeof(record) + path_length, target, target_length);
+    buffer->records_length = needed;
+    return true;
+}
+
+/**
+ * Appends a record which restores the access and modification times of an entry
+ * @return True if everything is ok
+ */
+static bool append_times(struct handoff_buffer *buffer, const char *path, size_t path_length,
+                         const struct mem_fs_times *times) {
+    return append_record(buffer, HANDOFF_TIMES, path, path_length, NULL,
+                         mem_fs_pack_time(times->atime), mem_fs_pack_time(times->mtime));
+}
+
+/**
+ * Appends the records of everything inside a folder. The quota of folder comes after its content, so restoring the
+ * content is not limited by it.
+ * @param buffer The buffer to append to
+ * @param directory The folder
+ * @param path Buffer which holds the path of folder. Can be reallocated.
+ * @param path_capacity Size of path buffer
+ * @param path_length Length of folder path in buffer
+ * @param second_pass False to append the tree with the first link of each file. True to append the other links,
+ * the quotas and the timestamps, which must come after every file is restored.
+ * @return 0 if everything is ok. Otherwise the error value.
+ */
+static int append_directory(struct handoff_buffer *buffer, const struct mem_fs_directory *directory,
+                            char **path, size_t *path_capacity, size_t path_length, bool second_pass) {
+    for (const struct mem_fs_entry *current_entry = directory->entries;
+         current_entry != NULL;
+         current_entry = current_entry->next) {
+        // Create the path of entry
+        size_t name_length = strlen(current_entry->name);
+        size_t entry_path_length = path_length + 1 + name_length;
+        if (entry_path_length + 1 > *path_capacity) {
+            char *new_path = realloc(*path, (entry_path_length + 1) * 2);
+            if (new_path == NULL)
+                return ENOMEM;
+            *path = new_path;
+            *path_capacity = (entry_path_length + 1) * 2;
+        }
+        (*path)[path_length] = '/';
+        memcpy(*path + path_length + 1, current_entry->name, name_length + 1);
+        switch (current_entry->type) {
+            case CROW_FS_FOLDER: {
+                if (!second_pass && !append_record(buffer, HANDOFF_FOLDER, *path, entry_path_length, NULL, 0, 0))
+                    return ENOMEM;
+                int result = append_directory(buffer, current_entry->data.directory,
+                                              path, path_capacity, entry_path_length, second_pass);
+                if (result != 0)
+                    return result;
+                break;
+            }
+            case CROW_FS_FILE: {
+                const struct mem_fs_file *file = current_entry->data.file;
+                if (second_pass && file->hard_links == current_entry) {
+                    if (!append_times(buffer, *path, entry_path_length, &file->times))
+                        return ENOMEM;
+                    break;
+                }
+                if (!second_pass && file->hard_links != current_entry) // appended in the second pass
+                    break;
+                if (second_pass) {
+                    char *first_link = mem_fs_entry_path(file->hard_links);
+                    bool ok = first_link != NULL && append_record(buffer, HANDOFF_LINK, *path, entry_path_length,
+                                                                  first_link, strlen(first_link), 0);
+                    free(first_link);
+                    if (!ok)
+                        return ENOMEM;
+                    break;
+                }
+                if (file->fd < 0) // only memfds can be passed without copying
+                    return EINVAL;
+                if (!append_record(buffer, HANDOFF_FILE, *path, entry_path_length, NULL, file->size, 0))
+                    return ENOMEM;
+                if (buffer->fd_count == buffer->fd_capacity) {
+                    size_t new_capacity = buffer->fd_capacity == 0 ? 64 : buffer->fd_capacity * 2;
+                    int *new_fds = realloc(buffer->fds, new_capacity * sizeof(int));
+                    if (new_fds == NULL)
+                        return ENOMEM;
+                    buffer->fds = new_fds;
+                    buffer->fd_capacity = new_capacity;
+                }
+                buffer->fds[buffer->fd_count++] = file->fd;
+                break;
+            }
+            case CROW_FS_LINK:
+                if (second_pass ? !append_times(buffer, *path, entry_path_length, &current_entry->data.link->times) :
+                    !append_record(buffer, HANDOFF_SYMLINK, *path, entry_path_length,
+                                   current_entry->data.link->target, current_entry->data.link->length, 0))
+                    return ENOMEM;
+                break;
+        }
+    }
+    if (!second_pass)
+        return 0;
+    // Quota and timestamps of the folder itself
+    size_t directory_path_length = path_length == 0 ? 1 : path_length;
+    (*path)[0] = '/';
+    if (directory->quota.bytes != 0 || directory->quota.inodes != 0)
+        if (!append_record(buffer, HANDOFF_QUOTA, *path, directory_path_length, NULL,
+                           directory->quota.bytes, directory->quota.inodes))
+            return ENOMEM;
+    if (!append_times(buffer, *path, directory_path_length, &directory->times))
+        return ENOMEM;
+    return 0;
+}
+
+int mem_fs_handoff_send(int socket_fd, const struct mem_fs *fs, int session_fd,
+                        const void *state, uint32_t state_length) {
+    if (state_length > MEM_FS_HANDOFF_MAX_STATE)
+        return EINVAL;
+    // Serialize the tree
+    struct handoff_buffer buffer = {0};
+    size_t path_capacity = 256;
+    char *path = malloc(path_capacity);
+    if (path == NULL)
+        return ENOMEM;
+    int result = append_directory(&buffer, &fs->root, &path, &path_capacity, 0, false);
+    if (result == 0)
+        result = append_directory(&buffer, &fs->root, &path, &path_capacity, 0, true);
+    free(path);
+    if (result != 0)
+        goto end;
+    // Send the metadata and then the fds
+    struct handoff_header header = {
+            .state_length = state_length,
+            .records_length = buffer.records_length,
+            .file_count = buffer.fd_count,
+    };
+    memcpy(header.magic, HANDOFF_MAGIC, sizeof(header.magic));
+    if ((result = mem_fs_socket_write(socket_fd, &header, sizeof(header))) != 0 ||
+        (result = mem_fs_socket_write(socket_fd, state, state_length)) != 0 ||
+        (result = mem_fs_socket_write(socket_fd, buffer.records, buffer.records_length)) != 0 ||
+        (result = mem_fs_socket_send_fds(socket_fd, &session_fd, 1)) != 0)
+        goto end;
+    for (size_t sent = 0; sent < buffer.fd_count; sent += MEM_FS_SOCKET_MAX_FDS) {
+        size_t count = buffer.fd_count - sent;
+        if (count > MEM_FS_SOCKET_MAX_FDS)
+            count = MEM_FS_SOCKET_MAX_FDS;
+        if ((result = mem_fs_socket_send_fds(socket_fd, buffer.fds + sent, count)) != 0)
+            goto end;
+    }
+    // Wait for the other process to rebuild the tree
+    char ack;
+    result = mem_fs_socket_read(socket_fd, &ack, 1);
+    end:
+    free(buffer.records);
+    free(buffer.fds);
+    return result;
+}
+
+int mem_fs_handoff_receive(int socket_fd, struct mem_fs *fs, int *session_fd,
+                           void *state, uint32_t *state_length) {
+    struct handoff_header header;
+    int result = mem_fs_socket_read(socket_fd, &header, sizeof(header));
+    if (result != 0)
+        return result;
+    if (memcmp(header.magic, HANDOFF_MAGIC, sizeof(header.magic)) != 0 ||
+        header.state_length > MEM_FS_HANDOFF_MAX_STATE)
+        return EPROTO;
+    *state_length = header.state_length;
+    if ((result = mem_fs_socket_read(socket_fd, state, header.state_length)) != 0)
+        return result;
+    char *records = malloc(header.records_length);
+    int *fds = malloc(header.file_count * sizeof(int));
+    char *path = NULL;
+    size_t adopted = 0, received = 0;
+    *session_fd = -1;
+    if ((records == NULL && header.records_length != 0) || (fds == NULL && header.file_count != 0)) {
+        result = ENOMEM;
+        goto end;
+    }
+    if ((result = mem_fs_socket_read(socket_fd, records, header.records_length)) != 0 ||
+        (result = mem_fs_socket_receive_fds(socket_fd, session_fd, 1)) != 0)
+        goto end;
+    while (received < header.file_count) {
+        size_t count = header.file_count - received;
+        if (count > MEM_FS_SOCKET_MAX_FDS)
+            count = MEM_FS_SOCKET_MAX_FDS;
+        if ((result = mem_fs_socket_receive_fds(socket_fd, fds + received, count)) != 0)
+            goto end;
+        received += count;
+    }
+    // Rebuild the tree
+    for (size_t offset = 0; offset < header.records_length;) {
+        struct handoff_record record;
+        if (header.records_length - offset < sizeof(record)) {
+            result = EPROTO;
+            goto end;
+        }
+        memcpy(&record, records + offset, sizeof(record));
+        offset += sizeof(record);
+        // Links have their target after the path
+        size_t target_length = record.type == HANDOFF_LINK || record.type == HANDOFF_SYMLINK ? record.size : 0;
+        if (header.records_length - offset < record.path_length ||
+            header.records_length - offset - record.path_length < target_length) {
+            result = EPROTO;
+            goto end;
+        }
+        char *new_path = realloc(path, record.path_length + 1 + target_length + 1);
+        if (new_path == NULL) {
+            result = ENOMEM;
+            goto end;
+        }
+        path = new_path;
+        memcpy(path, records + offset, record.path_length);
+        path[record.path_length] = '\0';
+        offset += record.path_length;
+        char *target = path + record.path_length + 1;
+        memcpy(target, records + offset, target_length);
+        target[target_length] = '\0';
+        offset += target_length;
+        switch (record.type) {
+            case HANDOFF_FOLDER:
+                result = mem_fs_create_folder(fs, path);
+                break;
+            case HANDOFF_FILE:
+                if (adopted == header.file_count) {
+                    result = EPROTO;
+                    break;
+                }
+                result = mem_fs_adopt_file(fs, path, fds[adopted], record.size);
+                if (result == 0)
+                    adopted++;
+                break;
+            case HANDOFF_QUOTA: {
+                struct mem_fs_usage quota = {.bytes = record.size, .inodes = record.inodes};
+                result = mem_fs_set_quota(fs, path, &quota);
+                break;
+            }
+            case HANDOFF_LINK:
+                result = mem_fs_link(fs, target, path);
+                break;
+            case HANDOFF_SYMLINK:
+                result = mem_fs_symlink(fs, target, path);
+                break;
+            case HANDOFF_TIMES: {
+                struct timespec times[2] = {mem_fs_unpack_time(record.size), mem_fs_unpack_time(record.inodes)};
+                result = mem_fs_set_times(fs, path, times);
+                break;
+            }
+            default:
+                result = EPROTO;
+        }
+        if (result != 0)
+            goto end;
+    }
+    // Let the old process go
+    char ack = 0;
+    result = mem_fs_socket_write(socket_fd, &ack, 1);
+    end:
+    // Close the fds which are not owned by the tree
+    for (size_t i = adopted; i < received; i++)
+        close(fds[i]);
+    if (result != 0 && *session_fd >= 0) {
+        close(*session_fd);
+        *session_fd = -1;
+    }
+    free(records);
+    free(fds);
+    free(path);
+    return result;
+}
@@ -0,0 +1,38 @@
+#include <stdint.h>
+#include "memfs.h"
+
+#ifndef MEMFS_HANDOFF_H
+#define MEMFS_HANDOFF_H
+
+/**
+ * Maximum bytes of opaque state which can be passed along the tree
+ */
+#define MEM_FS_HANDOFF_MAX_STATE 4096
+
+/**
+ * Sends the tree, the memfds of files and the session fd to another process and waits until it has rebuilt the tree.
+ * File contents are not copied. The tree must not change while this function runs and must not change after it
+ * succeeds, because the other process owns the files from then on.
+ * @param socket_fd A connected handoff socket
+ * @param fs The file system. Every file must be backed by a memfd.
+ * @param session_fd The fd of fuse session
+ * @param state Opaque state to pass to the other process
+ * @param state_length Length of state. At most MEM_FS_HANDOFF_MAX_STATE.
+ * @return 0 if the other process has taken over. Otherwise the error value.
+ */
+int mem_fs_handoff_send(int socket_fd, const struct mem_fs *fs, int session_fd,
+                        const void *state, uint32_t state_length);
+
+/**
+ * Receives a tree sent with mem_fs_handoff_send and rebuilds it. The files map the received memfds.
+ * @param socket_fd A connected handoff socket
+ * @param fs An empty file system to rebuild the tree in
+ * @param session_fd Will be set to the received fd of fuse session
+ * @param state The buffer to receive the opaque state in. Must be MEM_FS_HANDOFF_MAX_STATE bytes.
+ * @param state_length Will be set to the length of received state
+ * @return 0 if everything is ok. Otherwise the error value.
+ */
+int mem_fs_handoff_receive(int socket_fd, struct mem_fs *fs, int *session_fd,
+                           void *state, uint32_t *state_length);
+
+#endif //MEMFS_HANDOFF_H
@@ -0,0 +1,700 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/falloc.h>
+#include "journal.h"
+
+#define JOURNAL_MAGIC "MEMFSJNL"
+#define CHECKPOINT_MAGIC "MEMFSCKP"
+/**
+ * Maximum bytes of file data in each write record of a checkpoint
+ */
+#define CHECKPOINT_CHUNK_SIZE (1024 * 1024)
+/**
+ * If this many bytes are waiting for the commit thread, appending blocks until the batch is written
+ */
+#define MAX_PENDING_BYTES (64 * 1024 * 1024)
+
+/**
+ * Header of journal and checkpoint files
+ */
+struct file_header {
+    char magic[8];
+    uint64_t generation;
+};
+
+/**
+ * Header of each record. It is followed by path, new_path and data. None of them are null terminated.
+ */
+struct record_header {
+    /**
+     * FNV-1a of the rest of header and the payload. Used to detect torn writes at the end of journal.
+     */
+    uint32_t checksum;
+    uint32_t op;
+    uint32_t path_length;
+    uint32_t new_path_length;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t data_length;
+};
+
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Fills a record header and computes its checksum
+ */
+static void fill_record_header(struct record_header *header, enum mem_fs_journal_op op,
+                               const char *path, size_t path_length, const char *new_path, size_t new_path_length,
+                               uint64_t offset, uint64_t size, const char *data, size_t data_length) {
+    memset(header, 0, sizeof(*header));
+    header->op = op;
+    header->path_length = (uint32_t) path_length;
+    header->new_path_length = (uint32_t) new_path_length;
+    header->offset = offset;
+    header->size = size;
+    header->data_length = data_length;
+    uint32_t hash = fnv1a(2166136261u, (const char *) header + sizeof(header->checksum),
+                          sizeof(*header) - sizeof(header->checksum));
+    hash = fnv1a(hash, path, path_length);
+    hash = fnv1a(hash, new_path, new_path_length);
+    header->checksum = fnv1a(hash, data, data_length);
+}
+
+/**
+ * Joins the journal directory and a file name
+ * @return The path allocated with malloc
+ */
+static char *journal_file_path(const char *directory, const char *name) {
+    char *path = malloc(strlen(directory) + strlen(name) + 2);
+    if (path != NULL)
+        sprintf(path, "%s/%s", directory, name);
+    return path;
+}
+
+/**
+ * Writes the whole buffer to a file descriptor
+ * @return 0 if everything is ok. Otherwise the errno.
+ */
+static int write_fully(int fd, const char *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, buffer, length);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        buffer += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/**
+ * Applies a single record to the tree. Operations were successful when they were journaled, so errors are ignored.
+ */
+static void apply_record(struct mem_fs *fs, const struct record_header *header,
+                         const char *path, const char *new_path, const char *data) {
+    switch (header->op) {
+        case MEM_FS_JOURNAL_CREATE:
+            mem_fs_create_file(fs, path, 0);
+            break;
+        case MEM_FS_JOURNAL_MKDIR:
+            mem_fs_create_folder(fs, path);
+            break;
+        case MEM_FS_JOURNAL_WRITE:
+            mem_fs_write(fs, path, header->data_length, data, (off_t) header->offset);
+            break;
+        case MEM_FS_JOURNAL_TRUNCATE:
+            mem_fs_resize_file(fs, path, header->size);
+            break;
+        case MEM_FS_JOURNAL_UNLINK:
+            mem_fs_rm_file(fs, path);
+            break;
+        case MEM_FS_JOURNAL_RMDIR:
+            mem_fs_rm_dir(fs, path);
+            break;
+        case MEM_FS_JOURNAL_RENAME:
+            mem_fs_rename(fs, path, new_path);
+            break;
+        case MEM_FS_JOURNAL_ALLOCATE:
+            mem_fs_fallocate(fs, path, 0, (off_t) header->offset, header->size);
+            break;
+        case MEM_FS_JOURNAL_PUNCH_HOLE:
+            mem_fs_fallocate(fs, path, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                             (off_t) header->offset, header->size);
+            break;
+        case MEM_FS_JOURNAL_ZERO_RANGE:
+            mem_fs_fallocate(fs, path, FALLOC_FL_ZERO_RANGE, (off_t) header->offset, header->size);
+            break;
+        case MEM_FS_JOURNAL_LINK:
+            mem_fs_link(fs, path, new_path);
+            break;
+        case MEM_FS_JOURNAL_SYMLINK:
+            mem_fs_symlink(fs, new_path, path);
+            break;
+        case MEM_FS_JOURNAL_UTIMENS: {
+            struct timespec times[2] = {mem_fs_unpack_time(header->offset), mem_fs_unpack_time(header->size)};
+            mem_fs_set_times(fs, path, times);
+            break;
+        }
+        case MEM_FS_JOURNAL_QUOTA: {
+            struct mem_fs_usage quota = {.bytes = header->offset, .inodes = header->size};
+            mem_fs_set_quota(fs, path, &quota);
+            break;
+        }
+        case MEM_FS_JOURNAL_TIME: {
+            struct timespec time = mem_fs_unpack_time(header->offset);
+            mem_fs_set_clock(fs, &time);
+            break;
+        }
+    }
+}
+
+/**
+ * Replays records of a stream until the end of file or the first invalid record
+ * @param file The stream positioned after the file header
+ * @param fs The file system to apply the records to
+ * @param valid_end Will be set to the offset after the last valid record
+ * @return True if the whole stream was valid, false if a torn or corrupt record was found
+ */
+static bool replay_records(FILE *file, struct mem_fs *fs, off_t *valid_end) {
+    char *payload = NULL;
+    size_t payload_capacity = 0;
+    bool result = true;
+    struct record_header header;
+    *valid_end = ftello(file);
+    while (true) {
+        size_t header_read = fread(&header, 1, sizeof(header), file);
+        if (header_read == 0 && feof(file)) // clean end of stream
+            break;
+        if (header_read != sizeof(header) || header.op < MEM_FS_JOURNAL_CREATE || header.op > MEM_FS_JOURNAL_TIME) {
+            result = false;
+            break;
+        }
+        // Read the payload. Paths are null terminated in memory.
+        size_t payload_length = header.path_length + 1 + header.new_path_length + 1 + header.data_length;
+        if (payload_length > payload_capacity) {
+            char *new_payload = realloc(payload, payload_length);
+            if (new_payload == NULL) {
+                result = false;
+                break;
+            }
+            payload = new_payload;
+            payload_capacity = payload_length;
+        }
+        char *path = payload;
+        char *new_path = path + header.path_length + 1;
+        char *data = new_path + header.new_path_length + 1;
+        if (fread(path, 1, header.path_length, file) != header.path_length ||
+            fread(new_path, 1, header.new_path_length, file) != header.new_path_length ||
+            fread(data, 1, header.data_length, file) != header.data_length) {
+            result = false;
+            break;
+        }
+        path[header.path_length] = '\0';
+        new_path[header.new_path_length] = '\0';
+        // Check the checksum
+        struct record_header expected;
+        fill_record_header(&expected, header.op, path, header.path_length, new_path, header.new_path_length,
+                           header.offset, header.size, data, header.data_length);
+        if (expected.checksum != header.checksum) {
+            result = false;
+            break;
+        }
+        apply_record(fs, &header, path, new_path, data);
+        *valid_end = ftello(file);
+    }
+    mem_fs_set_clock(fs, NULL);
+    free(payload);
+    return result;
+}
+
+/**
+ * Writes a record to a checkpoint stream
+ * @return True if everything is ok
+ */
+static bool write_checkpoint_record(FILE *file, enum mem_fs_journal_op op, const char *path, size_t path_length,
+                                    const char *new_path, size_t new_path_length,
+                                    uint64_t offset, uint64_t size, const char *data, size_t data_length) {
+    struct record_header header;
+    fill_record_header(&header, op, path, path_length, new_path, new_path_length, offset, size, data, data_length);
+    // new_path and data are NULL when they are empty, which fwrite does not accept
+    return fwrite(&header, sizeof(header), 1, file) == 1 &&
+           fwrite(path, 1, path_length, file) == path_length &&
+           (new_path_length == 0 || fwrite(new_path, 1, new_path_length, file) == new_path_length) &&
+           (data_length == 0 || fwrite(data, 1, data_length, file) == data_length);
+}
+
+/**
+ * Writes a record which makes the following records be replayed at a time
+ * @return True if everything is ok
+ */
+static bool write_checkpoint_clock(FILE *file, struct timespec time) {
+    return write_checkpoint_record(file, MEM_FS_JOURNAL_TIME, "", 0, NULL, 0, mem_fs_pack_time(time), 0, NULL, 0);
+}
+
+/**
+ * Writes the records which restore the timestamps of an entry. Setting the times changes the ctime, so the clock is
+ * set to the ctime first.
+ * @return True if everything is ok
+ */
+static bool write_checkpoint_times(FILE *file, const char *path, size_t path_length, const struct mem_fs_times *times) {
+    return write_checkpoint_clock(file, times->ctime) &&
+           write_checkpoint_record(file, MEM_FS_JOURNAL_UTIMENS, path, path_length, NULL, 0,
+                                   mem_fs_pack_time(times->atime), mem_fs_pack_time(times->mtime), NULL, 0);
+}
+
+/**
+ * Writes a record which restores the quota of a folder. Nothing is written if the folder has no quota.
+ * @return True if everything is ok
+ */
+static bool write_checkpoint_quota(FILE *file, const char *path, size_t path_length,
+                                   const struct mem_fs_directory *directory) {
+    if (directory->quota.bytes == 0 && directory->quota.inodes == 0)
+        return true;
+    return write_checkpoint_record(file, MEM_FS_JOURNAL_QUOTA, path, path_length, NULL, 0,
+                                   directory->quota.bytes, directory->quota.inodes, NULL, 0);
+}
+
+/**
+ * Writes a folder and everything inside it to a checkpoint stream
+ * @param file The checkpoint stream
+ * @param fs The file system which holds the folder
+ * @param directory The folder to write
+ * @param path Buffer which holds the path of folder. Can be reallocated.
+ * @param path_capacity Size of path buffer
+ * @param path_length Length of folder path in buffer
+ * @param second_pass False to write the tree with the first link of each file. True to write the other links, the
+ * quotas and the timestamps, which must come after the whole tree exists. The first link might come later in the tree
+ * and creating an entry modifies its folder.
+ * @return True if everything is ok
+ */
+static bool write_checkpoint_directory(FILE *file, const struct mem_fs *fs, const struct mem_fs_directory *directory,
+                                       char **path, size_t *path_capacity, size_t path_length, bool second_pass) {
+    for (const struct mem_fs_entry *current_entry = directory->entries;
+         current_entry != NULL;
+         current_entry = current_entry->next) {
+        // Create the path of entry
+        size_t name_length = strlen(current_entry->name);
+        size_t entry_path_length = path_length + 1 + name_length;
+        if (entry_path_length + 1 > *path_capacity) {
+            char *new_path = realloc(*path, (entry_path_length + 1) * 2);
+            if (new_path == NULL)
+                return false;
+            *path = new_path;
+            *path_capacity = (entry_path_length + 1) * 2;
+        }
+        (*path)[path_length] = '/';
+        memcpy(*path + path_length + 1, current_entry->name, name_length + 1);
+        // Write it
+        switch (current_entry->type) {
+            case CROW_FS_FOLDER:
+                if ((!second_pass && !write_checkpoint_record(file, MEM_FS_JOURNAL_MKDIR, *path, entry_path_length,
+                                                              NULL, 0, 0, 0, NULL, 0)) ||
+                    !write_checkpoint_directory(file, fs, current_entry->data.directory,
+                                                path, path_capacity, entry_path_length, second_pass) ||
+                    (second_pass && !write_checkpoint_quota(file, *path, entry_path_length,
+                                                            current_entry->data.directory)) ||
+                    (second_pass && !write_checkpoint_times(file, *path, entry_path_length,
+                                                            &current_entry->data.directory->times)))
+                    return false;
+                break;
+            case CROW_FS_FILE: {
+                const struct mem_fs_file *entry_file = current_entry->data.file;
+                if (second_pass && entry_file->hard_links == current_entry) {
+                    if (!write_checkpoint_times(file, *path, entry_path_length, &entry_file->times))
+                        return false;
+                    break;
+                }
+                if (!second_pass && entry_file->hard_links != current_entry) // written in the second pass
+                    break;
+                if (second_pass) {
+                    char *first_link = mem_fs_entry_path(entry_file->hard_links);
+                    // The link changes the ctime of file, which might be restored already
+                    bool ok = first_link != NULL && write_checkpoint_clock(file, entry_file->times.ctime) &&
+                              write_checkpoint_record(file, MEM_FS_JOURNAL_LINK, first_link, strlen(first_link),
+                                                      *path, entry_path_length, 0, 0, NULL, 0);
+                    free(first_link);
+                    if (!ok)
+                        return false;
+                    break;
+                }
+                if (!write_checkpoint_record(file, MEM_FS_JOURNAL_CREATE, *path, entry_path_length,
+                                             NULL, 0, 0, 0, NULL, 0))
+                    return false;
+                // Spilled files are copied through a buffer instead of being loaded back to memory
+                char *spilled_chunk = NULL;
+                if (entry_file->data == NULL && entry_file->size != 0) {
+                    spilled_chunk = malloc(CHECKPOINT_CHUNK_SIZE);
+                    if (spilled_chunk == NULL)
+                        return false;
+                }
+                bool ok = true;
+                for (size_t offset = 0; ok && offset < entry_file->size; offset += CHECKPOINT_CHUNK_SIZE) {
+                    size_t chunk = entry_file->size - offset;
+                    if (chunk > CHECKPOINT_CHUNK_SIZE)
+                        chunk = CHECKPOINT_CHUNK_SIZE;
+                    const char *data = spilled_chunk;
+                    if (spilled_chunk == NULL)
+                        data = entry_file->data + offset;
+                    else
+                        ok = mem_fs_read_file_data(fs, entry_file, chunk, spilled_chunk, (off_t) offset) == 0;
+                    ok = ok && write_checkpoint_record(file, MEM_FS_JOURNAL_WRITE, *path, entry_path_length,
+                                                       NULL, 0, offset, 0, data, chunk);
+                }
+                free(spilled_chunk);
+                if (!ok)
+                    return false;
+                break;
+            }
+            case CROW_FS_LINK:
+                if (second_pass ? !write_checkpoint_times(file, *path, entry_path_length,
+                                                          &current_entry->data.link->times) :
+                    !write_checkpoint_record(file, MEM_FS_JOURNAL_SYMLINK, *path, entry_path_length,
+                                             current_entry->data.link->target,
+                                             current_entry->data.link->length, 0, 0, NULL, 0))
+                    return false;
+                break;
+        }
+    }
+    return true;
+}
+
+/**
+ * Empties the journal file and writes a new header with the current generation
+ * @return 0 if everything is ok. Otherwise the errno.
+ */
+static int reset_journal_file(struct mem_fs_journal *journal) {
+    struct file_header header;
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.generation = journal->generation;
+    if (ftruncate(journal->fd, 0) != 0)
+        return errno;
+    int result = write_fully(journal->fd, (const char *) &header, sizeof(header));
+    if (result != 0)
+        return result;
+    if (fdatasync(journal->fd) != 0)
+        return errno;
+    journal->journal_size = sizeof(header);
+    return 0;
+}
+
+/**
+ * Checks if the journal has grown enough to be checkpointed. Must be called with the mutex held.
+ */
+static bool is_checkpoint_due(const struct mem_fs_journal *journal) {
+    size_t size = journal->journal_size + journal->committing_length + journal->buffer_length;
+    return journal->error == 0 && size >= journal->checkpoint_size;
+}
+
+static void *commit_thread_main(void *arg) {
+    struct mem_fs_journal *journal = arg;
+    pthread_mutex_lock(&journal->mutex);
+    while (true) {
+        while (journal->buffer_length == 0 && !journal->stopping)
+            pthread_cond_wait(&journal->appended_cond, &journal->mutex);
+        if (journal->buffer_length == 0) // stopping and nothing left to commit
+            break;
+        // Take the whole buffer as one batch. Records appended meanwhile go to the next batch.
+        char *batch = journal->buffer;
+        size_t batch_length = journal->buffer_length;
+        uint64_t batch_end = journal->appended;
+        journal->buffer = NULL;
+        journal->buffer_length = 0;
+        journal->buffer_capacity = 0;
+        journal->committing = true;
+        journal->committing_length = batch_length;
+        pthread_mutex_unlock(&journal->mutex);
+        int result = write_fully(journal->fd, batch, batch_length);
+        if (result == 0 && fdatasync(journal->fd) != 0)
+            result = errno;
+        pthread_mutex_lock(&journal->mutex);
+        journal->committing = false;
+        journal->committing_length = 0;
+        if (result == 0) {
+            journal->journal_size += batch_length;
+            journal->durable = batch_end;
+        } else if (journal->error == 0) {
+            journal->error = result;
+        }
+        // Reuse the batch buffer if possible
+        if (journal->buffer == NULL) {
+            journal->buffer = batch;
+            journal->buffer_capacity = batch_length;
+        } else {
+            free(batch);
+        }
+        pthread_cond_broadcast(&journal->durable_cond);
+    }
+    pthread_mutex_unlock(&journal->mutex);
+    return NULL;
+}
+
+int mem_fs_journal_open(struct mem_fs_journal *journal, const char *directory, struct mem_fs *fs,
+                        size_t checkpoint_size) {
+    memset(journal, 0, sizeof(*journal));
+    journal->fd = -1;
+    journal->checkpoint_size = checkpoint_size;
+    journal->directory = strdup(directory);
+    char *checkpoint_path = journal_file_path(directory, MEM_FS_CHECKPOINT_FILE);
+    char *journal_path = journal_file_path(directory, MEM_FS_JOURNAL_FILE);
+    int result = 0;
+    off_t valid_end;
+    struct file_header header;
+    if (journal->directory == NULL || checkpoint_path == NULL || journal_path == NULL) {
+        result = ENOMEM;
+        goto end;
+    }
+    // Load the checkpoint. It is written atomically so it must be valid.
+    FILE *checkpoint = fopen(checkpoint_path, "rb");
+    if (checkpoint != NULL) {
+        if (fread(&header, sizeof(header), 1, checkpoint) != 1 ||
+            memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 ||
+            !replay_records(checkpoint, fs, &valid_end))
+            result = EIO;
+        journal->generation = header.generation;
+        fclose(checkpoint);
+        if (result != 0)
+            goto end;
+    } else if (errno != ENOENT) {
+        result = errno;
+        goto end;
+    }
+    // Replay the journal on top of it
+    journal->fd = open(journal_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (journal->fd < 0) {
+        result = errno;
+        goto end;
+    }
+    int replay_fd = dup(journal->fd);
+    FILE *journal_file = replay_fd < 0 ? NULL : fdopen(replay_fd, "rb");
+    if (journal_file == NULL) {
+        result = errno;
+        if (replay_fd >= 0)
+            close(replay_fd);
+        goto end;
+    }
+    if (fread(&header, sizeof(header), 1, journal_file) == 1 &&
+        memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) == 0 &&
+        header.generation == journal->generation) {
+        // Drop the torn tail of journal if any
+        if (!replay_records(journal_file, fs, &valid_end) && ftruncate(journal->fd, valid_end) != 0)
+            result = errno;
+        journal->journal_size = valid_end;
+    } else {
+        // New journal or a stale journal of an interrupted checkpoint. The checkpoint already contains it.
+        result = reset_journal_file(journal);
+    }
+    fclose(journal_file);
+    if (result != 0)
+        goto end;
+    pthread_mutex_init(&journal->mutex, NULL);
+    pthread_cond_init(&journal->appended_cond, NULL);
+    pthread_cond_init(&journal->durable_cond, NULL);
+    pthread_cond_init(&journal->checkpoint_cond, NULL);
+    end:
+    free(checkpoint_path);
+    free(journal_path);
+    if (result != 0) {
+        if (journal->fd >= 0)
+            close(journal->fd);
+        free(journal->directory);
+        journal->fd = -1;
+        journal->directory = NULL;
+    }
+    return result;
+}
+
+int mem_fs_journal_start(struct mem_fs_journal *journal) {
+    int result = pthread_create(&journal->commit_thread, NULL, commit_thread_main, journal);
+    journal->started = result == 0;
+    return result;
+}
+
+void mem_fs_journal_close(struct mem_fs_journal *journal) {
+    pthread_mutex_lock(&journal->mutex);
+    journal->stopping = true;
+    pthread_cond_signal(&journal->appended_cond);
+    pthread_mutex_unlock(&journal->mutex);
+    if (journal->started) {
+        pthread_join(journal->commit_thread, NULL);
+    } else if (journal->buffer_length != 0) { // commit the leftovers ourselves
+        if (write_fully(journal->fd, journal->buffer, journal->buffer_length) == 0)
+            fdatasync(journal->fd);
+    }
+    close(journal->fd);
+    free(journal->buffer);
+    free(journal->directory);
+    pthread_mutex_destroy(&journal->mutex);
+    pthread_cond_destroy(&journal->appended_cond);
+    pthread_cond_destroy(&journal->durable_cond);
+    pthread_cond_destroy(&journal->checkpoint_cond);
+    journal->fd = -1;
+    journal->buffer = NULL;
+    journal->directory = NULL;
+}
+
+void mem_fs_journal_append(struct mem_fs_journal *journal, enum mem_fs_journal_op op, const char *path,
+                           const char *new_path, off_t offset, size_t size, const char *data) {
+    size_t path_length = strlen(path);
+    size_t new_path_length = new_path == NULL ? 0 : strlen(new_path);
+    size_t data_length = data == NULL ? 0 : size;
+    size_t record_length = sizeof(struct record_header) + path_length + new_path_length + data_length;
+    pthread_mutex_lock(&journal->mutex);
+    // Apply back pressure if the disk cannot keep up
+    while (journal->buffer_length >= MAX_PENDING_BYTES && journal->error == 0)
+        pthread_cond_wait(&journal->durable_cond, &journal->mutex);
+    if (journal->error != 0)
+        goto end;
+    // Make room for the record
+    if (journal->buffer_length + record_length > journal->buffer_capacity) {
+        size_t new_capacity = (journal->buffer_length + record_length) * 2;
+        char *new_buffer = realloc(journal->buffer, new_capacity);
+        if (new_buffer == NULL) {
+            journal->error = ENOMEM;
+            goto end;
+        }
+        journal->buffer = new_buffer;
+        journal->buffer_capacity = new_capacity;
+    }
+    // Encode it
+    // Records have variable lengths, so the header is built aside and copied to the unaligned buffer
+    struct record_header header;
+    fill_record_header(&header, op, path, path_length, new_path, new_path_length, offset, size, data, data_length);
+    char *record = journal->buffer + journal->buffer_length;
+    memcpy(record, &header, sizeof(header));
+    record += sizeof(header);
+    memcpy(record, path, path_length);
+    record += path_length;
+    if (new_path_length != 0)
+        memcpy(record, new_path, new_path_length);
+    record += new_path_length;
+    if (data_length != 0)
+        memcpy(record, data, data_length);
+    journal->buffer_length += record_length;
+    journal->appended++;
+    pthread_cond_signal(&journal->appended_cond);
+    if (is_checkpoint_due(journal))
+        pthread_cond_signal(&journal->checkpoint_cond);
+    end:
+    pthread_mutex_unlock(&journal->mutex);
+}
+
+void mem_fs_journal_append_time(struct mem_fs_journal *journal, struct timespec time) {
+    // Only the thread which holds the write lock appends, so last_time does not need the mutex
+    uint64_t packed = mem_fs_pack_time(time);
+    if (packed == journal->last_time)
+        return;
+    journal->last_time = packed;
+    mem_fs_journal_append(journal, MEM_FS_JOURNAL_TIME, "", NULL, (off_t) packed, 0, NULL);
+}
+
+int mem_fs_journal_sync(struct mem_fs_journal *journal) {
+    pthread_mutex_lock(&journal->mutex);
+    uint64_t target = journal->appended;
+    while (journal->durable < target && journal->error == 0)
+        pthread_cond_wait(&journal->durable_cond, &journal->mutex);
+    int result = journal->error;
+    pthread_mutex_unlock(&journal->mutex);
+    return result;
+}
+
+bool mem_fs_journal_needs_checkpoint(struct mem_fs_journal *journal) {
+    pthread_mutex_lock(&journal->mutex);
+    bool result = is_checkpoint_due(journal);
+    pthread_mutex_unlock(&journal->mutex);
+    return result;
+}
+
+bool mem_fs_journal_wait_checkpoint(struct mem_fs_journal *journal) {
+    pthread_mutex_lock(&journal->mutex);
+    while (!journal->checkpoints_stopping && !is_checkpoint_due(journal))
+        pthread_cond_wait(&journal->checkpoint_cond, &journal->mutex);
+    bool result = !journal->checkpoints_stopping;
+    pthread_mutex_unlock(&journal->mutex);
+    return result;
+}
+
+void mem_fs_journal_stop_checkpoints(struct mem_fs_journal *journal) {
+    pthread_mutex_lock(&journal->mutex);
+    journal->checkpoints_stopping = true;
+    pthread_cond_broadcast(&journal->checkpoint_cond);
+    pthread_mutex_unlock(&journal->mutex);
+}
+
+int mem_fs_journal_checkpoint(struct mem_fs_journal *journal, const struct mem_fs *fs) {
+    char *checkpoint_path = journal_file_path(journal->directory, MEM_FS_CHECKPOINT_FILE);
+    char *temp_path = journal_file_path(journal->directory, MEM_FS_CHECKPOINT_FILE ".tmp");
+    char *path = NULL;
+    size_t path_capacity = 0;
+    int result = 0;
+    // Holding the lock keeps the commit thread away from the journal file
+    pthread_mutex_lock(&journal->mutex);
+    while (journal->committing)
+        pthread_cond_wait(&journal->durable_cond, &journal->mutex);
+    if (checkpoint_path == NULL || temp_path == NULL) {
+        result = ENOMEM;
+        goto end;
+    }
+    // Write the new checkpoint in a temp file
+    FILE *checkpoint = fopen(temp_path, "wb");
+    if (checkpoint == NULL) {
+        result = errno;
+        goto end;
+    }
+    struct file_header header;
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.generation = journal->generation + 1;
+    errno = 0;
+    bool ok = fwrite(&header, sizeof(header), 1, checkpoint) == 1 &&
+              write_checkpoint_directory(checkpoint, fs, &fs->root, &path, &path_capacity, 0, false) &&
+              write_checkpoint_directory(checkpoint, fs, &fs->root, &path, &path_capacity, 0, true) &&
+              write_checkpoint_quota(checkpoint, "/", 1, &fs->root) &&
+              write_checkpoint_times(checkpoint, "/", 1, &fs->root.times) &&
+              fflush(checkpoint) == 0 && fsync(fileno(checkpoint)) == 0;
+    if (!ok)
+        result = errno != 0 ? errno : EIO;
+    if (fclose(checkpoint) != 0 && result == 0)
+        result = errno;
+    if (result != 0) {
+        unlink(temp_path);
+        goto end;
+    }
+    // Atomically replace the old checkpoint
+    if (rename(temp_path, checkpoint_path) != 0) {
+        result = errno;
+        unlink(temp_path);
+        goto end;
+    }
+    int directory_fd = open(journal->directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directory_fd >= 0) {
+        fsync(directory_fd);
+        close(directory_fd);
+    }
+    // Everything in journal is now in the checkpoint. Start a new journal.
+    journal->generation++;
+    journal->last_time = 0;
+    journal->buffer_length = 0;
+    journal->durable = journal->appended;
+    result = reset_journal_file(journal);
+    if (result != 0) // new records would be ignored on replay
+        journal->error = result;
+    pthread_cond_broadcast(&journal->durable_cond);
+    end:
+    pthread_mutex_unlock(&journal->mutex);
+    free(checkpoint_path);
+    free(temp_path);
+    free(path);
+    return result;
+}
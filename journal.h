@@ -0,0 +1,227 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "memfs.h"
+
+#ifndef MEMFS_JOURNAL_H
+#define MEMFS_JOURNAL_H
+
+/**
+ * Name of the append-only journal file inside the journal directory
+ */
+#define MEM_FS_JOURNAL_FILE "journal"
+/**
+ * Name of the checkpoint file inside the journal directory
+ */
+#define MEM_FS_CHECKPOINT_FILE "checkpoint"
+/**
+ * Default size of journal in bytes which triggers a checkpoint
+ */
+#define MEM_FS_DEFAULT_CHECKPOINT_SIZE (64 * 1024 * 1024)
+
+enum mem_fs_journal_op {
+    MEM_FS_JOURNAL_CREATE = 1,
+    MEM_FS_JOURNAL_MKDIR,
+    MEM_FS_JOURNAL_WRITE,
+    MEM_FS_JOURNAL_TRUNCATE,
+    MEM_FS_JOURNAL_UNLINK,
+    MEM_FS_JOURNAL_RMDIR,
+    MEM_FS_JOURNAL_RENAME,
+    /**
+     * fallocate which grows the file. Preallocation which keeps the size is not journaled.
+     */
+    MEM_FS_JOURNAL_ALLOCATE,
+    /**
+     * fallocate which zeroes a range and keeps the size
+     */
+    MEM_FS_JOURNAL_PUNCH_HOLE,
+    /**
+     * fallocate which zeroes a range and might grow the file
+     */
+    MEM_FS_JOURNAL_ZERO_RANGE,
+    /**
+     * Hard link from path to new_path
+     */
+    MEM_FS_JOURNAL_LINK,
+    /**
+     * Symbolic link at path which points to new_path
+     */
+    MEM_FS_JOURNAL_SYMLINK,
+    /**
+     * Sets the access and modification times which are packed in offset and size
+     */
+    MEM_FS_JOURNAL_UTIMENS,
+    /**
+     * Sets the quota of a folder. Bytes are in offset and inodes in size.
+     */
+    MEM_FS_JOURNAL_QUOTA,
+    /**
+     * The following records were done at the time which is packed in offset. Replay stamps them with it.
+     */
+    MEM_FS_JOURNAL_TIME,
+};
+
+struct mem_fs_journal {
+    /**
+     * The directory which holds the journal and checkpoint files
+     */
+    char *directory;
+    /**
+     * File descriptor of the journal file
+     */
+    int fd;
+    /**
+     * The generation of the current checkpoint. The journal is only replayed on a checkpoint with same generation.
+     */
+    uint64_t generation;
+    /**
+     * The packed time of the last time record in the journal. 0 if the journal has none yet.
+     */
+    uint64_t last_time;
+    /**
+     * Size of the journal file on disk
+     */
+    size_t journal_size;
+    /**
+     * Journal size which makes mem_fs_journal_needs_checkpoint return true
+     */
+    size_t checkpoint_size;
+    /**
+     * Records which are appended but not written to disk yet. Allocated with malloc.
+     */
+    char *buffer;
+    size_t buffer_length;
+    size_t buffer_capacity;
+    /**
+     * Sequence number of the last appended record
+     */
+    uint64_t appended;
+    /**
+     * Sequence number of the last record which is durable on disk
+     */
+    uint64_t durable;
+    /**
+     * Sticky errno of the first failed disk operation. 0 if everything is ok.
+     */
+    int error;
+    /**
+     * True while the commit thread is writing a batch outside the lock
+     */
+    bool committing;
+    /**
+     * Bytes of the batch which the commit thread is writing
+     */
+    size_t committing_length;
+    /**
+     * True when the commit thread must exit
+     */
+    bool stopping;
+    /**
+     * True if the commit thread is running
+     */
+    bool started;
+    /**
+     * True when mem_fs_journal_wait_checkpoint must return false
+     */
+    bool checkpoints_stopping;
+    pthread_mutex_t mutex;
+    /**
+     * Signaled when new records are appended
+     */
+    pthread_cond_t appended_cond;
+    /**
+     * Signaled when a batch is committed
+     */
+    pthread_cond_t durable_cond;
+    /**
+     * Signaled when the journal grows past checkpoint_size
+     */
+    pthread_cond_t checkpoint_cond;
+    pthread_t commit_thread;
+};
+
+/**
+ * Opens the journal in a directory and replays the checkpoint and journal into fs.
+ * @param journal The journal to initialize
+ * @param directory The directory to keep the journal files in. It must exist.
+ * @param fs An empty file system to rebuild the tree in
+ * @param checkpoint_size Size of journal in bytes which makes a checkpoint due
+ * @return 0 if everything is ok. Otherwise the error value.
+ */
+int mem_fs_journal_open(struct mem_fs_journal *journal, const char *directory, struct mem_fs *fs,
+                        size_t checkpoint_size);
+
+/**
+ * Starts the group commit thread. Call this after the process is daemonized, threads do not survive fork.
+ * @param journal An opened journal
+ * @return 0 if everything is ok. Otherwise the error value.
+ */
+int mem_fs_journal_start(struct mem_fs_journal *journal);
+
+/**
+ * Commits all pending records, stops the commit thread and closes the journal.
+ * @param journal The journal to close
+ */
+void mem_fs_journal_close(struct mem_fs_journal *journal);
+
+/**
+ * Appends an operation to the journal. The record becomes durable when the commit thread writes its batch.
+ * Must be called in the same order which the operations are applied to the tree.
+ * @param journal The journal to append to
+ * @param op The operation
+ * @param path The path which operation was applied to
+ * @param new_path The destination of rename and link or target of symlink. NULL for other operations.
+ * @param offset The offset of write or fallocate, the packed access time of utimens or the bytes of quota
+ * @param size Bytes written for write, the new size for truncate, length of fallocate, the packed modification time
+ * of utimens or the inodes of quota
+ * @param data The data written for write. NULL for other operations.
+ */
+void mem_fs_journal_append(struct mem_fs_journal *journal, enum mem_fs_journal_op op, const char *path,
+                           const char *new_path, off_t offset, size_t size, const char *data);
+
+/**
+ * Appends a time record if the time differs from the last one. The records which are appended after it are replayed
+ * with this time, so they get their original timestamps back.
+ * @param journal The journal to append to
+ * @param time The time which the next operation was stamped with
+ */
+void mem_fs_journal_append_time(struct mem_fs_journal *journal, struct timespec time);
+
+/**
+ * Blocks until every record appended before this call is durable on disk.
+ * @param journal The journal to sync
+ * @return 0 if everything is ok. Otherwise the error value.
+ */
+int mem_fs_journal_sync(struct mem_fs_journal *journal);
+
+/**
+ * Checks if the journal has grown enough to be checkpointed
+ * @param journal The journal to check
+ * @return True if mem_fs_journal_checkpoint should be called
+ */
+bool mem_fs_journal_needs_checkpoint(struct mem_fs_journal *journal);
+
+/**
+ * Blocks until the journal has grown enough to be checkpointed. Checkpoints are written by a thread which waits on
+ * this function, so the request which crosses the checkpoint size does not dump the tree itself.
+ * @param journal The journal to wait on
+ * @return True if mem_fs_journal_checkpoint must be called, false if mem_fs_journal_stop_checkpoints was called
+ */
+bool mem_fs_journal_wait_checkpoint(struct mem_fs_journal *journal);
+
+/**
+ * Makes mem_fs_journal_wait_checkpoint return false. Call it before the journal is closed.
+ * @param journal The journal
+ */
+void mem_fs_journal_stop_checkpoints(struct mem_fs_journal *journal);
+
+/**
+ * Writes the whole tree to a new checkpoint and empties the journal. The tree must not change while
+ * this function runs.
+ * @param journal The journal to checkpoint
+ * @param fs The file system
+ * @return 0 if everything is ok. Otherwise the error value.
+ */
+int mem_fs_journal_checkpoint(struct mem_fs_journal *journal, const struct mem_fs *fs);
+
+#endif //MEMFS_JOURNAL_H
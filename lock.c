@@ -0,0 +1,46 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <unistd.h>
+#include "lock.h"
+
+void mem_fs_lock_init(struct mem_fs_lock *lock) {
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (cpus < 1)
+        cpus = 1;
+    lock->slot_count = cpus > MEM_FS_LOCK_MAX_SLOTS ? MEM_FS_LOCK_MAX_SLOTS : (unsigned int) cpus;
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (unsigned int i = 0; i < lock->slot_count; i++)
+        pthread_rwlock_init(&lock->slots[i].lock, &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+}
+
+void mem_fs_lock_destroy(struct mem_fs_lock *lock) {
+    for (unsigned int i = 0; i < lock->slot_count; i++)
+        pthread_rwlock_destroy(&lock->slots[i].lock);
+    lock->slot_count = 0;
+}
+
+unsigned int mem_fs_lock_read(struct mem_fs_lock *lock) {
+    // sched_getcpu is served from the vDSO, so this does not enter the kernel
+    int cpu = sched_getcpu();
+    unsigned int slot = cpu < 0 ? 0 : (unsigned int) cpu % lock->slot_count;
+    pthread_rwlock_rdlock(&lock->slots[slot].lock);
+    return slot;
+}
+
+void mem_fs_unlock_read(struct mem_fs_lock *lock, unsigned int slot) {
+    pthread_rwlock_unlock(&lock->slots[slot].lock);
+}
+
+void mem_fs_lock_write(struct mem_fs_lock *lock) {
+    // Readers hold a single slot, so taking the slots in order cannot deadlock
+    for (unsigned int i = 0; i < lock->slot_count; i++)
+        pthread_rwlock_wrlock(&lock->slots[i].lock);
+}
+
+void mem_fs_unlock_write(struct mem_fs_lock *lock) {
+    for (unsigned int i = lock->slot_count; i > 0; i--)
+        pthread_rwlock_unlock(&lock->slots[i - 1].lock);
+}
@@ -0,0 +1,70 @@
+#include <pthread.h>
+
+#ifndef MEMFS_LOCK_H
+#define MEMFS_LOCK_H
+
+/**
+ * A reader slot of the lock. Each one is on its own cache line, so readers on different CPUs do not share one.
+ */
+struct mem_fs_lock_slot {
+    pthread_rwlock_t lock;
+} __attribute__((aligned(64)));
+
+/**
+ * Maximum number of reader slots. Writers lock every slot, so more slots make writes slower. Past a few slots, readers
+ * rarely meet on the same one, so big machines share the slots between their CPUs.
+ */
+#define MEM_FS_LOCK_MAX_SLOTS 8
+
+/**
+ * A reader-writer lock with reader slots spread between the CPUs. Readers only lock the slot of the CPU which they run
+ * on, so threads on different CPUs mostly do not bounce the same cache line. Writers lock all the slots in order.
+ */
+struct mem_fs_lock {
+    struct mem_fs_lock_slot slots[MEM_FS_LOCK_MAX_SLOTS];
+    /**
+     * Number of slots in use. It is the number of CPUs, capped at MEM_FS_LOCK_MAX_SLOTS.
+     */
+    unsigned int slot_count;
+};
+
+/**
+ * Creates a lock with a slot for each CPU of the machine, up to MEM_FS_LOCK_MAX_SLOTS. The slots prefer writers, so
+ * a steady stream of readers cannot starve a writer which is waiting for every slot.
+ * @param lock The lock to initialize
+ */
+void mem_fs_lock_init(struct mem_fs_lock *lock);
+
+/**
+ * Frees a lock which is not held
+ * @param lock The lock
+ */
+void mem_fs_lock_destroy(struct mem_fs_lock *lock);
+
+/**
+ * Locks the lock for reading
+ * @param lock The lock
+ * @return The locked slot. It must be passed to mem_fs_unlock_read, because the thread might move to another CPU.
+ */
+unsigned int mem_fs_lock_read(struct mem_fs_lock *lock);
+
+/**
+ * Unlocks a lock which is locked with mem_fs_lock_read
+ * @param lock The lock
+ * @param slot The value which mem_fs_lock_read returned
+ */
+void mem_fs_unlock_read(struct mem_fs_lock *lock, unsigned int slot);
+
+/**
+ * Locks the lock for writing
+ * @param lock The lock
+ */
+void mem_fs_lock_write(struct mem_fs_lock *lock);
+
+/**
+ * Unlocks a lock which is locked with mem_fs_lock_write
+ * @param lock The lock
+ */
+void mem_fs_unlock_write(struct mem_fs_lock *lock);
+
+#endif //MEMFS_LOCK_H
@@ -1,72 +1,740 @@
-#define FUSE_USE_VERSION 31
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 312
 
 #include <errno.h>
+#include <fcntl.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include "memfs.h"
+#include "journal.h"
+#include "reclaimer.h"
+#include "spill.h"
+#include "cache.h"
+#include "handoff.h"
+#include "bypass.h"
+#include "socket.h"
+#include "tar.h"
+#include "trace.h"
 
 /**
- * The root of file system
+ * Parts of the kernel protocol which are needed to resume a session of another process.
+ * Same as fuse_in_header, fuse_init_in and fuse_out_header in linux/fuse.h.
  */
-static struct mem_fs_directory fs_root;
-static pthread_rwlock_t fs_mutex = PTHREAD_RWLOCK_INITIALIZER;
+struct kernel_in_header {
+    uint32_t len;
+    uint32_t opcode;
+    uint64_t unique;
+    uint64_t nodeid;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t pid;
+    uint16_t total_extlen;
+    uint16_t padding;
+};
+struct kernel_init_in {
+    uint32_t major;
+    uint32_t minor;
+    uint32_t max_readahead;
+    uint32_t flags;
+    uint32_t flags2;
+    uint32_t unused[11];
+};
+struct kernel_out_header {
+    uint32_t len;
+    int32_t error;
+    uint64_t unique;
+};
+#define KERNEL_OPCODE_INIT 26
+#define KERNEL_NOTIFY_RESEND 7
+/**
+ * Init flags of the kernel. Flags from bit 32 are sent in flags2 of the init request.
+ */
+#define KERNEL_ASYNC_READ (1ULL << 0)
+#define KERNEL_POSIX_LOCKS (1ULL << 1)
+#define KERNEL_ATOMIC_O_TRUNC (1ULL << 3)
+#define KERNEL_EXPORT_SUPPORT (1ULL << 4)
+#define KERNEL_DONT_MASK (1ULL << 6)
+#define KERNEL_FLOCK_LOCKS (1ULL << 10)
+#define KERNEL_HAS_IOCTL_DIR (1ULL << 11)
+#define KERNEL_AUTO_INVAL_DATA (1ULL << 12)
+#define KERNEL_DO_READDIRPLUS (1ULL << 13)
+#define KERNEL_READDIRPLUS_AUTO (1ULL << 14)
+#define KERNEL_ASYNC_DIO (1ULL << 15)
+#define KERNEL_WRITEBACK_CACHE (1ULL << 16)
+#define KERNEL_NO_OPEN_SUPPORT (1ULL << 17)
+#define KERNEL_PARALLEL_DIROPS (1ULL << 18)
+#define KERNEL_HANDLE_KILLPRIV (1ULL << 19)
+#define KERNEL_POSIX_ACL (1ULL << 20)
+#define KERNEL_MAX_PAGES (1ULL << 22)
+#define KERNEL_CACHE_SYMLINKS (1ULL << 23)
+#define KERNEL_NO_OPENDIR_SUPPORT (1ULL << 24)
+#define KERNEL_EXPLICIT_INVAL_DATA (1ULL << 25)
+#define KERNEL_HANDLE_KILLPRIV_V2 (1ULL << 28)
+#define KERNEL_SETXATTR_EXT (1ULL << 29)
+#define KERNEL_INIT_EXT (1ULL << 30)
+#define KERNEL_HAS_EXPIRE_ONLY (1ULL << 35)
+#define KERNEL_DIRECT_IO_ALLOW_MMAP (1ULL << 36)
+#define KERNEL_PASSTHROUGH (1ULL << 37)
+#define KERNEL_NO_EXPORT_SUPPORT (1ULL << 38)
+/**
+ * Pages of the largest request if the kernel does not send FUSE_MAX_PAGES. libfuse shrinks its receive buffer to
+ * this size in that case.
+ */
+#define KERNEL_DEFAULT_MAX_PAGES 32
+/**
+ * Number of threads which answer the processes that bypass fuse. A slow client only holds back its own thread.
+ */
+#define BYPASS_THREADS 4
+/**
+ * Milliseconds which a bypass thread waits for a client to send its request or to take the reply
+ */
+#define BYPASS_TIMEOUT_MS 100
+/**
+ * Unique id of the fake init request. The kernel does not know it, so the reply of libfuse is dropped.
+ */
+#define RESUME_INIT_UNIQUE 0xfffffffffffff000ULL
+
+/**
+ * The init flag of kernel which libfuse turns into each capability. libfuse only keeps the capabilities, so they are
+ * turned back into flags to resume a session of another process. io_uring is left out, because the rings belong to
+ * the old process.
+ */
+static const struct {
+    uint64_t kernel_flag;
+    uint64_t capability;
+} kernel_capabilities[] = {
+        {KERNEL_ASYNC_READ,           FUSE_CAP_ASYNC_READ},
+        {KERNEL_POSIX_LOCKS,          FUSE_CAP_POSIX_LOCKS},
+        {KERNEL_ATOMIC_O_TRUNC,       FUSE_CAP_ATOMIC_O_TRUNC},
+        {KERNEL_EXPORT_SUPPORT,       FUSE_CAP_EXPORT_SUPPORT},
+        {KERNEL_DONT_MASK,            FUSE_CAP_DONT_MASK},
+        {KERNEL_FLOCK_LOCKS,          FUSE_CAP_FLOCK_LOCKS},
+        {KERNEL_HAS_IOCTL_DIR,        FUSE_CAP_IOCTL_DIR},
+        {KERNEL_AUTO_INVAL_DATA,      FUSE_CAP_AUTO_INVAL_DATA},
+        {KERNEL_DO_READDIRPLUS,       FUSE_CAP_READDIRPLUS},
+        {KERNEL_READDIRPLUS_AUTO,     FUSE_CAP_READDIRPLUS_AUTO},
+        {KERNEL_ASYNC_DIO,            FUSE_CAP_ASYNC_DIO},
+        {KERNEL_WRITEBACK_CACHE,      FUSE_CAP_WRITEBACK_CACHE},
+        {KERNEL_NO_OPEN_SUPPORT,      FUSE_CAP_NO_OPEN_SUPPORT},
+        {KERNEL_PARALLEL_DIROPS,      FUSE_CAP_PARALLEL_DIROPS},
+        {KERNEL_HANDLE_KILLPRIV,      FUSE_CAP_HANDLE_KILLPRIV},
+        {KERNEL_POSIX_ACL,            FUSE_CAP_POSIX_ACL},
+        {KERNEL_CACHE_SYMLINKS,       FUSE_CAP_CACHE_SYMLINKS},
+        {KERNEL_NO_OPENDIR_SUPPORT,   FUSE_CAP_NO_OPENDIR_SUPPORT},
+        {KERNEL_EXPLICIT_INVAL_DATA,  FUSE_CAP_EXPLICIT_INVAL_DATA},
+#ifdef FUSE_CAP_HANDLE_KILLPRIV_V2
+        {KERNEL_HANDLE_KILLPRIV_V2,   FUSE_CAP_HANDLE_KILLPRIV_V2},
+#endif
+#ifdef FUSE_CAP_SETXATTR_EXT
+        {KERNEL_SETXATTR_EXT,         FUSE_CAP_SETXATTR_EXT},
+#endif
+#ifdef FUSE_CAP_EXPIRE_ONLY
+        {KERNEL_HAS_EXPIRE_ONLY,      FUSE_CAP_EXPIRE_ONLY},
+#endif
+#ifdef FUSE_CAP_DIRECT_IO_ALLOW_MMAP
+        {KERNEL_DIRECT_IO_ALLOW_MMAP, FUSE_CAP_DIRECT_IO_ALLOW_MMAP},
+#endif
+#ifdef FUSE_CAP_PASSTHROUGH
+        {KERNEL_PASSTHROUGH,          FUSE_CAP_PASSTHROUGH},
+#endif
+#ifdef FUSE_CAP_NO_EXPORT_SUPPORT
+        {KERNEL_NO_EXPORT_SUPPORT,    FUSE_CAP_NO_EXPORT_SUPPORT},
+#endif
+};
+
+/**
+ * The journal of file system. Only used if the journal option is set.
+ */
+static struct mem_fs_journal journal;
+static pthread_t checkpoint_thread;
+static bool checkpoint_thread_started = false;
+/**
+ * Frees the content of deleted files out of the file system lock
+ */
+static struct mem_fs_reclaimer reclaimer;
+/**
+ * Moves cold files to a local file under memory pressure. Only used if the spill option is set.
+ */
+static struct mem_fs_spill spill;
+static pthread_t spill_thread;
+static bool spill_thread_started = false;
+/**
+ * Removes least recently used and expired files. Only used if the cache_size option is set.
+ */
+static struct mem_fs_cache cache;
+static pthread_t cache_thread;
+static bool cache_thread_started = false;
+/**
+ * The state of fuse connection which is passed to the next process on handoff
+ */
+static struct session_state {
+    uint32_t proto_major;
+    uint32_t proto_minor;
+    uint32_t max_readahead;
+    /**
+     * Capabilities which the process enabled. The kernel keeps using them after handoff.
+     */
+    uint32_t want;
+    /**
+     * Largest write which the kernel sends
+     */
+    uint32_t max_write;
+    /**
+     * Pages of the largest request. The receive buffer of libfuse must fit it.
+     */
+    uint32_t max_pages;
+    /**
+     * Init flags which the kernel offered, as in flags and flags2 of the init request
+     */
+    uint64_t kernel_flags;
+} session_state;
+/**
+ * True if the session is taken over from another process and the kernel has already negotiated it
+ */
+static bool session_resumed = false;
+/**
+ * The socket which the next process connects to. -1 if handoff is disabled.
+ */
+static int handoff_listen_fd = -1;
+static pthread_t handoff_thread;
+static bool handoff_thread_started = false;
+/**
+ * The socket which processes that bypass fuse connect to. -1 if bypass is disabled.
+ */
+static int bypass_listen_fd = -1;
+static pthread_t bypass_threads[BYPASS_THREADS];
+static int bypass_threads_started = 0;
+/**
+ * The fuse session which is passed to the next process on handoff
+ */
+static struct fuse_session *handoff_session;
+/**
+ * Records the operations for memfs_replay. Only used if the trace option is set.
+ */
+static struct mem_fs_trace trace;
 
 static struct options {
+    /**
+     * The directory to keep the journal and checkpoints in. NULL if durability is disabled.
+     */
+    const char *journal;
+    /**
+     * Size of journal in bytes which triggers a checkpoint
+     */
+    unsigned long checkpoint_size;
+    /**
+     * The file to spill cold files to. NULL if everything is kept in memory.
+     */
+    const char *spill;
+    /**
+     * Size of spill file in bytes
+     */
+    unsigned long spill_size;
+    /**
+     * Start spilling when file contents in memory go over this many bytes
+     */
+    unsigned long memory_high;
+    /**
+     * Stop spilling when file contents in memory are at most this many bytes
+     */
+    unsigned long memory_low;
+    /**
+     * Keep the content of files in memfds
+     */
+    int memfd;
+    /**
+     * The socket to hand the file system off to a new process. NULL if disabled.
+     */
+    const char *handoff;
+    /**
+     * Take the file system over from the process which listens on the handoff socket
+     */
+    int takeover;
+    /**
+     * Keep CRC32C checksums of files
+     */
+    int checksums;
+    /**
+     * Check the checksums of pages on every read
+     */
+    int verify_reads;
+    /**
+     * Serve the requests in the main thread only. Same as -s.
+     */
+    int single_thread;
+    /**
+     * Maximum number of worker threads. Zero for the default of libfuse.
+     */
+    unsigned int max_threads;
+    /**
+     * Maximum number of idle worker threads. Zero for the default of libfuse.
+     */
+    unsigned int max_idle_threads;
+    /**
+     * Open a separate /dev/fuse fd for each worker thread
+     */
+    int clone_fd;
+    /**
+     * List of CPUs to run the worker threads on, like "0-15,32-47". NULL for all CPUs.
+     */
+    const char *cpus;
+    /**
+     * Maximum size of read requests. Zero for the default of kernel.
+     */
+    unsigned int max_read;
+    /**
+     * Maximum size of write requests. Zero for the default of libfuse.
+     */
+    unsigned int max_write;
+    /**
+     * Maximum number of pending background requests of kernel. Zero for the default of kernel.
+     */
+    unsigned int max_background;
+    /**
+     * Number of pending background requests which makes the kernel mark the file system as congested
+     */
+    unsigned int congestion_threshold;
+    /**
+     * The file to record the operations in. NULL if tracing is disabled.
+     */
+    const char *trace;
+    /**
+     * Read timestamps from the coarse clock
+     */
+    int coarse_clock;
+    /**
+     * The tar archive to fill an empty tree with before mounting. NULL if disabled.
+     */
+    const char *preload;
+    /**
+     * Carry the requests over io_uring instead of reading and writing /dev/fuse
+     */
+    int io_uring;
+    /**
+     * Number of requests in each io_uring queue. Zero for the default of libfuse.
+     */
+    unsigned int io_uring_depth;
+    /**
+     * Bytes of file content to keep before removing the least recently used files. Zero if files are never removed.
+     */
+    unsigned long cache_size;
+    /**
+     * The socket to pass the memfds of files to processes which bypass fuse. NULL if disabled.
+     */
+    const char *bypass;
 } options;
 
+#define OPTION(t, p) { t, offsetof(struct options, p), 1 }
 static const struct fuse_opt option_spec[] = {
+        OPTION("--journal=%s", journal),
+        OPTION("--checkpoint_size=%lu", checkpoint_size),
+        OPTION("--spill=%s", spill),
+        OPTION("--spill_size=%lu", spill_size),
+        OPTION("--memory_high=%lu", memory_high),
+        OPTION("--memory_low=%lu", memory_low),
+        OPTION("--memfd", memfd),
+        OPTION("--handoff=%s", handoff),
+        OPTION("--takeover", takeover),
+        OPTION("--checksums", checksums),
+        OPTION("--verify_reads", verify_reads),
+        OPTION("--single_thread", single_thread),
+        OPTION("--max_threads=%u", max_threads),
+        OPTION("--max_idle_threads=%u", max_idle_threads),
+        OPTION("--clone_fd", clone_fd),
+        OPTION("--cpus=%s", cpus),
+        OPTION("--max_read=%u", max_read),
+        OPTION("--max_write=%u", max_write),
+        OPTION("--max_background=%u", max_background),
+        OPTION("--congestion_threshold=%u", congestion_threshold),
+        OPTION("--trace=%s", trace),
+        OPTION("--coarse_clock", coarse_clock),
+        OPTION("--preload=%s", preload),
+        OPTION("--io_uring", io_uring),
+        OPTION("--io_uring_depth=%u", io_uring_depth),
+        OPTION("--cache_size=%lu", cache_size),
+        OPTION("--bypass=%s", bypass),
         FUSE_OPT_END
 };
 
-static void *mem_fuse_init(struct fuse_conn_info *conn,
-                           struct fuse_config *cfg) {
-    (void) conn;
-    cfg->kernel_cache = 1;
+/**
+ * Gets the file system which fuse serves. Must be called from a fuse handler.
+ */
+static struct mem_fs *get_fs(void) {
+    return fuse_get_context()->private_data;
+}
+
+/**
+ * Appends an operation to the journal if journal is enabled. Must be called while the write lock is held. The time
+ * which the operation was stamped with is journaled before it.
+ */
+static void journal_append(enum mem_fs_journal_op op, const char *path, const char *new_path,
+                           off_t offset, size_t size, const char *data) {
+    if (options.journal == NULL)
+        return;
+    mem_fs_journal_append_time(&journal, mem_fs_last_time(get_fs()));
+    mem_fs_journal_append(&journal, op, path, new_path, offset, size, data);
+}
+
+/**
+ * Gets the start time of an operation for the trace
+ * @return The start time or zero if tracing is disabled
+ */
+static uint64_t trace_start(void) {
+    return options.trace == NULL ? 0 : mem_fs_trace_clock();
+}
+
+/**
+ * Records a finished operation if tracing is enabled. See mem_fs_trace_record for the arguments.
+ * @return The result, to be returned to fuse
+ */
+static int trace_end(enum mem_fs_trace_op op, const char *path, const char *new_path,
+                     off_t offset, size_t size, uint32_t flags, int result, uint64_t start) {
+    if (options.trace != NULL)
+        mem_fs_trace_record(&trace, op, path, new_path, offset, size, flags, result, start);
+    return result;
+}
+
+/**
+ * Evicts cold files whenever the memory usage goes over the high watermark
+ */
+static void *spill_thread_main(void *arg) {
+    struct mem_fs *fs = arg;
+    while (mem_fs_spill_wait_pressure(&spill)) {
+        mem_fs_lock_write(&fs->lock);
+        mem_fs_spill_evict(&spill);
+        mem_fs_unlock_write(&fs->lock);
+    }
     return NULL;
 }
 
-static int mem_fuse_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
-    (void) fi;
-    memset(stbuf, 0, sizeof(struct stat));
-    // Get the entry from file list
-    struct mem_fs_entry entry;
-    pthread_rwlock_rdlock(&fs_mutex);
-    int result = mem_fs_get_entry(&fs_root, path, &entry);
-    if (result != 0) {
-        result = -result;
-        goto end;
+/**
+ * Writes a checkpoint whenever the journal grows past the checkpoint size. The dump runs here instead of in the
+ * request which crossed the size.
+ * @param arg The file system
+ */
+static void *checkpoint_thread_main(void *arg) {
+    struct mem_fs *fs = arg;
+    while (mem_fs_journal_wait_checkpoint(&journal)) {
+        // The tree must not change while it is written
+        mem_fs_lock_write(&fs->lock);
+        int result = 0;
+        if (mem_fs_journal_needs_checkpoint(&journal))
+            result = mem_fs_journal_checkpoint(&journal, fs);
+        mem_fs_unlock_write(&fs->lock);
+        if (result != 0) { // the journal keeps growing, try again later
+            fprintf(stderr, "cannot write a checkpoint: %s\n", strerror(result));
+            sleep(1);
+        }
     }
-    // Check the type
-    switch (entry.type) {
+    return NULL;
+}
+
+/**
+ * Passes the files which the cache removed to the reclaimer
+ * @param evicted The entries which mem_fs_cache_evict returned
+ */
+static void free_evicted(struct mem_fs_entry *evicted) {
+    while (evicted != NULL) {
+        struct mem_fs_entry *next_entry = evicted->next;
+        evicted->next = NULL;
+        mem_fs_reclaimer_free(&reclaimer, evicted);
+        evicted = next_entry;
+    }
+}
+
+/**
+ * Removes files right away if a change pushed the cache far over its budget, because the cache thread could not keep
+ * up with the writers. The file system lock must be held in write mode.
+ * @param fs The file system
+ * @return The removed entries. Pass them to free_evicted after releasing the lock.
+ */
+static struct mem_fs_entry *evict_overrun(struct mem_fs *fs) {
+    if (options.cache_size == 0 || !mem_fs_cache_overrun(&cache))
+        return NULL;
+    return mem_fs_cache_evict(&cache, fs);
+}
+
+/**
+ * Removes files whenever the cache goes over its budget or a file expires
+ * @param arg The file system
+ */
+static void *cache_thread_main(void *arg) {
+    struct mem_fs *fs = arg;
+    while (mem_fs_cache_wait(&cache)) {
+        mem_fs_lock_write(&fs->lock);
+        struct mem_fs_entry *evicted = mem_fs_cache_evict(&cache, fs);
+        mem_fs_unlock_write(&fs->lock);
+        free_evicted(evicted);
+    }
+    return NULL;
+}
+
+/**
+ * Hands the file system off to each process which connects to the handoff socket
+ * @param arg The file system
+ */
+static void *handoff_thread_main(void *arg) {
+    struct mem_fs *fs = arg;
+    while (true) {
+        int client = accept(handoff_listen_fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break; // the socket is shut down
+        }
+        // The tree must not change from now on
+        mem_fs_lock_write(&fs->lock);
+        int result = mem_fs_handoff_send(client, fs, fuse_session_fd(handoff_session),
+                                         &session_state, sizeof(session_state));
+        if (result == 0) // the new process owns everything now and resends the requests which are not answered
+            _exit(0);
+        mem_fs_unlock_write(&fs->lock);
+        close(client);
+        fprintf(stderr, "cannot hand the file system off: %s\n", strerror(result));
+    }
+    return NULL;
+}
+
+/**
+ * Fills the attributes of an entry
+ * @param entry The entry
+ * @param stbuf The attributes to fill
+ */
+static void fill_stat(const struct mem_fs_entry *entry, struct stat *stbuf) {
+    const struct mem_fs_times *times = mem_fs_entry_times(entry);
+    stbuf->st_atim = times->atime;
+    stbuf->st_mtim = times->mtime;
+    stbuf->st_ctim = times->ctime;
+    switch (entry->type) {
         case CROW_FS_FOLDER:
             stbuf->st_mode = S_IFDIR | 0755;
             stbuf->st_nlink = 2;
+            stbuf->st_ino = (ino_t) (uintptr_t) entry->data.directory;
             break;
         case CROW_FS_FILE:
             stbuf->st_mode = S_IFREG | 0777;
-            stbuf->st_nlink = 1;
-            stbuf->st_size = (long) entry.data.file->size;
+            stbuf->st_nlink = entry->data.file->link_count;
+            stbuf->st_ino = (ino_t) (uintptr_t) entry->data.file;
+            stbuf->st_size = (long) entry->data.file->size;
+            // Preallocated bytes are shown in the disk usage
+            stbuf->st_blocks = (blkcnt_t) ((entry->data.file->capacity + 511) / 512);
             break;
         case CROW_FS_LINK:
-            // TODO: later
+            stbuf->st_mode = S_IFLNK | 0777;
+            stbuf->st_nlink = 1;
+            stbuf->st_ino = (ino_t) (uintptr_t) entry->data.link;
+            stbuf->st_size = (long) entry->data.link->length;
             break;
     }
+}
+
+/**
+ * Sends the memfds of files to the processes which bypass fuse with libmemfs_bypass.so. Only the user who mounted the
+ * file system is served, like fuse does without allow_other. BYPASS_THREADS of these accept on the same socket.
+ * @param arg The file system
+ */
+static void *bypass_thread_main(void *arg) {
+    struct mem_fs *fs = arg;
+    char path[MEM_FS_BYPASS_MAX_PATH];
+    while (true) {
+        int client = accept(bypass_listen_fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break; // the socket is shut down
+        }
+        // A stuck client must not hold this thread for long
+        struct ucred credentials;
+        socklen_t credentials_length = sizeof(credentials);
+        struct timeval timeout = {.tv_usec = BYPASS_TIMEOUT_MS * 1000};
+        if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &credentials, &credentials_length) != 0 ||
+            credentials.uid != getuid() ||
+            setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0 ||
+            setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0 ||
+            mem_fs_bypass_receive_request(client, path) != 0) {
+            close(client);
+            continue;
+        }
+        // Sharing trims the memfd to the size of file, and a removed file closes its memfd, so both need the lock
+        struct mem_fs_entry entry;
+        struct stat stbuf = {0};
+        int fd = -1;
+        mem_fs_lock_write(&fs->lock);
+        int result = mem_fs_share_file(fs, path, &fd, &entry);
+        if (result == 0)
+            fill_stat(&entry, &stbuf);
+        mem_fs_unlock_write(&fs->lock);
+        mem_fs_bypass_send_file(client, result, fd, &stbuf);
+        if (fd >= 0)
+            close(fd);
+        close(client);
+    }
+    return NULL;
+}
+
+static void *mem_fuse_init(struct fuse_conn_info *conn,
+                           struct fuse_config *cfg) {
+    struct mem_fs *fs = get_fs();
+    // Hard links of a file share the inode number. Page cache is kept per open, see mem_fuse_open.
+    cfg->use_ino = 1;
+    // Tune the connection. Zero values are left to libfuse and kernel.
+    if (options.max_read != 0)
+        conn->max_read = options.max_read;
+    if (options.max_write != 0)
+        conn->max_write = options.max_write;
+    if (options.max_background != 0)
+        conn->max_background = options.max_background;
+    if (options.congestion_threshold != 0)
+        conn->congestion_threshold = options.congestion_threshold;
+    // The reply to a resumed init is dropped, so the kernel keeps what it has negotiated with the old process
+    if (session_resumed) {
+        conn->want = session_state.want;
+        conn->max_write = session_state.max_write;
+    }
+    session_state.proto_major = conn->proto_major;
+    session_state.proto_minor = conn->proto_minor;
+    session_state.max_readahead = conn->max_readahead;
+    session_state.want = conn->want;
+    session_state.max_write = conn->max_write;
+    session_state.max_pages = (conn->max_write - 1) / getpagesize() + 1;
+    session_state.kernel_flags = 0;
+    for (size_t i = 0; i < sizeof(kernel_capabilities) / sizeof(kernel_capabilities[0]); i++)
+        if ((conn->capable & kernel_capabilities[i].capability) != 0)
+            session_state.kernel_flags |= kernel_capabilities[i].kernel_flag;
+    // Threads must be started after fuse has daemonized the process
+    if (options.journal != NULL && mem_fs_journal_start(&journal) != 0) {
+        fprintf(stderr, "cannot start the journal commit thread\n");
+        fuse_exit(fuse_get_context()->fuse);
+    }
+    if (options.journal != NULL) {
+        if (pthread_create(&checkpoint_thread, NULL, checkpoint_thread_main, fs) == 0)
+            checkpoint_thread_started = true;
+        else // not fatal, the journal grows until the next mount
+            fprintf(stderr, "cannot start the checkpoint thread\n");
+    }
+    if (options.trace != NULL && mem_fs_trace_start(&trace) != 0) // not fatal, records are dropped
+        fprintf(stderr, "cannot start the trace writer thread\n");
+    if (mem_fs_reclaimer_start(&reclaimer) != 0) // not fatal, files are freed inline
+        fprintf(stderr, "cannot start the reclaimer thread\n");
+    if (options.spill != NULL) {
+        if (pthread_create(&spill_thread, NULL, spill_thread_main, fs) == 0)
+            spill_thread_started = true;
+        else
+            fprintf(stderr, "cannot start the spill thread\n");
+    }
+    if (options.cache_size != 0) {
+        if (pthread_create(&cache_thread, NULL, cache_thread_main, fs) == 0)
+            cache_thread_started = true;
+        else
+            fprintf(stderr, "cannot start the cache thread\n");
+    }
+    if (handoff_listen_fd >= 0) {
+        handoff_session = fuse_get_session(fuse_get_context()->fuse);
+        if (pthread_create(&handoff_thread, NULL, handoff_thread_main, fs) == 0)
+            handoff_thread_started = true;
+        else
+            fprintf(stderr, "cannot start the handoff thread\n");
+    }
+    if (bypass_listen_fd >= 0) {
+        while (bypass_threads_started < BYPASS_THREADS &&
+               pthread_create(&bypass_threads[bypass_threads_started], NULL, bypass_thread_main, fs) == 0)
+            bypass_threads_started++;
+        if (bypass_threads_started == 0) // not fatal, the processes fall back to fuse
+            fprintf(stderr, "cannot start the bypass threads\n");
+    }
+    // The return value replaces the private data of fuse
+    return fs;
+}
+
+static void mem_fuse_destroy(void *private_data) {
+    (void) private_data;
+    if (bypass_threads_started != 0) { // every thread which waits in accept wakes up
+        shutdown(bypass_listen_fd, SHUT_RDWR);
+        for (int i = 0; i < bypass_threads_started; i++)
+            pthread_join(bypass_threads[i], NULL);
+    }
+    if (bypass_listen_fd >= 0) {
+        close(bypass_listen_fd);
+        unlink(options.bypass);
+    }
+    if (handoff_thread_started) {
+        shutdown(handoff_listen_fd, SHUT_RDWR);
+        pthread_join(handoff_thread, NULL);
+    }
+    if (handoff_listen_fd >= 0) {
+        close(handoff_listen_fd);
+        unlink(options.handoff);
+    }
+    if (cache_thread_started) { // evicted files go to the reclaimer, so this stops first
+        mem_fs_cache_stop(&cache);
+        pthread_join(cache_thread, NULL);
+    }
+    mem_fs_reclaimer_stop(&reclaimer);
+    if (spill_thread_started) {
+        mem_fs_spill_stop(&spill);
+        pthread_join(spill_thread, NULL);
+    }
+    // A checkpoint reads spilled files, so the checkpoint thread is stopped before the spill file is closed.
+    // Closing the journal only commits the pending records and does not read the tree.
+    if (checkpoint_thread_started) {
+        mem_fs_journal_stop_checkpoints(&journal);
+        pthread_join(checkpoint_thread, NULL);
+    }
+    if (options.journal != NULL)
+        mem_fs_journal_close(&journal);
+    if (options.spill != NULL)
+        mem_fs_spill_destroy(&spill);
+    if (options.cache_size != 0)
+        mem_fs_cache_destroy(&cache);
+    if (options.trace != NULL) {
+        struct mem_fs_trace_stats stats;
+        mem_fs_trace_stats(&trace, &stats);
+        if (stats.dropped != 0)
+            fprintf(stderr, "%lu of trace records are dropped\n", (unsigned long) stats.dropped);
+        mem_fs_trace_close(&trace);
+    }
+}
+
+static int mem_fuse_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+    struct mem_fs *fs = get_fs();
+    (void) fi;
+    uint64_t start = trace_start();
+    memset(stbuf, 0, sizeof(struct stat));
+    // Get the entry from file list
+    struct mem_fs_entry entry;
+    unsigned int slot = mem_fs_lock_read(&fs->lock);
+    int result = mem_fs_get_entry(fs, path, &entry);
+    if (result != 0) {
+        result = -result;
+        goto end;
+    }
+    fill_stat(&entry, stbuf);
     end:
-    pthread_rwlock_unlock(&fs_mutex);
-    return result;
+    mem_fs_unlock_read(&fs->lock, slot);
+    return trace_end(MEM_FS_TRACE_GETATTR, path, NULL, 0, 0, 0, result, start);
 }
 
 static int mem_fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                             off_t offset, struct fuse_file_info *fi,
                             enum fuse_readdir_flags flags) {
+    struct mem_fs *fs = get_fs();
     (void) fi;
     (void) flags;
     (void) offset;
+    uint64_t start = trace_start();
     // Get the folder
     struct mem_fs_entry entry;
-    pthread_rwlock_rdlock(&fs_mutex);
-    int result = mem_fs_get_entry(&fs_root, path, &entry);
+    unsigned int slot = mem_fs_lock_read(&fs->lock);
+    int result = mem_fs_get_entry(fs, path, &entry);
     if (result != 0) {
         result = -result;
         goto end;
@@ -83,20 +751,7 @@ static int mem_fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     // Put them in?
     while (folder_content != NULL) {
         struct stat stbuf = {};
-        switch (folder_content->type) {
-            case CROW_FS_FOLDER:
-                stbuf.st_mode = S_IFDIR | 0755;
-                stbuf.st_nlink = 2;
-                break;
-            case CROW_FS_FILE:
-                stbuf.st_mode = S_IFREG | 0777;
-                stbuf.st_nlink = 1;
-                stbuf.st_size = (long) folder_content->data.file->size;
-                break;
-            case CROW_FS_LINK:
-                // TODO: later
-                break;
-        }
+        fill_stat(folder_content, &stbuf);
         // Put the entry in stuff
         int filler_result = filler(buf, folder_content->name, &stbuf, 0, 0);
         if (filler_result == 1) // buffer full
@@ -105,17 +760,22 @@ static int mem_fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         folder_content = folder_content->next;
     }
     end:
-    pthread_rwlock_unlock(&fs_mutex);
-    return result;
+    mem_fs_unlock_read(&fs->lock, slot);
+    return trace_end(MEM_FS_TRACE_READDIR, path, NULL, 0, 0, 0, result, start);
 }
 
 static int mem_fuse_open(const char *path, struct fuse_file_info *fi) {
+    struct mem_fs *fs = get_fs();
+    uint64_t start = trace_start();
     // Check if it exists
     struct mem_fs_entry entry;
-    pthread_rwlock_wrlock(&fs_mutex);
-    int result = mem_fs_get_entry(&fs_root, path, &entry);
+    mem_fs_lock_write(&fs->lock);
+    int result = mem_fs_get_entry(fs, path, &entry);
     if (result == ENOENT && (fi->flags & O_CREAT) != 0) { // if specified, create the file
-        result = -mem_fs_create_file(&fs_root, path, 0);
+        result = -mem_fs_create_file(fs, path, 0);
+        if (result == 0)
+            journal_append(MEM_FS_JOURNAL_CREATE, path, NULL, 0, 0, NULL);
+        fi->keep_cache = 1;
         goto end;
     }
     if (result != 0) {
@@ -127,86 +787,726 @@ static int mem_fuse_open(const char *path, struct fuse_file_info *fi) {
         result = -EISDIR;
         goto end;
     }
+    // The kernel caches the pages of each path separately. Files with more links might be changed through
+    // another path, so their cache is dropped on each open.
+    fi->keep_cache = entry.type == CROW_FS_FILE && entry.data.file->link_count == 1;
     // Truncate the file if needed
     if ((fi->flags & O_TRUNC) != 0) {
-        result = -mem_fs_resize_file(&fs_root, path, 0);
+        result = -mem_fs_resize_file(fs, path, 0);
+        if (result == 0)
+            journal_append(MEM_FS_JOURNAL_TRUNCATE, path, NULL, 0, 0, NULL);
         goto end;
     }
     end:
-    pthread_rwlock_unlock(&fs_mutex);
-    return result;
+    mem_fs_unlock_write(&fs->lock);
+    return trace_end(MEM_FS_TRACE_OPEN, path, NULL, 0, 0, fi->flags, result, start);
 }
 
 static int mem_fuse_read(const char *path, char *buf, size_t size, off_t offset,
                          struct fuse_file_info *fi) {
+    struct mem_fs *fs = get_fs();
     (void) fi;
-    pthread_rwlock_rdlock(&fs_mutex);
-    int result = mem_fs_read(&fs_root, path, size, buf, offset);
-    pthread_rwlock_unlock(&fs_mutex);
-    return result;
+    uint64_t start = trace_start();
+    unsigned int slot = mem_fs_lock_read(&fs->lock);
+    int result = mem_fs_read(fs, path, size, buf, offset);
+    mem_fs_unlock_read(&fs->lock, slot);
+    return trace_end(MEM_FS_TRACE_READ, path, NULL, offset, size, 0, result, start);
 }
 
 static int mem_fuse_write(const char *path, const char *buf, size_t size, off_t offset,
                           struct fuse_file_info *fi) {
+    struct mem_fs *fs = get_fs();
     (void) fi;
-    pthread_rwlock_wrlock(&fs_mutex);
-    int result = mem_fs_write(&fs_root, path, size, buf, offset);
-    pthread_rwlock_unlock(&fs_mutex);
-    return result;
+    uint64_t start = trace_start();
+    mem_fs_lock_write(&fs->lock);
+    int result = mem_fs_write(fs, path, size, buf, offset);
+    if (result > 0)
+        journal_append(MEM_FS_JOURNAL_WRITE, path, NULL, offset, result, buf);
+    struct mem_fs_entry *evicted = evict_overrun(fs);
+    mem_fs_unlock_write(&fs->lock);
+    free_evicted(evicted);
+    return trace_end(MEM_FS_TRACE_WRITE, path, NULL, offset, size, 0, result, start);
+}
+
+static int mem_fuse_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    struct mem_fs *fs = get_fs();
+    (void) fi;
+    uint64_t start = trace_start();
+    mem_fs_lock_write(&fs->lock);
+    int result = -mem_fs_resize_file(fs, path, size);
+    if (result == 0)
+        journal_append(MEM_FS_JOURNAL_TRUNCATE, path, NULL, 0, size, NULL);
+    struct mem_fs_entry *evicted = evict_overrun(fs);
+    mem_fs_unlock_write(&fs->lock);
+    free_evicted(evicted);
+    return trace_end(MEM_FS_TRACE_TRUNCATE, path, NULL, 0, size, 0, result, start);
+}
+
+static int mem_fuse_rename(const char *from, const char *to, unsigned int flags) {
+    struct mem_fs *fs = get_fs();
+    uint64_t start = trace_start();
+    if (flags != 0) // RENAME_NOREPLACE and RENAME_EXCHANGE are not supported
+        return trace_end(MEM_FS_TRACE_RENAME, from, to, 0, 0, 0, -EINVAL, start);
+    struct mem_fs_entry *replaced;
+    mem_fs_lock_write(&fs->lock);
+    int result = -mem_fs_detach_rename(fs, from, to, &replaced);
+    if (result == 0)
+        journal_append(MEM_FS_JOURNAL_RENAME, from, to, 0, 0, NULL);
+    mem_fs_unlock_write(&fs->lock);
+    if (result == 0 && replaced != NULL)
+        mem_fs_reclaimer_free(&reclaimer, replaced);
+    return trace_end(MEM_FS_TRACE_RENAME, from, to, 0, 0, 0, result, start);
+}
+
+static int mem_fuse_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    (void) fi;
+    uint64_t start = trace_start();
+    // Everything is durable once the journal is
+    int result = options.journal == NULL ? 0 : -mem_fs_journal_sync(&journal);
+    return trace_end(MEM_FS_TRACE_FSYNC, path, NULL, 0, 0, datasync, result, start);
+}
+
+static int mem_fuse_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    struct mem_fs *fs = get_fs();
+    (void) fi;
+    uint64_t start = trace_start();
+    mem_fs_lock_write(&fs->lock);
+    int result = length < 0 ? -EINVAL : -mem_fs_fallocate(fs, path, mode, offset, length);
+    if (result == 0) {
+        // Only the changes of size and content are journaled, capacity is rebuilt when needed
+        if ((mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) == 0) {
+            if ((mode & FALLOC_FL_KEEP_SIZE) == 0)
+                journal_append(MEM_FS_JOURNAL_ALLOCATE, path, NULL, offset, length, NULL);
+        } else if ((mode & FALLOC_FL_KEEP_SIZE) != 0) {
+            journal_append(MEM_FS_JOURNAL_PUNCH_HOLE, path, NULL, offset, length, NULL);
+        } else {
+            journal_append(MEM_FS_JOURNAL_ZERO_RANGE, path, NULL, offset, length, NULL);
+        }
+    }
+    struct mem_fs_entry *evicted = evict_overrun(fs);
+    mem_fs_unlock_write(&fs->lock);
+    free_evicted(evicted);
+    return trace_end(MEM_FS_TRACE_FALLOCATE, path, NULL, offset, length, mode, result, start);
+}
+
+static int mem_fuse_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi) {
+    struct mem_fs *fs = get_fs();
+    (void) fi;
+    uint64_t start = trace_start();
+    struct mem_fs_entry entry;
+    mem_fs_lock_write(&fs->lock);
+    int result = -mem_fs_set_times(fs, path, tv);
+    // Journal the resolved times, so UTIME_NOW is not replayed as the time of replay
+    if (result == 0 && options.journal != NULL && mem_fs_get_entry(fs, path, &entry) == 0) {
+        const struct mem_fs_times *times = mem_fs_entry_times(&entry);
+        journal_append(MEM_FS_JOURNAL_UTIMENS, path, NULL, (off_t) mem_fs_pack_time(times->atime),
+                       mem_fs_pack_time(times->mtime), NULL);
+    }
+    mem_fs_unlock_write(&fs->lock);
+    return trace_end(MEM_FS_TRACE_UTIMENS, path, NULL, 0, 0, 0, result, start);
 }
 
 static int mem_fuse_rmdir(const char *path) {
-    pthread_rwlock_wrlock(&fs_mutex);
-    int result = -mem_fs_rm_dir(&fs_root, path);
-    pthread_rwlock_unlock(&fs_mutex);
-    return result;
+    struct mem_fs *fs = get_fs();
+    uint64_t start = trace_start();
+    mem_fs_lock_write(&fs->lock);
+    int result = -mem_fs_rm_dir(fs, path);
+    if (result == 0)
+        journal_append(MEM_FS_JOURNAL_RMDIR, path, NULL, 0, 0, NULL);
+    mem_fs_unlock_write(&fs->lock);
+    return trace_end(MEM_FS_TRACE_RMDIR, path, NULL, 0, 0, 0, result, start);
 }
 
 static int mem_fuse_rmfile(const char *path) {
-    pthread_rwlock_wrlock(&fs_mutex);
-    int result = -mem_fs_rm_file(&fs_root, path);
-    pthread_rwlock_unlock(&fs_mutex);
+    struct mem_fs *fs = get_fs();
+    uint64_t start = trace_start();
+    struct mem_fs_entry *detached;
+    mem_fs_lock_write(&fs->lock);
+    int result = -mem_fs_detach_file(fs, path, &detached);
+    if (result == 0)
+        journal_append(MEM_FS_JOURNAL_UNLINK, path, NULL, 0, 0, NULL);
+    mem_fs_unlock_write(&fs->lock);
+    // Free the content without blocking other requests
+    if (result == 0)
+        mem_fs_reclaimer_free(&reclaimer, detached);
+    return trace_end(MEM_FS_TRACE_UNLINK, path, NULL, 0, 0, 0, result, start);
+}
+
+/**
+ * Copies the value of an extended attribute to the buffer of getxattr
+ * @param value The value of attribute
+ * @param buffer The buffer of getxattr
+ * @param size Size of buffer. If zero, only the size of value is returned.
+ * @return Size of value or the negative error
+ */
+static int reply_xattr(const char *value, char *buffer, size_t size) {
+    size_t length = strlen(value);
+    if (size == 0)
+        return (int) length;
+    if (size < length)
+        return -ERANGE;
+    memcpy(buffer, value, length);
+    return (int) length;
+}
+
+/**
+ * Gets the value of an extended attribute. See getxattr of fuse for the arguments.
+ */
+static int get_attribute(const char *path, const char *name, char *value, size_t size) {
+    struct mem_fs *fs = get_fs();
+    char attribute[64];
+    // Statistics are attributes of the root folder
+    if (strcmp(path, "/") == 0 && strcmp(name, "user.memfs.reclaim_pending") == 0) {
+        struct mem_fs_reclaimer_stats stats;
+        mem_fs_reclaimer_stats(&reclaimer, &stats);
+        snprintf(attribute, sizeof(attribute), "%zu", stats.pending_bytes);
+        return reply_xattr(attribute, value, size);
+    }
+    // In form of "resident_bytes spilled_bytes spills faults"
+    if (strcmp(path, "/") == 0 && strcmp(name, "user.memfs.spill") == 0 && options.spill != NULL) {
+        struct mem_fs_spill_stats stats;
+        mem_fs_spill_stats(&spill, &stats);
+        snprintf(attribute, sizeof(attribute), "%zu %zu %lu %lu", stats.resident_bytes, stats.spilled_bytes,
+                 (unsigned long) stats.spills, (unsigned long) stats.faults);
+        return reply_xattr(attribute, value, size);
+    }
+    // In form of "resident_bytes evictions expirations evicted_bytes"
+    if (strcmp(path, "/") == 0 && strcmp(name, "user.memfs.cache") == 0 && options.cache_size != 0) {
+        struct mem_fs_cache_stats stats;
+        mem_fs_cache_stats(&cache, &stats);
+        snprintf(attribute, sizeof(attribute), "%zu %lu %lu %lu", stats.resident_bytes,
+                 (unsigned long) stats.evictions, (unsigned long) stats.expirations,
+                 (unsigned long) stats.evicted_bytes);
+        return reply_xattr(attribute, value, size);
+    }
+    // Seconds which the file lives after its last modification
+    if (strcmp(name, "user.memfs.ttl") == 0 && options.cache_size != 0) {
+        struct mem_fs_entry entry;
+        unsigned int slot = mem_fs_lock_read(&fs->lock);
+        int result = mem_fs_get_entry(fs, path, &entry);
+        if (result == 0 && entry.type == CROW_FS_FILE)
+            snprintf(attribute, sizeof(attribute), "%ld", (long) entry.data.file->ttl);
+        mem_fs_unlock_read(&fs->lock, slot);
+        if (result != 0)
+            return -result;
+        if (entry.type != CROW_FS_FILE || entry.data.file->ttl == 0)
+            return -ENODATA;
+        return reply_xattr(attribute, value, size);
+    }
+    if (strcmp(name, "user.memfs.crc32c") == 0) {
+        uint32_t checksum;
+        unsigned int slot = mem_fs_lock_read(&fs->lock);
+        int result = mem_fs_get_checksum(fs, path, &checksum);
+        mem_fs_unlock_read(&fs->lock, slot);
+        if (result == ENOTSUP || result == EISDIR)
+            return -ENODATA;
+        if (result != 0)
+            return -result;
+        snprintf(attribute, sizeof(attribute), "%08x", checksum);
+        return reply_xattr(attribute, value, size);
+    }
+    // Usage and quota are in form of "bytes inodes"
+    if (strcmp(name, "user.memfs.usage") == 0) {
+        struct mem_fs_usage usage;
+        unsigned int slot = mem_fs_lock_read(&fs->lock);
+        int result = mem_fs_get_usage(fs, path, &usage);
+        mem_fs_unlock_read(&fs->lock, slot);
+        if (result != 0)
+            return -result;
+        snprintf(attribute, sizeof(attribute), "%zu %zu", usage.bytes, usage.inodes);
+        return reply_xattr(attribute, value, size);
+    }
+    if (strcmp(name, "user.memfs.quota") == 0) {
+        struct mem_fs_entry entry;
+        unsigned int slot = mem_fs_lock_read(&fs->lock);
+        int result = mem_fs_get_entry(fs, path, &entry);
+        if (result == 0 && entry.type == CROW_FS_FOLDER)
+            snprintf(attribute, sizeof(attribute), "%zu %zu",
+                     entry.data.directory->quota.bytes, entry.data.directory->quota.inodes);
+        mem_fs_unlock_read(&fs->lock, slot);
+        if (result != 0)
+            return -result;
+        if (entry.type != CROW_FS_FOLDER)
+            return -ENODATA;
+        return reply_xattr(attribute, value, size);
+    }
+    return -ENODATA;
+}
+
+static int mem_fuse_getxattr(const char *path, const char *name, char *value, size_t size) {
+    uint64_t start = trace_start();
+    int result = get_attribute(path, name, value, size);
+    return trace_end(MEM_FS_TRACE_GETXATTR, path, name, 0, size, 0, result, start);
+}
+
+/**
+ * Sets the value of an extended attribute. See setxattr of fuse for the arguments.
+ */
+static int set_attribute(const char *path, const char *name, const char *value, size_t size) {
+    struct mem_fs *fs = get_fs();
+    bool is_ttl = strcmp(name, "user.memfs.ttl") == 0;
+    if (strcmp(name, "user.memfs.quota") != 0 && !is_ttl)
+        return -ENOTSUP;
+    char attribute[64];
+    if (size >= sizeof(attribute))
+        return -EINVAL;
+    memcpy(attribute, value, size);
+    attribute[size] = '\0';
+    if (is_ttl) { // seconds
+        long ttl;
+        char *end;
+        errno = 0;
+        ttl = strtol(attribute, &end, 10);
+        if (end == attribute || *end != '\0' || errno != 0)
+            return -EINVAL;
+        mem_fs_lock_write(&fs->lock);
+        int result = -mem_fs_set_ttl(fs, path, ttl);
+        mem_fs_unlock_write(&fs->lock);
+        return result;
+    }
+    // Parse "bytes inodes"
+    struct mem_fs_usage quota = {0};
+    if (sscanf(attribute, "%zu %zu", &quota.bytes, &quota.inodes) < 1)
+        return -EINVAL;
+    mem_fs_lock_write(&fs->lock);
+    int result = -mem_fs_set_quota(fs, path, &quota);
+    if (result == 0)
+        journal_append(MEM_FS_JOURNAL_QUOTA, path, NULL, (off_t) quota.bytes, quota.inodes, NULL);
+    mem_fs_unlock_write(&fs->lock);
     return result;
 }
 
+static int mem_fuse_setxattr(const char *path, const char *name, const char *value, size_t size, int flags) {
+    (void) flags;
+    uint64_t start = trace_start();
+    int result = set_attribute(path, name, value, size);
+    return trace_end(MEM_FS_TRACE_SETXATTR, path, name, 0, size, 0, result, start);
+}
+
 static int mem_fuse_create_file(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    struct mem_fs *fs = get_fs();
     (void) mode;
-    (void) fi;
-    pthread_rwlock_wrlock(&fs_mutex);
-    int result = -mem_fs_create_file(&fs_root, path, 0);
-    pthread_rwlock_unlock(&fs_mutex);
-    return result;
+    uint64_t start = trace_start();
+    mem_fs_lock_write(&fs->lock);
+    int result = -mem_fs_create_file(fs, path, 0);
+    if (result == 0)
+        journal_append(MEM_FS_JOURNAL_CREATE, path, NULL, 0, 0, NULL);
+    mem_fs_unlock_write(&fs->lock);
+    fi->keep_cache = 1; // a new file has a single link
+    return trace_end(MEM_FS_TRACE_CREATE, path, NULL, 0, 0, 0, result, start);
 }
 
 static int mem_fuse_create_directory(const char *path, mode_t mode) {
+    struct mem_fs *fs = get_fs();
     (void) mode;
-    pthread_rwlock_wrlock(&fs_mutex);
-    int result = -mem_fs_create_folder(&fs_root, path);
-    pthread_rwlock_unlock(&fs_mutex);
-    return result;
+    uint64_t start = trace_start();
+    mem_fs_lock_write(&fs->lock);
+    int result = -mem_fs_create_folder(fs, path);
+    if (result == 0)
+        journal_append(MEM_FS_JOURNAL_MKDIR, path, NULL, 0, 0, NULL);
+    mem_fs_unlock_write(&fs->lock);
+    return trace_end(MEM_FS_TRACE_MKDIR, path, NULL, 0, 0, 0, result, start);
+}
+
+static int mem_fuse_link(const char *from, const char *to) {
+    struct mem_fs *fs = get_fs();
+    uint64_t start = trace_start();
+    mem_fs_lock_write(&fs->lock);
+    int result = -mem_fs_link(fs, from, to);
+    if (result == 0)
+        journal_append(MEM_FS_JOURNAL_LINK, from, to, 0, 0, NULL);
+    mem_fs_unlock_write(&fs->lock);
+    return trace_end(MEM_FS_TRACE_LINK, from, to, 0, 0, 0, result, start);
+}
+
+static int mem_fuse_symlink(const char *target, const char *path) {
+    struct mem_fs *fs = get_fs();
+    uint64_t start = trace_start();
+    mem_fs_lock_write(&fs->lock);
+    int result = -mem_fs_symlink(fs, target, path);
+    if (result == 0)
+        journal_append(MEM_FS_JOURNAL_SYMLINK, path, target, 0, 0, NULL);
+    mem_fs_unlock_write(&fs->lock);
+    return trace_end(MEM_FS_TRACE_SYMLINK, path, target, 0, 0, 0, result, start);
+}
+
+static int mem_fuse_readlink(const char *path, char *buf, size_t size) {
+    struct mem_fs *fs = get_fs();
+    uint64_t start = trace_start();
+    unsigned int slot = mem_fs_lock_read(&fs->lock);
+    int result = -mem_fs_readlink(fs, path, buf, size);
+    mem_fs_unlock_read(&fs->lock, slot);
+    return trace_end(MEM_FS_TRACE_READLINK, path, NULL, 0, size, 0, result, start);
 }
 
 static const struct fuse_operations mem_fuse_operations = {
         .init = mem_fuse_init,
+        .destroy = mem_fuse_destroy,
         .getattr = mem_fuse_getattr,
         .readdir = mem_fuse_readdir,
         .open = mem_fuse_open,
         .read = mem_fuse_read,
         .write = mem_fuse_write,
+        .truncate = mem_fuse_truncate,
+        .fallocate = mem_fuse_fallocate,
+        .utimens = mem_fuse_utimens,
+        .rename = mem_fuse_rename,
+        .fsync = mem_fuse_fsync,
+        .fsyncdir = mem_fuse_fsync,
         .rmdir = mem_fuse_rmdir,
         .unlink = mem_fuse_rmfile,
+        .getxattr = mem_fuse_getxattr,
+        .setxattr = mem_fuse_setxattr,
         .create = mem_fuse_create_file,
         .mkdir = mem_fuse_create_directory,
+        .link = mem_fuse_link,
+        .symlink = mem_fuse_symlink,
+        .readlink = mem_fuse_readlink,
 };
 
+/**
+ * Parses a list of CPUs like "0-15,32-47"
+ * @param list The list
+ * @param set The set to fill
+ * @return True if the list is valid and not empty
+ */
+static bool parse_cpu_list(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*list != '\0') {
+        char *end;
+        unsigned long first = strtoul(list, &end, 10), last = first;
+        if (end == list)
+            return false;
+        if (*end == '-') { // a range
+            list = end + 1;
+            last = strtoul(list, &end, 10);
+            if (end == list || last < first)
+                return false;
+        }
+        if (last >= CPU_SETSIZE)
+            return false;
+        for (unsigned long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return false;
+        list = end;
+    }
+    return CPU_COUNT(set) != 0;
+}
+
+/**
+ * Asks libfuse to carry the requests over io_uring, with a queue and a thread for each CPU. libfuse still talks over
+ * /dev/fuse if the kernel does not offer io_uring in its init reply, so only the cases which are known to fail are
+ * reported here.
+ * @param args The arguments of fuse
+ */
+static void enable_io_uring(struct fuse_args *args) {
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 18)
+    // Linux 6.14 and newer have this parameter and it is off by default
+    int enabled = EOF;
+    FILE *parameter = fopen("/sys/module/fuse/parameters/enable_uring", "r");
+    if (parameter != NULL) {
+        enabled = fgetc(parameter);
+        fclose(parameter);
+    }
+    if (enabled != 'Y' && enabled != '1') {
+        fprintf(stderr, "io_uring is not enabled for fuse in the kernel, using /dev/fuse\n");
+        return;
+    }
+    fuse_opt_add_arg(args, "-oio_uring");
+    if (options.io_uring_depth != 0) {
+        char depth_option[48];
+        snprintf(depth_option, sizeof(depth_option), "-oio_uring_q_depth=%u", options.io_uring_depth);
+        fuse_opt_add_arg(args, depth_option);
+    }
+#else
+    (void) args;
+    fprintf(stderr, "libfuse %s cannot use io_uring, using /dev/fuse\n", fuse_pkgversion());
+#endif
+}
+
+/**
+ * Lets the process keep a memfd open for each file
+ */
+static void raise_file_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+/**
+ * Receives the tree and the fuse session from the process which listens on the handoff socket
+ * @param session_fd Will be set to the fd of fuse session
+ * @return 0 if everything is ok. Otherwise the error value.
+ */
+static int take_over(struct mem_fs *fs, int *session_fd) {
+    int socket_fd;
+    int result = mem_fs_socket_connect(options.handoff, &socket_fd);
+    if (result != 0)
+        return result;
+    char state[MEM_FS_HANDOFF_MAX_STATE];
+    uint32_t state_length;
+    result = mem_fs_handoff_receive(socket_fd, fs, session_fd, state, &state_length);
+    if (result == 0 && state_length != sizeof(session_state))
+        result = EPROTO;
+    if (result == 0) {
+        memcpy(&session_state, state, sizeof(session_state));
+        // Wait for the old process to exit, so nobody else answers the requests
+        char byte;
+        ssize_t read_result;
+        do {
+            read_result = read(socket_fd, &byte, 1);
+        } while (read_result > 0 || (read_result < 0 && errno == EINTR));
+    }
+    close(socket_fd);
+    return result;
+}
+
+/**
+ * Makes libfuse treat the session as initialized, because the kernel has already initialized it with the old
+ * process. Then asks the kernel to resend the requests which the old process read but did not answer.
+ * @param session The session which is mounted with the fd of old process
+ */
+static void resume_session(struct fuse_session *session) {
+    struct {
+        struct kernel_in_header header;
+        struct kernel_init_in init;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.header.len = sizeof(request);
+    request.header.opcode = KERNEL_OPCODE_INIT;
+    request.header.unique = RESUME_INIT_UNIQUE;
+    request.init.major = session_state.proto_major;
+    request.init.minor = session_state.proto_minor;
+    request.init.max_readahead = session_state.max_readahead;
+    // libfuse sizes its receive buffer from the flags. Without FUSE_MAX_PAGES it would be too small for the writes
+    // which the kernel sends to this session.
+    uint64_t flags = session_state.kernel_flags;
+    if (session_state.max_pages > KERNEL_DEFAULT_MAX_PAGES)
+        flags |= KERNEL_MAX_PAGES;
+    if ((flags >> 32) != 0)
+        flags |= KERNEL_INIT_EXT;
+    request.init.flags = (uint32_t) flags;
+    request.init.flags2 = (uint32_t) (flags >> 32);
+    struct fuse_buf buffer = {.size = sizeof(request), .mem = &request};
+    fuse_session_process_buf(session, &buffer);
+    // Needs Linux 6.9 or newer
+    struct kernel_out_header notification = {
+            .len = sizeof(notification),
+            .error = KERNEL_NOTIFY_RESEND,
+            .unique = 0,
+    };
+    if (write(fuse_session_fd(session), &notification, sizeof(notification)) != sizeof(notification))
+        fprintf(stderr, "cannot ask the kernel to resend pending requests: %s\n", strerror(errno));
+}
+
 int main(int argc, char *argv[]) {
     // Initiate the file system
-    mem_fs_new(&fs_root);
+    struct mem_fs fs;
+    mem_fs_new(&fs);
+    mem_fs_reclaimer_init(&reclaimer);
     // Initiate fuse
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    options.checkpoint_size = MEM_FS_DEFAULT_CHECKPOINT_SIZE;
+    options.spill_size = MEM_FS_DEFAULT_SPILL_SIZE;
+    options.memory_high = MEM_FS_DEFAULT_MEMORY_HIGH;
     if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1)
         return 1;
-    int ret = fuse_main(args.argc, args.argv, &mem_fuse_operations, NULL);
+    struct fuse_cmdline_opts fuse_options;
+    if (fuse_parse_cmdline(&args, &fuse_options) != 0)
+        return 1;
+    if (fuse_options.show_help) {
+        printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+        fuse_cmdline_help();
+        fuse_lib_help(&args);
+        return 0;
+    }
+    if (fuse_options.show_version) {
+        printf("FUSE library version %s\n", fuse_pkgversion());
+        return 0;
+    }
+    // Threading options of ours override the ones of libfuse
+    if (options.single_thread)
+        fuse_options.singlethread = 1;
+    if (options.max_threads != 0)
+        fuse_options.max_threads = options.max_threads;
+    if (options.max_idle_threads != 0)
+        fuse_options.max_idle_threads = options.max_idle_threads;
+    if (options.clone_fd)
+        fuse_options.clone_fd = 1;
+    cpu_set_t cpus;
+    if (options.cpus != NULL && !parse_cpu_list(options.cpus, &cpus)) {
+        fprintf(stderr, "invalid list of CPUs: %s\n", options.cpus);
+        return 1;
+    }
+    // The kernel only honors max_read if it is passed as a mount option too
+    if (options.max_read != 0) {
+        char max_read_option[32];
+        snprintf(max_read_option, sizeof(max_read_option), "-omax_read=%u", options.max_read);
+        fuse_opt_add_arg(&args, max_read_option);
+    }
+    if (options.io_uring) {
+        if (fuse_options.singlethread) {
+            fprintf(stderr, "--io_uring cannot be used with --single_thread\n");
+            return 1;
+        }
+        enable_io_uring(&args);
+    }
+    // Check the options
+    if (fuse_options.mountpoint == NULL && !options.takeover) {
+        fprintf(stderr, "no mountpoint is specified\n");
+        return 1;
+    }
+    if (options.takeover && options.handoff == NULL) {
+        fprintf(stderr, "--takeover needs --handoff\n");
+        return 1;
+    }
+    if (options.takeover && options.preload != NULL) {
+        fprintf(stderr, "--preload cannot be used with --takeover\n");
+        return 1;
+    }
+    if (options.bypass != NULL) // files are passed to other processes as memfds
+        options.memfd = 1;
+    if (options.handoff != NULL) { // files are passed to the next process as memfds
+        options.memfd = 1;
+        if (options.journal != NULL) {
+            fprintf(stderr, "--handoff cannot be used with --journal\n");
+            return 1;
+        }
+    }
+    if (options.memfd) {
+        if (options.spill != NULL) {
+            fprintf(stderr, "--memfd, --handoff and --bypass cannot be used with --spill\n");
+            return 1;
+        }
+        mem_fs_set_memfd(&fs, true);
+        raise_file_limit();
+    }
+    if (options.checksums || options.verify_reads)
+        mem_fs_set_checksums(&fs, true, options.verify_reads);
+    if (options.coarse_clock)
+        mem_fs_set_coarse_clock(&fs, true);
+    // The spill tier must be ready before the journal creates any file
+    if (options.spill != NULL) {
+        if (options.memory_low == 0 || options.memory_low > options.memory_high)
+            options.memory_low = options.memory_high / 4 * 3;
+        int spill_result = mem_fs_spill_init(&spill, options.spill, options.spill_size,
+                                             options.memory_high, options.memory_low);
+        if (spill_result != 0) {
+            fprintf(stderr, "cannot create the spill file %s: %s\n", options.spill, strerror(spill_result));
+            return 1;
+        }
+        mem_fs_set_spill(&fs, &spill);
+    }
+    // Evicted files are not journaled, so a cache would come back after a restart
+    if (options.cache_size != 0) {
+        if (options.spill != NULL || options.journal != NULL) {
+            fprintf(stderr, "--cache_size cannot be used with --spill or --journal\n");
+            return 1;
+        }
+        mem_fs_cache_init(&cache, options.cache_size);
+        mem_fs_set_cache(&fs, &cache);
+    }
+    // Rebuild the tree from journal
+    if (options.journal != NULL) {
+        int journal_result = mem_fs_journal_open(&journal, options.journal, &fs, options.checkpoint_size);
+        if (journal_result != 0) {
+            fprintf(stderr, "cannot open the journal in %s: %s\n", options.journal, strerror(journal_result));
+            return 1;
+        }
+    }
+    // Fill the tree before the mount goes live. A tree which is rebuilt from the journal is newer than the archive.
+    if (options.preload != NULL && fs.root.entries == NULL) {
+        struct mem_fs_tar_stats tar_stats;
+        int preload_result = mem_fs_import_tar(&fs, options.preload, &tar_stats);
+        if (preload_result != 0) {
+            fprintf(stderr, "cannot preload %s: %s\n", options.preload, strerror(preload_result));
+            return 1;
+        }
+        if (tar_stats.skipped != 0)
+            fprintf(stderr, "skipped %zu members of %s\n", tar_stats.skipped, options.preload);
+        // The imported files are not in the journal, so they must be in a checkpoint
+        if (options.journal != NULL && (preload_result = mem_fs_journal_checkpoint(&journal, &fs)) != 0) {
+            fprintf(stderr, "cannot checkpoint the preloaded files: %s\n", strerror(preload_result));
+            return 1;
+        }
+    }
+    // Take the tree and session over from the old process
+    int session_fd = -1;
+    if (options.takeover) {
+        int takeover_result = take_over(&fs, &session_fd);
+        if (takeover_result != 0) {
+            fprintf(stderr, "cannot take over from %s: %s\n", options.handoff, strerror(takeover_result));
+            return 1;
+        }
+    }
+    if (options.handoff != NULL) {
+        int handoff_result = mem_fs_socket_listen(options.handoff, &handoff_listen_fd);
+        if (handoff_result != 0) {
+            fprintf(stderr, "cannot listen on %s: %s\n", options.handoff, strerror(handoff_result));
+            return 1;
+        }
+    }
+    if (options.bypass != NULL) {
+        int bypass_result = mem_fs_socket_listen(options.bypass, &bypass_listen_fd);
+        if (bypass_result != 0) {
+            fprintf(stderr, "cannot listen on %s: %s\n", options.bypass, strerror(bypass_result));
+            return 1;
+        }
+    }
+    if (options.trace != NULL) {
+        int trace_result = mem_fs_trace_open(&trace, options.trace);
+        if (trace_result != 0) {
+            fprintf(stderr, "cannot create the trace file %s: %s\n", options.trace, strerror(trace_result));
+            return 1;
+        }
+    }
+    // Mount. A taken over session is mounted already, libfuse only needs its fd.
+    struct fuse *fuse = fuse_new(&args, &mem_fuse_operations, sizeof(mem_fuse_operations), &fs);
+    if (fuse == NULL)
+        return 1;
+    char session_path[32];
+    const char *mountpoint = fuse_options.mountpoint;
+    if (session_fd >= 0) {
+        snprintf(session_path, sizeof(session_path), "/dev/fd/%d", session_fd);
+        mountpoint = session_path;
+    }
+    int ret = 1;
+    if (fuse_mount(fuse, mountpoint) != 0)
+        goto destroy;
+    if (fuse_daemonize(fuse_options.foreground) != 0)
+        goto unmount;
+    struct fuse_session *session = fuse_get_session(fuse);
+    if (fuse_set_signal_handlers(session) != 0)
+        goto unmount;
+    // Worker threads inherit the affinity of this thread
+    if (options.cpus != NULL && pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+        fprintf(stderr, "cannot set the CPU affinity\n");
+    if (session_fd >= 0) {
+        session_resumed = true;
+        resume_session(session);
+    }
+    // Serve the requests
+    if (fuse_options.singlethread) {
+        ret = fuse_loop(fuse);
+    } else {
+        struct fuse_loop_config *loop_config = fuse_loop_cfg_create();
+        fuse_loop_cfg_set_clone_fd(loop_config, fuse_options.clone_fd);
+        fuse_loop_cfg_set_idle_threads(loop_config, fuse_options.max_idle_threads);
+        fuse_loop_cfg_set_max_threads(loop_config, fuse_options.max_threads);
+        ret = fuse_loop_mt(fuse, loop_config);
+        fuse_loop_cfg_destroy(loop_config);
+    }
+    fuse_remove_signal_handlers(session);
+    unmount:
+    fuse_unmount(fuse);
+    destroy:
+    fuse_destroy(fuse);
+    free(fuse_options.mountpoint);
     fuse_opt_free_args(&args);
-    return ret;
+    return ret == 0 ? 0 : 1;
 }
@@ -1,19 +1,73 @@
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdbool.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "memfs.h"
+#include "spill.h"
+#include "cache.h"
+#include "crc32c.h"
 
 #define MIN(x, y) ((x < y) ? (x) : (y))
+#define CHECKSUM_PAGE_COUNT(size) (((size) + MEM_FS_CHECKSUM_PAGE_SIZE - 1) / MEM_FS_CHECKSUM_PAGE_SIZE)
+/**
+ * Appends grow the capacity of files by half of it, but at most this many bytes at once
+ */
+#define MAX_CAPACITY_GROWTH (64 * 1024 * 1024)
+
+/**
+ * Combines the checksum of a full page with the checksum of data before it. Same for every file system.
+ */
+static struct mem_fs_crc32c_shift page_shift;
+/**
+ * Checksum of a page full of zeros
+ */
+static uint32_t zero_page_checksum;
+static pthread_once_t checksum_constants_once = PTHREAD_ONCE_INIT;
+
+static void init_checksum_constants(void) {
+    static const char zero_page[MEM_FS_CHECKSUM_PAGE_SIZE];
+    mem_fs_crc32c_shift_init(&page_shift, MEM_FS_CHECKSUM_PAGE_SIZE);
+    zero_page_checksum = mem_fs_crc32c(0, zero_page, sizeof(zero_page));
+}
 
 /**
- * Checks if a string is an empty string or not.
- * @param string The string to check.
- * @return True if empty otherwise false.
+ * Gets the time for timestamps
  */
-static bool is_empty_string(const char *string) {
-    return string[0] == '\0';
+static struct timespec current_time(struct mem_fs *fs) {
+    struct timespec now = fs->fixed_time;
+    if (!fs->clock_fixed)
+        clock_gettime(fs->coarse_clock ? CLOCK_REALTIME_COARSE : CLOCK_REALTIME, &now);
+    fs->last_time = now;
+    return now;
+}
+
+/**
+ * Sets all timestamps of a new object to now
+ */
+static void init_times(struct mem_fs *fs, struct mem_fs_times *times) {
+    times->atime = times->mtime = times->ctime = current_time(fs);
+}
+
+/**
+ * Updates the timestamps after a change of content
+ */
+static void mark_modified(struct mem_fs *fs, struct mem_fs_times *times) {
+    times->mtime = times->ctime = current_time(fs);
+}
+
+/**
+ * Updates the timestamps after a change of metadata, like a rename or a new link
+ */
+static void mark_changed(struct mem_fs *fs, struct mem_fs_times *times) {
+    times->ctime = current_time(fs);
 }
 
 static void indent_tree(int depth) {
@@ -36,32 +90,370 @@ static void mem_fs_tree_internal(const struct mem_fs_directory *root, int depth)
                 printf("%s (%zu bytes)\n", current_entry->name, current_entry->data.file->size);
                 break;
             case CROW_FS_LINK:
-                // TODO: later...
+                printf("%s -> %s\n", current_entry->name, current_entry->data.link->target);
                 break;
         }
     }
 }
 
+/**
+ * Checks if adding some usage to a folder keeps it and all of its parents within their quotas
+ * @param directory The folder to add the usage to
+ * @param bytes Bytes to add
+ * @param inodes Inodes to add
+ * @return 0 if the usage fits, otherwise EDQUOT
+ */
+static int check_quota(const struct mem_fs_directory *directory, size_t bytes, size_t inodes) {
+    for (; directory != NULL; directory = directory->parent) {
+        if (directory->quota.bytes != 0 && directory->usage.bytes + bytes > directory->quota.bytes)
+            return EDQUOT;
+        if (directory->quota.inodes != 0 && directory->usage.inodes + inodes > directory->quota.inodes)
+            return EDQUOT;
+    }
+    return 0;
+}
+
+/**
+ * Adds usage to a folder and all of its parents. Pass the negated values to subtract.
+ * @param directory The folder to add the usage to
+ * @param bytes Bytes to add
+ * @param inodes Inodes to add
+ */
+static void add_usage(struct mem_fs_directory *directory, size_t bytes, size_t inodes) {
+    for (; directory != NULL; directory = directory->parent) {
+        directory->usage.bytes += bytes;
+        directory->usage.inodes += inodes;
+    }
+}
+
+/**
+ * Gets the usage of an entry
+ * @param entry The entry
+ * @return Usage of entry itself plus everything inside it
+ */
+static struct mem_fs_usage entry_usage(const struct mem_fs_entry *entry) {
+    struct mem_fs_usage usage = {.bytes = 0, .inodes = 1};
+    switch (entry->type) {
+        case CROW_FS_FOLDER:
+            usage.bytes = entry->data.directory->usage.bytes;
+            usage.inodes += entry->data.directory->usage.inodes;
+            break;
+        case CROW_FS_FILE: {
+            // Only the first link is charged for the bytes. Detached files with no links left are charged to nobody.
+            const struct mem_fs_file *file = entry->data.file;
+            if (file != NULL && (file->hard_links == NULL || file->hard_links == entry))
+                usage.bytes = file->size;
+            break;
+        }
+        case CROW_FS_LINK:
+            break;
+    }
+    return usage;
+}
+
+/**
+ * Gets the timestamps of the object which an entry points to
+ */
+static struct mem_fs_times *entry_times(const struct mem_fs_entry *entry) {
+    switch (entry->type) {
+        case CROW_FS_FOLDER:
+            return &entry->data.directory->times;
+        case CROW_FS_FILE:
+            return &entry->data.file->times;
+        case CROW_FS_LINK:
+            break;
+    }
+    return &entry->data.link->times;
+}
+
+/**
+ * Removes an entry from the hard links of its file. If the entry was charged for the bytes of file, they are
+ * moved to the folder of the next link.
+ * @param fs The file system of entry. NULL while a whole folder is freed, then the times of file are left alone.
+ * @param entry An entry of a file. It must not be charged to its folder anymore.
+ * @return True if this was the last link of file
+ */
+static bool remove_hard_link(struct mem_fs *fs, struct mem_fs_entry *entry) {
+    struct mem_fs_file *file = entry->data.file;
+    bool was_first = file->hard_links == entry;
+    for (struct mem_fs_entry **current = &file->hard_links; *current != NULL; current = &(*current)->next_hard_link) {
+        if (*current == entry) {
+            *current = entry->next_hard_link;
+            break;
+        }
+    }
+    entry->next_hard_link = NULL;
+    if (--file->link_count == 0)
+        return true;
+    if (fs != NULL)
+        mark_changed(fs, &file->times);
+    if (was_first)
+        add_usage(file->hard_links->parent, file->size, 0);
+    return false;
+}
+
+/**
+ * Takes a detached entry out of the hard links of its file. If other links remain, the entry stops pointing to
+ * the file, so freeing the entry leaves the file alone.
+ * @param fs The file system of entry
+ * @param entry The detached entry. Nothing is done if it is not a file.
+ */
+static void detach_hard_link(struct mem_fs *fs, struct mem_fs_entry *entry) {
+    if (entry->type != CROW_FS_FILE)
+        return;
+    if (!remove_hard_link(fs, entry))
+        entry->data.file = NULL;
+    else if (fs->spill != NULL)
+        mem_fs_spill_forget(fs->spill, entry->data.file);
+    else if (fs->cache != NULL)
+        mem_fs_cache_forget(fs->cache, entry->data.file);
+}
+
+/**
+ * Changes the capacity of the storage of a file. Added bytes are only zeroed for memfd backed files.
+ * @param file The file to resize. Its size field is not changed.
+ * @param new_capacity The new capacity of storage. Must not be less than the size of file.
+ * @return 0 if everything is ok. Otherwise ENOSPC.
+ */
+static int resize_storage(struct mem_fs_file *file, size_t new_capacity) {
+    if (file->fd < 0) {
+        char *new_data = realloc(file->data, new_capacity);
+        if (new_data == NULL && new_capacity != 0)
+            return ENOSPC;
+        file->data = new_data;
+        file->capacity = new_capacity;
+        return 0;
+    }
+    // Resize the memfd and then make the mapping follow it
+    if (ftruncate(file->fd, (off_t) new_capacity) != 0)
+        return ENOSPC;
+    char *new_data = NULL;
+    if (new_capacity == 0) {
+        if (file->data != NULL)
+            munmap(file->data, file->capacity);
+    } else {
+        if (file->data == NULL)
+            new_data = mmap(NULL, new_capacity, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+        else
+            new_data = mremap(file->data, file->capacity, new_capacity, MREMAP_MAYMOVE);
+        if (new_data == MAP_FAILED) {
+            ftruncate(file->fd, (off_t) file->capacity);
+            return ENOSPC;
+        }
+    }
+    file->data = new_data;
+    file->capacity = new_capacity;
+    return 0;
+}
+
+/**
+ * Makes sure that a file can hold some bytes without reallocating
+ * @param file The file
+ * @param needed Bytes which the file must be able to hold
+ * @param geometric True to reserve extra room for the next appends
+ * @return 0 if everything is ok. Otherwise ENOSPC.
+ */
+static int reserve_storage(struct mem_fs_file *file, size_t needed, bool geometric) {
+    if (needed <= file->capacity)
+        return 0;
+    if (geometric && !file->shared) { // the memfd of shared files must end where the file ends
+        size_t grown = file->capacity + MIN(file->capacity / 2, MAX_CAPACITY_GROWTH);
+        if (grown > needed && resize_storage(file, grown) == 0)
+            return 0;
+    }
+    return resize_storage(file, needed);
+}
+
+/**
+ * Fills a range of a file with zeros. The pages of memfds are freed.
+ * @param file The file. Its content must be in memory.
+ * @param from Start of range
+ * @param to End of range. Must not pass the capacity of file.
+ */
+static void zero_storage(struct mem_fs_file *file, size_t from, size_t to) {
+    if (from >= to)
+        return;
+    if (file->fd >= 0 &&
+        fallocate(file->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) from, (off_t) (to - from)) == 0)
+        return;
+    memset(file->data + from, 0, to - from);
+}
+
+/**
+ * Allocates the storage of a new file
+ * @param fs The file system which decides between the heap and memfds
+ * @param file The file to allocate the storage of
+ * @param size The size of file. The content is zeroed.
+ * @return 0 if everything is ok. Otherwise ENOSPC.
+ */
+static int create_storage(const struct mem_fs *fs, struct mem_fs_file *file, size_t size) {
+    file->fd = -1;
+    file->size = 0;
+    file->capacity = 0;
+    file->shared = false;
+    if (!fs->memfd) {
+        file->data = calloc(size, sizeof(char));
+        file->size = size;
+        file->capacity = size;
+        return 0;
+    }
+    file->data = NULL;
+    file->fd = memfd_create("memfs", MFD_CLOEXEC);
+    if (file->fd < 0)
+        return ENOSPC;
+    int result = resize_storage(file, size);
+    if (result != 0) {
+        close(file->fd);
+        return result;
+    }
+    file->size = size;
+    return 0;
+}
+
+/**
+ * Frees the storage of a file
+ * @param file The file to free the storage of
+ */
+static void free_storage(struct mem_fs_file *file) {
+    if (file->fd < 0) {
+        free(file->data);
+        return;
+    }
+    if (file->data != NULL)
+        munmap(file->data, file->capacity);
+    close(file->fd);
+}
+
+/**
+ * Updates the page checksums of a file after a change. Only the pages which might have changed are read.
+ * Full pages which are added after the old end of file and are not written are known to be zero.
+ * @param fs The file system. Nothing is done if it does not keep checksums.
+ * @param file The file. Its content must be in memory and its size must be the new size.
+ * @param old_size Size of file before the change
+ * @param from Start of the written range
+ * @param to End of the written range
+ */
+static void update_checksums(const struct mem_fs *fs, struct mem_fs_file *file, size_t old_size, size_t from,
+                             size_t to) {
+    if (!fs->checksums)
+        return;
+    file->checksum_valid = false;
+    if (file->page_checksums == NULL && old_size != 0) // not known, computed when needed
+        return;
+    size_t page_count = CHECKSUM_PAGE_COUNT(file->size);
+    if (page_count == 0) {
+        free(file->page_checksums);
+        file->page_checksums = NULL;
+        return;
+    }
+    uint32_t *new_checksums = realloc(file->page_checksums, page_count * sizeof(uint32_t));
+    if (new_checksums == NULL) { // forget them and compute them when needed
+        free(file->page_checksums);
+        file->page_checksums = NULL;
+        return;
+    }
+    file->page_checksums = new_checksums;
+    // Find the changed pages
+    size_t first_page = MIN(from, MIN(old_size, file->size)) / MEM_FS_CHECKSUM_PAGE_SIZE;
+    size_t end_page = file->size == old_size ? CHECKSUM_PAGE_COUNT(to) : page_count;
+    end_page = MIN(end_page, page_count);
+    for (size_t page = first_page; page < end_page; page++) {
+        size_t start = page * MEM_FS_CHECKSUM_PAGE_SIZE;
+        size_t length = MIN(MEM_FS_CHECKSUM_PAGE_SIZE, file->size - start);
+        bool zero = length == MEM_FS_CHECKSUM_PAGE_SIZE && start >= old_size &&
+                    (start >= to || start + MEM_FS_CHECKSUM_PAGE_SIZE <= from);
+        file->page_checksums[page] = zero ? zero_page_checksum : mem_fs_crc32c(0, file->data + start, length);
+    }
+}
+
+/**
+ * Computes the page checksums of a file which has none and publishes them. It only needs the file system lock in
+ * read mode: if readers race on the same file, one array wins and the others are freed.
+ * @param file The file. Its content must be in memory and it must not be empty.
+ * @return The page checksums of file. NULL if out of memory.
+ */
+static uint32_t *compute_checksums(struct mem_fs_file *file) {
+    size_t page_count = CHECKSUM_PAGE_COUNT(file->size);
+    uint32_t *checksums = malloc(page_count * sizeof(uint32_t));
+    if (checksums == NULL)
+        return NULL;
+    for (size_t page = 0; page < page_count; page++) {
+        size_t start = page * MEM_FS_CHECKSUM_PAGE_SIZE;
+        checksums[page] = mem_fs_crc32c(0, file->data + start, MIN(MEM_FS_CHECKSUM_PAGE_SIZE, file->size - start));
+    }
+    uint32_t *published = NULL;
+    if (!__atomic_compare_exchange_n(&file->page_checksums, &published, checksums, false,
+                                     __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+        free(checksums);
+        return published;
+    }
+    return checksums;
+}
+
+/**
+ * Checks the pages of a file which overlap a range against their checksums
+ * @param file The file. Its content must be in memory.
+ * @param offset Start of range
+ * @param length Length of range
+ * @return 0 if the content is intact. Otherwise EIO.
+ */
+static int verify_checksums(const struct mem_fs_file *file, off_t offset, size_t length) {
+    // Another reader might be publishing them, see compute_checksums
+    const uint32_t *page_checksums = __atomic_load_n(&file->page_checksums, __ATOMIC_ACQUIRE);
+    if (page_checksums == NULL || (size_t) offset >= file->size)
+        return 0;
+    size_t end = MIN(offset + length, file->size);
+    for (size_t page = offset / MEM_FS_CHECKSUM_PAGE_SIZE; page < CHECKSUM_PAGE_COUNT(end); page++) {
+        size_t start = page * MEM_FS_CHECKSUM_PAGE_SIZE;
+        size_t page_length = MIN(MEM_FS_CHECKSUM_PAGE_SIZE, file->size - start);
+        if (mem_fs_crc32c(0, file->data + start, page_length) != page_checksums[page])
+            return EIO;
+    }
+    return 0;
+}
+
 /**
  * Write a buffer to file, inflating the buffer if needed
+ * @param fs The file system of file
+ * @param parent The folder which is charged for the bytes of file
  * @param file The file to write to
  * @param buffer_size Size of buffer to write
  * @param buffer The buffer itself
  * @param offset Offset to write to
  * @return Bytes written or negative value on error
  */
-static int write_to_file(struct mem_fs_file *file, size_t buffer_size, const char *buffer, off_t offset) {
+static int write_to_file(struct mem_fs *fs, struct mem_fs_directory *parent, struct mem_fs_file *file,
+                         size_t buffer_size, const char *buffer, off_t offset) {
+    if (fs->spill != NULL) {
+        int result = mem_fs_spill_access(fs->spill, file);
+        if (result != 0)
+            return -result;
+    }
+    if (fs->cache != NULL)
+        mem_fs_cache_access(fs->cache, file);
     // Check size of buffer
+    size_t old_size = file->size, old_capacity = file->capacity;
     if (offset + buffer_size > file->size) {
-        // Try to make the buffer bigger
-        char *new_data = realloc(file->data, offset + buffer_size);
-        if (new_data == NULL)
+        size_t added_bytes = offset + buffer_size - file->size;
+        if (check_quota(parent, added_bytes, 0) != 0)
+            return -EDQUOT;
+        // Try to make the buffer bigger. Leave room for the next appends.
+        if (reserve_storage(file, offset + buffer_size, true) != 0)
             return -ENOSPC;
+        // Zero the hole between the old end of file and the offset. memfds are zero filled already.
+        if (file->fd < 0 && (size_t) offset > file->size)
+            memset(file->data + file->size, 0, offset - file->size);
         file->size = offset + buffer_size;
-        file->data = new_data;
+        add_usage(parent, added_bytes, 0);
+        if (fs->spill != NULL)
+            mem_fs_spill_resized(fs->spill, file, old_size);
+        if (fs->cache != NULL)
+            mem_fs_cache_resized(fs->cache, file, old_capacity);
     }
     // Just copy to buffer
     memcpy(file->data + offset, buffer, buffer_size);
+    update_checksums(fs, file, old_size, offset, offset + buffer_size);
+    mark_modified(fs, &file->times);
     return (int) buffer_size;
 }
 
@@ -74,8 +466,8 @@ static int write_to_file(struct mem_fs_file *file, size_t buffer_size, const cha
  * @return Bytes read. This function is error free
  */
 static int read_from_file(const struct mem_fs_file *file, size_t buffer_size, char *buffer, off_t offset) {
-    // Bound check
-    if (offset > file->size)
+    // Bound check. Empty memfd backed files have no mapping at all.
+    if ((size_t) offset >= file->size)
         return 0;
     // Get the size to copy
     size_t to_copy_size = MIN(buffer_size, file->size - offset);
@@ -83,332 +475,966 @@ static int read_from_file(const struct mem_fs_file *file, size_t buffer_size, ch
     return (int) to_copy_size;
 }
 
-void mem_fs_new(struct mem_fs_directory *root) {
-    root->entries = NULL; // we only set the root to null. (no files in this folder)
+/**
+ * Gets the next part of a path. Repeated slashes are skipped.
+ * @param path The path to read from. It is moved after the returned part.
+ * @param length Will be set to the length of returned part
+ * @return The start of next part inside path or NULL if there are no more parts
+ */
+static const char *next_path_part(const char **path, size_t *length) {
+    const char *part = *path;
+    while (*part == '/')
+        part++;
+    if (*part == '\0')
+        return NULL;
+    const char *end = part;
+    while (*end != '/' && *end != '\0')
+        end++;
+    *length = end - part;
+    *path = end;
+    return part;
+}
+
+/**
+ * Finds an entry in a directory by its name
+ * @param directory The directory to search in
+ * @param name The name of entry. Does not need to be null terminated.
+ * @param name_length Length of name
+ * @return The link which points to the entry (so it can be unlinked in place) or NULL if it does not exist
+ */
+static struct mem_fs_entry **find_in_directory(struct mem_fs_directory *directory, const char *name,
+                                               size_t name_length) {
+    for (struct mem_fs_entry **current_entry = &directory->entries;
+         *current_entry != NULL;
+         current_entry = &(*current_entry)->next)
+        if (memcmp((*current_entry)->name, name, name_length) == 0 && (*current_entry)->name[name_length] == '\0')
+            return current_entry;
+    return NULL;
+}
+
+/**
+ * Walks a path to the folder which holds its last part. The path is used in place, nothing is copied or allocated.
+ * @param root The root of file system
+ * @param path The path to walk
+ * @param parent Will be set to the folder which holds the last part of path
+ * @param name Will be set to the start of last part inside path. NULL if path is the root itself.
+ * @param name_length Will be set to the length of last part
+ * @return 0 if the parent folder exists. ENAMETOOLONG if a part is longer than MAX_FILE_NAME. Otherwise ENOENT.
+ */
+static int walk_path(struct mem_fs_directory *root, const char *path,
+                     struct mem_fs_directory **parent, const char **name, size_t *name_length) {
+    size_t part_length = 0, next_part_length;
+    const char *part = next_path_part(&path, &part_length);
+    while (part != NULL) {
+        if (part_length > MAX_FILE_NAME)
+            return ENAMETOOLONG;
+        const char *next_part = next_path_part(&path, &next_part_length);
+        if (next_part == NULL) // this is the last part
+            break;
+        // Enter the folder
+        struct mem_fs_entry **folder = find_in_directory(root, part, part_length);
+        if (folder == NULL || (*folder)->type != CROW_FS_FOLDER) // we can only enter folders
+            return ENOENT;
+        root = (*folder)->data.directory;
+        part = next_part;
+        part_length = next_part_length;
+    }
+    *parent = root;
+    *name = part;
+    *name_length = part_length;
+    return 0;
+}
+
+/**
+ * Removes an entry from the linked list of a directory. The entry itself is not freed.
+ * @param directory The directory which holds the entry
+ * @param entry The entry to remove
+ */
+static void unlink_from_directory(struct mem_fs_directory *directory, const struct mem_fs_entry *entry) {
+    for (struct mem_fs_entry **current_entry = &directory->entries;
+         *current_entry != NULL;
+         current_entry = &(*current_entry)->next) {
+        if (*current_entry == entry) {
+            *current_entry = entry->next;
+            return;
+        }
+    }
+}
+
+/**
+ * Finds an entry and the folder which holds it
+ * @param root The root of file system
+ * @param path The path of entry
+ * @param parent Will be set to the folder which holds the entry
+ * @param link Will be set to the link which points to the entry in parent
+ * @return 0 if the entry exists. EBUSY if path is the root itself. Otherwise the error of walk_path or ENOENT.
+ */
+static int find_entry(struct mem_fs_directory *root, const char *path,
+                      struct mem_fs_directory **parent, struct mem_fs_entry ***link) {
+    const char *name;
+    size_t name_length;
+    int result = walk_path(root, path, parent, &name, &name_length);
+    if (result != 0)
+        return result;
+    if (name == NULL)
+        return EBUSY;
+    *link = find_in_directory(*parent, name, name_length);
+    return *link == NULL ? ENOENT : 0;
+}
+
+/**
+ * Finds a file and the folder which is charged for its bytes. With hard links, that is the folder of first link
+ * and not necessarily the folder in path.
+ * @param root The root of file system
+ * @param path The path of file
+ * @param owner Will be set to the folder which is charged for the file
+ * @param file Will be set to the file
+ * @return 0 if the file exists. EISDIR for folders and root. EINVAL for symbolic links. Otherwise the error of
+ * find_entry.
+ */
+static int find_file(struct mem_fs_directory *root, const char *path,
+                     struct mem_fs_directory **owner, struct mem_fs_file **file) {
+    struct mem_fs_directory *parent;
+    struct mem_fs_entry **link;
+    int result = find_entry(root, path, &parent, &link);
+    if (result == EBUSY) // root folder
+        return EISDIR;
+    if (result != 0)
+        return result;
+    switch ((*link)->type) {
+        case CROW_FS_FOLDER:
+            return EISDIR;
+        case CROW_FS_LINK: // links are followed by the kernel
+            return EINVAL;
+        case CROW_FS_FILE:
+            break;
+    }
+    *file = (*link)->data.file;
+    *owner = (*file)->hard_links->parent;
+    return 0;
+}
+
+/**
+ * Walks to the folder which shall hold a new entry and makes sure that the name is not taken
+ * @param root The root of file system
+ * @param path The path of new entry
+ * @param parent Will be set to the folder which shall hold the entry
+ * @param name Will be set to the name of new entry inside path
+ * @param name_length Will be set to the length of name
+ * @return 0 if the entry can be created. EEXIST if it already exists. Otherwise the error of walk_path.
+ */
+static int walk_to_new_entry(struct mem_fs_directory *root, const char *path,
+                             struct mem_fs_directory **parent, const char **name, size_t *name_length) {
+    int result = walk_path(root, path, parent, name, name_length);
+    if (result != 0)
+        return result;
+    if (*name == NULL || find_in_directory(*parent, *name, *name_length) != NULL) // root or an existing entry
+        return EEXIST;
+    return 0;
+}
+
+/**
+ * Allocates a new entry and adds it to a folder
+ * @param fs The file system
+ * @param parent The folder to add the entry to
+ * @param type Type of entry
+ * @param name Name of entry. Does not need to be null terminated.
+ * @param name_length Length of name. Must not be more than MAX_FILE_NAME.
+ * @return The new entry
+ */
+static struct mem_fs_entry *add_new_entry(struct mem_fs *fs, struct mem_fs_directory *parent,
+                                          enum mem_fs_entry_type type, const char *name, size_t name_length) {
+    struct mem_fs_entry *new_entry = malloc(sizeof(struct mem_fs_entry));
+    new_entry->type = type;
+    memcpy(new_entry->name, name, name_length);
+    new_entry->name[name_length] = '\0';
+    new_entry->parent = parent;
+    new_entry->next_hard_link = NULL;
+    new_entry->next = parent->entries;
+    parent->entries = new_entry;
+    mark_modified(fs, &parent->times);
+    return new_entry;
+}
+
+/**
+ * Adds a file with allocated storage to a folder
+ * @param fs The file system
+ * @param parent The folder to add the file to
+ * @param name Name of file. Does not need to be null terminated.
+ * @param name_length Length of name
+ * @param file The file. Its size and storage must be set.
+ */
+static void add_new_file(struct mem_fs *fs, struct mem_fs_directory *parent, const char *name,
+                         size_t name_length, struct mem_fs_file *file) {
+    struct mem_fs_entry *new_entry = add_new_entry(fs, parent, CROW_FS_FILE, name, name_length);
+    new_entry->data.file = file;
+    file->link_count = 1;
+    file->hard_links = new_entry;
+    file->spill_offset = -1;
+    file->lru_prev = NULL;
+    file->lru_next = NULL;
+    file->ttl = 0;
+    file->ttl_prev = NULL;
+    file->ttl_next = NULL;
+    file->page_checksums = NULL;
+    file->checksum_valid = false;
+    init_times(fs, &file->times);
+    add_usage(parent, file->size, 1);
+    if (fs->spill != NULL)
+        mem_fs_spill_resized(fs->spill, file, 0);
+    if (fs->cache != NULL)
+        mem_fs_cache_resized(fs->cache, file, 0);
+}
+
+/**
+ * Initializes an empty folder
+ * @param fs The file system
+ * @param directory The folder to initialize
+ * @param parent The folder which holds this folder. NULL for root.
+ */
+static void init_directory(struct mem_fs *fs, struct mem_fs_directory *directory,
+                           struct mem_fs_directory *parent) {
+    directory->entries = NULL;
+    directory->parent = parent;
+    directory->usage = (struct mem_fs_usage) {0};
+    directory->quota = (struct mem_fs_usage) {0};
+    init_times(fs, &directory->times);
+}
+
+void mem_fs_set_spill(struct mem_fs *fs, struct mem_fs_spill *spill) {
+    fs->spill = spill;
+}
+
+void mem_fs_set_cache(struct mem_fs *fs, struct mem_fs_cache *cache) {
+    fs->cache = cache;
+}
+
+void mem_fs_set_memfd(struct mem_fs *fs, bool enabled) {
+    fs->memfd = enabled;
+}
+
+void mem_fs_set_checksums(struct mem_fs *fs, bool enabled, bool verify) {
+    if (enabled)
+        pthread_once(&checksum_constants_once, init_checksum_constants);
+    fs->checksums = enabled;
+    fs->verify_reads = enabled && verify;
+}
+
+void mem_fs_set_coarse_clock(struct mem_fs *fs, bool enabled) {
+    fs->coarse_clock = enabled;
+}
+
+void mem_fs_set_clock(struct mem_fs *fs, const struct timespec *time) {
+    fs->clock_fixed = time != NULL;
+    if (time != NULL)
+        fs->fixed_time = *time;
 }
 
-void mem_fs_tree(const struct mem_fs_directory *root) {
+struct timespec mem_fs_last_time(const struct mem_fs *fs) {
+    return fs->last_time;
+}
+
+void mem_fs_new(struct mem_fs *fs) {
+    fs->spill = NULL;
+    fs->cache = NULL;
+    fs->memfd = false;
+    fs->checksums = false;
+    fs->verify_reads = false;
+    fs->coarse_clock = false;
+    fs->clock_fixed = false;
+    fs->last_time = (struct timespec) {0};
+    mem_fs_lock_init(&fs->lock);
+    init_directory(fs, &fs->root, NULL); // no files in this folder
+}
+
+void mem_fs_destroy(struct mem_fs *fs) {
+    struct mem_fs_entry *current_entry = fs->root.entries;
+    while (current_entry != NULL) {
+        struct mem_fs_entry *next_entry = current_entry->next;
+        mem_fs_free_entry(current_entry);
+        current_entry = next_entry;
+    }
+    fs->root.entries = NULL;
+    fs->root.usage = (struct mem_fs_usage) {0};
+    mem_fs_lock_destroy(&fs->lock);
+}
+
+void mem_fs_tree(const struct mem_fs *fs) {
     printf("+-- /\n");
-    mem_fs_tree_internal(root, 1);
+    mem_fs_tree_internal(&fs->root, 1);
 }
 
-int mem_fs_get_entry(struct mem_fs_directory *root, const char *path, struct mem_fs_entry *entry) {
-    // Check literal root folder
-    if (strcmp("/", path) == 0) {
+int mem_fs_get_entry(struct mem_fs *fs, const char *path, struct mem_fs_entry *entry) {
+    struct mem_fs_directory *parent;
+    struct mem_fs_entry **link;
+    int result = find_entry(&fs->root, path, &parent, &link);
+    if (result == EBUSY) { // literal root folder
         strcpy(entry->name, "/");
         entry->type = CROW_FS_FOLDER;
-        entry->data.directory = root;
+        entry->data.directory = &fs->root;
+        entry->parent = NULL;
         entry->next = NULL;
+        entry->next_hard_link = NULL;
+        return 0;
     }
-    // Traverse the file system
-    int result = 0;
-    char *path_copy = strdup(path);
-    char *token;
-    char *rest = path_copy;
-    while ((token = strtok_r(rest, "/", &rest))) {
-        bool found = false;
-        bool last_part = is_empty_string(rest);
-        // Check each entry in file this directory
-        for (struct mem_fs_entry *current_entry = root->entries;
-             current_entry != NULL;
-             current_entry = current_entry->next) {
-            if (strcmp(current_entry->name, token) == 0) { // same name
-                if (last_part) { // On last part just set the results
-                    *entry = *current_entry; // copy all fields
-                    entry->next = NULL; // except the next value
-                    found = true;
-                } else {
-                    // Allow folders only if we are not at last part
-                    if (current_entry->type == CROW_FS_FOLDER) {
-                        root = current_entry->data.directory;
-                        found = true;
-                    }
-                }
-                break;
-            }
-        }
-        if (!found) { // cannot find the file. Just break out.
-            result = ENOENT;
-            break;
-        }
+    if (result != 0)
+        return result;
+    *entry = **link; // copy all fields
+    entry->next = NULL; // except the next value
+    return 0;
+}
+
+int mem_fs_create_file(struct mem_fs *fs, const char *path, size_t file_size) {
+    struct mem_fs_directory *parent;
+    const char *name;
+    size_t name_length;
+    int result = walk_to_new_entry(&fs->root, path, &parent, &name, &name_length);
+    if (result == 0)
+        result = check_quota(parent, file_size, 1);
+    if (result != 0)
+        return result;
+    // Create the file
+    struct mem_fs_file *file = malloc(sizeof(struct mem_fs_file));
+    if (file == NULL)
+        return ENOSPC;
+    if (create_storage(fs, file, file_size) != 0) {
+        free(file);
+        return ENOSPC;
     }
-    // Clean up
-    free(path_copy);
-    return result;
+    add_new_file(fs, parent, name, name_length, file);
+    update_checksums(fs, file, 0, 0, 0);
+    return 0;
 }
 
-int mem_fs_create_file(struct mem_fs_directory *root, const char *path, size_t file_size) {
-    int result = 0;
-    char filename[MAX_FILE_NAME + 1] = {'\0'};
-    // Traverse the file system
-    char *path_copy = strdup(path);
-    char *token;
-    char *rest = path_copy;
-    while ((token = strtok_r(rest, "/", &rest))) {
-        bool found = false;
-        bool last_part = is_empty_string(rest);
-        // Check each entry in file this directory
-        for (struct mem_fs_entry *current_entry = root->entries;
-             current_entry != NULL;
-             current_entry = current_entry->next) {
-            // TODO: at the last step, we shall truncate the token.
-            if (strcmp(current_entry->name, token) == 0) { // same name
-                found = true;
-                /**
-                 * If this is not the last part of the path, we are allowed to go to new folders.
-                 * Otherwise (this is the last part) we shall give user error that the file already exists.
-                 */
-                if (!last_part) {
-                    if (current_entry->type == CROW_FS_FOLDER) { // we can only enter folders
-                        root = current_entry->data.directory;
-                    } else { // we cant enter other files. NOT FOUND!
-                        found = false;
-                    }
-                }
-                break;
-            }
-        }
-        if (found && last_part) { // file already exists
-            result = EEXIST;
-            break;
-        } else if (!found && !last_part) { // not found part of path
-            result = ENOENT;
-            break;
+int mem_fs_adopt_file(struct mem_fs *fs, const char *path, int fd, size_t file_size) {
+    struct mem_fs_directory *parent;
+    const char *name;
+    size_t name_length;
+    int result = walk_to_new_entry(&fs->root, path, &parent, &name, &name_length);
+    if (result != 0)
+        return result;
+    // Map the memfd as it is
+    struct mem_fs_file *file = malloc(sizeof(struct mem_fs_file));
+    if (file == NULL)
+        return ENOMEM;
+    file->fd = fd;
+    file->data = NULL;
+    file->size = 0;
+    file->capacity = file_size;
+    file->shared = false;
+    if (file_size != 0) {
+        file->data = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (file->data == MAP_FAILED) {
+            free(file);
+            return ENOMEM;
         }
-        // Copy the filename if this is the last part of path
-        if (last_part)
-            strncpy(filename, token, sizeof(filename) - 1);
     }
-    free(path_copy); // clean up. We have a backup of our filename in filename array
-    // Check for errors
+    file->size = file_size;
+    add_new_file(fs, parent, name, name_length, file);
+    return 0;
+}
+
+int mem_fs_share_file(struct mem_fs *fs, const char *path, int *fd, struct mem_fs_entry *entry) {
+    int result = mem_fs_get_entry(fs, path, entry);
     if (result != 0)
         return result;
-    // Create the file
-    struct mem_fs_entry *new_entry = malloc(sizeof(struct mem_fs_entry));
-    new_entry->type = CROW_FS_FILE;
-    strcpy(new_entry->name, filename); // this is safe. I already truncated the length in iteration over path.
-    new_entry->data.file = malloc(sizeof(struct mem_fs_file));
-    new_entry->data.file->data = calloc(file_size, sizeof(char));
-    new_entry->data.file->size = file_size;
-    // Add it to directory
-    new_entry->next = root->entries;
-    root->entries = new_entry;
+    if (entry->type != CROW_FS_FILE || entry->data.file->fd < 0)
+        return EOPNOTSUPP;
+    struct mem_fs_file *file = entry->data.file;
+    // Free the preallocated bytes, the other process would read them as zeros after the end of file
+    size_t old_capacity = file->capacity;
+    if (file->capacity != file->size) {
+        if (resize_storage(file, file->size) != 0)
+            return ENOSPC;
+        if (fs->cache != NULL)
+            mem_fs_cache_resized(fs->cache, file, old_capacity);
+    }
+    *fd = fcntl(file->fd, F_DUPFD_CLOEXEC, 0);
+    if (*fd < 0)
+        return errno;
+    file->shared = true;
     return 0;
 }
 
-int mem_fs_create_folder(struct mem_fs_directory *root, const char *path) {
-    int result = 0;
-    char filename[MAX_FILE_NAME + 1] = {'\0'};
-    // Traverse the file system
-    char *path_copy = strdup(path);
-    char *token;
-    char *rest = path_copy;
-    while ((token = strtok_r(rest, "/", &rest))) {
-        bool found = false;
-        bool last_part = is_empty_string(rest);
-        // Check each entry in file this directory
-        for (struct mem_fs_entry *current_entry = root->entries;
-             current_entry != NULL;
-             current_entry = current_entry->next) {
-            // TODO: at the last step, we shall truncate the token.
-            if (strcmp(current_entry->name, token) == 0) { // same name
-                found = true;
-                /**
-                 * If this is not the last part of the path, we are allowed to go to new folders.
-                 * Otherwise (this is the last part) we shall give user error that the file already exists.
-                 */
-                if (!last_part) {
-                    if (current_entry->type == CROW_FS_FOLDER) { // we can only enter folders
-                        root = current_entry->data.directory;
-                    } else { // we cant enter other files. NOT FOUND!
-                        found = false;
-                    }
-                }
-                break;
-            }
-        }
-        if (found && last_part) { // file already exists
-            result = EEXIST;
-            break;
-        } else if (!found && !last_part) { // not found part of path
-            result = ENOENT;
-            break;
-        }
-        // Copy the filename if this is the last part of path
-        if (last_part)
-            strncpy(filename, token, sizeof(filename) - 1);
+int mem_fs_create_file_from(struct mem_fs *fs, const char *path, size_t file_size, FILE *source) {
+    struct mem_fs_directory *parent;
+    const char *name;
+    size_t name_length;
+    int result = walk_to_new_entry(&fs->root, path, &parent, &name, &name_length);
+    if (result == 0)
+        result = check_quota(parent, file_size, 1);
+    if (result != 0)
+        return result;
+    struct mem_fs_file *file = malloc(sizeof(struct mem_fs_file));
+    if (file == NULL)
+        return ENOSPC;
+    if (fs->memfd) {
+        result = create_storage(fs, file, file_size);
+    } else { // the whole storage is read over, so it is not zeroed
+        file->fd = -1;
+        file->shared = false;
+        file->data = malloc(file_size);
+        file->size = file_size;
+        file->capacity = file_size;
+        if (file->data == NULL && file_size != 0)
+            result = ENOSPC;
+    }
+    if (result == 0 && fread(file->data, 1, file_size, source) != file_size) {
+        free_storage(file);
+        result = EIO;
+    }
+    if (result != 0) {
+        free(file);
+        return result;
     }
-    free(path_copy); // clean up. We have a backup of our filename in filename array
-    // Check for errors
+    add_new_file(fs, parent, name, name_length, file);
+    update_checksums(fs, file, 0, 0, file_size);
+    return 0;
+}
+
+int mem_fs_create_folder(struct mem_fs *fs, const char *path) {
+    struct mem_fs_directory *parent;
+    const char *name;
+    size_t name_length;
+    int result = walk_to_new_entry(&fs->root, path, &parent, &name, &name_length);
+    if (result == 0)
+        result = check_quota(parent, 0, 1);
     if (result != 0)
         return result;
     // Create the folder
-    struct mem_fs_entry *new_entry = malloc(sizeof(struct mem_fs_entry));
-    new_entry->type = CROW_FS_FOLDER;
-    strcpy(new_entry->name, filename); // this is safe. I already truncated the length in iteration over path.
+    struct mem_fs_entry *new_entry = add_new_entry(fs, parent, CROW_FS_FOLDER, name, name_length);
     new_entry->data.directory = malloc(sizeof(struct mem_fs_directory));
-    new_entry->data.directory->entries = NULL;
-    // Add it to directory
-    new_entry->next = root->entries;
-    root->entries = new_entry;
+    init_directory(fs, new_entry->data.directory, parent);
+    add_usage(parent, 0, 1);
     return 0;
 }
 
 int
-mem_fs_write(struct mem_fs_directory *root, const char *path, size_t buffer_size, const char *buffer, off_t offset) {
+mem_fs_write(struct mem_fs *fs, const char *path, size_t buffer_size, const char *buffer, off_t offset) {
     // Get the file
-    struct mem_fs_entry entry;
-    int get_entry_status = mem_fs_get_entry(root, path, &entry);
-    if (get_entry_status != 0)
-        return -get_entry_status;
-    // TODO: read link if needed?
-    // Check if this is a file
-    if (entry.type == CROW_FS_FOLDER)
-        return -EISDIR;
+    struct mem_fs_directory *owner;
+    struct mem_fs_file *file;
+    int result = find_file(&fs->root, path, &owner, &file);
+    if (result != 0)
+        return -result;
     // Write to file
-    return write_to_file(entry.data.file, buffer_size, buffer, offset);
+    return write_to_file(fs, owner, file, buffer_size, buffer, offset);
 }
 
 int
-mem_fs_read(struct mem_fs_directory *root, const char *path, size_t buffer_size, char *buffer, off_t offset) {
+mem_fs_read(struct mem_fs *fs, const char *path, size_t buffer_size, char *buffer, off_t offset) {
     // Get the file
-    struct mem_fs_entry entry;
-    int get_entry_status = mem_fs_get_entry(root, path, &entry);
-    if (get_entry_status != 0)
-        return -get_entry_status;
-    // TODO: read link if needed?
-    // Check if this is a file
-    if (entry.type == CROW_FS_FOLDER)
-        return -EISDIR;
+    struct mem_fs_directory *owner;
+    struct mem_fs_file *file;
+    int result = find_file(&fs->root, path, &owner, &file);
+    if (result != 0)
+        return -result;
     // Read
-    return read_from_file(entry.data.file, buffer_size, buffer, offset);
+    if (fs->spill != NULL && (result = mem_fs_spill_access(fs->spill, file)) != 0)
+        return -result;
+    if (fs->cache != NULL)
+        mem_fs_cache_access(fs->cache, file);
+    if (fs->verify_reads && verify_checksums(file, offset, buffer_size) != 0)
+        return -EIO;
+    return read_from_file(file, buffer_size, buffer, offset);
 }
 
-int mem_fs_resize_file(struct mem_fs_directory *root, const char *path, size_t new_size) {
+int mem_fs_read_file_data(const struct mem_fs *fs, const struct mem_fs_file *file, size_t buffer_size, char *buffer,
+                          off_t offset) {
+    if (file->spill_offset >= 0)
+        return mem_fs_spill_read(fs->spill, file, buffer_size, buffer, offset);
+    memcpy(buffer, file->data + offset, buffer_size);
+    return 0;
+}
+
+int mem_fs_resize_file(struct mem_fs *fs, const char *path, size_t new_size) {
     // Get the file
-    struct mem_fs_entry entry;
-    int get_entry_status = mem_fs_get_entry(root, path, &entry);
-    if (get_entry_status != 0)
-        return get_entry_status;
-    // TODO: read link if needed?
-    // Check if this is a file
-    if (entry.type == CROW_FS_FOLDER)
-        return EISDIR;
-    // Try to resize
-    char *new_buffer = realloc(entry.data.file->data, new_size);
-    if (new_buffer == NULL && new_size != 0)
+    struct mem_fs_directory *parent;
+    struct mem_fs_file *file;
+    int get_file_status = find_file(&fs->root, path, &parent, &file);
+    if (get_file_status != 0)
+        return get_file_status;
+    if (new_size > file->size && check_quota(parent, new_size - file->size, 0) != 0)
+        return EDQUOT;
+    if (fs->spill != NULL) {
+        int result = mem_fs_spill_access(fs->spill, file);
+        if (result != 0)
+            return result;
+    }
+    // Try to resize. Shrinking gives the memory back, preallocated or not.
+    size_t old_capacity = file->capacity;
+    if (new_size < file->size) {
+        if (resize_storage(file, new_size) != 0)
+            return ENOSPC;
+    } else if (reserve_storage(file, new_size, false) != 0) {
         return ENOSPC;
+    }
+    // Fill the added bytes with zero. memfds are zero filled already.
+    if (file->fd < 0 && new_size > file->size)
+        memset(file->data + file->size, 0, new_size - file->size);
     // Apply
-    entry.data.file->data = new_buffer;
-    entry.data.file->size = new_size;
+    size_t old_size = file->size;
+    add_usage(parent, new_size - file->size, 0);
+    file->size = new_size;
+    if (fs->spill != NULL)
+        mem_fs_spill_resized(fs->spill, file, old_size);
+    if (fs->cache != NULL)
+        mem_fs_cache_resized(fs->cache, file, old_capacity);
+    update_checksums(fs, file, old_size, new_size, new_size);
+    mark_modified(fs, &file->times);
     return 0;
 }
 
-int mem_fs_rm_file(struct mem_fs_directory *root, const char *path) {
-    // Traverse the file system
-    int result = 0;
-    char *path_copy = strdup(path);
-    char *token;
-    char *rest = path_copy;
-    while ((token = strtok_r(rest, "/", &rest))) {
-        bool found = false;
-        bool last_part = is_empty_string(rest);
-        // Check each entry in file this directory
-        for (struct mem_fs_entry *current_entry = root->entries, *last_entry = NULL;
-             current_entry != NULL;
-             last_entry = current_entry, current_entry = current_entry->next) {
-            if (strcmp(current_entry->name, token) == 0) { // same name
-                if (last_part) { // On last part delete if this is a file
-                    if (current_entry->type == CROW_FS_FOLDER) { // don't delete folders
-                        result = EISDIR;
-                    } else { // this is a file. So delete and update link list
-                        // Delete file content
-                        free(current_entry->data.file->data);
-                        free(current_entry->data.file);
-                        // Update linked list
-                        if (last_entry == NULL) { // First file in directory
-                            root->entries = current_entry->next;
-                        } else {
-                            last_entry->next = current_entry->next;
-                        }
-                        // Free the file descriptor itself
-                        free(current_entry);
-                    }
-                    found = true;
-                } else {
-                    // Allow folders only if we are not at last part
-                    if (current_entry->type == CROW_FS_FOLDER) {
-                        root = current_entry->data.directory;
-                        found = true;
-                    }
-                }
-                break;
-            }
-        }
-        if (!found) { // cannot find the file. Just break out.
-            result = ENOENT;
-            break;
-        }
+int mem_fs_fallocate(struct mem_fs *fs, const char *path, int mode, off_t offset, size_t length) {
+    bool keep_size = (mode & FALLOC_FL_KEEP_SIZE) != 0;
+    bool punch_hole = (mode & FALLOC_FL_PUNCH_HOLE) != 0;
+    bool zero_range = (mode & FALLOC_FL_ZERO_RANGE) != 0;
+    if ((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) != 0 ||
+        (punch_hole && (!keep_size || zero_range)))
+        return EOPNOTSUPP;
+    if (offset < 0 || length == 0 || (size_t) offset + length < (size_t) offset)
+        return EINVAL;
+    // Get the file
+    struct mem_fs_directory *parent;
+    struct mem_fs_file *file;
+    int result = find_file(&fs->root, path, &parent, &file);
+    if (result != 0)
+        return result;
+    size_t end = offset + length, old_size = file->size, old_capacity = file->capacity;
+    size_t new_size = keep_size || end <= old_size ? old_size : end;
+    // Reserved bytes are not charged, but they must fit in the quota when they are used
+    if (!punch_hole && end > old_size && check_quota(parent, end - old_size, 0) != 0)
+        return EDQUOT;
+    if (fs->spill != NULL && (result = mem_fs_spill_access(fs->spill, file)) != 0)
+        return result;
+    // Shared files do not keep preallocated bytes
+    if (!punch_hole && reserve_storage(file, file->shared ? new_size : end, false) != 0)
+        return ENOSPC;
+    // Zero the range inside the file. The range after the end of file is zeroed when the file grows.
+    if (punch_hole || zero_range)
+        zero_storage(file, offset, MIN(end, old_size));
+    if (new_size > old_size) {
+        if (file->fd < 0) // memfds are zero filled already
+            memset(file->data + old_size, 0, new_size - old_size);
+        file->size = new_size;
+        add_usage(parent, new_size - old_size, 0);
+        if (fs->spill != NULL)
+            mem_fs_spill_resized(fs->spill, file, old_size);
     }
-    // Clean up
-    free(path_copy);
+    // Reserved capacity is charged to the cache even if the size is kept
+    if (fs->cache != NULL && file->capacity != old_capacity)
+        mem_fs_cache_resized(fs->cache, file, old_capacity);
+    if (punch_hole || zero_range)
+        update_checksums(fs, file, old_size, offset, MIN(end, old_size));
+    else if (new_size != old_size)
+        update_checksums(fs, file, old_size, new_size, new_size);
+    if (punch_hole || zero_range || new_size != old_size) // preallocation alone does not change the content
+        mark_modified(fs, &file->times);
+    return 0;
+}
+
+int mem_fs_link(struct mem_fs *fs, const char *old_path, const char *new_path) {
+    struct mem_fs_directory *parent;
+    struct mem_fs_entry **link;
+    int result = find_entry(&fs->root, old_path, &parent, &link);
+    if (result == EBUSY) // root folder
+        return EPERM;
+    if (result != 0)
+        return result;
+    struct mem_fs_entry *source = *link;
+    if (source->type == CROW_FS_FOLDER)
+        return EPERM;
+    if (source->type == CROW_FS_LINK) // links never change, so a copy is as good as sharing it
+        return mem_fs_symlink(fs, source->data.link->target, new_path);
+    const char *name;
+    size_t name_length;
+    result = walk_to_new_entry(&fs->root, new_path, &parent, &name, &name_length);
+    if (result == 0)
+        result = check_quota(parent, 0, 1);
+    if (result != 0)
+        return result;
+    // The new link is not charged for the bytes, the first link still is
+    struct mem_fs_file *file = source->data.file;
+    struct mem_fs_entry *new_entry = add_new_entry(fs, parent, CROW_FS_FILE, name, name_length);
+    new_entry->data.file = file;
+    new_entry->next_hard_link = file->hard_links->next_hard_link;
+    file->hard_links->next_hard_link = new_entry;
+    file->link_count++;
+    mark_changed(fs, &file->times);
+    add_usage(parent, 0, 1);
+    return 0;
+}
+
+int mem_fs_symlink(struct mem_fs *fs, const char *target, const char *path) {
+    size_t target_length = strlen(target);
+    if (target_length >= PATH_MAX)
+        return ENAMETOOLONG;
+    struct mem_fs_directory *parent;
+    const char *name;
+    size_t name_length;
+    int result = walk_to_new_entry(&fs->root, path, &parent, &name, &name_length);
+    if (result == 0)
+        result = check_quota(parent, 0, 1);
+    if (result != 0)
+        return result;
+    struct mem_fs_link *link = malloc(sizeof(struct mem_fs_link) + target_length + 1);
+    if (link == NULL)
+        return ENOMEM;
+    init_times(fs, &link->times);
+    link->length = target_length;
+    memcpy(link->target, target, target_length + 1);
+    struct mem_fs_entry *new_entry = add_new_entry(fs, parent, CROW_FS_LINK, name, name_length);
+    new_entry->data.link = link;
+    add_usage(parent, 0, 1);
+    return 0;
+}
+
+int mem_fs_readlink(struct mem_fs *fs, const char *path, char *buffer, size_t buffer_size) {
+    struct mem_fs_directory *parent;
+    struct mem_fs_entry **link;
+    int result = find_entry(&fs->root, path, &parent, &link);
+    if (result == EBUSY) // root folder
+        return EINVAL;
+    if (result != 0)
+        return result;
+    if ((*link)->type != CROW_FS_LINK || buffer_size == 0)
+        return EINVAL;
+    const struct mem_fs_link *target = (*link)->data.link;
+    size_t length = MIN(target->length, buffer_size - 1);
+    memcpy(buffer, target->target, length);
+    buffer[length] = '\0';
+    return 0;
+}
+
+int mem_fs_rm_file(struct mem_fs *fs, const char *path) {
+    struct mem_fs_entry *detached;
+    int result = mem_fs_detach_file(fs, path, &detached);
+    if (result == 0)
+        mem_fs_free_entry(detached);
     return result;
 }
 
-int mem_fs_rm_dir(struct mem_fs_directory *root, const char *path) {
-    // Check root!
-    if (strcmp(path, "/") == 0)
+int mem_fs_detach_file(struct mem_fs *fs, const char *path, struct mem_fs_entry **detached) {
+    struct mem_fs_directory *parent;
+    struct mem_fs_entry **link;
+    int result = find_entry(&fs->root, path, &parent, &link);
+    if (result == EBUSY) // root folder
+        return EISDIR;
+    if (result != 0)
+        return result;
+    struct mem_fs_entry *entry = *link;
+    if (entry->type == CROW_FS_FOLDER) // don't delete folders
+        return EISDIR;
+    // This is a file. So detach it from link list
+    struct mem_fs_usage usage = entry_usage(entry);
+    add_usage(parent, -usage.bytes, -usage.inodes);
+    *link = entry->next;
+    entry->next = NULL;
+    mark_modified(fs, &parent->times);
+    detach_hard_link(fs, entry);
+    *detached = entry;
+    return 0;
+}
+
+struct mem_fs_entry *mem_fs_detach_links(struct mem_fs *fs, struct mem_fs_file *file) {
+    while (true) {
+        struct mem_fs_entry *entry = file->hard_links;
+        struct mem_fs_directory *parent = entry->parent;
+        bool last_link = file->link_count == 1;
+        struct mem_fs_usage usage = entry_usage(entry);
+        add_usage(parent, -usage.bytes, -usage.inodes);
+        unlink_from_directory(parent, entry);
+        entry->next = NULL;
+        mark_modified(fs, &parent->times);
+        detach_hard_link(fs, entry);
+        if (last_link)
+            return entry;
+        mem_fs_free_entry(entry); // it does not point to the file anymore
+    }
+}
+
+int mem_fs_rm_dir(struct mem_fs *fs, const char *path) {
+    struct mem_fs_directory *parent;
+    struct mem_fs_entry **link;
+    int result = find_entry(&fs->root, path, &parent, &link);
+    if (result == EBUSY) // root folder
         return EPERM;
-    // Traverse the file system
-    int result = 0;
-    char *path_copy = strdup(path);
-    char *token;
-    char *rest = path_copy;
-    while ((token = strtok_r(rest, "/", &rest))) {
-        bool found = false;
-        bool last_part = is_empty_string(rest);
-        // Check each entry in file this directory
-        for (struct mem_fs_entry *current_entry = root->entries, *last_entry = NULL;
-             current_entry != NULL;
-             last_entry = current_entry, current_entry = current_entry->next) {
-            if (strcmp(current_entry->name, token) == 0) { // same name
-                if (last_part) { // On last part delete if this is a file
-                    if (current_entry->type != CROW_FS_FOLDER) { // don't delete non folders
-                        result = ENOTDIR;
-                    } else { // directory
-                        // Check if folder is empty
-                        if (current_entry->data.directory->entries != NULL) { // non empty directory
-                            result = ENOTEMPTY;
-                        } else { // empty directory. Delete it
-                            // Delete directory content
-                            free(current_entry->data.directory);
-                            // Update linked list
-                            if (last_entry == NULL) { // First file in directory
-                                root->entries = current_entry->next;
-                            } else {
-                                last_entry->next = current_entry->next;
-                            }
-                            // Free the file descriptor itself
-                            free(current_entry);
-                        }
-                    }
-                    found = true;
-                } else {
-                    // Allow folders only if we are not at last part
-                    if (current_entry->type == CROW_FS_FOLDER) {
-                        root = current_entry->data.directory;
-                        found = true;
-                    }
-                }
-                break;
+    if (result != 0)
+        return result;
+    struct mem_fs_entry *entry = *link;
+    if (entry->type != CROW_FS_FOLDER) // don't delete non folders
+        return ENOTDIR;
+    if (entry->data.directory->entries != NULL) // non empty directory
+        return ENOTEMPTY;
+    // Empty directory. Delete it
+    add_usage(parent, 0, -1);
+    *link = entry->next;
+    mark_modified(fs, &parent->times);
+    free(entry->data.directory);
+    free(entry);
+    return 0;
+}
+
+int mem_fs_rename(struct mem_fs *fs, const char *old_path, const char *new_path) {
+    struct mem_fs_entry *replaced;
+    int result = mem_fs_detach_rename(fs, old_path, new_path, &replaced);
+    if (result == 0 && replaced != NULL)
+        mem_fs_free_entry(replaced);
+    return result;
+}
+
+int mem_fs_detach_rename(struct mem_fs *fs, const char *old_path, const char *new_path,
+                         struct mem_fs_entry **replaced) {
+    *replaced = NULL;
+    // Get both parents
+    struct mem_fs_directory *old_parent, *new_parent;
+    const char *old_name, *new_name;
+    size_t old_name_length, new_name_length;
+    int result = walk_path(&fs->root, old_path, &old_parent, &old_name, &old_name_length);
+    if (result != 0)
+        return result;
+    result = walk_path(&fs->root, new_path, &new_parent, &new_name, &new_name_length);
+    if (result != 0)
+        return result;
+    if (old_name == NULL || new_name == NULL) // root cannot be moved or replaced
+        return EBUSY;
+    // Find the source and possible target
+    struct mem_fs_entry **source_link = find_in_directory(old_parent, old_name, old_name_length);
+    if (source_link == NULL)
+        return ENOENT;
+    struct mem_fs_entry *source = *source_link;
+    struct mem_fs_entry **target_link = find_in_directory(new_parent, new_name, new_name_length);
+    struct mem_fs_entry *target = target_link == NULL ? NULL : *target_link;
+    if (target == source) // renaming to itself is a no-op
+        return 0;
+    if (target != NULL && source->type == CROW_FS_FILE && target->type == CROW_FS_FILE &&
+        source->data.file == target->data.file) // so is renaming to another link of the same file
+        return 0;
+    // Moving a folder inside itself is not possible
+    if (source->type == CROW_FS_FOLDER)
+        for (const struct mem_fs_directory *directory = new_parent; directory != NULL; directory = directory->parent)
+            if (directory == source->data.directory)
+                return EINVAL;
+    if (target != NULL) { // check if we can replace the target
+        if (source->type == CROW_FS_FOLDER && target->type != CROW_FS_FOLDER)
+            return ENOTDIR;
+        if (source->type != CROW_FS_FOLDER && target->type == CROW_FS_FOLDER)
+            return EISDIR;
+        if (target->type == CROW_FS_FOLDER && target->data.directory->entries != NULL)
+            return ENOTEMPTY;
+    }
+    // Move the usage first, so the common parents of both paths are not charged twice
+    struct mem_fs_usage source_usage = entry_usage(source);
+    struct mem_fs_usage target_usage = target == NULL ? (struct mem_fs_usage) {0} : entry_usage(target);
+    add_usage(old_parent, -source_usage.bytes, -source_usage.inodes);
+    add_usage(new_parent, -target_usage.bytes, -target_usage.inodes);
+    if (check_quota(new_parent, source_usage.bytes, source_usage.inodes) != 0) {
+        add_usage(new_parent, target_usage.bytes, target_usage.inodes);
+        add_usage(old_parent, source_usage.bytes, source_usage.inodes);
+        return EDQUOT;
+    }
+    add_usage(new_parent, source_usage.bytes, source_usage.inodes);
+    // Detach the source. The link of target might be inside source, so it is searched again.
+    *source_link = source->next;
+    if (target != NULL) {
+        unlink_from_directory(new_parent, target);
+        target->next = NULL;
+        detach_hard_link(fs, target);
+        *replaced = target;
+    }
+    // Move the entry
+    memcpy(source->name, new_name, new_name_length);
+    source->name[new_name_length] = '\0';
+    source->parent = new_parent;
+    source->next = new_parent->entries;
+    new_parent->entries = source;
+    if (source->type == CROW_FS_FOLDER)
+        source->data.directory->parent = new_parent;
+    mark_modified(fs, &old_parent->times);
+    mark_modified(fs, &new_parent->times);
+    mark_changed(fs, entry_times(source));
+    return 0;
+}
+
+void mem_fs_free_entry(struct mem_fs_entry *entry) {
+    switch (entry->type) {
+        case CROW_FS_FOLDER: {
+            struct mem_fs_entry *current_entry = entry->data.directory->entries;
+            while (current_entry != NULL) {
+                struct mem_fs_entry *next_entry = current_entry->next;
+                mem_fs_free_entry(current_entry);
+                current_entry = next_entry;
             }
+            free(entry->data.directory);
+            break;
         }
-        if (!found) { // cannot find the file. Just break out.
-            result = ENOENT;
+        case CROW_FS_FILE: {
+            // Entries inside freed folders are still linked. Other links might keep the file alive.
+            struct mem_fs_file *file = entry->data.file;
+            if (file == NULL || (file->link_count != 0 && !remove_hard_link(NULL, entry)))
+                break;
+            free_storage(file);
+            free(file->page_checksums);
+            free(file);
             break;
         }
+        case CROW_FS_LINK:
+            free(entry->data.link);
+            break;
     }
-    // Clean up
-    free(path_copy);
-    return result;
-}
\ No newline at end of file
+    free(entry);
+}
+
+size_t mem_fs_entry_bytes(const struct mem_fs_entry *entry) {
+    return entry_usage(entry).bytes;
+}
+
+/**
+ * Finds the entry which holds a folder
+ * @param directory The folder
+ * @return The entry in the parent of folder or NULL for root
+ */
+static const struct mem_fs_entry *directory_entry(const struct mem_fs_directory *directory) {
+    if (directory->parent == NULL)
+        return NULL;
+    for (const struct mem_fs_entry *entry = directory->parent->entries; entry != NULL; entry = entry->next)
+        if (entry->type == CROW_FS_FOLDER && entry->data.directory == directory)
+            return entry;
+    return NULL;
+}
+
+char *mem_fs_entry_path(const struct mem_fs_entry *entry) {
+    // Measure the path first, then fill it from the end
+    size_t length = 0;
+    for (const struct mem_fs_entry *current = entry;
+         current != NULL && current->parent != NULL;
+         current = directory_entry(current->parent))
+        length += 1 + strlen(current->name);
+    char *path = malloc(length == 0 ? 2 : length + 1);
+    if (path == NULL)
+        return NULL;
+    if (length == 0) {
+        strcpy(path, "/");
+        return path;
+    }
+    path[length] = '\0';
+    for (const struct mem_fs_entry *current = entry;
+         current != NULL && current->parent != NULL;
+         current = directory_entry(current->parent)) {
+        size_t name_length = strlen(current->name);
+        length -= name_length;
+        memcpy(path + length, current->name, name_length);
+        path[--length] = '/';
+    }
+    return path;
+}
+
+int mem_fs_set_times(struct mem_fs *fs, const char *path, const struct timespec times[2]) {
+    struct mem_fs_entry entry;
+    int result = mem_fs_get_entry(fs, path, &entry);
+    if (result != 0)
+        return result;
+    struct mem_fs_times *object_times = entry_times(&entry);
+    struct timespec now = current_time(fs);
+    if (times == NULL || times[0].tv_nsec != UTIME_OMIT)
+        object_times->atime = times == NULL || times[0].tv_nsec == UTIME_NOW ? now : times[0];
+    if (times == NULL || times[1].tv_nsec != UTIME_OMIT)
+        object_times->mtime = times == NULL || times[1].tv_nsec == UTIME_NOW ? now : times[1];
+    object_times->ctime = now;
+    return 0;
+}
+
+const struct mem_fs_times *mem_fs_entry_times(const struct mem_fs_entry *entry) {
+    return entry_times(entry);
+}
+
+uint64_t mem_fs_pack_time(struct timespec time) {
+    return (uint64_t) ((int64_t) time.tv_sec * 1000000000 + time.tv_nsec);
+}
+
+struct timespec mem_fs_unpack_time(uint64_t packed) {
+    int64_t nanoseconds = (int64_t) packed;
+    struct timespec time = {.tv_sec = nanoseconds / 1000000000, .tv_nsec = nanoseconds % 1000000000};
+    if (time.tv_nsec < 0) { // times before 1970
+        time.tv_sec--;
+        time.tv_nsec += 1000000000;
+    }
+    return time;
+}
+
+int mem_fs_get_usage(struct mem_fs *fs, const char *path, struct mem_fs_usage *usage) {
+    struct mem_fs_entry entry;
+    int result = mem_fs_get_entry(fs, path, &entry);
+    if (result != 0)
+        return result;
+    if (entry.type == CROW_FS_FOLDER) { // the folder itself is not counted
+        *usage = entry.data.directory->usage;
+    } else if (entry.type == CROW_FS_FILE) { // every link shows the whole file
+        *usage = (struct mem_fs_usage) {.bytes = entry.data.file->size, .inodes = 1};
+    } else {
+        *usage = entry_usage(&entry);
+    }
+    return 0;
+}
+
+int mem_fs_set_quota(struct mem_fs *fs, const char *path, const struct mem_fs_usage *quota) {
+    struct mem_fs_entry entry;
+    int result = mem_fs_get_entry(fs, path, &entry);
+    if (result != 0)
+        return result;
+    if (entry.type != CROW_FS_FOLDER)
+        return ENOTDIR;
+    entry.data.directory->quota = *quota;
+    return 0;
+}
+
+int mem_fs_get_checksum(struct mem_fs *fs, const char *path, uint32_t *checksum) {
+    if (!fs->checksums)
+        return ENOTSUP;
+    struct mem_fs_directory *owner;
+    struct mem_fs_file *file;
+    int result = find_file(&fs->root, path, &owner, &file);
+    if (result != 0)
+        return result;
+    // Readers might cache the checksum at the same time. They store the same value.
+    if (__atomic_load_n(&file->checksum_valid, __ATOMIC_ACQUIRE)) {
+        *checksum = __atomic_load_n(&file->checksum, __ATOMIC_RELAXED);
+        return 0;
+    }
+    // Page checksums might be unknown, for example for files which are passed from another process
+    const uint32_t *page_checksums = __atomic_load_n(&file->page_checksums, __ATOMIC_ACQUIRE);
+    if (page_checksums == NULL && file->size != 0) {
+        if (fs->spill != NULL && (result = mem_fs_spill_access(fs->spill, file)) != 0)
+            return result;
+        page_checksums = compute_checksums(file);
+        if (page_checksums == NULL)
+            return ENOMEM;
+    }
+    // Combine the pages. All of them but the last one have the same size.
+    uint32_t combined = 0;
+    size_t page_count = CHECKSUM_PAGE_COUNT(file->size);
+    for (size_t page = 0; page + 1 < page_count; page++)
+        combined = mem_fs_crc32c_shift_combine(&page_shift, combined, page_checksums[page]);
+    if (page_count != 0)
+        combined = mem_fs_crc32c_combine(combined, page_checksums[page_count - 1],
+                                         file->size - (page_count - 1) * MEM_FS_CHECKSUM_PAGE_SIZE);
+    __atomic_store_n(&file->checksum, combined, __ATOMIC_RELAXED);
+    __atomic_store_n(&file->checksum_valid, true, __ATOMIC_RELEASE);
+    *checksum = combined;
+    return 0;
+}
+
+int mem_fs_set_ttl(struct mem_fs *fs, const char *path, time_t ttl) {
+    if (fs->cache == NULL)
+        return ENOTSUP;
+    if (ttl < 0)
+        return EINVAL;
+    struct mem_fs_directory *owner;
+    struct mem_fs_file *file;
+    int result = find_file(&fs->root, path, &owner, &file);
+    if (result != 0)
+        return result;
+    mem_fs_cache_set_ttl(fs->cache, file, ttl);
+    mark_changed(fs, &file->times);
+    return 0;
+}
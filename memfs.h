@@ -1,12 +1,19 @@
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
 #include <sys/types.h>
+#include "lock.h"
 
 #ifndef CROWFS_CROWFS_H
 #define CROWFS_CROWFS_H
 
-#endif //CROWFS_CROWFS_H
-
 #define MAX_FILE_NAME 63
+/**
+ * Files are checksummed in pages of this size
+ */
+#define MEM_FS_CHECKSUM_PAGE_SIZE 4096
 
 enum mem_fs_entry_type {
     CROW_FS_FOLDER,
@@ -31,10 +38,47 @@ struct mem_fs_entry {
      * The name of this file/folder/link
      */
     char name[MAX_FILE_NAME + 1];
+    /**
+     * The folder which holds this entry. NULL for the copy of root which mem_fs_get_entry returns.
+     */
+    struct mem_fs_directory *parent;
     /**
      * Next element in linked list. Can be NULL.
      */
     struct mem_fs_entry *next;
+    /**
+     * Next hard link of the same file. Only used for files.
+     */
+    struct mem_fs_entry *next_hard_link;
+};
+
+struct mem_fs_usage {
+    /**
+     * Bytes of file content
+     */
+    size_t bytes;
+    /**
+     * Number of files, folders and links
+     */
+    size_t inodes;
+};
+
+/**
+ * Timestamps of a file, folder or link. They belong to the object and not the entry, so hard links share them.
+ */
+struct mem_fs_times {
+    /**
+     * Last access. Reads do not update it, like the noatime mount option.
+     */
+    struct timespec atime;
+    /**
+     * Last change of content
+     */
+    struct timespec mtime;
+    /**
+     * Last change of content or metadata
+     */
+    struct timespec ctime;
 };
 
 struct mem_fs_directory {
@@ -42,6 +86,22 @@ struct mem_fs_directory {
      * List of files/folder/links this folder has. This is a linked list.
      */
     struct mem_fs_entry *entries;
+    /**
+     * The folder which holds this folder. NULL for root.
+     */
+    struct mem_fs_directory *parent;
+    /**
+     * Usage of everything inside this folder, recursively. Updated on every change so reading it is O(1).
+     */
+    struct mem_fs_usage usage;
+    /**
+     * Maximum usage of this folder. Zero fields are unlimited.
+     */
+    struct mem_fs_usage quota;
+    /**
+     * Modified when an entry is added, removed or renamed in this folder
+     */
+    struct mem_fs_times times;
 };
 
 struct mem_fs_file {
@@ -49,69 +109,270 @@ struct mem_fs_file {
      * The size of this file
      */
     size_t size;
+    /**
+     * Bytes allocated for data. At least size. The bytes after size are zero for memfds and undefined otherwise.
+     */
+    size_t capacity;
     /**
      * The data which this file holds. Note that this field is allocated with malloc and must be freed with free.
+     * NULL while the file is spilled. If fd is set, this is a shared mapping of the fd instead.
      */
     char *data;
+    /**
+     * The memfd which holds the content of this file. -1 if the content is allocated with malloc.
+     */
+    int fd;
+    /**
+     * True once the memfd is passed to another process with mem_fs_share_file. The capacity is kept equal to the size
+     * from then on, so the memfd ends where the file ends.
+     */
+    bool shared;
+    /**
+     * Offset of the content of this file in the spill file. -1 if the content is in memory.
+     */
+    off_t spill_offset;
+    /**
+     * Neighbours of this file in the least recently used list of spill tier or cache
+     */
+    struct mem_fs_file *lru_prev, *lru_next;
+    /**
+     * Seconds which this file lives after its last modification in a cache. Zero if it lives until it is evicted.
+     */
+    time_t ttl;
+    /**
+     * Neighbours of this file in the list of cache which holds the files with a time to live
+     */
+    struct mem_fs_file *ttl_prev, *ttl_next;
+    /**
+     * CRC32C of each MEM_FS_CHECKSUM_PAGE_SIZE bytes of file. Allocated with malloc. NULL if checksums are disabled
+     * or not computed yet.
+     */
+    uint32_t *page_checksums;
+    /**
+     * CRC32C of the whole file. Only valid if checksum_valid is true.
+     */
+    uint32_t checksum;
+    bool checksum_valid;
+    /**
+     * Number of entries which point to this file. The file is freed when the last one is removed.
+     */
+    size_t link_count;
+    /**
+     * The entries which point to this file, linked by next_hard_link. The folder of first one is charged for the
+     * bytes of file, the others only count as an inode.
+     */
+    struct mem_fs_entry *hard_links;
+    struct mem_fs_times times;
 };
 
+/**
+ * A symbolic link. Links are resolved by the kernel, so the file system only keeps the target.
+ */
 struct mem_fs_link {
-    // TODO: implement
+    struct mem_fs_times times;
+    /**
+     * Length of target
+     */
+    size_t length;
+    /**
+     * The path which this link points to. Null terminated.
+     */
+    char target[];
+};
+
+struct mem_fs_spill;
+struct mem_fs_cache;
+
+/**
+ * A file system. The tree and all of its settings live in this object, so a process can have as many file systems
+ * as it needs. The functions of this file do not lock anything: threads which share a file system must hold lock,
+ * for reading while they only look at the tree and for writing while they change it.
+ */
+struct mem_fs {
+    struct mem_fs_directory root;
+    /**
+     * The spill tier which keeps cold files out of memory. NULL if files are never spilled.
+     */
+    struct mem_fs_spill *spill;
+    /**
+     * The cache which removes least recently used files when they go over a budget. NULL if files are never removed.
+     */
+    struct mem_fs_cache *cache;
+    /**
+     * True if the content of new files is kept in memfds instead of the heap
+     */
+    bool memfd;
+    /**
+     * True if page checksums of files are kept
+     */
+    bool checksums;
+    /**
+     * True if page checksums are checked on every read
+     */
+    bool verify_reads;
+    /**
+     * True if timestamps are read from the coarse clock
+     */
+    bool coarse_clock;
+    /**
+     * True if changes are stamped with fixed_time instead of the clock
+     */
+    bool clock_fixed;
+    struct timespec fixed_time;
+    /**
+     * The time which the last change was stamped with. Changes are only done while the write lock is held.
+     */
+    struct timespec last_time;
+    struct mem_fs_lock lock;
 };
 
 /**
- * Creates a new file system.
- * @param root The root of file system to initiate the file system in it.
+ * Sets the spill tier which keeps cold files out of memory. Must be called before any file is created.
+ * @param fs The file system
+ * @param spill The spill tier or NULL to keep everything in memory
+ */
+void mem_fs_set_spill(struct mem_fs *fs, struct mem_fs_spill *spill);
+
+/**
+ * Sets the cache which removes the least recently used files. Must be called before any file is created. It cannot
+ * be used with a spill tier, because both keep files in the same list.
+ * @param fs The file system
+ * @param cache The cache or NULL to keep every file until it is deleted
+ */
+void mem_fs_set_cache(struct mem_fs *fs, struct mem_fs_cache *cache);
+
+/**
+ * Keeps the content of files created after this call in memfds, so they can be passed to another process.
+ * Cannot be used with a spill tier.
+ * @param fs The file system
+ * @param enabled True to use memfds, false to use the heap
+ */
+void mem_fs_set_memfd(struct mem_fs *fs, bool enabled);
+
+/**
+ * Keeps CRC32C checksums of pages of files. They are updated on every change, so only changed pages are read.
+ * Must be called before any file is created.
+ * @param fs The file system
+ * @param enabled True to keep checksums
+ * @param verify True to check the checksums of pages on every read
+ */
+void mem_fs_set_checksums(struct mem_fs *fs, bool enabled, bool verify);
+
+/**
+ * Reads the time for timestamps from the coarse clock of kernel. It is cheaper to read on every write, but it is only
+ * as precise as the timer tick.
+ * @param fs The file system
+ * @param enabled True to use the coarse clock
+ */
+void mem_fs_set_coarse_clock(struct mem_fs *fs, bool enabled);
+
+/**
+ * Stamps the following changes with a fixed time instead of the clock, for example to replay them at the time which
+ * they were done at
+ * @param fs The file system
+ * @param time The time or NULL to read the clock again
+ */
+void mem_fs_set_clock(struct mem_fs *fs, const struct timespec *time);
+
+/**
+ * Gets the time which the last change was stamped with. Only meaningful while the write lock is still held since
+ * that change.
+ * @param fs The file system
+ * @return The time of last change
+ */
+struct timespec mem_fs_last_time(const struct mem_fs *fs);
+
+/**
+ * Creates a new empty file system with the default settings
+ * @param fs The file system to initialize
  */
-void mem_fs_new(struct mem_fs_directory *root);
+void mem_fs_new(struct mem_fs *fs);
+
+/**
+ * Frees everything in a file system. It must not be used afterwards unless it is created again with mem_fs_new.
+ * @param fs The file system to destroy
+ */
+void mem_fs_destroy(struct mem_fs *fs);
 
 /**
  * Prints the tree of the file system in stdout
- * @param root The file directory to start printing from
+ * @param fs The file system
  */
-void mem_fs_tree(const struct mem_fs_directory *root);
+void mem_fs_tree(const struct mem_fs *fs);
 
 /**
  * Gets the entry if it exists
- * @param root The root of file system
+ * @param fs The file system
  * @param path The path of the file to get its info.
  * @param entry The entry to fill the info of file in it.
  * @return 0 if everything is ok. Otherwise the error value.
  */
-int mem_fs_get_entry(struct mem_fs_directory *root, const char *path, struct mem_fs_entry *entry);
+int mem_fs_get_entry(struct mem_fs *fs, const char *path, struct mem_fs_entry *entry);
 
 /**
  * Create a file in specified path.
- * @param root The root of file system
+ * @param fs The file system
  * @param path The path to create the file. The last part of this path is the filename.
  * @param file_size Size of file in bytes.
  * @return 0 if everything is ok.
  */
-int mem_fs_create_file(struct mem_fs_directory *root, const char *path, size_t file_size);
+int mem_fs_create_file(struct mem_fs *fs, const char *path, size_t file_size);
+
+/**
+ * Adds a file whose content is already in a memfd. Quotas are not checked, this is used to restore a tree.
+ * @param fs The file system
+ * @param path The path to create the file. The last part of this path is the filename.
+ * @param fd The memfd. The file system owns it if this function succeeds.
+ * @param file_size Size of file in bytes. The memfd must be at least this large.
+ * @return 0 if everything is ok.
+ */
+int mem_fs_adopt_file(struct mem_fs *fs, const char *path, int fd, size_t file_size);
+
+/**
+ * Duplicates the memfd of a file to pass it to another process. The preallocated bytes of file are freed and no new
+ * ones are reserved, so the other process sees the size of file as the size of memfd.
+ * @param fs The file system. It must be locked for writing.
+ * @param path Path of the file
+ * @param fd Will be set to a new fd of memfd. It is closed on exec.
+ * @param entry Will be set to the entry of file
+ * @return 0 if everything is ok. EOPNOTSUPP if the entry is not a file or the file is not backed by a memfd.
+ */
+int mem_fs_share_file(struct mem_fs *fs, const char *path, int *fd, struct mem_fs_entry *entry);
+
+/**
+ * Creates a file and reads its content straight from a stream into its storage. The storage is allocated once with
+ * the exact size, so the content is neither zeroed nor copied.
+ * @param fs The file system
+ * @param path The path of file
+ * @param file_size Bytes to read from source
+ * @param source The stream to read the content from. Nothing is read if the file cannot be created.
+ * @return 0 if everything is ok. EIO if the stream fails or ends early. Otherwise the error value.
+ */
+int mem_fs_create_file_from(struct mem_fs *fs, const char *path, size_t file_size, FILE *source);
 
 /**
  * Creates a new folder in a path
- * @param root The root of file system
+ * @param fs The file system
  * @param path The path to create the folder in
  * @return 0 if everything is ok.
  */
-int mem_fs_create_folder(struct mem_fs_directory *root, const char *path);
+int mem_fs_create_folder(struct mem_fs *fs, const char *path);
 
 /**
  * Writes to a file, inflates it if needed
- * @param root The root of file system
+ * @param fs The file system
  * @param path The file to write to
  * @param buffer_size Buffer size to write to
  * @param buffer The buffer to write to file
  * @param offset The offset to write the buffer in file
- * @return Negative value on error or bytes written to disk
+ * @return Negative value on error or bytes written to disk. -EDQUOT if a quota does not allow the file to grow.
  */
 int
-mem_fs_write(struct mem_fs_directory *root, const char *path, size_t buffer_size, const char *buffer, off_t offset);
+mem_fs_write(struct mem_fs *fs, const char *path, size_t buffer_size, const char *buffer, off_t offset);
 
 /**
  * Reads from a file system
- * @param root The root of file system
+ * @param fs The file system
  * @param path The file to read from
  * @param buffer_size Buffer size to read to
  * @param buffer The buffer to read into
@@ -119,29 +380,208 @@ mem_fs_write(struct mem_fs_directory *root, const char *path, size_t buffer_size
  * @return On error, returns the negative value of errno (just like fuse). On Success, returns the bytes read.
  */
 int
-mem_fs_read(struct mem_fs_directory *root, const char *path, size_t buffer_size, char *buffer, off_t offset);
+mem_fs_read(struct mem_fs *fs, const char *path, size_t buffer_size, char *buffer, off_t offset);
+
+/**
+ * Copies the content of a file without loading it back to memory if it is spilled
+ * @param fs The file system of file
+ * @param file The file to read from
+ * @param buffer_size Bytes to copy. offset + buffer_size must not pass the file size.
+ * @param buffer The buffer to copy into
+ * @param offset The offset to copy from
+ * @return 0 if everything is ok. Otherwise the error value.
+ */
+int mem_fs_read_file_data(const struct mem_fs *fs, const struct mem_fs_file *file, size_t buffer_size, char *buffer,
+                          off_t offset);
 
 /**
  * Resizes a file to a new size. Fills added bytes with zero.
- * @param root The root of file system
+ * @param fs The file system
  * @param path The path to create the file. The last part of this path is the filename.
  * @param new_size New size of file in bytes.
  * @return 0 if everything is ok.
  */
-int mem_fs_resize_file(struct mem_fs_directory *root, const char *path, size_t new_size);
+int mem_fs_resize_file(struct mem_fs *fs, const char *path, size_t new_size);
+
+/**
+ * Preallocates, zeroes or punches a hole in a range of a file, like fallocate(2). Preallocated capacity is not
+ * counted in the usage of folders, but it must fit in their quota.
+ * @param fs The file system
+ * @param path The path of file
+ * @param mode Zero or FALLOC_FL_KEEP_SIZE, FALLOC_FL_PUNCH_HOLE and FALLOC_FL_ZERO_RANGE of fallocate(2).
+ * PUNCH_HOLE must be used with KEEP_SIZE.
+ * @param offset Start of range
+ * @param length Length of range
+ * @return 0 if everything is ok. EOPNOTSUPP for other modes. Otherwise the error value.
+ */
+int mem_fs_fallocate(struct mem_fs *fs, const char *path, int mode, off_t offset, size_t length);
+
+/**
+ * Creates a hard link to a file. Both paths share the same content afterwards.
+ * @param fs The file system
+ * @param old_path The path of existing file. Linking a symbolic link links the link itself.
+ * @param new_path The path of new link. The last part of this path is the name.
+ * @return 0 if everything is ok. EPERM for folders. Otherwise the error value.
+ */
+int mem_fs_link(struct mem_fs *fs, const char *old_path, const char *new_path);
+
+/**
+ * Creates a symbolic link
+ * @param fs The file system
+ * @param target The path which the link points to. It does not need to exist.
+ * @param path The path of new link. The last part of this path is the name.
+ * @return 0 if everything is ok.
+ */
+int mem_fs_symlink(struct mem_fs *fs, const char *target, const char *path);
+
+/**
+ * Reads the target of a symbolic link
+ * @param fs The file system
+ * @param path The path of link
+ * @param buffer The buffer to copy the target into. The target is cut if it does not fit and always null terminated.
+ * @param buffer_size Size of buffer
+ * @return 0 if everything is ok. EINVAL if path is not a symbolic link.
+ */
+int mem_fs_readlink(struct mem_fs *fs, const char *path, char *buffer, size_t buffer_size);
 
 /**
  * Removes a single file
- * @param root The root of file system
+ * @param fs The file system
  * @param path Path of file to delete. This must be a file or link. Not a folder
  * @return 0 if deletion was ok.
  */
-int mem_fs_rm_file(struct mem_fs_directory *root, const char *path);
+int mem_fs_rm_file(struct mem_fs *fs, const char *path);
+
+/**
+ * Removes a single file from its folder without freeing it
+ * @param fs The file system
+ * @param path Path of file to detach. This must be a file or link. Not a folder
+ * @param detached Will be set to the detached entry. It must be freed with mem_fs_free_entry.
+ * @return 0 if detaching was ok.
+ */
+int mem_fs_detach_file(struct mem_fs *fs, const char *path, struct mem_fs_entry **detached);
+
+/**
+ * Removes every link of a file from its folder, as if all of them were unlinked
+ * @param fs The file system
+ * @param file A file in the tree
+ * @return The detached entry of last link which holds the file. It must be freed with mem_fs_free_entry.
+ */
+struct mem_fs_entry *mem_fs_detach_links(struct mem_fs *fs, struct mem_fs_file *file);
 
 /**
  * Removes an empty directory
- * @param root The root of file system
+ * @param fs The file system
  * @param path Folder to delete. Must be an empty folder
  * @return 0 if deletion was ok.
  */
-int mem_fs_rm_dir(struct mem_fs_directory *root, const char *path);
\ No newline at end of file
+int mem_fs_rm_dir(struct mem_fs *fs, const char *path);
+/**
+ * Moves a file or folder to a new path. If the new path exists, it is replaced just like rename(2).
+ * @param fs The file system
+ * @param old_path The current path of file or folder
+ * @param new_path The path to move the file or folder to. The last part of this path is the new name.
+ * @return 0 if everything is ok.
+ */
+int mem_fs_rename(struct mem_fs *fs, const char *old_path, const char *new_path);
+
+/**
+ * Same as mem_fs_rename but the replaced entry is detached instead of being freed
+ * @param fs The file system
+ * @param old_path The current path of file or folder
+ * @param new_path The path to move the file or folder to
+ * @param replaced Will be set to the replaced entry which must be freed with mem_fs_free_entry. NULL if nothing
+ * was replaced.
+ * @return 0 if everything is ok.
+ */
+int mem_fs_detach_rename(struct mem_fs *fs, const char *old_path, const char *new_path,
+                         struct mem_fs_entry **replaced);
+
+/**
+ * Sets the access and modification times of a file, folder or link like utimensat(2). The change time is set to now.
+ * @param fs The file system
+ * @param path The path of entry
+ * @param times The access and modification times. tv_nsec can be UTIME_NOW or UTIME_OMIT. NULL sets both to now.
+ * @return 0 if everything is ok.
+ */
+int mem_fs_set_times(struct mem_fs *fs, const char *path, const struct timespec times[2]);
+
+/**
+ * Gets the timestamps of an entry
+ * @param entry The entry
+ * @return The timestamps of file, folder or link which the entry points to
+ */
+const struct mem_fs_times *mem_fs_entry_times(const struct mem_fs_entry *entry);
+
+/**
+ * Packs a timestamp in a single integer, for example to store it in a record
+ * @param time The timestamp
+ * @return Nanoseconds since epoch
+ */
+uint64_t mem_fs_pack_time(struct timespec time);
+
+/**
+ * Unpacks a timestamp which is packed with mem_fs_pack_time
+ * @param packed The packed timestamp
+ * @return The timestamp
+ */
+struct timespec mem_fs_unpack_time(uint64_t packed);
+
+/**
+ * Gets the usage of a file or folder. For folders, everything inside the folder is counted.
+ * @param fs The file system
+ * @param path The path of file or folder
+ * @param usage Will be filled with the usage
+ * @return 0 if everything is ok.
+ */
+int mem_fs_get_usage(struct mem_fs *fs, const char *path, struct mem_fs_usage *usage);
+
+/**
+ * Sets the quota of a folder. Operations which make the usage of folder exceed the quota fail with EDQUOT.
+ * @param fs The file system
+ * @param path The path of folder
+ * @param quota The new quota. Zero fields are unlimited.
+ * @return 0 if everything is ok.
+ */
+int mem_fs_set_quota(struct mem_fs *fs, const char *path, const struct mem_fs_usage *quota);
+
+/**
+ * Gets the CRC32C of the whole content of a file. It is combined from the page checksums without reading the file.
+ * It is cached in the file, but only the file system lock in read mode is needed.
+ * @param fs The file system
+ * @param path The path of file
+ * @param checksum Will be set to the checksum
+ * @return 0 if everything is ok. ENOTSUP if checksums are disabled.
+ */
+int mem_fs_get_checksum(struct mem_fs *fs, const char *path, uint32_t *checksum);
+
+/**
+ * Sets the time to live of a file in the cache
+ * @param fs The file system
+ * @param path The path of file
+ * @param ttl Seconds which the file lives after its last modification. Zero to keep it until it is evicted.
+ * @return 0 if everything is ok. ENOTSUP if the file system has no cache.
+ */
+int mem_fs_set_ttl(struct mem_fs *fs, const char *path, time_t ttl);
+
+/**
+ * Frees a detached entry. If this is a folder, everything inside it is freed as well.
+ * @param entry The entry to free. It must not be in any folder.
+ */
+void mem_fs_free_entry(struct mem_fs_entry *entry);
+
+/**
+ * Counts the bytes of file data held by an entry and everything inside it
+ * @param entry The entry to count
+ * @return Total bytes of file content
+ */
+size_t mem_fs_entry_bytes(const struct mem_fs_entry *entry);
+
+/**
+ * Builds the full path of an entry
+ * @param entry An entry which is in a folder
+ * @return The path allocated with malloc or NULL if out of memory
+ */
+char *mem_fs_entry_path(const struct mem_fs_entry *entry);
+
+#endif //CROWFS_CROWFS_H
@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "bypass.h"
+#include "socket.h"
+
+// The 64 bit variants of functions share the implementation of the plain ones
+_Static_assert(sizeof(off_t) == sizeof(off64_t) && sizeof(struct stat) == sizeof(struct stat64),
+               "the bypass needs a 64 bit off_t");
+
+/**
+ * Only fds below this number report the attributes which fuse reports in fstat. Bigger ones report the attributes of
+ * memfd, which only differ in the identity and times of file.
+ */
+#define BYPASS_MAX_FDS 65536
+
+/**
+ * Checks if open is given a mode along the flags
+ */
+#define NEEDS_MODE(flags) (((flags) & O_CREAT) != 0 || ((flags) & O_TMPFILE) == O_TMPFILE)
+
+/**
+ * Marks the functions which replace the ones of libc. Everything else is hidden in the library.
+ */
+#define EXPORT __attribute__((visibility("default")))
+
+/**
+ * A file which is read from its memfd instead of fuse. The memfd ends where the file ends, so reads, seeks and the
+ * offset are left to the kernel. The fds which are duplicated share it, like they share the open file of kernel.
+ */
+struct bypass_file {
+    /**
+     * Attributes of file when it was opened. fstat reports them along the current size of memfd.
+     */
+    struct stat stbuf;
+    unsigned int references;
+};
+
+/**
+ * The mount point without the trailing slash. NULL if the environment does not ask for a bypass.
+ */
+static const char *mount_point;
+static size_t mount_point_length;
+/**
+ * The bypass socket of MemFS
+ */
+static const char *socket_path;
+/**
+ * The device of mount point. The attributes of files report it like fuse does.
+ */
+static dev_t mount_device;
+static struct bypass_file *files[BYPASS_MAX_FDS];
+static bool initialized = false;
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_openat)(int, const char *, int, ...);
+static int (*real_fstat)(int, struct stat *);
+static int (*real_close)(int);
+static int (*real_dup)(int);
+static int (*real_dup2)(int, int);
+static int (*real_dup3)(int, int, int);
+static int (*real_fcntl)(int, int, ...);
+
+/**
+ * Finds the functions of libc and reads the environment. The constructors of other libraries might open files before
+ * this one is initialized, so every wrapper calls it as well.
+ */
+__attribute__((constructor)) static void bypass_init(void) {
+    if (__atomic_load_n(&initialized, __ATOMIC_ACQUIRE))
+        return;
+    real_open = dlsym(RTLD_NEXT, "open");
+    real_openat = dlsym(RTLD_NEXT, "openat");
+    real_fstat = dlsym(RTLD_NEXT, "fstat");
+    real_close = dlsym(RTLD_NEXT, "close");
+    real_dup = dlsym(RTLD_NEXT, "dup");
+    real_dup2 = dlsym(RTLD_NEXT, "dup2");
+    real_dup3 = dlsym(RTLD_NEXT, "dup3");
+    real_fcntl = dlsym(RTLD_NEXT, "fcntl");
+    const char *mount = getenv("MEMFS_BYPASS_MOUNT");
+    socket_path = getenv("MEMFS_BYPASS_SOCKET");
+    struct stat mount_stat;
+    if (mount != NULL && socket_path != NULL && mount[0] == '/' && stat(mount, &mount_stat) == 0) {
+        mount_device = mount_stat.st_dev;
+        mount_point_length = strlen(mount);
+        while (mount_point_length > 0 && mount[mount_point_length - 1] == '/')
+            mount_point_length--;
+        mount_point = mount;
+    }
+    __atomic_store_n(&initialized, true, __ATOMIC_RELEASE);
+}
+
+/**
+ * Gets the file which is opened without fuse at an fd
+ * @return The file or NULL if the fd is not bypassed
+ */
+static struct bypass_file *get_file(int fd) {
+    if (fd < 0 || fd >= BYPASS_MAX_FDS)
+        return NULL;
+    return __atomic_load_n(&files[fd], __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Stops bypassing an fd. The file is freed when its last fd is closed.
+ */
+static void release_fd(int fd) {
+    if (fd < 0 || fd >= BYPASS_MAX_FDS)
+        return;
+    struct bypass_file *file = __atomic_exchange_n(&files[fd], NULL, __ATOMIC_ACQ_REL);
+    if (file != NULL && __atomic_sub_fetch(&file->references, 1, __ATOMIC_ACQ_REL) == 0)
+        free(file);
+}
+
+/**
+ * Makes a new fd share the file of an old one. A new fd which cannot be tracked reports the attributes of memfd.
+ * @return The new fd
+ */
+static int share_fd(struct bypass_file *file, int new_fd) {
+    if (new_fd < 0 || new_fd >= BYPASS_MAX_FDS)
+        return new_fd;
+    release_fd(new_fd);
+    __atomic_add_fetch(&file->references, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&files[new_fd], file, __ATOMIC_RELEASE);
+    return new_fd;
+}
+
+/**
+ * Opens a file of the mount from its memfd
+ * @param path Path of the file to open
+ * @param flags Flags of open
+ * @return The new fd, or -1 if the file must be opened through fuse
+ */
+static int bypass_open(const char *path, int flags) {
+    // Only plain reads are served. Everything which changes the file goes through fuse.
+    if (mount_point == NULL || (flags & O_ACCMODE) != O_RDONLY ||
+        (flags & (O_CREAT | O_TRUNC | O_DIRECTORY | O_PATH | O_TMPFILE)) != 0 ||
+        strncmp(path, mount_point, mount_point_length) != 0 || path[mount_point_length] != '/')
+        return -1;
+    int socket_fd;
+    if (mem_fs_socket_connect(socket_path, &socket_fd) != 0)
+        return -1;
+    int memfd;
+    struct bypass_file *file = malloc(sizeof(struct bypass_file));
+    int result = file == NULL ? ENOMEM :
+                 mem_fs_bypass_request_file(socket_fd, path + mount_point_length, &memfd, &file->stbuf);
+    real_close(socket_fd);
+    if (result != 0) {
+        free(file);
+        return -1;
+    }
+    // Reopen it read only, so writes fail like they do on the fd which fuse returns
+    char memfd_path[32];
+    snprintf(memfd_path, sizeof(memfd_path), "/proc/self/fd/%d", memfd);
+    int fd = real_open(memfd_path, O_RDONLY | (flags & O_CLOEXEC));
+    real_close(memfd);
+    if (fd < 0 || fd >= BYPASS_MAX_FDS) {
+        free(file);
+        return fd;
+    }
+    file->stbuf.st_dev = mount_device;
+    file->references = 1;
+    __atomic_store_n(&files[fd], file, __ATOMIC_RELEASE);
+    return fd;
+}
+
+EXPORT int open(const char *path, int flags, ...) {
+    bypass_init();
+    mode_t mode = 0;
+    if (NEEDS_MODE(flags)) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    int fd = bypass_open(path, flags);
+    return fd >= 0 ? fd : real_open(path, flags, mode);
+}
+
+EXPORT int open64(const char *path, int flags, ...) {
+    mode_t mode = 0;
+    if (NEEDS_MODE(flags)) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    return open(path, flags, mode);
+}
+
+EXPORT int openat(int dir_fd, const char *path, int flags, ...) {
+    bypass_init();
+    mode_t mode = 0;
+    if (NEEDS_MODE(flags)) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    int fd = path[0] == '/' ? bypass_open(path, flags) : -1; // relative paths are left to fuse
+    return fd >= 0 ? fd : real_openat(dir_fd, path, flags, mode);
+}
+
+EXPORT int openat64(int dir_fd, const char *path, int flags, ...) {
+    mode_t mode = 0;
+    if (NEEDS_MODE(flags)) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    return openat(dir_fd, path, flags, mode);
+}
+
+EXPORT int fstat(int fd, struct stat *stbuf) {
+    bypass_init();
+    struct bypass_file *file = get_file(fd);
+    int result = real_fstat(fd, stbuf);
+    if (file == NULL || result != 0)
+        return result;
+    // The memfd knows the current size and allocation of file. The rest is what fuse reported on open.
+    off_t size = stbuf->st_size;
+    blkcnt_t blocks = stbuf->st_blocks;
+    *stbuf = file->stbuf;
+    stbuf->st_size = size;
+    stbuf->st_blocks = blocks;
+    return 0;
+}
+
+EXPORT int fstat64(int fd, struct stat64 *stbuf) {
+    return fstat(fd, (struct stat *) stbuf);
+}
+
+EXPORT int close(int fd) {
+    bypass_init();
+    release_fd(fd);
+    return real_close(fd);
+}
+
+EXPORT int dup(int old_fd) {
+    bypass_init();
+    struct bypass_file *file = get_file(old_fd);
+    int new_fd = real_dup(old_fd);
+    return file == NULL ? new_fd : share_fd(file, new_fd);
+}
+
+EXPORT int dup2(int old_fd, int new_fd) {
+    bypass_init();
+    struct bypass_file *file = get_file(old_fd);
+    if (old_fd == new_fd)
+        return real_dup2(old_fd, new_fd);
+    int result = real_dup2(old_fd, new_fd);
+    if (result < 0)
+        return result;
+    if (file == NULL) {
+        release_fd(new_fd);
+        return result;
+    }
+    return share_fd(file, result);
+}
+
+EXPORT int dup3(int old_fd, int new_fd, int flags) {
+    bypass_init();
+    struct bypass_file *file = get_file(old_fd);
+    int result = real_dup3(old_fd, new_fd, flags);
+    if (result < 0)
+        return result;
+    if (file == NULL) {
+        release_fd(new_fd);
+        return result;
+    }
+    return share_fd(file, result);
+}
+
+EXPORT int fcntl(int fd, int cmd, ...) {
+    bypass_init();
+    // Like libc, the argument is passed on as a pointer whatever the command is
+    va_list args;
+    va_start(args, cmd);
+    void *arg = va_arg(args, void *);
+    va_end(args);
+    struct bypass_file *file = get_file(fd);
+    int result = real_fcntl(fd, cmd, arg);
+    if (file != NULL && (cmd == F_DUPFD || cmd == F_DUPFD_CLOEXEC))
+        return share_fd(file, result);
+    return result;
+}
+
+EXPORT int fcntl64(int fd, int cmd, ...) {
+    va_list args;
+    va_start(args, cmd);
+    void *arg = va_arg(args, void *);
+    va_end(args);
+    return fcntl(fd, cmd, arg);
+}
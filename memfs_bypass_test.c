@@ -0,0 +1,225 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <linux/falloc.h>
+#include "memfs.h"
+#include "bypass.h"
+#include "socket.h"
+
+/**
+ * Bytes of the file which is served from memory. It is grown by appends, so its capacity is bigger than its size.
+ */
+#define FILE_SIZE 1010
+/**
+ * Content of the files on disk which the client reads when it falls back to the real open
+ */
+#define DISK_CONTENT "on disk\n"
+
+/**
+ * Answers the requests of client like MemFS does with --bypass
+ */
+struct bypass_server {
+    struct mem_fs *fs;
+    int listen_fd;
+};
+
+static void *bypass_server_main(void *arg) {
+    struct bypass_server *server = arg;
+    char path[MEM_FS_BYPASS_MAX_PATH];
+    int client;
+    while ((client = accept(server->listen_fd, NULL, NULL)) >= 0) {
+        if (mem_fs_bypass_receive_request(client, path) != 0) {
+            close(client);
+            continue;
+        }
+        struct mem_fs_entry entry;
+        struct stat stbuf = {0};
+        int fd = -1;
+        mem_fs_lock_write(&server->fs->lock);
+        int result = mem_fs_share_file(server->fs, path, &fd, &entry);
+        if (result == 0) {
+            stbuf.st_mode = S_IFREG | 0644;
+            stbuf.st_nlink = 1;
+            stbuf.st_ino = 42;
+            stbuf.st_size = (off_t) entry.data.file->size;
+        }
+        mem_fs_unlock_write(&server->fs->lock);
+        mem_fs_bypass_send_file(client, result, fd, &stbuf);
+        if (fd >= 0)
+            close(fd);
+        close(client);
+    }
+    return NULL;
+}
+
+/**
+ * Gets the byte at an offset of the file which is served from memory
+ */
+static char file_byte(size_t offset) {
+    return (char) ('a' + offset % 26);
+}
+
+/**
+ * Opens a file and checks that it holds DISK_CONTENT
+ */
+static void assert_disk_file(int dir_fd, const char *path, int flags) {
+    int fd = openat(dir_fd, path, flags);
+    assert(fd >= 0);
+    char buffer[64];
+    assert(read(fd, buffer, sizeof(buffer)) == sizeof(DISK_CONTENT) - 1);
+    assert(memcmp(buffer, DISK_CONTENT, sizeof(DISK_CONTENT) - 1) == 0);
+    close(fd);
+}
+
+/**
+ * Runs under the bypass library and reads the files of mount
+ * @param mount The mount point
+ * @param outside A file which is not in the mount
+ */
+static int run_client(const char *mount, const char *outside) {
+    char path[4096], buffer[4096];
+    struct stat stbuf, mount_stbuf;
+    assert(stat(mount, &mount_stbuf) == 0);
+    snprintf(path, sizeof(path), "%s/file", mount);
+    int fd = open(path, O_RDONLY);
+    assert(fd >= 0);
+    // Reads stop at the size of file, not its capacity
+    size_t total = 0;
+    ssize_t read_bytes;
+    while ((read_bytes = read(fd, buffer, 100)) > 0) {
+        for (ssize_t i = 0; i < read_bytes; i++)
+            assert(buffer[i] == file_byte(total + i));
+        total += read_bytes;
+    }
+    assert(read_bytes == 0 && total == FILE_SIZE);
+    assert(lseek(fd, 0, SEEK_END) == FILE_SIZE);
+    // The attributes are the ones of server, with the size of file
+    assert(fstat(fd, &stbuf) == 0);
+    assert(stbuf.st_size == FILE_SIZE && stbuf.st_ino == 42 && stbuf.st_mode == (S_IFREG | 0644));
+    assert(stbuf.st_dev == mount_stbuf.st_dev);
+    // The paths which are not wrapped do not see the preallocated bytes either
+    int out = memfd_create("out", MFD_CLOEXEC);
+    assert(out >= 0);
+    loff_t copy_offset = 0;
+    total = 0;
+    while ((read_bytes = copy_file_range(fd, &copy_offset, out, NULL, sizeof(buffer), 0)) > 0)
+        total += read_bytes;
+    assert(read_bytes == 0 && total == FILE_SIZE);
+    off_t send_offset = 0;
+    assert(sendfile(out, fd, &send_offset, FILE_SIZE * 2) == FILE_SIZE);
+    assert(pread(fd, buffer, sizeof(buffer), FILE_SIZE - 10) == 10);
+    close(out);
+    // Duplicated fds share the offset
+    assert(lseek(fd, 100, SEEK_SET) == 100);
+    int duplicate = dup(fd);
+    assert(duplicate >= 0);
+    assert(read(duplicate, buffer, 10) == 10 && buffer[0] == file_byte(100));
+    assert(lseek(fd, 0, SEEK_CUR) == 110);
+    assert(dup2(fd, 50) == 50);
+    assert(read(50, buffer, 10) == 10 && buffer[0] == file_byte(110));
+    assert(lseek(duplicate, 0, SEEK_CUR) == 120);
+    assert(fstat(50, &stbuf) == 0 && stbuf.st_ino == 42);
+    close(50);
+    close(duplicate);
+    // Writes fail like they do on a read only fd of fuse
+    assert(write(fd, "x", 1) == -1 && errno == EBADF);
+    close(fd);
+    // Everything else goes to the real open: writable opens, relative paths, paths outside the mount and files which
+    // are not in the file system
+    assert_disk_file(AT_FDCWD, path, O_RDWR);
+    int mount_fd = open(mount, O_RDONLY | O_DIRECTORY);
+    assert(mount_fd >= 0);
+    assert_disk_file(mount_fd, "file", O_RDONLY);
+    close(mount_fd);
+    assert(chdir(mount) == 0);
+    assert_disk_file(AT_FDCWD, "file", O_RDONLY);
+    assert_disk_file(AT_FDCWD, outside, O_RDONLY);
+    snprintf(path, sizeof(path), "%s/disk_only", mount);
+    assert_disk_file(AT_FDCWD, path, O_RDONLY);
+    return 0;
+}
+
+/**
+ * Writes DISK_CONTENT to a new file
+ */
+static void create_disk_file(const char *path) {
+    FILE *file = fopen(path, "w");
+    assert(file != NULL);
+    assert(fputs(DISK_CONTENT, file) >= 0);
+    fclose(file);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 4 && strcmp(argv[1], "--client") == 0)
+        return run_client(argv[2], argv[3]);
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s libmemfs_bypass.so\n", argv[0]);
+        return 1;
+    }
+    // The mount point is a plain folder, so the files on disk show what the real open returns
+    char directory[] = "/tmp/memfs_bypass_XXXXXX";
+    assert(mkdtemp(directory) != NULL);
+    char mount[64], socket_path[128], outside[128], disk_file[128], disk_only[128];
+    snprintf(mount, sizeof(mount), "%s/mount", directory);
+    snprintf(socket_path, sizeof(socket_path), "%s/socket", directory);
+    snprintf(outside, sizeof(outside), "%s/outside", directory);
+    snprintf(disk_file, sizeof(disk_file), "%s/file", mount);
+    snprintf(disk_only, sizeof(disk_only), "%s/disk_only", mount);
+    assert(mkdir(mount, 0700) == 0);
+    create_disk_file(disk_file);
+    create_disk_file(disk_only);
+    create_disk_file(outside);
+    // A file whose memfd is bigger than the file
+    struct mem_fs fs;
+    mem_fs_new(&fs);
+    mem_fs_set_memfd(&fs, true);
+    assert(mem_fs_create_file(&fs, "/file", 0) == 0);
+    char content[FILE_SIZE];
+    for (size_t i = 0; i < FILE_SIZE; i++)
+        content[i] = file_byte(i);
+    assert(mem_fs_write(&fs, "/file", 1000, content, 0) == 1000);
+    assert(mem_fs_write(&fs, "/file", FILE_SIZE - 1000, content + 1000, 1000) == FILE_SIZE - 1000);
+    assert(mem_fs_fallocate(&fs, "/file", FALLOC_FL_KEEP_SIZE, 0, 65536) == 0);
+    struct mem_fs_entry entry;
+    assert(mem_fs_get_entry(&fs, "/file", &entry) == 0 && entry.data.file->capacity > FILE_SIZE);
+    // Serve it and run the client
+    struct bypass_server server = {.fs = &fs};
+    assert(mem_fs_socket_listen(socket_path, &server.listen_fd) == 0);
+    pthread_t server_thread;
+    assert(pthread_create(&server_thread, NULL, bypass_server_main, &server) == 0);
+    pid_t child = fork();
+    assert(child >= 0);
+    if (child == 0) {
+        setenv("LD_PRELOAD", argv[1], 1);
+        setenv("MEMFS_BYPASS_MOUNT", mount, 1);
+        setenv("MEMFS_BYPASS_SOCKET", socket_path, 1);
+        execl("/proc/self/exe", argv[0], "--client", mount, outside, (char *) NULL);
+        _exit(127);
+    }
+    int status;
+    assert(waitpid(child, &status, 0) == child);
+    shutdown(server.listen_fd, SHUT_RDWR);
+    pthread_join(server_thread, NULL);
+    close(server.listen_fd);
+    // The file was trimmed when it was shared
+    assert(entry.data.file->capacity == FILE_SIZE);
+    unlink(socket_path);
+    unlink(disk_file);
+    unlink(disk_only);
+    unlink(outside);
+    rmdir(mount);
+    rmdir(directory);
+    mem_fs_destroy(&fs);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -0,0 +1,579 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "memfs.h"
+#include "tar.h"
+#include "trace.h"
+
+/**
+ * Replays a trace which is recorded with the trace option of MemFS against the file system library and
+ * reports the throughput and latency. The locking is same as MemFS, so contention shows up in the latency.
+ */
+
+struct replay_thread {
+    pthread_t thread;
+    /**
+     * Index of the events which this thread replays, in order
+     */
+    size_t *events;
+    size_t event_count;
+    /**
+     * Latency of each replayed event in nanoseconds. Same order as events.
+     */
+    uint64_t *latencies;
+    /**
+     * Buffer for read and write. Big enough for the biggest one in trace.
+     */
+    char *buffer;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    /**
+     * Number of events which returned something else than the recorded result
+     */
+    size_t mismatches;
+    /**
+     * Number of mismatches which returned ENOENT, because something that existed on the mount did not exist here
+     */
+    size_t missing;
+};
+
+static struct mem_fs fs;
+static struct mem_fs_trace_event *events;
+static size_t event_count;
+/**
+ * Replay with the original timing instead of as fast as possible
+ */
+static bool original_speed = false;
+/**
+ * Monotonic time which the replay started at
+ */
+static uint64_t replay_epoch;
+/**
+ * Start time of the first event in trace. Records are written when operations finish, so it is not always
+ * the start time of first record.
+ */
+static uint64_t first_start = UINT64_MAX;
+
+/**
+ * Looks up the entry of an extended attribute event, like the handlers of MemFS do before they read or change it
+ * @return 0 or the negative errno of lookup
+ */
+static int lookup_attribute(struct mem_fs *tree, const struct mem_fs_trace_event *event) {
+    struct mem_fs_usage usage;
+    struct mem_fs_entry entry;
+    if (event->new_path != NULL && strcmp(event->new_path, "user.memfs.usage") == 0)
+        return -mem_fs_get_usage(tree, event->path, &usage);
+    return -mem_fs_get_entry(tree, event->path, &entry);
+}
+
+/**
+ * Applies an event to a file system, same as the handler of MemFS which recorded it
+ * @param tree The file system
+ * @param event The event
+ * @param thread The replay thread which owns the buffer and the byte counters
+ * @return The value which the handler would return to fuse
+ */
+static int replay_event(struct mem_fs *tree, const struct mem_fs_trace_event *event, struct replay_thread *thread) {
+    struct mem_fs_entry entry;
+    unsigned int slot;
+    int result;
+    switch (event->op) {
+        case MEM_FS_TRACE_GETATTR:
+            slot = mem_fs_lock_read(&tree->lock);
+            result = -mem_fs_get_entry(tree, event->path, &entry);
+            mem_fs_unlock_read(&tree->lock, slot);
+            return result;
+        case MEM_FS_TRACE_READDIR:
+            slot = mem_fs_lock_read(&tree->lock);
+            result = -mem_fs_get_entry(tree, event->path, &entry);
+            if (result == 0 && entry.type != CROW_FS_FOLDER)
+                result = -ENOENT;
+            if (result == 0) {
+                volatile size_t entries = 0;
+                for (const struct mem_fs_entry *child = entry.data.directory->entries; child != NULL;
+                     child = child->next)
+                    entries++;
+            }
+            mem_fs_unlock_read(&tree->lock, slot);
+            return result;
+        case MEM_FS_TRACE_OPEN:
+            mem_fs_lock_write(&tree->lock);
+            result = mem_fs_get_entry(tree, event->path, &entry);
+            if (result == ENOENT && (event->flags & O_CREAT) != 0)
+                result = mem_fs_create_file(tree, event->path, 0);
+            else if (result == 0 && entry.type == CROW_FS_FOLDER)
+                result = EISDIR;
+            else if (result == 0 && (event->flags & O_TRUNC) != 0)
+                result = mem_fs_resize_file(tree, event->path, 0);
+            mem_fs_unlock_write(&tree->lock);
+            return -result;
+        case MEM_FS_TRACE_READ:
+            slot = mem_fs_lock_read(&tree->lock);
+            result = mem_fs_read(tree, event->path, event->size, thread->buffer, (off_t) event->offset);
+            mem_fs_unlock_read(&tree->lock, slot);
+            if (result > 0)
+                thread->bytes_read += result;
+            return result;
+        case MEM_FS_TRACE_WRITE: // the data is not recorded, zeros are written instead
+            mem_fs_lock_write(&tree->lock);
+            result = mem_fs_write(tree, event->path, event->size, thread->buffer, (off_t) event->offset);
+            mem_fs_unlock_write(&tree->lock);
+            if (result > 0)
+                thread->bytes_written += result;
+            return result;
+        case MEM_FS_TRACE_TRUNCATE:
+            mem_fs_lock_write(&tree->lock);
+            result = -mem_fs_resize_file(tree, event->path, event->size);
+            mem_fs_unlock_write(&tree->lock);
+            return result;
+        case MEM_FS_TRACE_RENAME:
+            if (event->new_path == NULL)
+                return -EINVAL;
+            mem_fs_lock_write(&tree->lock);
+            result = -mem_fs_rename(tree, event->path, event->new_path);
+            mem_fs_unlock_write(&tree->lock);
+            return result;
+        case MEM_FS_TRACE_FALLOCATE:
+            mem_fs_lock_write(&tree->lock);
+            result = -mem_fs_fallocate(tree, event->path, (int) event->flags, (off_t) event->offset, event->size);
+            mem_fs_unlock_write(&tree->lock);
+            return result;
+        case MEM_FS_TRACE_FSYNC: // there is no journal in replay
+            return 0;
+        case MEM_FS_TRACE_RMDIR:
+            mem_fs_lock_write(&tree->lock);
+            result = -mem_fs_rm_dir(tree, event->path);
+            mem_fs_unlock_write(&tree->lock);
+            return result;
+        case MEM_FS_TRACE_UNLINK:
+            mem_fs_lock_write(&tree->lock);
+            result = -mem_fs_rm_file(tree, event->path);
+            mem_fs_unlock_write(&tree->lock);
+            return result;
+        case MEM_FS_TRACE_GETXATTR: // values of attributes are not recorded, only the lookup and lock are replayed
+            slot = mem_fs_lock_read(&tree->lock);
+            result = lookup_attribute(tree, event);
+            mem_fs_unlock_read(&tree->lock, slot);
+            return result;
+        case MEM_FS_TRACE_SETXATTR:
+            mem_fs_lock_write(&tree->lock);
+            result = lookup_attribute(tree, event);
+            mem_fs_unlock_write(&tree->lock);
+            return result;
+        case MEM_FS_TRACE_CREATE:
+            mem_fs_lock_write(&tree->lock);
+            result = -mem_fs_create_file(tree, event->path, 0);
+            mem_fs_unlock_write(&tree->lock);
+            return result;
+        case MEM_FS_TRACE_MKDIR:
+            mem_fs_lock_write(&tree->lock);
+            result = -mem_fs_create_folder(tree, event->path);
+            mem_fs_unlock_write(&tree->lock);
+            return result;
+        case MEM_FS_TRACE_LINK:
+        case MEM_FS_TRACE_SYMLINK:
+            if (event->new_path == NULL)
+                return -EINVAL;
+            mem_fs_lock_write(&tree->lock);
+            if (event->op == MEM_FS_TRACE_LINK)
+                result = -mem_fs_link(tree, event->path, event->new_path);
+            else
+                result = -mem_fs_symlink(tree, event->new_path, event->path);
+            mem_fs_unlock_write(&tree->lock);
+            return result;
+        case MEM_FS_TRACE_UTIMENS: // the times are not recorded, now is used instead
+            mem_fs_lock_write(&tree->lock);
+            result = -mem_fs_set_times(tree, event->path, NULL);
+            mem_fs_unlock_write(&tree->lock);
+            return result;
+        case MEM_FS_TRACE_READLINK: {
+            char target[PATH_MAX];
+            slot = mem_fs_lock_read(&tree->lock);
+            result = -mem_fs_readlink(tree, event->path, target, sizeof(target));
+            mem_fs_unlock_read(&tree->lock, slot);
+            return result;
+        }
+        default:
+            return -ENOSYS;
+    }
+}
+
+/**
+ * Checks if a replayed result is different from the recorded one. Sizes of successful reads are not compared
+ * because the content depends on the files which existed before recording.
+ */
+static bool is_mismatch(const struct mem_fs_trace_event *event, int result) {
+    if (event->result < 0 || result < 0)
+        return event->result != result;
+    return event->op != MEM_FS_TRACE_READ && event->result != result;
+}
+
+static void *replay_thread_main(void *arg) {
+    struct replay_thread *thread = arg;
+    for (size_t i = 0; i < thread->event_count; i++) {
+        const struct mem_fs_trace_event *event = &events[thread->events[i]];
+        if (original_speed) { // wait until the time which event started at in trace
+            uint64_t due = replay_epoch + event->start - first_start;
+            struct timespec deadline = {.tv_sec = (time_t) (due / 1000000000),
+                    .tv_nsec = (long) (due % 1000000000)};
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+        }
+        uint64_t start = mem_fs_trace_clock();
+        int result = replay_event(&fs, event, thread);
+        thread->latencies[i] = mem_fs_trace_clock() - start;
+        if (is_mismatch(event, result)) {
+            thread->mismatches++;
+            if (result == -ENOENT)
+                thread->missing++;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Creates the missing parent folders of a path. Errors are ignored.
+ */
+static void create_parents(struct mem_fs *tree, const char *path) {
+    char parent[PATH_MAX];
+    size_t length = strlen(path);
+    if (length >= sizeof(parent))
+        return;
+    memcpy(parent, path, length + 1);
+    for (char *slash = strchr(parent + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mem_fs_create_folder(tree, parent);
+        *slash = '/';
+    }
+}
+
+/**
+ * Creates an entry and its parent folders if it does not exist
+ * @param tree The file system
+ * @param path The path of entry
+ * @param type The type of entry. Symbolic links point to the root.
+ * @return True if the entry was missing
+ */
+static bool create_missing(struct mem_fs *tree, const char *path, enum mem_fs_entry_type type) {
+    struct mem_fs_entry entry;
+    if (mem_fs_get_entry(tree, path, &entry) != ENOENT)
+        return false;
+    create_parents(tree, path);
+    switch (type) {
+        case CROW_FS_FOLDER:
+            mem_fs_create_folder(tree, path);
+            break;
+        case CROW_FS_FILE:
+            mem_fs_create_file(tree, path, 0);
+            break;
+        case CROW_FS_LINK:
+            mem_fs_symlink(tree, "/", path);
+            break;
+    }
+    return true;
+}
+
+/**
+ * Grows a file to a size if it is a smaller file
+ */
+static void grow_file(struct mem_fs *tree, const char *path, size_t size) {
+    struct mem_fs_entry entry;
+    if (mem_fs_get_entry(tree, path, &entry) == 0 && entry.type == CROW_FS_FILE && entry.data.file->size < size)
+        mem_fs_resize_file(tree, path, size);
+}
+
+/**
+ * Checks if a successful event needs its path to exist before it runs
+ */
+static bool needs_existing_path(const struct mem_fs_trace_event *event) {
+    switch (event->op) {
+        case MEM_FS_TRACE_CREATE:
+        case MEM_FS_TRACE_MKDIR:
+        case MEM_FS_TRACE_SYMLINK:
+        case MEM_FS_TRACE_FSYNC:
+            return false;
+        case MEM_FS_TRACE_OPEN:
+            return (event->flags & O_CREAT) == 0;
+        default:
+            return true;
+    }
+}
+
+/**
+ * Gets the path which an event creates an entry at. Its parent folders must exist.
+ * @return The path or NULL if the event does not create anything
+ */
+static const char *created_path(const struct mem_fs_trace_event *event) {
+    switch (event->op) {
+        case MEM_FS_TRACE_CREATE:
+        case MEM_FS_TRACE_MKDIR:
+        case MEM_FS_TRACE_SYMLINK:
+            return event->path;
+        case MEM_FS_TRACE_OPEN:
+            return (event->flags & O_CREAT) != 0 ? event->path : NULL;
+        case MEM_FS_TRACE_RENAME:
+        case MEM_FS_TRACE_LINK:
+            return event->new_path;
+        default:
+            return NULL;
+    }
+}
+
+static int compare_start(const void *a, const void *b) {
+    uint64_t x = events[*(const size_t *) a].start, y = events[*(const size_t *) b].start;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Creates the entries which existed on the mount before the trace was recorded, so the replay runs the recorded
+ * workload instead of its error paths. The events are simulated in order of their start on a copy of tree. Whenever
+ * a successful event needs an entry which the copy does not have, the entry is created in both. Folders are told
+ * apart from files by the paths which are under them, and files are grown to the end of their successful reads.
+ * @param tree The file system to replay on. It is empty or holds a snapshot.
+ * @param snapshot The tar archive which tree holds or NULL
+ * @param buffer_size Size of the biggest read or write in trace
+ * @return The number of created entries or -1 on error
+ */
+static long prepopulate(struct mem_fs *tree, const char *snapshot, size_t buffer_size) {
+    // Folders are the parents of all paths in the trace. Another tree is used as the set of them.
+    struct mem_fs folders, copy;
+    mem_fs_new(&folders);
+    mem_fs_new(&copy);
+    struct replay_thread simulator = {.buffer = calloc(1, buffer_size)};
+    size_t *order = malloc(event_count * sizeof(size_t));
+    long created = -1;
+    struct mem_fs_tar_stats stats;
+    if (simulator.buffer == NULL || order == NULL ||
+        (snapshot != NULL && mem_fs_import_tar(&copy, snapshot, &stats) != 0))
+        goto end;
+    for (size_t i = 0; i < event_count; i++) {
+        order[i] = i;
+        create_parents(&folders, events[i].path);
+        if (events[i].op == MEM_FS_TRACE_RENAME || events[i].op == MEM_FS_TRACE_LINK)
+            create_parents(&folders, events[i].new_path);
+    }
+    qsort(order, event_count, sizeof(size_t), compare_start);
+    created = 0;
+    for (size_t i = 0; i < event_count; i++) {
+        const struct mem_fs_trace_event *event = &events[order[i]];
+        if (event->path == NULL || ((event->op == MEM_FS_TRACE_RENAME || event->op == MEM_FS_TRACE_LINK) &&
+                                    event->new_path == NULL))
+            continue;
+        // An entry which the trace failed to create existed already
+        bool existed = event->result == -EEXIST &&
+                       (event->op == MEM_FS_TRACE_CREATE || event->op == MEM_FS_TRACE_MKDIR);
+        if ((event->result >= 0 && needs_existing_path(event)) || existed) {
+            struct mem_fs_entry entry;
+            enum mem_fs_entry_type type = CROW_FS_FILE;
+            if (event->op == MEM_FS_TRACE_READDIR || event->op == MEM_FS_TRACE_RMDIR ||
+                event->op == MEM_FS_TRACE_MKDIR ||
+                (mem_fs_get_entry(&folders, event->path, &entry) == 0 && entry.type == CROW_FS_FOLDER))
+                type = CROW_FS_FOLDER;
+            else if (event->op == MEM_FS_TRACE_READLINK)
+                type = CROW_FS_LINK;
+            if (create_missing(&copy, event->path, type)) {
+                create_missing(tree, event->path, type);
+                created++;
+            }
+        }
+        if (event->result >= 0 && created_path(event) != NULL) {
+            create_parents(&copy, created_path(event));
+            create_parents(tree, created_path(event));
+        }
+        if (event->op == MEM_FS_TRACE_READ && event->result > 0) {
+            size_t end = event->offset + (size_t) event->result;
+            struct mem_fs_entry entry;
+            if (mem_fs_get_entry(&copy, event->path, &entry) == 0 && entry.type == CROW_FS_FILE &&
+                entry.data.file->size < end) {
+                grow_file(&copy, event->path, end);
+                grow_file(tree, event->path, end);
+            }
+        }
+        replay_event(&copy, event, &simulator);
+    }
+    end:
+    free(simulator.buffer);
+    free(order);
+    mem_fs_destroy(&folders);
+    mem_fs_destroy(&copy);
+    return created;
+}
+
+static int compare_latency(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Prints count and latency percentiles of each operation
+ */
+static void print_latencies(const struct replay_thread *threads, size_t thread_count) {
+    uint64_t *latencies = malloc(event_count * sizeof(uint64_t));
+    if (latencies == NULL)
+        return;
+    printf("%-10s %10s %10s %10s %10s %10s %12s\n", "op", "count", "avg(us)", "p50(us)", "p99(us)", "max(us)",
+           "traced(us)");
+    for (int op = 1; op < MEM_FS_TRACE_OP_COUNT; op++) {
+        size_t count = 0;
+        uint64_t sum = 0, traced_sum = 0;
+        for (size_t t = 0; t < thread_count; t++)
+            for (size_t i = 0; i < threads[t].event_count; i++)
+                if (events[threads[t].events[i]].op == (enum mem_fs_trace_op) op) {
+                    latencies[count++] = threads[t].latencies[i];
+                    sum += threads[t].latencies[i];
+                    traced_sum += events[threads[t].events[i]].latency;
+                }
+        if (count == 0)
+            continue;
+        qsort(latencies, count, sizeof(uint64_t), compare_latency);
+        // The last column is the average latency in MemFS which includes the round trip through kernel
+        printf("%-10s %10zu %10.2f %10.2f %10.2f %10.2f %12.2f\n", mem_fs_trace_op_name(op), count,
+               (double) sum / count / 1000, (double) latencies[count / 2] / 1000,
+               (double) latencies[count * 99 / 100] / 1000, (double) latencies[count - 1] / 1000,
+               (double) traced_sum / count / 1000);
+    }
+    free(latencies);
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "usage: %s [-t threads] [-o] [-s snapshot] [-e] <trace>\n"
+                    "    -t threads  replay with this many threads (default: 1). Operations of each recorded\n"
+                    "                thread are replayed in order by one replay thread.\n"
+                    "    -o          replay with the original timing (default: as fast as possible)\n"
+                    "    -s snapshot start from a tar archive of the mount at the start of recording\n"
+                    "    -e          do not create the entries which the trace expects to exist\n", program);
+}
+
+int main(int argc, char *argv[]) {
+    size_t thread_count = 1;
+    const char *snapshot = NULL;
+    bool populate = true;
+    int option;
+    while ((option = getopt(argc, argv, "t:os:e")) != -1) {
+        switch (option) {
+            case 't':
+                thread_count = strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                original_speed = true;
+                break;
+            case 's':
+                snapshot = optarg;
+                break;
+            case 'e':
+                populate = false;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc - 1 || thread_count == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (populate && snapshot != NULL && strcmp(snapshot, "-") == 0) {
+        fprintf(stderr, "a snapshot from the standard input cannot be read twice, use -e with it\n");
+        return 1;
+    }
+    int result = mem_fs_trace_load(argv[optind], &events, &event_count);
+    if (result != 0) {
+        fprintf(stderr, "cannot load the trace %s: %s\n", argv[optind], strerror(result));
+        return 1;
+    }
+    if (event_count == 0) {
+        fprintf(stderr, "the trace is empty\n");
+        return 1;
+    }
+    // Split the events between threads
+    size_t buffer_size = 1;
+    struct replay_thread *threads = calloc(thread_count, sizeof(struct replay_thread));
+    size_t *indexes = malloc(event_count * sizeof(size_t));
+    uint64_t *latencies = malloc(event_count * sizeof(uint64_t));
+    if (threads == NULL || indexes == NULL || latencies == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < event_count; i++) {
+        threads[events[i].thread % thread_count].event_count++;
+        if (events[i].start < first_start)
+            first_start = events[i].start;
+        if ((events[i].op == MEM_FS_TRACE_READ || events[i].op == MEM_FS_TRACE_WRITE) &&
+            events[i].size > buffer_size)
+            buffer_size = events[i].size;
+    }
+    size_t next = 0;
+    for (size_t t = 0; t < thread_count; t++) {
+        threads[t].events = indexes + next;
+        threads[t].latencies = latencies + next;
+        next += threads[t].event_count;
+        threads[t].event_count = 0;
+        threads[t].buffer = calloc(1, buffer_size);
+        if (threads[t].buffer == NULL) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < event_count; i++) {
+        struct replay_thread *thread = &threads[events[i].thread % thread_count];
+        thread->events[thread->event_count++] = i;
+    }
+    // Build the tree which the trace expects
+    mem_fs_new(&fs);
+    if (snapshot != NULL) {
+        struct mem_fs_tar_stats stats;
+        result = mem_fs_import_tar(&fs, snapshot, &stats);
+        if (result != 0) {
+            fprintf(stderr, "cannot import the snapshot %s: %s\n", snapshot, strerror(result));
+            return 1;
+        }
+        printf("imported %zu files and %zu folders from the snapshot\n", stats.files, stats.folders);
+    }
+    if (populate) {
+        long created = prepopulate(&fs, snapshot, buffer_size);
+        if (created < 0) {
+            fprintf(stderr, "cannot create the entries which the trace expects\n");
+            return 1;
+        }
+        printf("created %ld entries which existed before recording\n", created);
+    }
+    // Replay
+    replay_epoch = mem_fs_trace_clock();
+    for (size_t t = 0; t < thread_count; t++)
+        if (pthread_create(&threads[t].thread, NULL, replay_thread_main, &threads[t]) != 0) {
+            fprintf(stderr, "cannot create the replay threads\n");
+            return 1;
+        }
+    for (size_t t = 0; t < thread_count; t++)
+        pthread_join(threads[t].thread, NULL);
+    double seconds = (double) (mem_fs_trace_clock() - replay_epoch) / 1e9;
+    // Report
+    uint64_t bytes_read = 0, bytes_written = 0;
+    size_t mismatches = 0, missing = 0;
+    for (size_t t = 0; t < thread_count; t++) {
+        bytes_read += threads[t].bytes_read;
+        bytes_written += threads[t].bytes_written;
+        mismatches += threads[t].mismatches;
+        missing += threads[t].missing;
+    }
+    printf("replayed %zu operations with %zu threads in %.3f seconds\n", event_count, thread_count, seconds);
+    printf("throughput: %.0f ops/s, read %.2f MiB/s, written %.2f MiB/s\n", event_count / seconds,
+           bytes_read / seconds / (1024 * 1024), bytes_written / seconds / (1024 * 1024));
+    // A high rate means that the replay measured error paths instead of the recorded workload
+    printf("mismatches: %zu (%.2f%%) returned a different result than the trace, %zu (%.2f%%) returned ENOENT\n",
+           mismatches, 100.0 * mismatches / event_count, missing, 100.0 * missing / event_count);
+    print_latencies(threads, thread_count);
+    for (size_t t = 0; t < thread_count; t++)
+        free(threads[t].buffer);
+    free(threads);
+    free(indexes);
+    free(latencies);
+    mem_fs_destroy(&fs);
+    mem_fs_trace_free_events(events, event_count);
+    return 0;
+}
@@ -3,7 +3,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <linux/falloc.h>
 #include "memfs.h"
+#include "journal.h"
+#include "reclaimer.h"
+#include "spill.h"
+#include "handoff.h"
+#include "bypass.h"
+#include "crc32c.h"
+#include "trace.h"
+#include "tar.h"
+#include "lock.h"
+#include "cache.h"
 
 int test_create_file();
 
@@ -21,6 +36,48 @@ int test_delete_file();
 
 int test_delete_folder();
 
+int test_rename();
+
+int test_journal_replay();
+
+int test_journal_checkpoint();
+
+int test_detach_file();
+
+int test_reclaimer();
+
+int test_usage();
+
+int test_quota();
+
+int test_path_walk();
+
+int test_spill();
+
+int test_memfd();
+
+int test_handoff();
+
+int test_crc32c();
+
+int test_checksums();
+
+int test_trace();
+
+int test_fallocate();
+
+int test_links();
+
+int test_times();
+
+int test_import_tar();
+
+int test_instances();
+
+int test_lock();
+
+int test_cache();
+
 int main(int argc, char **argv) {
     if (argc != 2) {
         puts("Enter the test number as argument");
@@ -44,6 +101,48 @@ int main(int argc, char **argv) {
             return test_delete_file();
         case 8:
             return test_delete_folder();
+        case 9:
+            return test_rename();
+        case 10:
+            return test_journal_replay();
+        case 11:
+            return test_journal_checkpoint();
+        case 12:
+            return test_detach_file();
+        case 13:
+            return test_reclaimer();
+        case 14:
+            return test_usage();
+        case 15:
+            return test_quota();
+        case 16:
+            return test_path_walk();
+        case 17:
+            return test_spill();
+        case 18:
+            return test_memfd();
+        case 19:
+            return test_handoff();
+        case 20:
+            return test_crc32c();
+        case 21:
+            return test_checksums();
+        case 22:
+            return test_trace();
+        case 23:
+            return test_fallocate();
+        case 24:
+            return test_links();
+        case 25:
+            return test_times();
+        case 26:
+            return test_import_tar();
+        case 27:
+            return test_instances();
+        case 28:
+            return test_lock();
+        case 29:
+            return test_cache();
         default:
             puts("invalid test number");
             return 1;
@@ -51,7 +150,7 @@ int main(int argc, char **argv) {
 }
 
 int test_create_file() {
-    struct mem_fs_directory root;
+    struct mem_fs root;
     mem_fs_new(&root);
     assert(mem_fs_create_file(&root, "/hello", 10) == 0);
     assert(mem_fs_create_file(&root, "/my file", 69) == 0);
@@ -64,7 +163,7 @@ int test_create_file() {
 }
 
 int test_create_folder() {
-    struct mem_fs_directory root;
+    struct mem_fs root;
     mem_fs_new(&root);
     assert(mem_fs_create_folder(&root, "/hello") == 0);
     assert(mem_fs_create_folder(&root, "/hello/world") == 0);
@@ -83,7 +182,7 @@ int test_create_folder() {
 }
 
 int test_get_entry() {
-    struct mem_fs_directory root;
+    struct mem_fs root;
     mem_fs_new(&root);
     // Create basic entries
     assert(mem_fs_create_folder(&root, "/hello") == 0);
@@ -125,7 +224,7 @@ int test_get_entry() {
 }
 
 int test_read_write_file() {
-    struct mem_fs_directory root;
+    struct mem_fs root;
     mem_fs_new(&root);
     const char to_write_buffer[] = "Hello world!";
     assert(mem_fs_create_file(&root, "/file", 1024) == 0);
@@ -162,7 +261,7 @@ int test_read_write_file() {
 }
 
 int test_read_write_file_inflate() {
-    struct mem_fs_directory root;
+    struct mem_fs root;
     mem_fs_new(&root);
     const char to_write_buffer[] = "Hello world!";
     assert(mem_fs_create_file(&root, "/file", 0) == 0);
@@ -185,7 +284,7 @@ int test_read_write_file_inflate() {
 }
 
 int test_resize_file() {
-    struct mem_fs_directory root;
+    struct mem_fs root;
     mem_fs_new(&root);
     const char to_write_buffer[] = "Hello world!";
     assert(mem_fs_create_file(&root, "/file", 0) == 0);
@@ -213,7 +312,7 @@ int test_resize_file() {
 }
 
 int test_delete_file() {
-    struct mem_fs_directory root;
+    struct mem_fs root;
     mem_fs_new(&root);
     assert(mem_fs_create_folder(&root, "/folder1") == 0);
     assert(mem_fs_create_folder(&root, "/folder2") == 0);
@@ -245,7 +344,7 @@ int test_delete_file() {
 }
 
 int test_delete_folder() {
-    struct mem_fs_directory root;
+    struct mem_fs root;
     mem_fs_new(&root);
     assert(mem_fs_create_folder(&root, "/folder") == 0);
     assert(mem_fs_create_folder(&root, "/folder/dir") == 0);
@@ -263,11 +362,1520 @@ int test_delete_folder() {
     assert(mem_fs_rm_dir(&root, "/folder") == ENOTEMPTY);
     assert(mem_fs_rm_dir(&root, "/folder/dir") == 0);
     assert(mem_fs_rm_dir(&root, "/folder") == 0);
-    assert(root.entries == NULL);
+    assert(root.root.entries == NULL);
     // General tests
     assert(mem_fs_rm_dir(&root, "/") == EPERM);
     assert(mem_fs_rm_dir(&root, "/nope") == ENOENT);
     assert(mem_fs_create_file(&root, "/file", 0) == 0);
     assert(mem_fs_rm_dir(&root, "/file/folder") == ENOENT);
     return 0;
-}
\ No newline at end of file
+}
+
+int test_rename() {
+    struct mem_fs root;
+    mem_fs_new(&root);
+    const char to_write_buffer[] = "Hello world!";
+    assert(mem_fs_create_folder(&root, "/folder") == 0);
+    assert(mem_fs_create_folder(&root, "/folder/dir") == 0);
+    assert(mem_fs_create_folder(&root, "/empty") == 0);
+    assert(mem_fs_create_file(&root, "/file", 0) == 0);
+    assert(mem_fs_create_file(&root, "/other", 10) == 0);
+    assert(mem_fs_write(&root, "/file", sizeof(to_write_buffer), to_write_buffer, 0) == sizeof(to_write_buffer));
+    // Move file between folders
+    assert(mem_fs_rename(&root, "/file", "/folder/dir/moved") == 0);
+    assert(mem_fs_rename(&root, "/file", "/folder/file") == ENOENT);
+    char read_buffer[sizeof(to_write_buffer)] = {0};
+    assert(mem_fs_read(&root, "/folder/dir/moved", sizeof(read_buffer), read_buffer, 0) == sizeof(read_buffer));
+    assert(memcmp(read_buffer, to_write_buffer, sizeof(to_write_buffer)) == 0);
+    // Replace an existing file
+    assert(mem_fs_rename(&root, "/folder/dir/moved", "/other") == 0);
+    struct mem_fs_entry entry;
+    assert(mem_fs_get_entry(&root, "/other", &entry) == 0);
+    assert(entry.data.file->size == sizeof(to_write_buffer));
+    assert(mem_fs_get_entry(&root, "/folder/dir/moved", &entry) == ENOENT);
+    // Move folders
+    assert(mem_fs_rename(&root, "/folder/dir", "/dir") == 0);
+    assert(mem_fs_rename(&root, "/dir", "/empty") == 0);
+    assert(mem_fs_get_entry(&root, "/empty", &entry) == 0);
+    assert(entry.type == CROW_FS_FOLDER);
+    // Errors
+    assert(mem_fs_rename(&root, "/empty", "/empty/inside") == EINVAL);
+    assert(mem_fs_rename(&root, "/empty", "/other") == ENOTDIR);
+    assert(mem_fs_rename(&root, "/other", "/folder") == EISDIR);
+    assert(mem_fs_create_file(&root, "/empty/file", 0) == 0);
+    assert(mem_fs_rename(&root, "/folder", "/empty") == ENOTEMPTY);
+    assert(mem_fs_rename(&root, "/other", "/nope/other") == ENOENT);
+    assert(mem_fs_rename(&root, "/", "/root") == EBUSY);
+    mem_fs_tree(&root);
+    return 0;
+}
+
+/**
+ * Creates an empty temp directory for journal tests
+ */
+static char *create_journal_directory() {
+    static char directory[] = "/tmp/memfs_journal_XXXXXX";
+    assert(mkdtemp(directory) != NULL);
+    return directory;
+}
+
+int test_journal_replay() {
+    char *directory = create_journal_directory();
+    const char to_write_buffer[] = "Hello world!";
+    struct mem_fs_journal journal;
+    // Create some operations
+    struct mem_fs root;
+    mem_fs_new(&root);
+    assert(mem_fs_journal_open(&journal, directory, &root, MEM_FS_DEFAULT_CHECKPOINT_SIZE) == 0);
+    assert(mem_fs_journal_start(&journal) == 0);
+    // Changes are done at fixed times in the past, so replay must not stamp them with the time of replay
+    struct timespec created_time = {.tv_sec = 1000000000, .tv_nsec = 123}, renamed_time = {.tv_sec = 1000000100};
+    mem_fs_set_clock(&root, &created_time);
+    assert(mem_fs_create_folder(&root, "/folder") == 0);
+    mem_fs_journal_append_time(&journal, mem_fs_last_time(&root));
+    mem_fs_journal_append(&journal, MEM_FS_JOURNAL_MKDIR, "/folder", NULL, 0, 0, NULL);
+    assert(mem_fs_create_file(&root, "/folder/file", 0) == 0);
+    mem_fs_journal_append(&journal, MEM_FS_JOURNAL_CREATE, "/folder/file", NULL, 0, 0, NULL);
+    assert(mem_fs_write(&root, "/folder/file", sizeof(to_write_buffer), to_write_buffer, 100) ==
+           sizeof(to_write_buffer));
+    mem_fs_journal_append(&journal, MEM_FS_JOURNAL_WRITE, "/folder/file", NULL, 100, sizeof(to_write_buffer),
+                          to_write_buffer);
+    assert(mem_fs_create_file(&root, "/deleted", 0) == 0);
+    mem_fs_journal_append(&journal, MEM_FS_JOURNAL_CREATE, "/deleted", NULL, 0, 0, NULL);
+    assert(mem_fs_rm_file(&root, "/deleted") == 0);
+    mem_fs_journal_append(&journal, MEM_FS_JOURNAL_UNLINK, "/deleted", NULL, 0, 0, NULL);
+    assert(mem_fs_create_folder(&root, "/dir") == 0);
+    mem_fs_journal_append(&journal, MEM_FS_JOURNAL_MKDIR, "/dir", NULL, 0, 0, NULL);
+    assert(mem_fs_rm_dir(&root, "/dir") == 0);
+    mem_fs_journal_append(&journal, MEM_FS_JOURNAL_RMDIR, "/dir", NULL, 0, 0, NULL);
+    mem_fs_set_clock(&root, &renamed_time);
+    assert(mem_fs_rename(&root, "/folder/file", "/renamed") == 0);
+    mem_fs_journal_append_time(&journal, mem_fs_last_time(&root));
+    mem_fs_journal_append(&journal, MEM_FS_JOURNAL_RENAME, "/folder/file", "/renamed", 0, 0, NULL);
+    assert(mem_fs_resize_file(&root, "/renamed", 105) == 0);
+    mem_fs_journal_append_time(&journal, mem_fs_last_time(&root)); // same time, nothing is appended
+    mem_fs_journal_append(&journal, MEM_FS_JOURNAL_TRUNCATE, "/renamed", NULL, 0, 105, NULL);
+    assert(mem_fs_journal_sync(&journal) == 0);
+    mem_fs_journal_close(&journal);
+    // Add a torn record at the end of journal
+    char journal_path[64];
+    sprintf(journal_path, "%s/%s", directory, MEM_FS_JOURNAL_FILE);
+    FILE *journal_file = fopen(journal_path, "ab");
+    assert(journal_file != NULL);
+    assert(fwrite("torn", 1, 4, journal_file) == 4);
+    fclose(journal_file);
+    // Replay it
+    struct mem_fs replayed;
+    mem_fs_new(&replayed);
+    assert(mem_fs_journal_open(&journal, directory, &replayed, MEM_FS_DEFAULT_CHECKPOINT_SIZE) == 0);
+    mem_fs_tree(&replayed);
+    struct mem_fs_entry entry;
+    assert(mem_fs_get_entry(&replayed, "/folder", &entry) == 0);
+    assert(entry.type == CROW_FS_FOLDER);
+    assert(entry.data.directory->entries == NULL);
+    assert(mem_fs_get_entry(&replayed, "/deleted", &entry) == ENOENT);
+    assert(mem_fs_get_entry(&replayed, "/dir", &entry) == ENOENT);
+    char read_buffer[1024] = {0}, expected_buffer[105] = {0};
+    memcpy(expected_buffer + 100, to_write_buffer, 5);
+    assert(mem_fs_read(&replayed, "/renamed", sizeof(read_buffer), read_buffer, 0) == sizeof(expected_buffer));
+    assert(memcmp(read_buffer, expected_buffer, sizeof(expected_buffer)) == 0);
+    // Timestamps come back from the journal
+    assert(mem_fs_get_entry(&replayed, "/renamed", &entry) == 0);
+    assert(mem_fs_pack_time(entry.data.file->times.atime) == mem_fs_pack_time(created_time));
+    assert(mem_fs_pack_time(entry.data.file->times.mtime) == mem_fs_pack_time(renamed_time));
+    assert(mem_fs_pack_time(entry.data.file->times.ctime) == mem_fs_pack_time(renamed_time));
+    assert(mem_fs_pack_time(replayed.root.times.mtime) == mem_fs_pack_time(renamed_time));
+    assert(!replayed.clock_fixed);
+    // The torn tail must be gone and new records must be appended after the valid ones
+    assert(mem_fs_journal_start(&journal) == 0);
+    assert(mem_fs_create_file(&replayed, "/new", 0) == 0);
+    mem_fs_journal_append(&journal, MEM_FS_JOURNAL_CREATE, "/new", NULL, 0, 0, NULL);
+    mem_fs_journal_close(&journal);
+    struct mem_fs replayed_again;
+    mem_fs_new(&replayed_again);
+    assert(mem_fs_journal_open(&journal, directory, &replayed_again, MEM_FS_DEFAULT_CHECKPOINT_SIZE) == 0);
+    assert(mem_fs_get_entry(&replayed_again, "/new", &entry) == 0);
+    assert(mem_fs_get_entry(&replayed_again, "/renamed", &entry) == 0);
+    mem_fs_journal_close(&journal);
+    return 0;
+}
+
+int test_journal_checkpoint() {
+    char *directory = create_journal_directory();
+    char big_buffer[4096];
+    for (size_t i = 0; i < sizeof(big_buffer); i++)
+        big_buffer[i] = (char) i;
+    struct mem_fs_journal journal;
+    struct mem_fs root;
+    mem_fs_new(&root);
+    // Small checkpoint size to trigger checkpoints
+    assert(mem_fs_journal_open(&journal, directory, &root, sizeof(big_buffer) * 4) == 0);
+    assert(mem_fs_journal_start(&journal) == 0);
+    assert(!mem_fs_journal_needs_checkpoint(&journal));
+    assert(mem_fs_create_folder(&root, "/folder") == 0);
+    mem_fs_journal_append(&journal, MEM_FS_JOURNAL_MKDIR, "/folder", NULL, 0, 0, NULL);
+    assert(mem_fs_create_file(&root, "/folder/file", 0) == 0);
+    mem_fs_journal_append(&journal, MEM_FS_JOURNAL_CREATE, "/folder/file", NULL, 0, 0, NULL);
+    struct mem_fs_usage quota = {.bytes = 1000000, .inodes = 10};
+    assert(mem_fs_set_quota(&root, "/folder", &quota) == 0);
+    mem_fs_journal_append(&journal, MEM_FS_JOURNAL_QUOTA, "/folder", NULL, (off_t) quota.bytes, quota.inodes, NULL);
+    for (int i = 0; i < 8; i++) {
+        assert(mem_fs_write(&root, "/folder/file", sizeof(big_buffer), big_buffer, i * (off_t) sizeof(big_buffer)) ==
+               sizeof(big_buffer));
+        mem_fs_journal_append(&journal, MEM_FS_JOURNAL_WRITE, "/folder/file", NULL, i * (off_t) sizeof(big_buffer),
+                              sizeof(big_buffer), big_buffer);
+    }
+    assert(mem_fs_journal_needs_checkpoint(&journal));
+    assert(mem_fs_journal_wait_checkpoint(&journal)); // does not block, a checkpoint is due
+    assert(mem_fs_journal_checkpoint(&journal, &root) == 0);
+    assert(!mem_fs_journal_needs_checkpoint(&journal));
+    // Operations after the checkpoint go to the new journal
+    struct timespec renamed_time = {.tv_sec = 1000000000, .tv_nsec = 456};
+    mem_fs_set_clock(&root, &renamed_time);
+    assert(mem_fs_rename(&root, "/folder/file", "/file") == 0);
+    mem_fs_journal_append_time(&journal, mem_fs_last_time(&root));
+    mem_fs_journal_append(&journal, MEM_FS_JOURNAL_RENAME, "/folder/file", "/file", 0, 0, NULL);
+    quota = (struct mem_fs_usage) {.inodes = 50};
+    assert(mem_fs_set_quota(&root, "/", &quota) == 0);
+    mem_fs_journal_append(&journal, MEM_FS_JOURNAL_QUOTA, "/", NULL, (off_t) quota.bytes, quota.inodes, NULL);
+    assert(mem_fs_journal_sync(&journal) == 0);
+    mem_fs_journal_stop_checkpoints(&journal);
+    assert(!mem_fs_journal_wait_checkpoint(&journal));
+    mem_fs_journal_close(&journal);
+    // Replay checkpoint + journal
+    struct mem_fs replayed;
+    mem_fs_new(&replayed);
+    assert(mem_fs_journal_open(&journal, directory, &replayed, sizeof(big_buffer) * 4) == 0);
+    mem_fs_tree(&replayed);
+    struct mem_fs_entry entry;
+    assert(mem_fs_get_entry(&replayed, "/folder/file", &entry) == ENOENT);
+    assert(mem_fs_get_entry(&replayed, "/file", &entry) == 0);
+    assert(entry.data.file->size == sizeof(big_buffer) * 8);
+    for (int i = 0; i < 8; i++)
+        assert(memcmp(entry.data.file->data + i * sizeof(big_buffer), big_buffer, sizeof(big_buffer)) == 0);
+    // Quotas come back from the checkpoint and the journal
+    assert(mem_fs_get_entry(&replayed, "/folder", &entry) == 0);
+    assert(entry.data.directory->quota.bytes == 1000000 && entry.data.directory->quota.inodes == 10);
+    assert(replayed.root.quota.bytes == 0 && replayed.root.quota.inodes == 50);
+    // So do the timestamps, the ctime included
+    struct mem_fs_entry original;
+    assert(mem_fs_get_entry(&root, "/file", &original) == 0 && mem_fs_get_entry(&replayed, "/file", &entry) == 0);
+    assert(mem_fs_pack_time(entry.data.file->times.mtime) == mem_fs_pack_time(original.data.file->times.mtime));
+    assert(mem_fs_pack_time(entry.data.file->times.ctime) == mem_fs_pack_time(renamed_time));
+    assert(mem_fs_get_entry(&root, "/folder", &original) == 0 && mem_fs_get_entry(&replayed, "/folder", &entry) == 0);
+    assert(memcmp(&entry.data.directory->times, &original.data.directory->times, sizeof(struct mem_fs_times)) == 0);
+    mem_fs_journal_close(&journal);
+    return 0;
+}
+
+int test_detach_file() {
+    struct mem_fs root;
+    mem_fs_new(&root);
+    assert(mem_fs_create_folder(&root, "/folder") == 0);
+    assert(mem_fs_create_folder(&root, "/folder/dir") == 0);
+    assert(mem_fs_create_file(&root, "/folder/file", 100) == 0);
+    assert(mem_fs_create_file(&root, "/folder/dir/file", 20) == 0);
+    assert(mem_fs_create_file(&root, "/file", 10) == 0);
+    // Detach a file
+    struct mem_fs_entry *detached;
+    assert(mem_fs_detach_file(&root, "/folder/file", &detached) == 0);
+    assert(detached->type == CROW_FS_FILE);
+    assert(detached->next == NULL);
+    assert(mem_fs_entry_bytes(detached) == 100);
+    mem_fs_free_entry(detached);
+    struct mem_fs_entry entry;
+    assert(mem_fs_get_entry(&root, "/folder/file", &entry) == ENOENT);
+    assert(mem_fs_detach_file(&root, "/folder", &detached) == EISDIR);
+    assert(mem_fs_detach_file(&root, "/nope", &detached) == ENOENT);
+    // Replacing a folder by rename detaches the old one
+    assert(mem_fs_create_folder(&root, "/empty") == 0);
+    assert(mem_fs_detach_rename(&root, "/folder/dir", "/empty", &detached) == 0);
+    assert(detached != NULL && detached->type == CROW_FS_FOLDER);
+    mem_fs_free_entry(detached);
+    assert(mem_fs_detach_rename(&root, "/empty", "/dir", &detached) == 0);
+    assert(detached == NULL);
+    assert(mem_fs_get_entry(&root, "/folder", &entry) == 0);
+    assert(mem_fs_entry_bytes(&entry) == 0);
+    assert(mem_fs_get_entry(&root, "/dir", &entry) == 0);
+    assert(mem_fs_entry_bytes(&entry) == 20);
+    mem_fs_tree(&root);
+    return 0;
+}
+
+int test_reclaimer() {
+    struct mem_fs root;
+    mem_fs_new(&root);
+    struct mem_fs_reclaimer reclaimer;
+    struct mem_fs_reclaimer_stats stats;
+    mem_fs_reclaimer_init(&reclaimer);
+    // Before starting, files are freed inline
+    struct mem_fs_entry *detached;
+    assert(mem_fs_create_file(&root, "/file", 1000) == 0);
+    assert(mem_fs_detach_file(&root, "/file", &detached) == 0);
+    mem_fs_reclaimer_free(&reclaimer, detached);
+    mem_fs_reclaimer_stats(&reclaimer, &stats);
+    assert(stats.inline_bytes == 1000);
+    assert(stats.pending_bytes == 0);
+    // Now free a lot of files in background
+    assert(mem_fs_reclaimer_start(&reclaimer) == 0);
+    const int file_count = MEM_FS_RECLAIMER_QUEUE_SIZE * 2;
+    for (int i = 0; i < file_count; i++) {
+        assert(mem_fs_create_file(&root, "/file", 1024 * 1024) == 0);
+        assert(mem_fs_detach_file(&root, "/file", &detached) == 0);
+        mem_fs_reclaimer_free(&reclaimer, detached);
+    }
+    mem_fs_reclaimer_stop(&reclaimer);
+    mem_fs_reclaimer_stats(&reclaimer, &stats);
+    assert(stats.pending_bytes == 0);
+    assert(stats.pending_entries == 0);
+    assert(stats.reclaimed_bytes + stats.inline_bytes == 1000 + (size_t) file_count * 1024 * 1024);
+    assert(root.root.entries == NULL);
+    return 0;
+}
+
+/**
+ * Checks the usage of a path
+ */
+static void assert_usage(struct mem_fs *root, const char *path, size_t bytes, size_t inodes) {
+    struct mem_fs_usage usage;
+    assert(mem_fs_get_usage(root, path, &usage) == 0);
+    assert(usage.bytes == bytes);
+    assert(usage.inodes == inodes);
+}
+
+int test_usage() {
+    struct mem_fs root;
+    mem_fs_new(&root);
+    const char to_write_buffer[] = "Hello world!";
+    assert(mem_fs_create_folder(&root, "/a") == 0);
+    assert(mem_fs_create_folder(&root, "/a/b") == 0);
+    assert(mem_fs_create_folder(&root, "/c") == 0);
+    assert(mem_fs_create_file(&root, "/a/b/file", 100) == 0);
+    assert(mem_fs_create_file(&root, "/a/file", 10) == 0);
+    assert_usage(&root, "/", 110, 5);
+    assert_usage(&root, "/a", 110, 3);
+    assert_usage(&root, "/a/b", 100, 1);
+    assert_usage(&root, "/a/b/file", 100, 1);
+    assert_usage(&root, "/c", 0, 0);
+    // Write and resize
+    assert(mem_fs_write(&root, "/a/b/file", sizeof(to_write_buffer), to_write_buffer, 200) == sizeof(to_write_buffer));
+    assert_usage(&root, "/a/b", 200 + sizeof(to_write_buffer), 1);
+    assert(mem_fs_write(&root, "/a/b/file", sizeof(to_write_buffer), to_write_buffer, 0) == sizeof(to_write_buffer));
+    assert_usage(&root, "/a/b", 200 + sizeof(to_write_buffer), 1);
+    assert(mem_fs_resize_file(&root, "/a/b/file", 50) == 0);
+    assert_usage(&root, "/", 60, 5);
+    assert_usage(&root, "/a/b", 50, 1);
+    // Rename between folders
+    assert(mem_fs_rename(&root, "/a/b", "/c/b") == 0);
+    assert_usage(&root, "/a", 10, 1);
+    assert_usage(&root, "/c", 50, 2);
+    assert_usage(&root, "/", 60, 5);
+    assert(mem_fs_write(&root, "/c/b/file", 10, to_write_buffer, 50) == 10);
+    assert_usage(&root, "/c", 60, 2);
+    // Replace a file by rename
+    assert(mem_fs_rename(&root, "/a/file", "/c/b/file") == 0);
+    assert_usage(&root, "/a", 0, 0);
+    assert_usage(&root, "/c", 10, 2);
+    assert_usage(&root, "/", 10, 4);
+    // Delete
+    assert(mem_fs_rm_file(&root, "/c/b/file") == 0);
+    assert(mem_fs_rm_dir(&root, "/c/b") == 0);
+    assert_usage(&root, "/", 0, 2);
+    assert_usage(&root, "/c", 0, 0);
+    struct mem_fs_usage usage;
+    assert(mem_fs_get_usage(&root, "/nope", &usage) == ENOENT);
+    return 0;
+}
+
+int test_quota() {
+    struct mem_fs root;
+    mem_fs_new(&root);
+    const char to_write_buffer[100] = {0};
+    assert(mem_fs_create_folder(&root, "/tenant") == 0);
+    assert(mem_fs_create_folder(&root, "/tenant/dir") == 0);
+    assert(mem_fs_create_folder(&root, "/other") == 0);
+    assert(mem_fs_create_file(&root, "/tenant/file", 0) == 0);
+    struct mem_fs_usage quota = {.bytes = 150, .inodes = 4};
+    assert(mem_fs_set_quota(&root, "/tenant", &quota) == 0);
+    assert(mem_fs_set_quota(&root, "/tenant/file", &quota) == ENOTDIR);
+    assert(mem_fs_set_quota(&root, "/nope", &quota) == ENOENT);
+    // Bytes
+    assert(mem_fs_write(&root, "/tenant/file", 100, to_write_buffer, 0) == 100);
+    assert(mem_fs_write(&root, "/tenant/file", 100, to_write_buffer, 100) == -EDQUOT);
+    assert(mem_fs_resize_file(&root, "/tenant/file", 151) == EDQUOT);
+    assert(mem_fs_resize_file(&root, "/tenant/file", 150) == 0);
+    assert(mem_fs_create_file(&root, "/tenant/dir/big", 1) == EDQUOT);
+    assert(mem_fs_create_file(&root, "/other/big", 1000) == 0);
+    assert(mem_fs_rename(&root, "/other/big", "/tenant/dir/big") == EDQUOT);
+    assert_usage(&root, "/other", 1000, 1);
+    // Inodes
+    assert(mem_fs_create_file(&root, "/tenant/dir/a", 0) == 0);
+    assert(mem_fs_create_file(&root, "/tenant/dir/b", 0) == 0);
+    assert(mem_fs_create_folder(&root, "/tenant/dir/c") == EDQUOT);
+    // Moving inside the tenant does not count twice
+    assert(mem_fs_rename(&root, "/tenant/file", "/tenant/dir/file") == 0);
+    assert_usage(&root, "/tenant", 150, 4);
+    // Shrinking is always allowed
+    assert(mem_fs_resize_file(&root, "/tenant/dir/file", 0) == 0);
+    assert(mem_fs_create_file(&root, "/tenant/dir/big", 150) == EDQUOT); // no inode left
+    assert(mem_fs_rm_file(&root, "/tenant/dir/a") == 0);
+    assert(mem_fs_create_file(&root, "/tenant/dir/big", 150) == 0);
+    assert_usage(&root, "/", 1150, 7);
+    return 0;
+}
+
+int test_path_walk() {
+    struct mem_fs root;
+    mem_fs_new(&root);
+    char long_name[MAX_FILE_NAME + 3];
+    long_name[0] = '/';
+    memset(long_name + 1, 'a', MAX_FILE_NAME + 1);
+    long_name[MAX_FILE_NAME + 2] = '\0';
+    // Names longer than the limit are rejected, names at the limit work
+    assert(mem_fs_create_file(&root, long_name, 0) == ENAMETOOLONG);
+    assert(mem_fs_create_folder(&root, long_name) == ENAMETOOLONG);
+    long_name[MAX_FILE_NAME + 1] = '\0';
+    assert(mem_fs_create_folder(&root, long_name) == 0);
+    struct mem_fs_entry entry;
+    assert(mem_fs_get_entry(&root, long_name, &entry) == 0);
+    assert(strlen(entry.name) == MAX_FILE_NAME);
+    // Repeated and trailing slashes are ignored
+    assert(mem_fs_create_folder(&root, "//folder/") == 0);
+    assert(mem_fs_create_file(&root, "/folder//file", 10) == 0);
+    assert(mem_fs_get_entry(&root, "/folder/file/", &entry) == 0);
+    assert(strcmp(entry.name, "file") == 0);
+    assert(mem_fs_get_entry(&root, "//", &entry) == 0);
+    assert(entry.data.directory == &root.root);
+    // Prefix of a name is not the name
+    assert(mem_fs_get_entry(&root, "/fold", &entry) == ENOENT);
+    assert(mem_fs_get_entry(&root, "/folder/fil", &entry) == ENOENT);
+    assert(mem_fs_get_entry(&root, "/folder/files", &entry) == ENOENT);
+    // Root cannot be created
+    assert(mem_fs_create_file(&root, "/", 0) == EEXIST);
+    assert(mem_fs_create_folder(&root, "/") == EEXIST);
+    mem_fs_tree(&root);
+    return 0;
+}
+
+int test_spill() {
+    char spill_directory[] = "/tmp/memfs_spill_XXXXXX", spill_path[64];
+    assert(mkdtemp(spill_directory) != NULL);
+    sprintf(spill_path, "%s/spill", spill_directory);
+    struct mem_fs_spill spill;
+    assert(mem_fs_spill_init(&spill, spill_path, 100, 50, 40) == 0);
+    struct mem_fs root;
+    mem_fs_new(&root);
+    mem_fs_set_spill(&root, &spill);
+    char to_write_buffer[30], read_buffer[30];
+    memset(to_write_buffer, 'a', sizeof(to_write_buffer));
+    assert(mem_fs_write(&root, "/a", sizeof(to_write_buffer), to_write_buffer, 0) == -ENOENT);
+    assert(mem_fs_create_file(&root, "/a", 0) == 0);
+    assert(mem_fs_write(&root, "/a", sizeof(to_write_buffer), to_write_buffer, 0) == sizeof(to_write_buffer));
+    memset(to_write_buffer, 'b', sizeof(to_write_buffer));
+    assert(mem_fs_create_file(&root, "/b", 0) == 0);
+    assert(mem_fs_write(&root, "/b", sizeof(to_write_buffer), to_write_buffer, 0) == sizeof(to_write_buffer));
+    assert(mem_fs_create_file(&root, "/c", 30) == 0);
+    // Least recently used files go to the spill file until the low watermark is reached
+    struct mem_fs_spill_stats stats;
+    mem_fs_spill_stats(&spill, &stats);
+    assert(stats.resident_bytes == 90);
+    assert(mem_fs_spill_evict(&spill) == 60);
+    mem_fs_spill_stats(&spill, &stats);
+    assert(stats.resident_bytes == 30 && stats.spilled_bytes == 60 && stats.spills == 2);
+    struct mem_fs_entry entry;
+    assert(mem_fs_get_entry(&root, "/a", &entry) == 0);
+    assert(entry.data.file->data == NULL && entry.data.file->spill_offset >= 0);
+    // Spilled files can be copied without loading them
+    assert(mem_fs_get_entry(&root, "/b", &entry) == 0);
+    assert(mem_fs_read_file_data(&root, entry.data.file, 10, read_buffer, 20) == 0);
+    assert(memcmp(read_buffer, to_write_buffer, 10) == 0);
+    assert(entry.data.file->data == NULL);
+    // Reading brings the file back
+    assert(mem_fs_read(&root, "/b", sizeof(read_buffer), read_buffer, 0) == sizeof(read_buffer));
+    assert(memcmp(read_buffer, to_write_buffer, sizeof(read_buffer)) == 0);
+    mem_fs_spill_stats(&spill, &stats);
+    assert(stats.resident_bytes == 60 && stats.spilled_bytes == 30 && stats.faults == 1);
+    // Writing and resizing a spilled file bring it back as well
+    assert(mem_fs_resize_file(&root, "/a", 40) == 0);
+    assert(mem_fs_read(&root, "/a", sizeof(read_buffer), read_buffer, 0) == sizeof(read_buffer));
+    memset(to_write_buffer, 'a', sizeof(to_write_buffer));
+    assert(memcmp(read_buffer, to_write_buffer, sizeof(read_buffer)) == 0);
+    mem_fs_spill_stats(&spill, &stats);
+    assert(stats.resident_bytes == 100 && stats.spilled_bytes == 0 && stats.faults == 2);
+    // Deleted files release their room in spill file
+    assert(mem_fs_spill_evict(&spill) == 60); // c and b
+    assert(mem_fs_rm_file(&root, "/b") == 0);
+    assert(mem_fs_rename(&root, "/a", "/c") == 0);
+    mem_fs_spill_stats(&spill, &stats);
+    assert(stats.resident_bytes == 40 && stats.spilled_bytes == 0);
+    // Files which do not fit in the spill file stay in memory
+    assert(mem_fs_create_file(&root, "/big", 200) == 0);
+    assert(mem_fs_spill_evict(&spill) == 40);
+    mem_fs_spill_stats(&spill, &stats);
+    assert(stats.resident_bytes == 200 && stats.spilled_bytes == 40);
+    assert(spill.full);
+    assert(mem_fs_rm_file(&root, "/big") == 0);
+    // Checkpoints read spilled files from the spill file
+    struct mem_fs_journal journal;
+    char *directory = create_journal_directory();
+    struct mem_fs replayed;
+    mem_fs_new(&replayed);
+    assert(mem_fs_journal_open(&journal, directory, &replayed, MEM_FS_DEFAULT_CHECKPOINT_SIZE) == 0);
+    assert(mem_fs_journal_checkpoint(&journal, &root) == 0);
+    mem_fs_journal_close(&journal);
+    mem_fs_new(&replayed);
+    assert(mem_fs_journal_open(&journal, directory, &replayed, MEM_FS_DEFAULT_CHECKPOINT_SIZE) == 0);
+    assert(mem_fs_read(&replayed, "/c", sizeof(read_buffer), read_buffer, 0) == sizeof(read_buffer));
+    assert(memcmp(read_buffer, to_write_buffer, sizeof(read_buffer)) == 0);
+    mem_fs_journal_close(&journal);
+    // Freeing a range of the spill file lets the eviction continue
+    assert(spill.full);
+    assert(mem_fs_rm_file(&root, "/c") == 0);
+    assert(!spill.full);
+    mem_fs_spill_destroy(&spill);
+    return 0;
+}
+
+int test_memfd() {
+    struct mem_fs root;
+    mem_fs_new(&root);
+    mem_fs_set_memfd(&root, true);
+    const char to_write_buffer[] = "Hello world!";
+    char read_buffer[1024], expected_buffer[105] = {0};
+    assert(mem_fs_create_file(&root, "/empty", 0) == 0);
+    assert(mem_fs_read(&root, "/empty", sizeof(read_buffer), read_buffer, 0) == 0);
+    assert(mem_fs_create_file(&root, "/file", 10) == 0);
+    struct mem_fs_entry entry;
+    assert(mem_fs_get_entry(&root, "/file", &entry) == 0);
+    assert(entry.data.file->fd >= 0);
+    // Writing after the end leaves a zero filled hole
+    assert(mem_fs_write(&root, "/file", sizeof(to_write_buffer), to_write_buffer, 100) == sizeof(to_write_buffer));
+    memcpy(expected_buffer + 100, to_write_buffer, 5);
+    assert(mem_fs_resize_file(&root, "/file", 105) == 0);
+    assert(mem_fs_read(&root, "/file", sizeof(read_buffer), read_buffer, 0) == sizeof(expected_buffer));
+    assert(memcmp(read_buffer, expected_buffer, sizeof(expected_buffer)) == 0);
+    // Shrinking and growing again zeroes the content
+    assert(mem_fs_resize_file(&root, "/file", 0) == 0);
+    assert(mem_fs_resize_file(&root, "/file", 105) == 0);
+    assert(mem_fs_read(&root, "/file", sizeof(read_buffer), read_buffer, 0) == sizeof(expected_buffer));
+    memset(expected_buffer, 0, sizeof(expected_buffer));
+    assert(memcmp(read_buffer, expected_buffer, sizeof(expected_buffer)) == 0);
+    // The memfd holds the content
+    assert(mem_fs_write(&root, "/file", sizeof(to_write_buffer), to_write_buffer, 0) == sizeof(to_write_buffer));
+    assert(mem_fs_get_entry(&root, "/file", &entry) == 0);
+    assert(pread(entry.data.file->fd, read_buffer, sizeof(to_write_buffer), 0) == sizeof(to_write_buffer));
+    assert(memcmp(read_buffer, to_write_buffer, sizeof(to_write_buffer)) == 0);
+    assert(mem_fs_rm_file(&root, "/file") == 0);
+    assert(mem_fs_rm_file(&root, "/empty") == 0);
+    return 0;
+}
+
+struct handoff_sender {
+    int socket_fd;
+    const struct mem_fs *root;
+    int session_fd;
+    int result;
+};
+
+static void *handoff_sender_main(void *arg) {
+    struct handoff_sender *sender = arg;
+    sender->result = mem_fs_handoff_send(sender->socket_fd, sender->root, sender->session_fd, "state", 5);
+    return NULL;
+}
+
+struct file_requester {
+    int socket_fd;
+    const char *path;
+    int fd;
+    struct stat stbuf;
+    int result;
+};
+
+static void *file_requester_main(void *arg) {
+    struct file_requester *requester = arg;
+    requester->result = mem_fs_bypass_request_file(requester->socket_fd, requester->path, &requester->fd,
+                                                   &requester->stbuf);
+    return NULL;
+}
+
+int test_handoff() {
+    struct mem_fs root;
+    mem_fs_new(&root);
+    mem_fs_set_memfd(&root, true);
+    const char to_write_buffer[] = "Hello world!";
+    assert(mem_fs_create_folder(&root, "/folder") == 0);
+    assert(mem_fs_create_folder(&root, "/folder/inner") == 0);
+    assert(mem_fs_create_file(&root, "/folder/inner/file", 0) == 0);
+    assert(mem_fs_write(&root, "/folder/inner/file", sizeof(to_write_buffer), to_write_buffer, 0) ==
+           sizeof(to_write_buffer));
+    assert(mem_fs_create_file(&root, "/empty", 0) == 0);
+    // Many files need more than one batch of fds
+    char path[64];
+    for (int i = 0; i < 300; i++) {
+        sprintf(path, "/folder/%d", i);
+        assert(mem_fs_create_file(&root, path, i) == 0);
+    }
+    struct mem_fs_usage quota = {.bytes = 1000000, .inodes = 400};
+    assert(mem_fs_set_quota(&root, "/folder", &quota) == 0);
+    quota.inodes = 500;
+    assert(mem_fs_set_quota(&root, "/", &quota) == 0);
+    const struct timespec times[2] = {{.tv_sec = 1000}, {.tv_sec = 2000, .tv_nsec = 3}};
+    assert(mem_fs_set_times(&root, "/folder", times) == 0);
+    // Send it to ourselves
+    int sockets[2], session_pipe[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+    assert(pipe(session_pipe) == 0);
+    struct handoff_sender sender = {.socket_fd = sockets[0], .root = &root, .session_fd = session_pipe[1]};
+    pthread_t sender_thread;
+    assert(pthread_create(&sender_thread, NULL, handoff_sender_main, &sender) == 0);
+    struct mem_fs received;
+    mem_fs_new(&received);
+    mem_fs_set_memfd(&received, true);
+    int session_fd;
+    char state[MEM_FS_HANDOFF_MAX_STATE];
+    uint32_t state_length;
+    assert(mem_fs_handoff_receive(sockets[1], &received, &session_fd, state, &state_length) == 0);
+    pthread_join(sender_thread, NULL);
+    assert(sender.result == 0);
+    assert(state_length == 5 && memcmp(state, "state", 5) == 0);
+    // The session fd is the same pipe
+    assert(write(session_pipe[1], "x", 1) == 1);
+    char byte;
+    assert(read(session_pipe[0], &byte, 1) == 1 && byte == 'x');
+    assert(write(session_fd, "y", 1) == 1);
+    assert(read(session_pipe[0], &byte, 1) == 1 && byte == 'y');
+    // The tree and its accounting are the same
+    char read_buffer[1024];
+    assert(mem_fs_read(&received, "/folder/inner/file", sizeof(read_buffer), read_buffer, 0) ==
+           sizeof(to_write_buffer));
+    assert(memcmp(read_buffer, to_write_buffer, sizeof(to_write_buffer)) == 0);
+    assert_usage(&received, "/", 300 * 299 / 2 + sizeof(to_write_buffer), 304);
+    assert_usage(&received, "/folder/299", 299, 1);
+    struct mem_fs_entry entry;
+    assert(mem_fs_get_entry(&received, "/folder", &entry) == 0);
+    assert(entry.data.directory->quota.bytes == 1000000 && entry.data.directory->quota.inodes == 400);
+    assert(entry.data.directory->times.atime.tv_sec == 1000);
+    assert(entry.data.directory->times.mtime.tv_sec == 2000 && entry.data.directory->times.mtime.tv_nsec == 3);
+    assert(received.root.quota.inodes == 500);
+    // The content is shared, not copied
+    assert(mem_fs_write(&received, "/folder/inner/file", 5, "HELLO", 0) == 5);
+    assert(mem_fs_read(&root, "/folder/inner/file", sizeof(read_buffer), read_buffer, 0) ==
+           sizeof(to_write_buffer));
+    assert(memcmp(read_buffer, "HELLO world!", sizeof(to_write_buffer)) == 0);
+    // A single file can be requested. It stays shared with the process which sent it.
+    assert(mem_fs_fallocate(&root, "/folder/inner/file", FALLOC_FL_KEEP_SIZE, 0, 4096) == 0);
+    struct file_requester requester = {.socket_fd = sockets[1], .path = "/folder/inner/file"};
+    pthread_t requester_thread;
+    assert(pthread_create(&requester_thread, NULL, file_requester_main, &requester) == 0);
+    char requested_path[MEM_FS_BYPASS_MAX_PATH];
+    assert(mem_fs_bypass_receive_request(sockets[0], requested_path) == 0);
+    assert(strcmp(requested_path, "/folder/inner/file") == 0);
+    int shared_fd;
+    assert(mem_fs_share_file(&root, requested_path, &shared_fd, &entry) == 0);
+    struct stat stbuf = {.st_size = (off_t) entry.data.file->size, .st_mode = S_IFREG | 0777};
+    assert(mem_fs_bypass_send_file(sockets[0], 0, shared_fd, &stbuf) == 0);
+    close(shared_fd);
+    pthread_join(requester_thread, NULL);
+    assert(requester.result == 0);
+    assert(requester.stbuf.st_size == sizeof(to_write_buffer) && requester.stbuf.st_mode == (S_IFREG | 0777));
+    assert(mem_fs_write(&root, "/folder/inner/file", 5, "howdy", 0) == 5);
+    assert(pread(requester.fd, read_buffer, sizeof(to_write_buffer), 0) == sizeof(to_write_buffer));
+    assert(memcmp(read_buffer, "howdy world!", sizeof(to_write_buffer)) == 0);
+    // The preallocated bytes are gone, so the memfd ends where the file ends, even after it grows
+    struct stat memfd_stbuf;
+    assert(fstat(requester.fd, &memfd_stbuf) == 0 && memfd_stbuf.st_size == sizeof(to_write_buffer));
+    assert(entry.data.file->capacity == entry.data.file->size);
+    assert(mem_fs_write(&root, "/folder/inner/file", 3, "!!!", sizeof(to_write_buffer)) == 3);
+    assert(mem_fs_fallocate(&root, "/folder/inner/file", FALLOC_FL_KEEP_SIZE, 0, 4096) == 0);
+    assert(fstat(requester.fd, &memfd_stbuf) == 0 && memfd_stbuf.st_size == sizeof(to_write_buffer) + 3);
+    assert(read(requester.fd, read_buffer, sizeof(read_buffer)) == sizeof(to_write_buffer) + 3);
+    close(requester.fd);
+    // Errors reach the process which requested the file
+    requester.path = "/folder";
+    assert(pthread_create(&requester_thread, NULL, file_requester_main, &requester) == 0);
+    assert(mem_fs_bypass_receive_request(sockets[0], requested_path) == 0);
+    assert(mem_fs_share_file(&root, requested_path, &shared_fd, &entry) == EOPNOTSUPP);
+    assert(mem_fs_bypass_send_file(sockets[0], EOPNOTSUPP, -1, NULL) == 0);
+    pthread_join(requester_thread, NULL);
+    assert(requester.result == EOPNOTSUPP);
+    // Heap files cannot be passed
+    mem_fs_set_memfd(&root, false);
+    assert(mem_fs_create_file(&root, "/heap", 1) == 0);
+    assert(mem_fs_handoff_send(sockets[0], &root, session_pipe[1], NULL, 0) == EINVAL);
+    close(sockets[0]);
+    close(sockets[1]);
+    return 0;
+}
+
+int test_crc32c() {
+    // Check value of CRC32C
+    assert(mem_fs_crc32c(0, "123456789", 9) == 0xe3069283);
+    assert(mem_fs_crc32c(0, NULL, 0) == 0);
+    // Continuing and combining give the same result as one pass
+    char buffer[10000];
+    for (size_t i = 0; i < sizeof(buffer); i++)
+        buffer[i] = (char) (i * 31 + 7);
+    uint32_t whole = mem_fs_crc32c(0, buffer, sizeof(buffer));
+    assert(mem_fs_crc32c(mem_fs_crc32c(0, buffer, 1234), buffer + 1234, sizeof(buffer) - 1234) == whole);
+    uint32_t first = mem_fs_crc32c(0, buffer, 4096), second = mem_fs_crc32c(0, buffer + 4096, 4096);
+    uint32_t rest = mem_fs_crc32c(0, buffer + 8192, sizeof(buffer) - 8192);
+    uint32_t combined = mem_fs_crc32c_combine(first, second, 4096);
+    combined = mem_fs_crc32c_combine(combined, rest, sizeof(buffer) - 8192);
+    assert(combined == whole);
+    struct mem_fs_crc32c_shift shift;
+    mem_fs_crc32c_shift_init(&shift, 4096);
+    assert(mem_fs_crc32c_shift_combine(&shift, first, second) == mem_fs_crc32c(0, buffer, 8192));
+    return 0;
+}
+
+/**
+ * Asserts that the checksum of a file is the CRC32C of its content
+ */
+static void assert_checksum(struct mem_fs *root, const char *path) {
+    static char read_buffer[64 * 1024];
+    int read_size = mem_fs_read(root, path, sizeof(read_buffer), read_buffer, 0);
+    assert(read_size >= 0);
+    uint32_t checksum;
+    assert(mem_fs_get_checksum(root, path, &checksum) == 0);
+    assert(checksum == mem_fs_crc32c(0, read_buffer, read_size));
+}
+
+/**
+ * Gets the checksum of /late while other threads do the same, like getxattr with the read lock does
+ */
+static void *checksum_thread(void *arg) {
+    struct mem_fs *root = arg;
+    uint32_t checksum;
+    char read_buffer[100];
+    for (int i = 0; i < 100; i++) {
+        assert(mem_fs_get_checksum(root, "/late", &checksum) == 0);
+        assert(mem_fs_read(root, "/late", sizeof(read_buffer), read_buffer, 8000) == sizeof(read_buffer));
+    }
+    return NULL;
+}
+
+int test_checksums() {
+    struct mem_fs root;
+    mem_fs_new(&root);
+    uint32_t checksum;
+    assert(mem_fs_create_file(&root, "/file", 0) == 0);
+    assert(mem_fs_get_checksum(&root, "/file", &checksum) == ENOTSUP);
+    assert(mem_fs_create_file(&root, "/late", 50000) == 0);
+    mem_fs_set_checksums(&root, true, true);
+    // Readers compute the unknown page checksums of a file at the same time
+    pthread_t threads[8];
+    for (int i = 0; i < 8; i++)
+        assert(pthread_create(&threads[i], NULL, checksum_thread, &root) == 0);
+    for (int i = 0; i < 8; i++)
+        pthread_join(threads[i], NULL);
+    assert_checksum(&root, "/late");
+    assert(mem_fs_create_file(&root, "/empty", 0) == 0);
+    assert_checksum(&root, "/empty");
+    assert(mem_fs_create_file(&root, "/zero", 10000) == 0);
+    assert_checksum(&root, "/zero");
+    assert(mem_fs_get_checksum(&root, "/", &checksum) == EISDIR);
+    // Writes in the middle, at the end and after a hole
+    char to_write_buffer[5000];
+    for (size_t i = 0; i < sizeof(to_write_buffer); i++)
+        to_write_buffer[i] = (char) (i * 13 + 1);
+    assert(mem_fs_write(&root, "/zero", 100, to_write_buffer, 4000) == 100);
+    assert_checksum(&root, "/zero");
+    assert(mem_fs_write(&root, "/zero", sizeof(to_write_buffer), to_write_buffer, 9000) == sizeof(to_write_buffer));
+    assert_checksum(&root, "/zero");
+    assert(mem_fs_write(&root, "/zero", 10, to_write_buffer, 30000) == 10);
+    assert_checksum(&root, "/zero");
+    // Resizing
+    assert(mem_fs_resize_file(&root, "/zero", 12345) == 0);
+    assert_checksum(&root, "/zero");
+    assert(mem_fs_resize_file(&root, "/zero", 50000) == 0);
+    assert_checksum(&root, "/zero");
+    assert(mem_fs_resize_file(&root, "/zero", 0) == 0);
+    assert_checksum(&root, "/zero");
+    // Files created before checksums are computed when needed
+    assert(mem_fs_write(&root, "/file", 100, to_write_buffer, 0) == 100);
+    assert_checksum(&root, "/file");
+    // Corruption is detected on read
+    assert(mem_fs_write(&root, "/empty", sizeof(to_write_buffer), to_write_buffer, 0) == sizeof(to_write_buffer));
+    struct mem_fs_entry entry;
+    assert(mem_fs_get_entry(&root, "/empty", &entry) == 0);
+    entry.data.file->data[4500] ^= 1;
+    char read_buffer[100];
+    assert(mem_fs_read(&root, "/empty", sizeof(read_buffer), read_buffer, 0) == sizeof(read_buffer));
+    assert(mem_fs_read(&root, "/empty", sizeof(read_buffer), read_buffer, 4400) == -EIO);
+    return 0;
+}
+
+static void *trace_record_thread(void *arg) {
+    struct mem_fs_trace *trace = arg;
+    mem_fs_trace_record(trace, MEM_FS_TRACE_MKDIR, "/other", NULL, 0, 0, 0, -EEXIST, mem_fs_trace_clock());
+    return NULL;
+}
+
+int test_trace() {
+    char trace_directory[] = "/tmp/memfs_trace_XXXXXX", trace_path[64];
+    assert(mkdtemp(trace_directory) != NULL);
+    sprintf(trace_path, "%s/trace", trace_directory);
+    struct mem_fs_trace trace;
+    assert(mem_fs_trace_open(&trace, trace_path) == 0);
+    // Records before the writer thread starts are kept in buffer
+    uint64_t start = mem_fs_trace_clock();
+    mem_fs_trace_record(&trace, MEM_FS_TRACE_CREATE, "/file", NULL, 0, 0, 0100, 0, start);
+    mem_fs_trace_record(&trace, MEM_FS_TRACE_WRITE, "/file", NULL, 4096, 100, 0, 100, mem_fs_trace_clock());
+    assert(mem_fs_trace_start(&trace) == 0);
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, trace_record_thread, &trace) == 0);
+    pthread_join(thread, NULL);
+    mem_fs_trace_record(&trace, MEM_FS_TRACE_RENAME, "/file", "/renamed", 0, 0, 0, 0, mem_fs_trace_clock());
+    struct mem_fs_trace_stats stats;
+    mem_fs_trace_stats(&trace, &stats);
+    assert(stats.recorded == 4 && stats.dropped == 0);
+    mem_fs_trace_close(&trace);
+    // Load it back
+    struct mem_fs_trace_event *events;
+    size_t count;
+    assert(mem_fs_trace_load(trace_path, &events, &count) == 0);
+    assert(count == 4);
+    assert(events[0].op == MEM_FS_TRACE_CREATE && strcmp(events[0].path, "/file") == 0);
+    assert(events[0].new_path == NULL && events[0].result == 0 && events[0].thread == 1);
+    assert(events[0].flags == 0100);
+    assert(events[1].op == MEM_FS_TRACE_WRITE && events[1].offset == 4096 && events[1].size == 100);
+    assert(events[1].result == 100 && events[1].start >= events[0].start);
+    assert(events[2].op == MEM_FS_TRACE_MKDIR && events[2].result == -EEXIST && events[2].thread == 2);
+    assert(events[3].op == MEM_FS_TRACE_RENAME && strcmp(events[3].new_path, "/renamed") == 0);
+    assert(events[3].thread == 1);
+    assert(strcmp(mem_fs_trace_op_name(events[3].op), "rename") == 0);
+    mem_fs_trace_free_events(events, count);
+    // A record which is cut at the end is ignored
+    assert(truncate(trace_path, 230) == 0);
+    assert(mem_fs_trace_load(trace_path, &events, &count) == 0);
+    assert(count == 3);
+    mem_fs_trace_free_events(events, count);
+    // Records are dropped if nothing writes the buffer
+    assert(mem_fs_trace_open(&trace, trace_path) == 0);
+    do {
+        mem_fs_trace_record(&trace, MEM_FS_TRACE_READ, "/file", NULL, 0, 4096, 0, 4096, mem_fs_trace_clock());
+        mem_fs_trace_stats(&trace, &stats);
+    } while (stats.dropped == 0);
+    mem_fs_trace_close(&trace);
+    assert(mem_fs_trace_load(trace_path, &events, &count) == 0);
+    assert(count == stats.recorded);
+    mem_fs_trace_free_events(events, count);
+    // Other files are rejected
+    assert(truncate(trace_path, 0) == 0);
+    assert(mem_fs_trace_load(trace_path, &events, &count) == EPROTO);
+    unlink(trace_path);
+    rmdir(trace_directory);
+    return 0;
+}
+
+int test_fallocate() {
+    // Same checks for heap and memfd backed files
+    for (int memfd = 0; memfd < 2; memfd++) {
+        struct mem_fs root;
+        mem_fs_new(&root);
+        mem_fs_set_memfd(&root, memfd);
+        mem_fs_set_checksums(&root, true, false);
+        char to_write_buffer[100], read_buffer[10000], expected_buffer[10000] = {0};
+        memset(to_write_buffer, 'a', sizeof(to_write_buffer));
+        assert(mem_fs_create_file(&root, "/file", 0) == 0);
+        // Invalid modes and ranges
+        assert(mem_fs_fallocate(&root, "/file", FALLOC_FL_PUNCH_HOLE, 0, 10) == EOPNOTSUPP);
+        assert(mem_fs_fallocate(&root, "/file", FALLOC_FL_COLLAPSE_RANGE, 0, 10) == EOPNOTSUPP);
+        assert(mem_fs_fallocate(&root, "/file", 0, 0, 0) == EINVAL);
+        assert(mem_fs_fallocate(&root, "/file", 0, -1, 10) == EINVAL);
+        assert(mem_fs_fallocate(&root, "/nothing", 0, 0, 10) == ENOENT);
+        assert(mem_fs_fallocate(&root, "/", 0, 0, 10) == EISDIR);
+        // Preallocating keeps the size, and writes in the preallocated range do not reallocate
+        assert(mem_fs_fallocate(&root, "/file", FALLOC_FL_KEEP_SIZE, 0, 8192) == 0);
+        struct mem_fs_entry entry;
+        assert(mem_fs_get_entry(&root, "/file", &entry) == 0);
+        struct mem_fs_file *file = entry.data.file;
+        assert(file->size == 0 && file->capacity == 8192);
+        assert_usage(&root, "/", 0, 1);
+        char *data = file->data;
+        for (int i = 0; i < 80; i++)
+            assert(mem_fs_write(&root, "/file", sizeof(to_write_buffer), to_write_buffer,
+                                i * sizeof(to_write_buffer)) == sizeof(to_write_buffer));
+        assert(file->data == data && file->size == 8000 && file->capacity == 8192);
+        assert_usage(&root, "/", 8000, 1);
+        memset(expected_buffer, 'a', 8000);
+        // Default mode grows the file with zeros
+        assert(mem_fs_fallocate(&root, "/file", 0, 9000, 1000) == 0);
+        assert(file->size == 10000 && file->capacity == 10000);
+        assert(mem_fs_read(&root, "/file", sizeof(read_buffer), read_buffer, 0) == 10000);
+        assert(memcmp(read_buffer, expected_buffer, sizeof(expected_buffer)) == 0);
+        assert_checksum(&root, "/file");
+        // Punching a hole zeroes the range and keeps the size
+        assert(mem_fs_fallocate(&root, "/file", FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 10, 5000) == 0);
+        memset(expected_buffer + 10, 0, 5000);
+        assert(file->size == 10000);
+        assert(mem_fs_read(&root, "/file", sizeof(read_buffer), read_buffer, 0) == 10000);
+        assert(memcmp(read_buffer, expected_buffer, sizeof(expected_buffer)) == 0);
+        assert_checksum(&root, "/file");
+        // Zeroing a range which passes the end grows the file
+        assert(mem_fs_fallocate(&root, "/file", FALLOC_FL_ZERO_RANGE, 7000, 5000) == 0);
+        memset(expected_buffer + 7000, 0, 1000);
+        assert(file->size == 12000);
+        assert(mem_fs_read(&root, "/file", sizeof(read_buffer), read_buffer, 0) == 10000);
+        assert(memcmp(read_buffer, expected_buffer, sizeof(expected_buffer)) == 0);
+        assert_checksum(&root, "/file");
+        assert_usage(&root, "/", 12000, 1);
+        // Truncating gives the preallocated memory back
+        assert(mem_fs_fallocate(&root, "/file", FALLOC_FL_KEEP_SIZE, 0, 20000) == 0);
+        assert(file->size == 12000 && file->capacity == 20000);
+        assert(mem_fs_resize_file(&root, "/file", 100) == 0);
+        assert(file->size == 100 && file->capacity == 100);
+        // Appends grow the capacity geometrically
+        for (int i = 0; i < 100; i++)
+            assert(mem_fs_write(&root, "/file", sizeof(to_write_buffer), to_write_buffer,
+                                (off_t) file->size) == sizeof(to_write_buffer));
+        assert(file->size == 10100 && file->capacity >= file->size && file->capacity < file->size * 2);
+        assert_checksum(&root, "/file");
+        // Preallocation must fit in the quota
+        struct mem_fs_usage quota = {.bytes = 15000};
+        assert(mem_fs_set_quota(&root, "/", &quota) == 0);
+        assert(mem_fs_fallocate(&root, "/file", FALLOC_FL_KEEP_SIZE, 0, 20000) == EDQUOT);
+        assert(mem_fs_fallocate(&root, "/file", FALLOC_FL_KEEP_SIZE, 0, 15000) == 0);
+        assert_usage(&root, "/", 10100, 1);
+        assert(mem_fs_rm_file(&root, "/file") == 0);
+        mem_fs_destroy(&root);
+    }
+    // Changes of size and content are replayed from journal
+    char *directory = create_journal_directory();
+    char to_write_buffer[100], read_buffer[1024], expected_buffer[300] = {0};
+    memset(to_write_buffer, 'a', sizeof(to_write_buffer));
+    struct mem_fs_journal journal;
+    struct mem_fs root;
+    mem_fs_new(&root);
+    assert(mem_fs_journal_open(&journal, directory, &root, MEM_FS_DEFAULT_CHECKPOINT_SIZE) == 0);
+    assert(mem_fs_create_file(&root, "/file", 0) == 0);
+    mem_fs_journal_append(&journal, MEM_FS_JOURNAL_CREATE, "/file", NULL, 0, 0, NULL);
+    assert(mem_fs_write(&root, "/file", sizeof(to_write_buffer), to_write_buffer, 0) == sizeof(to_write_buffer));
+    mem_fs_journal_append(&journal, MEM_FS_JOURNAL_WRITE, "/file", NULL, 0, sizeof(to_write_buffer),
+                          to_write_buffer);
+    mem_fs_journal_append(&journal, MEM_FS_JOURNAL_ALLOCATE, "/file", NULL, 0, 200, NULL);
+    mem_fs_journal_append(&journal, MEM_FS_JOURNAL_PUNCH_HOLE, "/file", NULL, 10, 20, NULL);
+    mem_fs_journal_append(&journal, MEM_FS_JOURNAL_ZERO_RANGE, "/file", NULL, 50, 250, NULL);
+    mem_fs_journal_close(&journal);
+    struct mem_fs replayed;
+    mem_fs_new(&replayed);
+    assert(mem_fs_journal_open(&journal, directory, &replayed, MEM_FS_DEFAULT_CHECKPOINT_SIZE) == 0);
+    memset(expected_buffer, 'a', 10);
+    memset(expected_buffer + 30, 'a', 20);
+    assert(mem_fs_read(&replayed, "/file", sizeof(read_buffer), read_buffer, 0) == sizeof(expected_buffer));
+    assert(memcmp(read_buffer, expected_buffer, sizeof(expected_buffer)) == 0);
+    mem_fs_journal_close(&journal);
+    return 0;
+}
+
+int test_links() {
+    struct mem_fs root;
+    mem_fs_new(&root);
+    const char to_write_buffer[] = "Hello world!";
+    char read_buffer[1024];
+    assert(mem_fs_create_folder(&root, "/a") == 0);
+    assert(mem_fs_create_folder(&root, "/b") == 0);
+    assert(mem_fs_create_file(&root, "/a/file", 0) == 0);
+    assert(mem_fs_write(&root, "/a/file", 5, to_write_buffer, 0) == 5);
+    // Errors
+    assert(mem_fs_link(&root, "/a", "/b/folder") == EPERM);
+    assert(mem_fs_link(&root, "/", "/b/root") == EPERM);
+    assert(mem_fs_link(&root, "/nothing", "/b/link") == ENOENT);
+    assert(mem_fs_link(&root, "/a/file", "/a/file") == EEXIST);
+    assert(mem_fs_link(&root, "/a/file", "/nothing/link") == ENOENT);
+    // Both links share the file, only the first one is charged for the bytes
+    assert(mem_fs_link(&root, "/a/file", "/b/link") == 0);
+    struct mem_fs_entry first, second;
+    assert(mem_fs_get_entry(&root, "/a/file", &first) == 0);
+    assert(mem_fs_get_entry(&root, "/b/link", &second) == 0);
+    assert(first.data.file == second.data.file && first.data.file->link_count == 2);
+    assert_usage(&root, "/a", 5, 1);
+    assert_usage(&root, "/b", 0, 1);
+    assert_usage(&root, "/", 5, 4);
+    assert(mem_fs_write(&root, "/b/link", sizeof(to_write_buffer), to_write_buffer, 0) == sizeof(to_write_buffer));
+    assert(mem_fs_read(&root, "/a/file", sizeof(read_buffer), read_buffer, 0) == sizeof(to_write_buffer));
+    assert(memcmp(read_buffer, to_write_buffer, sizeof(to_write_buffer)) == 0);
+    assert_usage(&root, "/a", sizeof(to_write_buffer), 1);
+    assert_usage(&root, "/b", 0, 1);
+    // Renaming a link over another link of the same file does nothing
+    assert(mem_fs_rename(&root, "/b/link", "/a/file") == 0);
+    assert(mem_fs_get_entry(&root, "/b/link", &second) == 0);
+    assert(mem_fs_get_entry(&root, "/a/file", &first) == 0);
+    // Removing the first link moves the bytes to the next one
+    assert(mem_fs_rm_file(&root, "/a/file") == 0);
+    assert(second.data.file->link_count == 1 && second.data.file->hard_links->parent == second.parent);
+    assert_usage(&root, "/a", 0, 0);
+    assert_usage(&root, "/b", sizeof(to_write_buffer), 1);
+    assert_usage(&root, "/", sizeof(to_write_buffer), 3);
+    assert(mem_fs_read(&root, "/b/link", sizeof(read_buffer), read_buffer, 0) == sizeof(to_write_buffer));
+    char *path = mem_fs_entry_path(second.data.file->hard_links);
+    assert(strcmp(path, "/b/link") == 0);
+    free(path);
+    // Detached links which are not the last one do not hold the file
+    assert(mem_fs_link(&root, "/b/link", "/a/file") == 0);
+    struct mem_fs_entry *detached;
+    assert(mem_fs_detach_file(&root, "/a/file", &detached) == 0);
+    assert(mem_fs_entry_bytes(detached) == 0);
+    mem_fs_free_entry(detached);
+    assert(mem_fs_read(&root, "/b/link", sizeof(read_buffer), read_buffer, 0) == sizeof(to_write_buffer));
+    // Replacing the first link with rename also moves the bytes
+    assert(mem_fs_link(&root, "/b/link", "/a/file") == 0);
+    assert(mem_fs_create_file(&root, "/new", 1) == 0);
+    assert(mem_fs_rename(&root, "/new", "/b/link") == 0);
+    assert_usage(&root, "/a", sizeof(to_write_buffer), 1);
+    assert_usage(&root, "/b", 1, 1);
+    assert(mem_fs_get_entry(&root, "/a/file", &first) == 0);
+    assert(first.data.file->link_count == 1);
+    // Symbolic links
+    assert(mem_fs_symlink(&root, "../a/file", "/b/symlink") == 0);
+    assert(mem_fs_symlink(&root, "/a/file", "/b/symlink") == EEXIST);
+    assert(mem_fs_readlink(&root, "/b/symlink", read_buffer, sizeof(read_buffer)) == 0);
+    assert(strcmp(read_buffer, "../a/file") == 0);
+    assert(mem_fs_readlink(&root, "/b/symlink", read_buffer, 4) == 0);
+    assert(strcmp(read_buffer, "../") == 0);
+    assert(mem_fs_readlink(&root, "/a/file", read_buffer, sizeof(read_buffer)) == EINVAL);
+    assert(mem_fs_readlink(&root, "/", read_buffer, sizeof(read_buffer)) == EINVAL);
+    assert(mem_fs_read(&root, "/b/symlink", sizeof(read_buffer), read_buffer, 0) == -EINVAL);
+    assert(mem_fs_write(&root, "/b/symlink", 1, "a", 0) == -EINVAL);
+    assert(mem_fs_resize_file(&root, "/b/symlink", 0) == EINVAL);
+    assert_usage(&root, "/b/symlink", 0, 1);
+    assert_usage(&root, "/b", 1, 2);
+    // Hard links of symbolic links are copies
+    assert(mem_fs_link(&root, "/b/symlink", "/symlink") == 0);
+    assert(mem_fs_readlink(&root, "/symlink", read_buffer, sizeof(read_buffer)) == 0);
+    assert(strcmp(read_buffer, "../a/file") == 0);
+    assert(mem_fs_rm_file(&root, "/b/symlink") == 0);
+    assert(mem_fs_readlink(&root, "/symlink", read_buffer, sizeof(read_buffer)) == 0);
+    mem_fs_tree(&root);
+    // Links survive a checkpoint. /first is created first, so the link in /second is visited before the file.
+    char *directory = create_journal_directory();
+    struct mem_fs_journal journal;
+    struct mem_fs journaled;
+    mem_fs_new(&journaled);
+    assert(mem_fs_journal_open(&journal, directory, &journaled, MEM_FS_DEFAULT_CHECKPOINT_SIZE) == 0);
+    assert(mem_fs_create_folder(&journaled, "/first") == 0);
+    assert(mem_fs_create_folder(&journaled, "/second") == 0);
+    assert(mem_fs_create_file(&journaled, "/first/file", 0) == 0);
+    assert(mem_fs_write(&journaled, "/first/file", sizeof(to_write_buffer), to_write_buffer, 0) ==
+           sizeof(to_write_buffer));
+    assert(mem_fs_link(&journaled, "/first/file", "/second/link") == 0);
+    assert(mem_fs_symlink(&journaled, "first/file", "/symlink") == 0);
+    assert(mem_fs_journal_checkpoint(&journal, &journaled) == 0);
+    // And the journal after it
+    assert(mem_fs_link(&journaled, "/second/link", "/third") == 0);
+    mem_fs_journal_append(&journal, MEM_FS_JOURNAL_LINK, "/second/link", "/third", 0, 0, NULL);
+    assert(mem_fs_symlink(&journaled, "third", "/symlink2") == 0);
+    mem_fs_journal_append(&journal, MEM_FS_JOURNAL_SYMLINK, "/symlink2", "third", 0, 0, NULL);
+    mem_fs_journal_close(&journal);
+    struct mem_fs replayed;
+    mem_fs_new(&replayed);
+    assert(mem_fs_journal_open(&journal, directory, &replayed, MEM_FS_DEFAULT_CHECKPOINT_SIZE) == 0);
+    mem_fs_tree(&replayed);
+    assert(mem_fs_get_entry(&replayed, "/first/file", &first) == 0);
+    assert(mem_fs_get_entry(&replayed, "/second/link", &second) == 0);
+    assert(first.data.file == second.data.file && first.data.file->link_count == 3);
+    assert_usage(&replayed, "/first", sizeof(to_write_buffer), 1);
+    assert_usage(&replayed, "/second", 0, 1);
+    assert(mem_fs_read(&replayed, "/third", sizeof(read_buffer), read_buffer, 0) == sizeof(to_write_buffer));
+    assert_usage(&replayed, "/", sizeof(to_write_buffer), 7);
+    assert(mem_fs_readlink(&replayed, "/symlink", read_buffer, sizeof(read_buffer)) == 0);
+    assert(strcmp(read_buffer, "first/file") == 0);
+    assert(mem_fs_readlink(&replayed, "/symlink2", read_buffer, sizeof(read_buffer)) == 0);
+    assert(strcmp(read_buffer, "third") == 0);
+    mem_fs_journal_close(&journal);
+    // Links are handed off too
+    struct mem_fs sent;
+    mem_fs_new(&sent);
+    mem_fs_set_memfd(&sent, true);
+    assert(mem_fs_create_folder(&sent, "/first") == 0);
+    assert(mem_fs_create_folder(&sent, "/second") == 0);
+    assert(mem_fs_create_file(&sent, "/first/file", 0) == 0);
+    assert(mem_fs_write(&sent, "/first/file", sizeof(to_write_buffer), to_write_buffer, 0) ==
+           sizeof(to_write_buffer));
+    assert(mem_fs_link(&sent, "/first/file", "/second/link") == 0);
+    assert(mem_fs_symlink(&sent, "first/file", "/symlink") == 0);
+    struct mem_fs_usage quota = {.inodes = 5};
+    assert(mem_fs_set_quota(&sent, "/", &quota) == 0);
+    int sockets[2], session_pipe[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+    assert(pipe(session_pipe) == 0);
+    struct handoff_sender sender = {.socket_fd = sockets[0], .root = &sent, .session_fd = session_pipe[1]};
+    pthread_t sender_thread;
+    assert(pthread_create(&sender_thread, NULL, handoff_sender_main, &sender) == 0);
+    struct mem_fs received;
+    mem_fs_new(&received);
+    mem_fs_set_memfd(&received, true);
+    int session_fd;
+    char state[MEM_FS_HANDOFF_MAX_STATE];
+    uint32_t state_length;
+    assert(mem_fs_handoff_receive(sockets[1], &received, &session_fd, state, &state_length) == 0);
+    pthread_join(sender_thread, NULL);
+    assert(sender.result == 0);
+    assert(mem_fs_get_entry(&received, "/first/file", &first) == 0);
+    assert(mem_fs_get_entry(&received, "/second/link", &second) == 0);
+    assert(first.data.file == second.data.file && first.data.file->link_count == 2);
+    assert_usage(&received, "/first", sizeof(to_write_buffer), 1);
+    assert_usage(&received, "/", sizeof(to_write_buffer), 5);
+    assert(received.root.quota.inodes == 5);
+    assert(mem_fs_readlink(&received, "/symlink", read_buffer, sizeof(read_buffer)) == 0);
+    assert(strcmp(read_buffer, "first/file") == 0);
+    close(sockets[0]);
+    close(sockets[1]);
+    return 0;
+}
+
+static bool same_time(struct timespec a, struct timespec b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static bool after_time(struct timespec time, struct timespec old) {
+    return time.tv_sec > old.tv_sec || (time.tv_sec == old.tv_sec && time.tv_nsec > old.tv_nsec);
+}
+
+int test_times() {
+    struct mem_fs root;
+    mem_fs_new(&root);
+    const struct timespec old[2] = {{.tv_sec = 1000, .tv_nsec = 1}, {.tv_sec = 2000, .tv_nsec = 2}};
+    struct mem_fs_entry entry;
+    // New entries have all timestamps set and modify their folder
+    assert(mem_fs_set_times(&root, "/", old) == 0);
+    assert(mem_fs_create_folder(&root, "/folder") == 0);
+    assert(mem_fs_create_file(&root, "/folder/file", 0) == 0);
+    assert(mem_fs_get_entry(&root, "/folder/file", &entry) == 0);
+    struct mem_fs_times *times = &entry.data.file->times;
+    assert(times->mtime.tv_sec != 0);
+    assert(same_time(times->atime, times->mtime) && same_time(times->mtime, times->ctime));
+    assert(after_time(root.root.times.mtime, old[1]) && same_time(root.root.times.atime, old[0]));
+    // utimens
+    assert(mem_fs_set_times(&root, "/folder/file", old) == 0);
+    assert(same_time(times->atime, old[0]) && same_time(times->mtime, old[1]));
+    assert(after_time(times->ctime, old[1]));
+    const struct timespec omit[2] = {{.tv_nsec = UTIME_NOW}, {.tv_nsec = UTIME_OMIT}};
+    assert(mem_fs_set_times(&root, "/folder/file", omit) == 0);
+    assert(after_time(times->atime, old[0]) && same_time(times->mtime, old[1]));
+    assert(mem_fs_set_times(&root, "/nothing", old) == ENOENT);
+    // Changes of content modify the file
+    assert(mem_fs_write(&root, "/folder/file", 5, "Hello", 0) == 5);
+    assert(after_time(times->mtime, old[1]) && same_time(times->mtime, times->ctime));
+    assert(mem_fs_set_times(&root, "/folder/file", old) == 0);
+    assert(mem_fs_resize_file(&root, "/folder/file", 10) == 0);
+    assert(after_time(times->mtime, old[1]));
+    assert(mem_fs_set_times(&root, "/folder/file", old) == 0);
+    assert(mem_fs_fallocate(&root, "/folder/file", FALLOC_FL_KEEP_SIZE, 0, 100) == 0);
+    assert(same_time(times->mtime, old[1]));
+    assert(mem_fs_fallocate(&root, "/folder/file", FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, 5) == 0);
+    assert(after_time(times->mtime, old[1]));
+    // Renames and links modify the folders and change the file
+    assert(mem_fs_set_times(&root, "/folder/file", old) == 0);
+    assert(mem_fs_set_times(&root, "/folder", old) == 0);
+    assert(mem_fs_set_times(&root, "/", old) == 0);
+    assert(mem_fs_rename(&root, "/folder/file", "/file") == 0);
+    assert(after_time(root.root.times.mtime, old[1]));
+    assert(mem_fs_get_entry(&root, "/folder", &entry) == 0);
+    assert(after_time(entry.data.directory->times.mtime, old[1]));
+    assert(same_time(times->mtime, old[1]) && after_time(times->ctime, old[1]));
+    assert(mem_fs_set_times(&root, "/file", old) == 0);
+    assert(mem_fs_set_times(&root, "/folder", old) == 0);
+    assert(mem_fs_link(&root, "/file", "/folder/link") == 0);
+    assert(after_time(entry.data.directory->times.mtime, old[1]));
+    assert(same_time(times->mtime, old[1]) && after_time(times->ctime, old[1]));
+    assert(mem_fs_set_times(&root, "/folder", old) == 0);
+    assert(mem_fs_rm_file(&root, "/folder/link") == 0);
+    assert(after_time(entry.data.directory->times.mtime, old[1]));
+    // The coarse clock is not behind by more than a tick
+    struct timespec before;
+    clock_gettime(CLOCK_REALTIME, &before);
+    before.tv_sec--;
+    mem_fs_set_coarse_clock(&root, true);
+    assert(mem_fs_write(&root, "/file", 5, "Hello", 0) == 5);
+    mem_fs_set_coarse_clock(&root, false);
+    assert(after_time(times->mtime, before));
+    // Packing
+    struct timespec packed = {.tv_sec = -5, .tv_nsec = 7};
+    assert(same_time(mem_fs_unpack_time(mem_fs_pack_time(packed)), packed));
+    assert(same_time(mem_fs_unpack_time(mem_fs_pack_time(old[1])), old[1]));
+    // Timestamps survive a checkpoint and the journal
+    char *directory = create_journal_directory();
+    struct mem_fs_journal journal;
+    assert(mem_fs_journal_open(&journal, directory, &root, MEM_FS_DEFAULT_CHECKPOINT_SIZE) == 0);
+    assert(mem_fs_symlink(&root, "file", "/symlink") == 0);
+    assert(mem_fs_link(&root, "/file", "/folder/link") == 0);
+    assert(mem_fs_set_times(&root, "/file", old) == 0);
+    assert(mem_fs_set_times(&root, "/folder", old) == 0);
+    assert(mem_fs_set_times(&root, "/symlink", old) == 0);
+    assert(mem_fs_set_times(&root, "/", old) == 0);
+    assert(mem_fs_journal_checkpoint(&journal, &root) == 0);
+    const struct timespec newer[2] = {{.tv_sec = 3000}, {.tv_sec = 4000}};
+    assert(mem_fs_set_times(&root, "/folder/link", newer) == 0);
+    mem_fs_journal_append(&journal, MEM_FS_JOURNAL_UTIMENS, "/folder/link", NULL,
+                          (off_t) mem_fs_pack_time(newer[0]), mem_fs_pack_time(newer[1]), NULL);
+    mem_fs_journal_close(&journal);
+    struct mem_fs replayed;
+    mem_fs_new(&replayed);
+    assert(mem_fs_journal_open(&journal, directory, &replayed, MEM_FS_DEFAULT_CHECKPOINT_SIZE) == 0);
+    assert(same_time(replayed.root.times.atime, old[0]) && same_time(replayed.root.times.mtime, old[1]));
+    assert(mem_fs_get_entry(&replayed, "/folder", &entry) == 0);
+    assert(same_time(entry.data.directory->times.mtime, old[1]));
+    assert(mem_fs_get_entry(&replayed, "/symlink", &entry) == 0);
+    assert(same_time(entry.data.link->times.mtime, old[1]));
+    assert(mem_fs_get_entry(&replayed, "/file", &entry) == 0);
+    assert(same_time(entry.data.file->times.atime, newer[0]) && same_time(entry.data.file->times.mtime, newer[1]));
+    mem_fs_journal_close(&journal);
+    return 0;
+}
+
+/**
+ * Appends a ustar member to an archive
+ * @param archive The archive
+ * @param name Path of member. At most 100 bytes.
+ * @param type Type of member
+ * @param link_name Target of link or NULL
+ * @param data Data of member or NULL
+ * @param size Size of data
+ * @param mtime Modification time
+ */
+static void write_tar_member(FILE *archive, const char *name, char type, const char *link_name,
+                             const char *data, size_t size, long mtime) {
+    char header[512] = {0};
+    strncpy(header, name, 100);
+    sprintf(header + 100, "%07o", 0644);
+    sprintf(header + 124, "%011zo", size);
+    sprintf(header + 136, "%011lo", mtime);
+    memset(header + 148, ' ', 8);
+    header[156] = type;
+    if (link_name != NULL)
+        strncpy(header + 157, link_name, 100);
+    memcpy(header + 257, "ustar\0" "00", 8);
+    unsigned int checksum = 0;
+    for (size_t i = 0; i < sizeof(header); i++)
+        checksum += (unsigned char) header[i];
+    sprintf(header + 148, "%06o", checksum);
+    assert(fwrite(header, 1, sizeof(header), archive) == sizeof(header));
+    if (size != 0) {
+        static const char zeros[512];
+        assert(fwrite(data, 1, size, archive) == size);
+        assert(fwrite(zeros, 1, (512 - size % 512) % 512, archive) == (512 - size % 512) % 512);
+    }
+}
+
+int test_import_tar() {
+    char tar_directory[] = "/tmp/memfs_tar_XXXXXX", tar_path[64];
+    assert(mkdtemp(tar_directory) != NULL);
+    sprintf(tar_path, "%s/archive.tar", tar_directory);
+    char content[5000];
+    for (size_t i = 0; i < sizeof(content); i++)
+        content[i] = (char) (i * 7 + 3);
+    FILE *archive = fopen(tar_path, "wb");
+    assert(archive != NULL);
+    write_tar_member(archive, "./", '5', NULL, NULL, 0, 100);
+    write_tar_member(archive, "./usr/", '5', NULL, NULL, 0, 200);
+    write_tar_member(archive, "./usr/file", '0', NULL, content, sizeof(content), 300);
+    write_tar_member(archive, "./usr/empty", '0', NULL, NULL, 0, 300);
+    // Parents which are not in the archive are created
+    write_tar_member(archive, "opt/deep/folder/file", '0', NULL, content, 10, 400);
+    write_tar_member(archive, "usr/hard", '1', "./usr/file", NULL, 0, 300);
+    write_tar_member(archive, "usr/soft", '2', "file", NULL, 0, 500);
+    // A later member replaces an earlier one
+    write_tar_member(archive, "usr/empty", '0', NULL, "replaced", 8, 300);
+    // Members which do not fit are skipped
+    write_tar_member(archive, "../outside", '0', NULL, content, 10, 300);
+    write_tar_member(archive, "usr/fifo", '6', NULL, NULL, 0, 300);
+    write_tar_member(archive, "usr/0123456789012345678901234567890123456789012345678901234567890123456789",
+                     '0', NULL, content, 10, 300);
+    write_tar_member(archive, "usr/broken", '1', "usr/nothing", NULL, 0, 300);
+    // GNU long name
+    char long_name[200];
+    memset(long_name, 'a', sizeof(long_name));
+    memcpy(long_name, "usr/", 4);
+    long_name[60] = '/';
+    long_name[120] = '/';
+    long_name[180] = '/';
+    long_name[sizeof(long_name) - 1] = '\0';
+    write_tar_member(archive, "././@LongLink", 'L', NULL, long_name, sizeof(long_name), 0);
+    write_tar_member(archive, "usr/cut", '0', NULL, content, 20, 300);
+    // pax extended header with path, size and mtime
+    char pax[128];
+    int pax_length = sprintf(pax, "23 path=usr/pax_folder\n16 mtime=600.25\n");
+    write_tar_member(archive, "PaxHeaders/x", 'x', NULL, pax, pax_length, 0);
+    write_tar_member(archive, "usr/ignored", '5', NULL, NULL, 0, 300);
+    write_tar_member(archive, "usr/pax_folder/file", '0', NULL, content, 30, 300);
+    char zeros[1024] = {0};
+    assert(fwrite(zeros, 1, sizeof(zeros), archive) == sizeof(zeros));
+    assert(fclose(archive) == 0);
+    // Import it
+    struct mem_fs root;
+    mem_fs_new(&root);
+    mem_fs_set_checksums(&root, true, false);
+    struct mem_fs_tar_stats stats;
+    assert(mem_fs_import_tar(&root, tar_path, &stats) == 0);
+    assert(stats.files == 6 && stats.folders == 2 && stats.links == 2 && stats.skipped == 4);
+    assert(stats.bytes == sizeof(content) + 10 + 8 + 20 + 30);
+    char read_buffer[sizeof(content)];
+    assert(mem_fs_read(&root, "/usr/file", sizeof(read_buffer), read_buffer, 0) == sizeof(content));
+    assert(memcmp(read_buffer, content, sizeof(content)) == 0);
+    assert_checksum(&root, "/usr/file");
+    assert(mem_fs_read(&root, "/usr/empty", sizeof(read_buffer), read_buffer, 0) == 8);
+    assert(memcmp(read_buffer, "replaced", 8) == 0);
+    assert(mem_fs_read(&root, "/opt/deep/folder/file", sizeof(read_buffer), read_buffer, 0) == 10);
+    assert(mem_fs_read(&root, long_name, sizeof(read_buffer), read_buffer, 0) == 20);
+    assert(mem_fs_read(&root, "/usr/pax_folder/file", sizeof(read_buffer), read_buffer, 0) == 30);
+    assert(mem_fs_readlink(&root, "/usr/soft", read_buffer, sizeof(read_buffer)) == 0);
+    assert(strcmp(read_buffer, "file") == 0);
+    struct mem_fs_entry entry;
+    assert(mem_fs_get_entry(&root, "/usr/hard", &entry) == 0);
+    assert(entry.data.file->link_count == 2 && entry.data.file->times.mtime.tv_sec == 300);
+    assert(mem_fs_get_entry(&root, "/usr/ignored", &entry) == ENOENT);
+    assert(mem_fs_get_entry(&root, "/outside", &entry) == ENOENT);
+    assert(mem_fs_get_entry(&root, "/usr/fifo", &entry) == ENOENT);
+    assert(mem_fs_get_entry(&root, "/usr/broken", &entry) == ENOENT);
+    assert_usage(&root, "/", sizeof(content) + 10 + 8 + 20 + 30, 15);
+    // Folders keep their times even though entries are added to them later
+    assert(root.root.times.mtime.tv_sec == 100);
+    assert(mem_fs_get_entry(&root, "/usr", &entry) == 0);
+    assert(entry.data.directory->times.mtime.tv_sec == 200);
+    assert(mem_fs_get_entry(&root, "/usr/pax_folder", &entry) == 0);
+    assert(entry.data.directory->times.mtime.tv_sec == 600);
+    assert(entry.data.directory->times.mtime.tv_nsec == 250000000);
+    // Cut and corrupted archives are rejected
+    assert(truncate(tar_path, 512 * 4 + 100) == 0);
+    mem_fs_new(&root);
+    assert(mem_fs_import_tar(&root, tar_path, &stats) == EPROTO);
+    archive = fopen(tar_path, "r+b");
+    assert(archive != NULL);
+    assert(fseek(archive, 512 + 10, SEEK_SET) == 0);
+    assert(fputc('x', archive) != EOF);
+    assert(fclose(archive) == 0);
+    mem_fs_new(&root);
+    assert(mem_fs_import_tar(&root, tar_path, &stats) == EPROTO);
+    assert(mem_fs_import_tar(&root, "/nothing.tar", &stats) == ENOENT);
+    unlink(tar_path);
+    rmdir(tar_directory);
+    return 0;
+}
+
+int test_instances() {
+    // Each file system has its own tree and settings
+    struct mem_fs first, second;
+    mem_fs_new(&first);
+    mem_fs_new(&second);
+    mem_fs_set_memfd(&first, true);
+    mem_fs_set_checksums(&first, true, true);
+    assert(mem_fs_create_file(&first, "/file", 0) == 0);
+    assert(mem_fs_write(&first, "/file", 5, "first", 0) == 5);
+    struct mem_fs_entry entry;
+    assert(mem_fs_get_entry(&second, "/file", &entry) == ENOENT);
+    assert(mem_fs_create_file(&second, "/file", 0) == 0);
+    assert(mem_fs_write(&second, "/file", 6, "second", 0) == 6);
+    assert(mem_fs_get_entry(&first, "/file", &entry) == 0);
+    assert(entry.data.file->fd >= 0 && entry.data.file->size == 5);
+    assert(mem_fs_get_entry(&second, "/file", &entry) == 0);
+    assert(entry.data.file->fd == -1 && entry.data.file->size == 6);
+    uint32_t checksum;
+    assert(mem_fs_get_checksum(&first, "/file", &checksum) == 0);
+    assert(checksum == mem_fs_crc32c(0, "first", 5));
+    assert(mem_fs_get_checksum(&second, "/file", &checksum) == ENOTSUP);
+    char read_buffer[16];
+    assert(mem_fs_read(&first, "/file", sizeof(read_buffer), read_buffer, 0) == 5);
+    assert(memcmp(read_buffer, "first", 5) == 0);
+    assert(mem_fs_read(&second, "/file", sizeof(read_buffer), read_buffer, 0) == 6);
+    assert(memcmp(read_buffer, "second", 6) == 0);
+    // Destroying one of them leaves the other one alone
+    assert(mem_fs_create_folder(&first, "/folder") == 0);
+    assert(mem_fs_create_file(&first, "/folder/file", 100) == 0);
+    mem_fs_destroy(&first);
+    assert(mem_fs_read(&second, "/file", sizeof(read_buffer), read_buffer, 0) == 6);
+    // A destroyed file system can be created again with the default settings
+    mem_fs_new(&first);
+    assert(first.root.entries == NULL);
+    assert(mem_fs_create_file(&first, "/file", 1) == 0);
+    assert(mem_fs_get_entry(&first, "/file", &entry) == 0 && entry.data.file->fd == -1);
+    assert(mem_fs_get_checksum(&first, "/file", &checksum) == ENOTSUP);
+    mem_fs_destroy(&first);
+    mem_fs_destroy(&second);
+    return 0;
+}
+
+struct lock_tester {
+    struct mem_fs_lock *lock;
+    /**
+     * Changed together under the write lock, so readers must always see them equal
+     */
+    size_t first, second;
+    size_t torn_reads;
+};
+
+static void *lock_tester_main(void *arg) {
+    struct lock_tester *tester = arg;
+    for (int i = 0; i < 20000; i++) {
+        if (i % 10 == 0) {
+            mem_fs_lock_write(tester->lock);
+            tester->first++;
+            tester->second++;
+            mem_fs_unlock_write(tester->lock);
+        } else {
+            unsigned int slot = mem_fs_lock_read(tester->lock);
+            assert(slot < tester->lock->slot_count);
+            if (tester->first != tester->second)
+                __atomic_add_fetch(&tester->torn_reads, 1, __ATOMIC_RELAXED);
+            mem_fs_unlock_read(tester->lock, slot);
+        }
+    }
+    return NULL;
+}
+
+static void *lock_writer_main(void *arg) {
+    mem_fs_lock_write(arg);
+    mem_fs_unlock_write(arg);
+    return NULL;
+}
+
+int test_lock() {
+    struct mem_fs_lock lock;
+    mem_fs_lock_init(&lock);
+    // A slot for each CPU, but writers never take more than the cap
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    assert(lock.slot_count >= 1 && lock.slot_count <= MEM_FS_LOCK_MAX_SLOTS);
+    assert(lock.slot_count == (cpus > MEM_FS_LOCK_MAX_SLOTS ? MEM_FS_LOCK_MAX_SLOTS : (unsigned int) cpus));
+    // Writers exclude readers on every slot, wherever the threads run
+    struct lock_tester tester = {.lock = &lock};
+    pthread_t threads[8];
+    for (int i = 0; i < 8; i++)
+        assert(pthread_create(&threads[i], NULL, lock_tester_main, &tester) == 0);
+    for (int i = 0; i < 8; i++)
+        pthread_join(threads[i], NULL);
+    assert(tester.first == 8 * 2000 && tester.second == 8 * 2000);
+    assert(tester.torn_reads == 0);
+    // Readers on the same slot share it
+    unsigned int first_slot = mem_fs_lock_read(&lock);
+    assert(pthread_rwlock_tryrdlock(&lock.slots[first_slot].lock) == 0);
+    assert(pthread_rwlock_trywrlock(&lock.slots[first_slot].lock) == EBUSY);
+    pthread_rwlock_unlock(&lock.slots[first_slot].lock);
+    mem_fs_unlock_read(&lock, first_slot);
+    // New readers wait behind a waiting writer
+    first_slot = mem_fs_lock_read(&lock);
+    pthread_t writer;
+    assert(pthread_create(&writer, NULL, lock_writer_main, &lock) == 0);
+    int waits = 0;
+    while (pthread_rwlock_tryrdlock(&lock.slots[first_slot].lock) == 0) {
+        pthread_rwlock_unlock(&lock.slots[first_slot].lock);
+        assert(++waits < 5000);
+        usleep(1000);
+    }
+    mem_fs_unlock_read(&lock, first_slot);
+    pthread_join(writer, NULL);
+    mem_fs_lock_write(&lock);
+    for (unsigned int i = 0; i < lock.slot_count; i++)
+        assert(pthread_rwlock_tryrdlock(&lock.slots[i].lock) == EBUSY);
+    mem_fs_unlock_write(&lock);
+    mem_fs_lock_destroy(&lock);
+    return 0;
+}
+
+/**
+ * Frees a list of entries which mem_fs_cache_evict returned
+ * @return Number of freed entries
+ */
+static int free_evicted(struct mem_fs_entry *evicted) {
+    int count = 0;
+    while (evicted != NULL) {
+        struct mem_fs_entry *next = evicted->next;
+        mem_fs_free_entry(evicted);
+        evicted = next;
+        count++;
+    }
+    return count;
+}
+
+int test_cache() {
+    struct mem_fs root;
+    mem_fs_new(&root);
+    struct mem_fs_cache cache;
+    mem_fs_cache_init(&cache, 100);
+    mem_fs_set_cache(&root, &cache);
+    struct mem_fs_cache_stats stats;
+    struct mem_fs_entry entry;
+    char buffer[40];
+    // Nothing is removed while in budget
+    assert(mem_fs_create_folder(&root, "/folder") == 0);
+    assert(mem_fs_create_file(&root, "/a", 40) == 0);
+    assert(mem_fs_create_file(&root, "/b", 40) == 0);
+    assert(mem_fs_create_file(&root, "/empty", 0) == 0);
+    assert(mem_fs_link(&root, "/a", "/folder/a") == 0);
+    assert(mem_fs_cache_evict(&cache, &root) == NULL);
+    // Reading a file makes it the most recently used one, so b is removed with all its bytes
+    assert(mem_fs_read(&root, "/a", sizeof(buffer), buffer, 0) == sizeof(buffer));
+    assert(mem_fs_create_file(&root, "/c", 40) == 0);
+    mem_fs_cache_stats(&cache, &stats);
+    assert(stats.resident_bytes == 120);
+    assert(free_evicted(mem_fs_cache_evict(&cache, &root)) == 1);
+    assert(mem_fs_get_entry(&root, "/b", &entry) == ENOENT);
+    assert(mem_fs_get_entry(&root, "/a", &entry) == 0);
+    assert(mem_fs_get_entry(&root, "/c", &entry) == 0);
+    mem_fs_cache_stats(&cache, &stats);
+    assert(stats.resident_bytes == 80 && stats.evictions == 1 && stats.expirations == 0);
+    assert(stats.evicted_bytes == 40);
+    assert_usage(&root, "/", 80, 5);
+    // Every link of an evicted file is removed. Empty files are never evicted.
+    assert(mem_fs_write(&root, "/c", sizeof(buffer), buffer, 40) == sizeof(buffer));
+    assert(free_evicted(mem_fs_cache_evict(&cache, &root)) == 1);
+    assert(mem_fs_get_entry(&root, "/a", &entry) == ENOENT);
+    assert(mem_fs_get_entry(&root, "/folder/a", &entry) == ENOENT);
+    assert(mem_fs_get_entry(&root, "/empty", &entry) == 0);
+    assert_usage(&root, "/folder", 0, 0);
+    assert_usage(&root, "/", 80, 3);
+    mem_fs_cache_stats(&cache, &stats);
+    assert(stats.resident_bytes == 80 && stats.evictions == 2 && stats.evicted_bytes == 80);
+    // Removed files leave the cache
+    assert(mem_fs_create_file(&root, "/d", 10) == 0);
+    assert(mem_fs_rm_file(&root, "/d") == 0);
+    mem_fs_cache_stats(&cache, &stats);
+    assert(stats.resident_bytes == 80);
+    // Files expire after their time to live since their last modification
+    assert(mem_fs_set_ttl(&root, "/c", -1) == EINVAL);
+    assert(mem_fs_set_ttl(&root, "/folder", 10) == EISDIR);
+    assert(mem_fs_set_ttl(&root, "/c", 3600) == 0);
+    assert(mem_fs_get_entry(&root, "/c", &entry) == 0);
+    assert(entry.data.file->ttl == 3600);
+    assert(mem_fs_cache_evict(&cache, &root) == NULL);
+    const struct timespec old[2] = {{.tv_sec = 1000}, {.tv_sec = 2000}};
+    assert(mem_fs_set_times(&root, "/c", old) == 0);
+    assert(free_evicted(mem_fs_cache_evict(&cache, &root)) == 1);
+    assert(mem_fs_get_entry(&root, "/c", &entry) == ENOENT);
+    mem_fs_cache_stats(&cache, &stats);
+    assert(stats.resident_bytes == 0 && stats.expirations == 1 && stats.evicted_bytes == 160);
+    // A time to live of zero keeps the file
+    assert(mem_fs_create_file(&root, "/e", 10) == 0);
+    assert(mem_fs_set_ttl(&root, "/e", 10) == 0);
+    assert(mem_fs_set_ttl(&root, "/e", 0) == 0);
+    assert(mem_fs_set_times(&root, "/e", old) == 0);
+    assert(mem_fs_cache_evict(&cache, &root) == NULL);
+    assert(cache.ttl_head == NULL);
+    // Capacity which is reserved beyond the end of file is charged
+    assert(mem_fs_fallocate(&root, "/e", FALLOC_FL_KEEP_SIZE, 0, 60) == 0);
+    mem_fs_cache_stats(&cache, &stats);
+    assert(stats.resident_bytes == 60 && !mem_fs_cache_overrun(&cache));
+    assert(mem_fs_write(&root, "/e", sizeof(buffer), buffer, 60) == sizeof(buffer));
+    assert(mem_fs_write(&root, "/e", sizeof(buffer), buffer, 100) == sizeof(buffer));
+    assert(mem_fs_get_entry(&root, "/e", &entry) == 0);
+    assert(entry.data.file->size == 140 && entry.data.file->capacity == 150);
+    mem_fs_cache_stats(&cache, &stats);
+    assert(stats.resident_bytes == 150);
+    // A quarter over the budget, writers must evict before releasing the lock
+    assert(mem_fs_cache_overrun(&cache));
+    assert(free_evicted(mem_fs_cache_evict(&cache, &root)) == 1);
+    assert(!mem_fs_cache_overrun(&cache));
+    mem_fs_cache_stats(&cache, &stats);
+    assert(stats.resident_bytes == 0 && stats.evicted_bytes == 310);
+    // The eviction thread stops waiting when the cache stops
+    mem_fs_cache_stop(&cache);
+    assert(!mem_fs_cache_wait(&cache));
+    mem_fs_destroy(&root);
+    mem_fs_cache_destroy(&cache);
+    // Times to live need a cache
+    struct mem_fs other;
+    mem_fs_new(&other);
+    assert(mem_fs_create_file(&other, "/file", 10) == 0);
+    assert(mem_fs_set_ttl(&other, "/file", 10) == ENOTSUP);
+    mem_fs_destroy(&other);
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include "reclaimer.h"
+
+static void *reclaimer_thread_main(void *arg) {
+    struct mem_fs_reclaimer *reclaimer = arg;
+    pthread_mutex_lock(&reclaimer->mutex);
+    while (true) {
+        while (reclaimer->queue_length == 0 && !reclaimer->stopping)
+            pthread_cond_wait(&reclaimer->cond, &reclaimer->mutex);
+        if (reclaimer->queue_length == 0) // stopping and queue is drained
+            break;
+        // Pop one entry and free it out of lock
+        struct mem_fs_entry *entry = reclaimer->queue[reclaimer->queue_head];
+        size_t bytes = reclaimer->queue_bytes[reclaimer->queue_head];
+        reclaimer->queue_head = (reclaimer->queue_head + 1) % MEM_FS_RECLAIMER_QUEUE_SIZE;
+        reclaimer->queue_length--;
+        pthread_mutex_unlock(&reclaimer->mutex);
+        mem_fs_free_entry(entry);
+        pthread_mutex_lock(&reclaimer->mutex);
+        reclaimer->stats.pending_bytes -= bytes;
+        reclaimer->stats.pending_entries--;
+        reclaimer->stats.reclaimed_bytes += bytes;
+    }
+    pthread_mutex_unlock(&reclaimer->mutex);
+    return NULL;
+}
+
+void mem_fs_reclaimer_init(struct mem_fs_reclaimer *reclaimer) {
+    reclaimer->queue_head = 0;
+    reclaimer->queue_length = 0;
+    reclaimer->stats = (struct mem_fs_reclaimer_stats) {0};
+    reclaimer->stopping = false;
+    reclaimer->started = false;
+    pthread_mutex_init(&reclaimer->mutex, NULL);
+    pthread_cond_init(&reclaimer->cond, NULL);
+}
+
+int mem_fs_reclaimer_start(struct mem_fs_reclaimer *reclaimer) {
+    int result = pthread_create(&reclaimer->thread, NULL, reclaimer_thread_main, reclaimer);
+    reclaimer->started = result == 0;
+    return result;
+}
+
+void mem_fs_reclaimer_stop(struct mem_fs_reclaimer *reclaimer) {
+    pthread_mutex_lock(&reclaimer->mutex);
+    reclaimer->stopping = true;
+    pthread_cond_signal(&reclaimer->cond);
+    pthread_mutex_unlock(&reclaimer->mutex);
+    if (reclaimer->started)
+        pthread_join(reclaimer->thread, NULL);
+    reclaimer->started = false;
+}
+
+void mem_fs_reclaimer_free(struct mem_fs_reclaimer *reclaimer, struct mem_fs_entry *entry) {
+    size_t bytes = mem_fs_entry_bytes(entry);
+    pthread_mutex_lock(&reclaimer->mutex);
+    if (!reclaimer->started || reclaimer->stopping || reclaimer->queue_length == MEM_FS_RECLAIMER_QUEUE_SIZE) {
+        // No room in queue. Free it ourselves.
+        reclaimer->stats.inline_bytes += bytes;
+        pthread_mutex_unlock(&reclaimer->mutex);
+        mem_fs_free_entry(entry);
+        return;
+    }
+    size_t tail = (reclaimer->queue_head + reclaimer->queue_length) % MEM_FS_RECLAIMER_QUEUE_SIZE;
+    reclaimer->queue[tail] = entry;
+    reclaimer->queue_bytes[tail] = bytes;
+    reclaimer->queue_length++;
+    reclaimer->stats.pending_bytes += bytes;
+    reclaimer->stats.pending_entries++;
+    pthread_cond_signal(&reclaimer->cond);
+    pthread_mutex_unlock(&reclaimer->mutex);
+}
+
+void mem_fs_reclaimer_stats(struct mem_fs_reclaimer *reclaimer, struct mem_fs_reclaimer_stats *stats) {
+    pthread_mutex_lock(&reclaimer->mutex);
+    *stats = reclaimer->stats;
+    pthread_mutex_unlock(&reclaimer->mutex);
+}
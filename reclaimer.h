@@ -0,0 +1,94 @@
+#include <stdbool.h>
+#include <pthread.h>
+#include "memfs.h"
+
+#ifndef MEMFS_RECLAIMER_H
+#define MEMFS_RECLAIMER_H
+
+/**
+ * Maximum number of detached entries waiting to be freed
+ */
+#define MEM_FS_RECLAIMER_QUEUE_SIZE 1024
+
+struct mem_fs_reclaimer_stats {
+    /**
+     * Bytes of file content waiting to be freed
+     */
+    size_t pending_bytes;
+    /**
+     * Number of entries waiting to be freed
+     */
+    size_t pending_entries;
+    /**
+     * Bytes freed by the reclaimer thread so far
+     */
+    size_t reclaimed_bytes;
+    /**
+     * Bytes freed by the caller because the queue was full or the thread was not running
+     */
+    size_t inline_bytes;
+};
+
+/**
+ * Frees detached files and folders in a background thread, so the caller does not pay for munmap of large buffers.
+ */
+struct mem_fs_reclaimer {
+    /**
+     * Ring buffer of entries to free
+     */
+    struct mem_fs_entry *queue[MEM_FS_RECLAIMER_QUEUE_SIZE];
+    /**
+     * Bytes of each entry in queue
+     */
+    size_t queue_bytes[MEM_FS_RECLAIMER_QUEUE_SIZE];
+    size_t queue_head;
+    size_t queue_length;
+    struct mem_fs_reclaimer_stats stats;
+    /**
+     * True when the thread must exit after draining the queue
+     */
+    bool stopping;
+    /**
+     * True if the thread is running
+     */
+    bool started;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+};
+
+/**
+ * Initializes a reclaimer. Until mem_fs_reclaimer_start is called, entries are freed inline.
+ * @param reclaimer The reclaimer to initialize
+ */
+void mem_fs_reclaimer_init(struct mem_fs_reclaimer *reclaimer);
+
+/**
+ * Starts the reclaimer thread
+ * @param reclaimer The reclaimer to start
+ * @return 0 if everything is ok. Otherwise the error value.
+ */
+int mem_fs_reclaimer_start(struct mem_fs_reclaimer *reclaimer);
+
+/**
+ * Frees every queued entry and stops the reclaimer thread
+ * @param reclaimer The reclaimer to stop
+ */
+void mem_fs_reclaimer_stop(struct mem_fs_reclaimer *reclaimer);
+
+/**
+ * Queues a detached entry to be freed in background. If the queue is full, the entry is freed right away.
+ * Do not call this while holding the file system lock.
+ * @param reclaimer The reclaimer
+ * @param entry The detached entry. It must not be in any folder.
+ */
+void mem_fs_reclaimer_free(struct mem_fs_reclaimer *reclaimer, struct mem_fs_entry *entry);
+
+/**
+ * Gets the statistics of reclaimer
+ * @param reclaimer The reclaimer
+ * @param stats The struct to fill the statistics in
+ */
+void mem_fs_reclaimer_stats(struct mem_fs_reclaimer *reclaimer, struct mem_fs_reclaimer_stats *stats);
+
+#endif //MEMFS_RECLAIMER_H
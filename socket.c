@@ -0,0 +1,123 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "socket.h"
+
+int mem_fs_socket_listen(const char *path, int *listen_fd) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path))
+        return ENAMETOOLONG;
+    strcpy(address.sun_path, path);
+    *listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (*listen_fd < 0)
+        return errno;
+    unlink(path);
+    if (bind(*listen_fd, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+        listen(*listen_fd, SOMAXCONN) != 0) {
+        int result = errno;
+        close(*listen_fd);
+        return result;
+    }
+    return 0;
+}
+
+int mem_fs_socket_connect(const char *path, int *socket_fd) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path))
+        return ENAMETOOLONG;
+    strcpy(address.sun_path, path);
+    *socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (*socket_fd < 0)
+        return errno;
+    if (connect(*socket_fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        int result = errno;
+        close(*socket_fd);
+        return result;
+    }
+    return 0;
+}
+
+int mem_fs_socket_write(int socket_fd, const void *buffer, size_t length) {
+    const char *bytes = buffer;
+    while (length > 0) {
+        ssize_t written = write(socket_fd, bytes, length);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        bytes += written;
+        length -= written;
+    }
+    return 0;
+}
+
+int mem_fs_socket_read(int socket_fd, void *buffer, size_t length) {
+    char *bytes = buffer;
+    while (length > 0) {
+        ssize_t read_bytes = read(socket_fd, bytes, length);
+        if (read_bytes < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        if (read_bytes == 0) // the other process is gone
+            return EPIPE;
+        bytes += read_bytes;
+        length -= read_bytes;
+    }
+    return 0;
+}
+
+int mem_fs_socket_send_fds(int socket_fd, const int *fds, size_t count) {
+    char byte = 0;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    char control[CMSG_SPACE(sizeof(int) * MEM_FS_SOCKET_MAX_FDS)];
+    memset(control, 0, sizeof(control));
+    struct msghdr message = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control,
+            .msg_controllen = CMSG_SPACE(sizeof(int) * count),
+    };
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(header), fds, sizeof(int) * count);
+    while (sendmsg(socket_fd, &message, 0) < 0)
+        if (errno != EINTR)
+            return errno;
+    return 0;
+}
+
+int mem_fs_socket_receive_fds(int socket_fd, int *fds, size_t count) {
+    char byte;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    char control[CMSG_SPACE(sizeof(int) * MEM_FS_SOCKET_MAX_FDS)];
+    struct msghdr message = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control,
+            .msg_controllen = CMSG_SPACE(sizeof(int) * count),
+    };
+    ssize_t result;
+    while ((result = recvmsg(socket_fd, &message, MSG_CMSG_CLOEXEC)) < 0)
+        if (errno != EINTR)
+            return errno;
+    if (result == 0)
+        return EPIPE;
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    if (header == NULL || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+        return EPROTO;
+    size_t received = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(header), sizeof(int) * (received < count ? received : count));
+    if (received != count || (message.msg_flags & MSG_CTRUNC) != 0) {
+        for (size_t i = 0; i < received && i < count; i++)
+            close(fds[i]);
+        return EPROTO;
+    }
+    return 0;
+}
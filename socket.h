@@ -0,0 +1,64 @@
+#include <stddef.h>
+
+#ifndef MEMFS_SOCKET_H
+#define MEMFS_SOCKET_H
+
+/**
+ * Maximum number of fds which can be passed in a single call of mem_fs_socket_send_fds. The kernel does not accept
+ * more than 253.
+ */
+#define MEM_FS_SOCKET_MAX_FDS 250
+
+/**
+ * Creates a unix socket which other processes connect to. An old socket file in the same path is removed.
+ * @param path Path of the socket
+ * @param listen_fd Will be set to the listening socket
+ * @return 0 if everything is ok. Otherwise the error value.
+ */
+int mem_fs_socket_listen(const char *path, int *listen_fd);
+
+/**
+ * Connects to a unix socket
+ * @param path Path of the socket
+ * @param socket_fd Will be set to the connected socket
+ * @return 0 if everything is ok. Otherwise the error value.
+ */
+int mem_fs_socket_connect(const char *path, int *socket_fd);
+
+/**
+ * Writes the whole buffer to a socket
+ * @param socket_fd The socket
+ * @param buffer The bytes to write
+ * @param length Number of bytes
+ * @return 0 if everything is ok. Otherwise the error value.
+ */
+int mem_fs_socket_write(int socket_fd, const void *buffer, size_t length);
+
+/**
+ * Reads exactly length bytes from a socket
+ * @param socket_fd The socket
+ * @param buffer The buffer to read to
+ * @param length Number of bytes
+ * @return 0 if everything is ok. EPIPE if the other process closed the socket. Otherwise the error value.
+ */
+int mem_fs_socket_read(int socket_fd, void *buffer, size_t length);
+
+/**
+ * Sends some fds along a single byte
+ * @param socket_fd The socket
+ * @param fds The fds to send. They stay open in this process.
+ * @param count Number of fds. At most MEM_FS_SOCKET_MAX_FDS.
+ * @return 0 if everything is ok. Otherwise the error value.
+ */
+int mem_fs_socket_send_fds(int socket_fd, const int *fds, size_t count);
+
+/**
+ * Receives exactly count fds which were sent with mem_fs_socket_send_fds. The fds are close on exec.
+ * @param socket_fd The socket
+ * @param fds Will be set to the received fds
+ * @param count Number of fds. At most MEM_FS_SOCKET_MAX_FDS.
+ * @return 0 if everything is ok. Otherwise the error value.
+ */
+int mem_fs_socket_receive_fds(int socket_fd, int *fds, size_t count);
+
+#endif //MEMFS_SOCKET_H
@@ -0,0 +1,295 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "spill.h"
+
+static bool is_in_lru(const struct mem_fs_spill *spill, const struct mem_fs_file *file) {
+    return file->lru_prev != NULL || spill->lru_head == file;
+}
+
+static void lru_remove(struct mem_fs_spill *spill, struct mem_fs_file *file) {
+    if (file->lru_prev != NULL)
+        file->lru_prev->lru_next = file->lru_next;
+    else
+        spill->lru_head = file->lru_next;
+    if (file->lru_next != NULL)
+        file->lru_next->lru_prev = file->lru_prev;
+    else
+        spill->lru_tail = file->lru_prev;
+    file->lru_prev = NULL;
+    file->lru_next = NULL;
+}
+
+static void lru_push_front(struct mem_fs_spill *spill, struct mem_fs_file *file) {
+    file->lru_prev = NULL;
+    file->lru_next = spill->lru_head;
+    if (spill->lru_head != NULL)
+        spill->lru_head->lru_prev = file;
+    else
+        spill->lru_tail = file;
+    spill->lru_head = file;
+}
+
+/**
+ * Signals the eviction thread if there are too many bytes in memory. Must be called with the mutex held.
+ */
+static void check_pressure(struct mem_fs_spill *spill) {
+    if (spill->stats.resident_bytes > spill->high_watermark)
+        pthread_cond_signal(&spill->pressure_cond);
+}
+
+/**
+ * Allocates a range of spill file with first fit
+ * @param spill The spill tier
+ * @param length Length of range
+ * @param offset Will be set to the offset of range
+ * @return True if there was enough room
+ */
+static bool allocate_extent(struct mem_fs_spill *spill, size_t length, off_t *offset) {
+    for (size_t i = 0; i < spill->free_extent_count; i++) {
+        struct mem_fs_spill_extent *extent = &spill->free_extents[i];
+        if (extent->length < length)
+            continue;
+        *offset = extent->offset;
+        extent->offset += (off_t) length;
+        extent->length -= length;
+        if (extent->length == 0) { // remove the empty extent
+            spill->free_extent_count--;
+            for (size_t j = i; j < spill->free_extent_count; j++)
+                spill->free_extents[j] = spill->free_extents[j + 1];
+        }
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Gives back a range of spill file and merges it with its neighbours
+ * @param spill The spill tier
+ * @param offset Offset of range
+ * @param length Length of range
+ */
+static void free_extent(struct mem_fs_spill *spill, off_t offset, size_t length) {
+    if (spill->full) { // the eviction thread might be able to make progress again
+        spill->full = false;
+        pthread_cond_signal(&spill->pressure_cond);
+    }
+    // Find the place to keep the list sorted
+    size_t index = 0;
+    while (index < spill->free_extent_count && spill->free_extents[index].offset < offset)
+        index++;
+    const struct mem_fs_spill_extent *previous = index > 0 ? &spill->free_extents[index - 1] : NULL;
+    bool merge_previous = previous != NULL && previous->offset + (off_t) previous->length == offset;
+    bool merge_next = index < spill->free_extent_count &&
+                      offset + (off_t) length == spill->free_extents[index].offset;
+    if (merge_previous && merge_next) {
+        spill->free_extents[index - 1].length += length + spill->free_extents[index].length;
+        spill->free_extent_count--;
+        for (size_t j = index; j < spill->free_extent_count; j++)
+            spill->free_extents[j] = spill->free_extents[j + 1];
+    } else if (merge_previous) {
+        spill->free_extents[index - 1].length += length;
+    } else if (merge_next) {
+        spill->free_extents[index].offset = offset;
+        spill->free_extents[index].length += length;
+    } else {
+        if (spill->free_extent_count == spill->free_extent_capacity) {
+            size_t new_capacity = spill->free_extent_capacity * 2;
+            struct mem_fs_spill_extent *new_extents = realloc(spill->free_extents,
+                                                              new_capacity * sizeof(struct mem_fs_spill_extent));
+            if (new_extents == NULL) // we just leak this range of spill file
+                return;
+            spill->free_extents = new_extents;
+            spill->free_extent_capacity = new_capacity;
+        }
+        for (size_t j = spill->free_extent_count; j > index; j--)
+            spill->free_extents[j] = spill->free_extents[j - 1];
+        spill->free_extents[index].offset = offset;
+        spill->free_extents[index].length = length;
+        spill->free_extent_count++;
+    }
+}
+
+int mem_fs_spill_init(struct mem_fs_spill *spill, const char *path, size_t capacity,
+                      size_t high_watermark, size_t low_watermark) {
+    spill->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (spill->fd < 0)
+        return errno;
+    // Preallocate the file, so spilling does not fail because the disk is full
+    int result = posix_fallocate(spill->fd, 0, (off_t) capacity);
+    if (result != 0) {
+        close(spill->fd);
+        return result;
+    }
+    spill->high_watermark = high_watermark;
+    spill->low_watermark = low_watermark;
+    spill->free_extent_capacity = 16;
+    spill->free_extents = malloc(spill->free_extent_capacity * sizeof(struct mem_fs_spill_extent));
+    if (spill->free_extents == NULL) {
+        close(spill->fd);
+        return ENOMEM;
+    }
+    spill->free_extents[0].offset = 0;
+    spill->free_extents[0].length = capacity;
+    spill->free_extent_count = capacity == 0 ? 0 : 1;
+    spill->lru_head = NULL;
+    spill->lru_tail = NULL;
+    spill->stats = (struct mem_fs_spill_stats) {0};
+    spill->full = false;
+    spill->stopping = false;
+    pthread_mutex_init(&spill->mutex, NULL);
+    pthread_cond_init(&spill->pressure_cond, NULL);
+    return 0;
+}
+
+void mem_fs_spill_destroy(struct mem_fs_spill *spill) {
+    close(spill->fd);
+    free(spill->free_extents);
+    pthread_mutex_destroy(&spill->mutex);
+    pthread_cond_destroy(&spill->pressure_cond);
+}
+
+int mem_fs_spill_access(struct mem_fs_spill *spill, struct mem_fs_file *file) {
+    int result = 0;
+    pthread_mutex_lock(&spill->mutex);
+    if (file->spill_offset >= 0) { // bring it back to memory
+        char *data = malloc(file->size);
+        if (data == NULL) {
+            result = ENOSPC;
+            goto end;
+        }
+        for (size_t read_bytes = 0; read_bytes < file->size;) {
+            ssize_t n = pread(spill->fd, data + read_bytes, file->size - read_bytes,
+                              file->spill_offset + (off_t) read_bytes);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                free(data);
+                result = EIO;
+                goto end;
+            }
+            read_bytes += n;
+        }
+        free_extent(spill, file->spill_offset, file->size);
+        file->data = data;
+        file->capacity = file->size;
+        file->spill_offset = -1;
+        spill->stats.spilled_bytes -= file->size;
+        spill->stats.resident_bytes += file->size;
+        spill->stats.faults++;
+        check_pressure(spill);
+    }
+    // Move to the front of list
+    if (is_in_lru(spill, file))
+        lru_remove(spill, file);
+    lru_push_front(spill, file);
+    end:
+    pthread_mutex_unlock(&spill->mutex);
+    return result;
+}
+
+void mem_fs_spill_resized(struct mem_fs_spill *spill, struct mem_fs_file *file, size_t old_size) {
+    pthread_mutex_lock(&spill->mutex);
+    spill->stats.resident_bytes += file->size - old_size;
+    if (!is_in_lru(spill, file))
+        lru_push_front(spill, file);
+    check_pressure(spill);
+    pthread_mutex_unlock(&spill->mutex);
+}
+
+void mem_fs_spill_forget(struct mem_fs_spill *spill, struct mem_fs_file *file) {
+    pthread_mutex_lock(&spill->mutex);
+    if (file->spill_offset >= 0) {
+        free_extent(spill, file->spill_offset, file->size);
+        spill->stats.spilled_bytes -= file->size;
+        file->spill_offset = -1;
+    } else {
+        if (is_in_lru(spill, file))
+            lru_remove(spill, file);
+        spill->stats.resident_bytes -= file->size;
+    }
+    pthread_mutex_unlock(&spill->mutex);
+}
+
+int mem_fs_spill_read(struct mem_fs_spill *spill, const struct mem_fs_file *file,
+                      size_t buffer_size, char *buffer, off_t offset) {
+    for (size_t read_bytes = 0; read_bytes < buffer_size;) {
+        ssize_t n = pread(spill->fd, buffer + read_bytes, buffer_size - read_bytes,
+                          file->spill_offset + offset + (off_t) read_bytes);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return EIO;
+        read_bytes += n;
+    }
+    return 0;
+}
+
+size_t mem_fs_spill_evict(struct mem_fs_spill *spill) {
+    size_t spilled = 0;
+    pthread_mutex_lock(&spill->mutex);
+    while (spill->stats.resident_bytes > spill->low_watermark && spill->lru_tail != NULL) {
+        struct mem_fs_file *file = spill->lru_tail;
+        lru_remove(spill, file);
+        if (file->size == 0) // nothing to spill. It is added back on next access.
+            continue;
+        off_t offset;
+        if (!allocate_extent(spill, file->size, &offset)) { // spill file is full
+            lru_push_front(spill, file);
+            spill->full = true;
+            break;
+        }
+        // Write the content
+        bool ok = true;
+        for (size_t written = 0; written < file->size;) {
+            ssize_t n = pwrite(spill->fd, file->data + written, file->size - written, offset + (off_t) written);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                ok = false;
+                break;
+            }
+            written += n;
+        }
+        if (!ok) { // wait for some room just like when the file is full
+            free_extent(spill, offset, file->size);
+            lru_push_front(spill, file);
+            spill->full = true;
+            break;
+        }
+        // Drop it from memory
+        free(file->data);
+        file->data = NULL;
+        file->capacity = 0;
+        file->spill_offset = offset;
+        spill->stats.resident_bytes -= file->size;
+        spill->stats.spilled_bytes += file->size;
+        spill->stats.spills++;
+        spilled += file->size;
+    }
+    pthread_mutex_unlock(&spill->mutex);
+    return spilled;
+}
+
+bool mem_fs_spill_wait_pressure(struct mem_fs_spill *spill) {
+    pthread_mutex_lock(&spill->mutex);
+    while (!spill->stopping && (spill->stats.resident_bytes <= spill->high_watermark || spill->full))
+        pthread_cond_wait(&spill->pressure_cond, &spill->mutex);
+    bool result = !spill->stopping;
+    pthread_mutex_unlock(&spill->mutex);
+    return result;
+}
+
+void mem_fs_spill_stop(struct mem_fs_spill *spill) {
+    pthread_mutex_lock(&spill->mutex);
+    spill->stopping = true;
+    pthread_cond_broadcast(&spill->pressure_cond);
+    pthread_mutex_unlock(&spill->mutex);
+}
+
+void mem_fs_spill_stats(struct mem_fs_spill *spill, struct mem_fs_spill_stats *stats) {
+    pthread_mutex_lock(&spill->mutex);
+    *stats = spill->stats;
+    pthread_mutex_unlock(&spill->mutex);
+}
@@ -0,0 +1,176 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "memfs.h"
+
+#ifndef MEMFS_SPILL_H
+#define MEMFS_SPILL_H
+
+/**
+ * Default size of the spill file in bytes
+ */
+#define MEM_FS_DEFAULT_SPILL_SIZE (1024UL * 1024 * 1024)
+/**
+ * Default bytes of file content in memory which start the spilling
+ */
+#define MEM_FS_DEFAULT_MEMORY_HIGH (512UL * 1024 * 1024)
+
+struct mem_fs_spill_stats {
+    /**
+     * Bytes of file content in memory
+     */
+    size_t resident_bytes;
+    /**
+     * Bytes of file content in the spill file
+     */
+    size_t spilled_bytes;
+    /**
+     * Number of files moved to the spill file
+     */
+    uint64_t spills;
+    /**
+     * Number of files read back from the spill file
+     */
+    uint64_t faults;
+};
+
+/**
+ * A free range of the spill file
+ */
+struct mem_fs_spill_extent {
+    off_t offset;
+    size_t length;
+};
+
+/**
+ * Moves the content of least recently used files to a local file when memory usage goes over a watermark.
+ */
+struct mem_fs_spill {
+    /**
+     * File descriptor of the preallocated spill file
+     */
+    int fd;
+    /**
+     * When resident bytes go over this value, files are spilled
+     */
+    size_t high_watermark;
+    /**
+     * Files are spilled until resident bytes are at most this value
+     */
+    size_t low_watermark;
+    /**
+     * Free ranges of spill file sorted by offset. Allocated with malloc.
+     */
+    struct mem_fs_spill_extent *free_extents;
+    size_t free_extent_count;
+    size_t free_extent_capacity;
+    /**
+     * Most recently used file which is in memory
+     */
+    struct mem_fs_file *lru_head;
+    /**
+     * Least recently used file which is in memory
+     */
+    struct mem_fs_file *lru_tail;
+    struct mem_fs_spill_stats stats;
+    /**
+     * True if the last eviction stopped because the spill file had no room. Cleared when a range is freed.
+     */
+    bool full;
+    /**
+     * True when mem_fs_spill_wait_pressure must return
+     */
+    bool stopping;
+    /**
+     * Protects everything in this struct and the spill fields of files
+     */
+    pthread_mutex_t mutex;
+    /**
+     * Signaled when resident bytes go over the high watermark or the spill file gets room
+     */
+    pthread_cond_t pressure_cond;
+};
+
+/**
+ * Creates the spill file and initializes the tier. Set the tier with mem_fs_set_spill before creating any file.
+ * @param spill The spill tier to initialize
+ * @param path The path of spill file. It is created if it does not exist. Its old content is discarded.
+ * @param capacity Size of spill file to preallocate
+ * @param high_watermark Start spilling when this many bytes of file content are in memory
+ * @param low_watermark Stop spilling when this many bytes of file content are in memory
+ * @return 0 if everything is ok. Otherwise the error value.
+ */
+int mem_fs_spill_init(struct mem_fs_spill *spill, const char *path, size_t capacity,
+                      size_t high_watermark, size_t low_watermark);
+
+/**
+ * Closes the spill file. Spilled files cannot be read after this.
+ * @param spill The spill tier
+ */
+void mem_fs_spill_destroy(struct mem_fs_spill *spill);
+
+/**
+ * Makes sure the content of a file is in memory and marks it as the most recently used file.
+ * Can be called while holding the file system lock in read mode.
+ * @param spill The spill tier
+ * @param file The file which is going to be accessed
+ * @return 0 if everything is ok. Otherwise the error value.
+ */
+int mem_fs_spill_access(struct mem_fs_spill *spill, struct mem_fs_file *file);
+
+/**
+ * Accounts the change of size of a file which is in memory. New files must be passed to this function as well.
+ * @param spill The spill tier
+ * @param file The file which is resized
+ * @param old_size Size of file before the change. Zero for new files.
+ */
+void mem_fs_spill_resized(struct mem_fs_spill *spill, struct mem_fs_file *file, size_t old_size);
+
+/**
+ * Stops tracking a file which is detached from the tree. Its spilled content, if any, is released.
+ * @param spill The spill tier
+ * @param file The detached file
+ */
+void mem_fs_spill_forget(struct mem_fs_spill *spill, struct mem_fs_file *file);
+
+/**
+ * Reads the content of a spilled file without bringing it back to memory
+ * @param spill The spill tier
+ * @param file The spilled file
+ * @param buffer_size Bytes to read
+ * @param buffer The buffer to read to
+ * @param offset Offset in file. offset + buffer_size must not pass the file size.
+ * @return 0 if everything is ok. Otherwise the error value.
+ */
+int mem_fs_spill_read(struct mem_fs_spill *spill, const struct mem_fs_file *file,
+                      size_t buffer_size, char *buffer, off_t offset);
+
+/**
+ * Moves least recently used files to the spill file until the low watermark is reached or the spill file is full.
+ * The file system lock must be held in write mode.
+ * @param spill The spill tier
+ * @return Number of bytes spilled
+ */
+size_t mem_fs_spill_evict(struct mem_fs_spill *spill);
+
+/**
+ * Blocks until the resident bytes go over the high watermark and the spill file has room
+ * @param spill The spill tier
+ * @return True if files must be evicted, false if mem_fs_spill_stop was called
+ */
+bool mem_fs_spill_wait_pressure(struct mem_fs_spill *spill);
+
+/**
+ * Makes mem_fs_spill_wait_pressure return false
+ * @param spill The spill tier
+ */
+void mem_fs_spill_stop(struct mem_fs_spill *spill);
+
+/**
+ * Gets the statistics of spill tier
+ * @param spill The spill tier
+ * @param stats The struct to fill the statistics in
+ */
+void mem_fs_spill_stats(struct mem_fs_spill *spill, struct mem_fs_spill_stats *stats);
+
+#endif //MEMFS_SPILL_H
@@ -0,0 +1,519 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tar.h"
+
+#define BLOCK_SIZE 512
+#define PADDING(size) ((BLOCK_SIZE - (size) % BLOCK_SIZE) % BLOCK_SIZE)
+/**
+ * Maximum size of pax extended headers and GNU long names
+ */
+#define MAX_EXTENDED_HEADER (1024 * 1024)
+
+/**
+ * Header of each member of archive. All numbers are octal strings, or big endian binary if the first bit is set.
+ */
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char type;
+    char link_name[100];
+    char magic[6];
+    char version[2];
+    char user_name[32];
+    char group_name[32];
+    char dev_major[8];
+    char dev_minor[8];
+    /**
+     * Only used by ustar. GNU tar keeps other fields here.
+     */
+    char prefix[155];
+    char padding[12];
+};
+
+/**
+ * Values of pax extended headers and GNU long names which override the header of next member
+ */
+struct pending_values {
+    char *path;
+    char *link_name;
+    bool has_size;
+    uint64_t size;
+    bool has_mtime;
+    struct timespec mtime;
+};
+
+/**
+ * A folder which its modification time is set at the end, because adding entries to it changes the time
+ */
+struct folder_time {
+    char *path;
+    struct timespec mtime;
+};
+
+struct import_state {
+    struct mem_fs *fs;
+    FILE *archive;
+    struct mem_fs_tar_stats *stats;
+    struct pending_values pending;
+    struct folder_time *folder_times;
+    size_t folder_count, folder_capacity;
+    /**
+     * Normalized paths of the current member and the target of its hard link
+     */
+    char path[PATH_MAX], target[PATH_MAX];
+};
+
+/**
+ * Parses a number field of header
+ * @return True if the field is a valid non-negative number
+ */
+static bool parse_number(const char *field, size_t length, uint64_t *value) {
+    *value = 0;
+    if ((unsigned char) field[0] & 0x80) { // base-256, used for files of 8 GiB or more
+        if ((unsigned char) field[0] & 0x40) // negative
+            return false;
+        *value = (unsigned char) field[0] & 0x3f;
+        for (size_t i = 1; i < length; i++) {
+            if (*value >> 56 != 0)
+                return false;
+            *value = *value << 8 | (unsigned char) field[i];
+        }
+        return true;
+    }
+    size_t i = 0;
+    while (i < length && field[i] == ' ')
+        i++;
+    for (; i < length && field[i] >= '0' && field[i] <= '7'; i++) {
+        if (*value >> 61 != 0)
+            return false;
+        *value = *value << 3 | (field[i] - '0');
+    }
+    return i == length || field[i] == ' ' || field[i] == '\0';
+}
+
+/**
+ * Checks the checksum of a header. The checksum is the sum of bytes of header with the checksum field as spaces.
+ */
+static bool valid_checksum(const struct tar_header *header) {
+    uint64_t expected;
+    if (!parse_number(header->checksum, sizeof(header->checksum), &expected))
+        return false;
+    const unsigned char *bytes = (const unsigned char *) header;
+    size_t checksum_start = offsetof(struct tar_header, checksum);
+    uint64_t sum = ' ' * sizeof(header->checksum);
+    for (size_t i = 0; i < BLOCK_SIZE; i++)
+        if (i < checksum_start || i >= checksum_start + sizeof(header->checksum))
+            sum += bytes[i];
+    return sum == expected;
+}
+
+static bool is_zero_block(const struct tar_header *header) {
+    const char *bytes = (const char *) header;
+    for (size_t i = 0; i < BLOCK_SIZE; i++)
+        if (bytes[i] != 0)
+            return false;
+    return true;
+}
+
+/**
+ * Reads and drops some bytes of archive. Archives are not seeked, so they can be pipes.
+ * @return 0 if everything is ok. EPROTO if the archive ends. Otherwise EIO.
+ */
+static int skip_bytes(FILE *archive, uint64_t length) {
+    char buffer[16 * BLOCK_SIZE];
+    while (length > 0) {
+        size_t chunk = length < sizeof(buffer) ? length : sizeof(buffer);
+        if (fread(buffer, 1, chunk, archive) != chunk)
+            return ferror(archive) ? EIO : EPROTO;
+        length -= chunk;
+    }
+    return 0;
+}
+
+/**
+ * Reads the data of a member as a null terminated string, like a GNU long name or a pax extended header
+ * @param archive The archive
+ * @param size Size of data in header
+ * @param string Will be set to the string allocated with malloc
+ * @return 0 if everything is ok. Otherwise the error value.
+ */
+static int read_string(FILE *archive, uint64_t size, char **string) {
+    if (size > MAX_EXTENDED_HEADER)
+        return EPROTO;
+    *string = malloc(size + 1);
+    if (*string == NULL)
+        return ENOMEM;
+    if (fread(*string, 1, size, archive) != size) {
+        free(*string);
+        *string = NULL;
+        return ferror(archive) ? EIO : EPROTO;
+    }
+    (*string)[size] = '\0';
+    return skip_bytes(archive, PADDING(size));
+}
+
+/**
+ * Parses a pax time like "1700000000.123456789"
+ * @return True if the time is valid
+ */
+static bool parse_pax_time(const char *value, struct timespec *time) {
+    char *end;
+    errno = 0;
+    long long seconds = strtoll(value, &end, 10);
+    if (errno != 0 || end == value)
+        return false;
+    long nanoseconds = 0;
+    if (*end == '.') {
+        long scale = 100000000;
+        for (end++; *end >= '0' && *end <= '9'; end++, scale /= 10)
+            nanoseconds += (*end - '0') * scale;
+    }
+    if (*end != '\0')
+        return false;
+    if (value[0] == '-' && nanoseconds != 0) { // "-1.5" is 2 seconds before the epoch plus half a second
+        seconds--;
+        nanoseconds = 1000000000 - nanoseconds;
+    }
+    time->tv_sec = (time_t) seconds;
+    time->tv_nsec = nanoseconds;
+    return true;
+}
+
+/**
+ * Replaces a pending string with a copy of value
+ */
+static int set_pending_string(char **pending, const char *value) {
+    char *copy = strdup(value);
+    if (copy == NULL)
+        return ENOMEM;
+    free(*pending);
+    *pending = copy;
+    return 0;
+}
+
+/**
+ * Parses the records of a pax extended header. Each record is "length key=value\n" where length counts the whole
+ * record. Only the keys which matter to the tree are kept.
+ * @return 0 if everything is ok. EPROTO if the header is corrupted. Otherwise the error value.
+ */
+static int parse_pax_header(char *data, size_t length, struct pending_values *pending) {
+    size_t offset = 0;
+    while (offset < length) {
+        char *record = data + offset, *end;
+        unsigned long record_length = strtoul(record, &end, 10);
+        if (end == record || *end != ' ' || record_length > length - offset ||
+            record_length <= (size_t) (end - record) + 1 || record[record_length - 1] != '\n')
+            return EPROTO;
+        record[record_length - 1] = '\0';
+        char *key = end + 1, *value = strchr(key, '=');
+        if (value == NULL)
+            return EPROTO;
+        *value++ = '\0';
+        int result = 0;
+        if (strcmp(key, "path") == 0) {
+            result = set_pending_string(&pending->path, value);
+        } else if (strcmp(key, "linkpath") == 0) {
+            result = set_pending_string(&pending->link_name, value);
+        } else if (strcmp(key, "size") == 0) {
+            errno = 0;
+            pending->size = strtoull(value, &end, 10);
+            pending->has_size = true;
+            if (errno != 0 || end == value || *end != '\0')
+                result = EPROTO;
+        } else if (strcmp(key, "mtime") == 0) {
+            pending->has_mtime = parse_pax_time(value, &pending->mtime);
+            if (!pending->has_mtime)
+                result = EPROTO;
+        }
+        if (result != 0)
+            return result;
+        offset += record_length;
+    }
+    return 0;
+}
+
+static void clear_pending(struct pending_values *pending) {
+    free(pending->path);
+    free(pending->link_name);
+    memset(pending, 0, sizeof(*pending));
+}
+
+/**
+ * Turns a path of archive into a path of file system: "./usr//bin/" becomes "/usr/bin"
+ * @param name The path in archive
+ * @param path Will be set to the normalized path. Must hold PATH_MAX bytes.
+ * @return True if the path is valid. Paths which go up with ".." and too long paths are not.
+ */
+static bool normalize_path(const char *name, char *path) {
+    size_t length = 0;
+    while (*name != '\0') {
+        while (*name == '/')
+            name++;
+        const char *end = name;
+        while (*end != '/' && *end != '\0')
+            end++;
+        size_t part_length = end - name;
+        if (part_length == 2 && name[0] == '.' && name[1] == '.')
+            return false;
+        if (part_length != 0 && !(part_length == 1 && name[0] == '.')) {
+            if (length + 1 + part_length >= PATH_MAX)
+                return false;
+            path[length++] = '/';
+            memcpy(path + length, name, part_length);
+            length += part_length;
+        }
+        name = end;
+    }
+    if (length == 0) // the root itself
+        path[length++] = '/';
+    path[length] = '\0';
+    return true;
+}
+
+/**
+ * Creates the missing folders above a path
+ * @param fs The file system
+ * @param path A normalized path. It is changed while this function runs.
+ * @return 0 if everything is ok. Otherwise the error of mem_fs_create_folder.
+ */
+static int create_parents(struct mem_fs *fs, char *path) {
+    for (char *slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        int result = mem_fs_create_folder(fs, path);
+        *slash = '/';
+        if (result != 0 && result != EEXIST)
+            return result;
+    }
+    return 0;
+}
+
+/**
+ * Makes room for a new entry after its creation failed: creates the missing folders above it or removes the older
+ * file or link with the same path.
+ * @param fs The file system
+ * @param path The normalized path of entry
+ * @param error The error of creation
+ * @return True if the creation should be retried
+ */
+static bool make_room(struct mem_fs *fs, char *path, int error) {
+    if (error == ENOENT)
+        return create_parents(fs, path) == 0;
+    struct mem_fs_entry entry;
+    return error == EEXIST && mem_fs_get_entry(fs, path, &entry) == 0 && entry.type != CROW_FS_FOLDER &&
+           mem_fs_rm_file(fs, path) == 0;
+}
+
+static int add_folder_time(struct import_state *state, struct timespec mtime) {
+    if (state->folder_count == state->folder_capacity) {
+        size_t new_capacity = state->folder_capacity == 0 ? 64 : state->folder_capacity * 2;
+        struct folder_time *new_times = realloc(state->folder_times, new_capacity * sizeof(struct folder_time));
+        if (new_times == NULL)
+            return ENOMEM;
+        state->folder_times = new_times;
+        state->folder_capacity = new_capacity;
+    }
+    char *path = strdup(state->path);
+    if (path == NULL)
+        return ENOMEM;
+    state->folder_times[state->folder_count++] = (struct folder_time) {.path = path, .mtime = mtime};
+    return 0;
+}
+
+static void set_mtime(struct mem_fs *fs, const char *path, struct timespec mtime) {
+    const struct timespec times[2] = {mtime, mtime};
+    mem_fs_set_times(fs, path, times);
+}
+
+/**
+ * Creates one member of archive in the tree and reads its data
+ * @param state The state of import
+ * @param type Type of member in header
+ * @param name Path of member in archive
+ * @param link_name Target of hard link or symbolic link
+ * @param size Size of data of member
+ * @param mtime Modification time of member
+ * @return 0 if the member is imported or skipped. Otherwise the error value.
+ */
+static int import_member(struct import_state *state, char type, const char *name, const char *link_name,
+                         uint64_t size, struct timespec mtime) {
+    struct mem_fs *fs = state->fs;
+    char *path = state->path;
+    if (!normalize_path(name, path)) {
+        state->stats->skipped++;
+        return skip_bytes(state->archive, size + PADDING(size));
+    }
+    bool is_root = strcmp(path, "/") == 0;
+    int result = 0;
+    uint64_t unread = size;
+    switch (type) {
+        case '0':
+        case '\0':
+        case '7': // contiguous files are regular files for everyone but a few old systems
+            if (is_root || size > SIZE_MAX) {
+                result = EINVAL;
+                break;
+            }
+            result = mem_fs_create_file_from(fs, path, size, state->archive);
+            if (make_room(fs, path, result))
+                result = mem_fs_create_file_from(fs, path, size, state->archive);
+            if (result == 0) {
+                unread = 0;
+                set_mtime(fs, path, mtime);
+                state->stats->files++;
+                state->stats->bytes += size;
+            } else if (result == EIO && feof(state->archive)) {
+                return EPROTO;
+            }
+            break;
+        case '5':
+            result = is_root ? 0 : mem_fs_create_folder(fs, path);
+            if (result == ENOENT && create_parents(fs, path) == 0)
+                result = mem_fs_create_folder(fs, path);
+            if (result == EEXIST) { // listed twice or created as a parent before
+                struct mem_fs_entry entry;
+                if (mem_fs_get_entry(fs, path, &entry) == 0 && entry.type == CROW_FS_FOLDER)
+                    result = 0;
+            }
+            if (result == 0) {
+                result = add_folder_time(state, mtime);
+                state->stats->folders += !is_root;
+            }
+            break;
+        case '1':
+            if (is_root || !normalize_path(link_name, state->target)) {
+                result = EINVAL;
+                break;
+            }
+            result = mem_fs_link(fs, state->target, path);
+            if (make_room(fs, path, result))
+                result = mem_fs_link(fs, state->target, path);
+            state->stats->links += result == 0;
+            break;
+        case '2':
+            if (is_root) {
+                result = EINVAL;
+                break;
+            }
+            result = mem_fs_symlink(fs, link_name, path);
+            if (make_room(fs, path, result))
+                result = mem_fs_symlink(fs, link_name, path);
+            if (result == 0) {
+                set_mtime(fs, path, mtime);
+                state->stats->links++;
+            }
+            break;
+        default:
+            state->stats->skipped++;
+            break;
+    }
+    // Members which do not fit in the tree are skipped, anything else stops the import
+    if (result == ENAMETOOLONG || result == ENOENT || result == EINVAL) {
+        state->stats->skipped++;
+        result = 0;
+    }
+    if (result != 0)
+        return result;
+    return skip_bytes(state->archive, unread + PADDING(size));
+}
+
+int mem_fs_import_tar(struct mem_fs *fs, const char *path, struct mem_fs_tar_stats *stats) {
+    bool standard_input = strcmp(path, "-") == 0;
+    FILE *archive = standard_input ? stdin : fopen(path, "rb");
+    if (archive == NULL)
+        return errno;
+    struct import_state *state = calloc(1, sizeof(struct import_state));
+    if (state == NULL) {
+        if (!standard_input)
+            fclose(archive);
+        return ENOMEM;
+    }
+    memset(stats, 0, sizeof(*stats));
+    state->fs = fs;
+    state->archive = archive;
+    state->stats = stats;
+    int result = 0;
+    struct tar_header header;
+    while (result == 0) {
+        // Some writers leave the zero blocks at the end of archive out
+        size_t header_length = fread(&header, 1, sizeof(header), archive);
+        if (header_length != sizeof(header)) {
+            result = ferror(archive) ? EIO : header_length == 0 ? 0 : EPROTO;
+            break;
+        }
+        if (is_zero_block(&header))
+            break;
+        uint64_t size, seconds;
+        if (!valid_checksum(&header) || !parse_number(header.size, sizeof(header.size), &size) ||
+            !parse_number(header.mtime, sizeof(header.mtime), &seconds)) {
+            result = EPROTO;
+            break;
+        }
+        struct pending_values *pending = &state->pending;
+        switch (header.type) {
+            case 'x': { // pax extended header of next member
+                char *data;
+                result = read_string(archive, size, &data);
+                if (result == 0) {
+                    result = parse_pax_header(data, size, pending);
+                    free(data);
+                }
+                continue;
+            }
+            case 'g': // pax global header, nothing in it matters to us
+                result = skip_bytes(archive, size + PADDING(size));
+                continue;
+            case 'L': // GNU long name of next member
+                free(pending->path);
+                result = read_string(archive, size, &pending->path);
+                continue;
+            case 'K': // GNU long link name of next member
+                free(pending->link_name);
+                result = read_string(archive, size, &pending->link_name);
+                continue;
+            default:
+                break;
+        }
+        // ustar splits long names into prefix and name. None of them has to be null terminated.
+        char name[sizeof(header.prefix) + 1 + sizeof(header.name) + 1];
+        size_t name_length = 0;
+        if (memcmp(header.magic, "ustar", sizeof(header.magic)) == 0 && header.prefix[0] != '\0') {
+            name_length = strnlen(header.prefix, sizeof(header.prefix));
+            memcpy(name, header.prefix, name_length);
+            name[name_length++] = '/';
+        }
+        size_t length = strnlen(header.name, sizeof(header.name));
+        memcpy(name + name_length, header.name, length);
+        name[name_length + length] = '\0';
+        char link_name[sizeof(header.link_name) + 1];
+        length = strnlen(header.link_name, sizeof(header.link_name));
+        memcpy(link_name, header.link_name, length);
+        link_name[length] = '\0';
+        struct timespec mtime = {.tv_sec = (time_t) seconds};
+        result = import_member(state, header.type, pending->path != NULL ? pending->path : name,
+                               pending->link_name != NULL ? pending->link_name : link_name,
+                               pending->has_size ? pending->size : size,
+                               pending->has_mtime ? pending->mtime : mtime);
+        clear_pending(pending);
+    }
+    // Folders get their times after everything inside them is created
+    for (size_t i = 0; i < state->folder_count; i++) {
+        if (result == 0)
+            set_mtime(fs, state->folder_times[i].path, state->folder_times[i].mtime);
+        free(state->folder_times[i].path);
+    }
+    free(state->folder_times);
+    clear_pending(&state->pending);
+    free(state);
+    if (!standard_input)
+        fclose(archive);
+    return result;
+}
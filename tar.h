@@ -0,0 +1,43 @@
+#include <stddef.h>
+#include "memfs.h"
+
+#ifndef MEMFS_TAR_H
+#define MEMFS_TAR_H
+
+struct mem_fs_tar_stats {
+    /**
+     * Number of regular files which are created
+     */
+    size_t files;
+    /**
+     * Number of folders which are created
+     */
+    size_t folders;
+    /**
+     * Number of hard links and symbolic links which are created
+     */
+    size_t links;
+    /**
+     * Bytes of file content which are read
+     */
+    size_t bytes;
+    /**
+     * Number of members which are not imported: devices, fifos, sparse files, paths with "..", names longer than
+     * MAX_FILE_NAME and hard links to missing files
+     */
+    size_t skipped;
+};
+
+/**
+ * Imports a tar archive into the tree. The archive is read once from start to end, so it can be a pipe. The content
+ * of each file is read straight into its storage which is allocated once with the size in the tar header.
+ * ustar, GNU long names and pax extended headers are understood. Modification times are kept, owners and modes are
+ * ignored. Missing parent folders are created and existing files are replaced, like tar does.
+ * @param fs The file system
+ * @param path The path of archive. "-" reads the standard input.
+ * @param stats Will be filled with the number of imported members
+ * @return 0 if everything is ok. EPROTO if the archive is corrupted. Otherwise the error value.
+ */
+int mem_fs_import_tar(struct mem_fs *fs, const char *path, struct mem_fs_tar_stats *stats);
+
+#endif //MEMFS_TAR_H
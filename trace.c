@@ -0,0 +1,318 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "trace.h"
+
+#define TRACE_MAGIC "MEMFSTRC"
+#define TRACE_VERSION 1
+/**
+ * Seconds which the writer thread waits before writing a buffer which is not half full
+ */
+#define WRITE_INTERVAL 1
+
+/**
+ * Header of trace files
+ */
+struct file_header {
+    char magic[8];
+    uint64_t version;
+};
+
+/**
+ * Header of each record. It is followed by path and new_path which are not null terminated.
+ */
+struct record_header {
+    uint16_t op;
+    uint16_t path_length;
+    uint16_t new_path_length;
+    uint16_t thread;
+    int32_t result;
+    uint32_t flags;
+    uint64_t start;
+    uint64_t latency;
+    uint64_t offset;
+    uint64_t size;
+};
+
+/**
+ * Id of the current thread in thread_trace. Ids are given on the first record of each thread.
+ */
+static _Thread_local uint32_t thread_id;
+static _Thread_local const struct mem_fs_trace *thread_trace;
+
+static const char *op_names[MEM_FS_TRACE_OP_COUNT] = {
+        [MEM_FS_TRACE_GETATTR] = "getattr",
+        [MEM_FS_TRACE_READDIR] = "readdir",
+        [MEM_FS_TRACE_OPEN] = "open",
+        [MEM_FS_TRACE_READ] = "read",
+        [MEM_FS_TRACE_WRITE] = "write",
+        [MEM_FS_TRACE_TRUNCATE] = "truncate",
+        [MEM_FS_TRACE_RENAME] = "rename",
+        [MEM_FS_TRACE_FSYNC] = "fsync",
+        [MEM_FS_TRACE_RMDIR] = "rmdir",
+        [MEM_FS_TRACE_UNLINK] = "unlink",
+        [MEM_FS_TRACE_GETXATTR] = "getxattr",
+        [MEM_FS_TRACE_SETXATTR] = "setxattr",
+        [MEM_FS_TRACE_CREATE] = "create",
+        [MEM_FS_TRACE_MKDIR] = "mkdir",
+        [MEM_FS_TRACE_FALLOCATE] = "fallocate",
+        [MEM_FS_TRACE_LINK] = "link",
+        [MEM_FS_TRACE_SYMLINK] = "symlink",
+        [MEM_FS_TRACE_READLINK] = "readlink",
+        [MEM_FS_TRACE_UTIMENS] = "utimens",
+};
+
+/**
+ * Writes the whole buffer to a file descriptor
+ * @return 0 if everything is ok. Otherwise the errno.
+ */
+static int write_fully(int fd, const char *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, buffer, length);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        buffer += written;
+        length -= written;
+    }
+    return 0;
+}
+
+static void *writer_thread_main(void *arg) {
+    struct mem_fs_trace *trace = arg;
+    pthread_mutex_lock(&trace->mutex);
+    while (true) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += WRITE_INTERVAL;
+        while (trace->buffer_length < MEM_FS_TRACE_BUFFER_SIZE / 2 && !trace->stopping)
+            if (pthread_cond_timedwait(&trace->cond, &trace->mutex, &deadline) == ETIMEDOUT)
+                break;
+        if (trace->buffer_length == 0 && trace->stopping)
+            break;
+        if (trace->buffer_length == 0)
+            continue;
+        // Swap the buffers and write the full one out of lock
+        char *batch = trace->buffer;
+        size_t batch_length = trace->buffer_length;
+        trace->buffer = trace->spare;
+        trace->buffer_length = 0;
+        pthread_mutex_unlock(&trace->mutex);
+        int result = trace->error == 0 ? write_fully(trace->fd, batch, batch_length) : 0;
+        pthread_mutex_lock(&trace->mutex);
+        if (result != 0 && trace->error == 0)
+            trace->error = result;
+        trace->spare = batch;
+    }
+    pthread_mutex_unlock(&trace->mutex);
+    return NULL;
+}
+
+int mem_fs_trace_open(struct mem_fs_trace *trace, const char *path) {
+    memset(trace, 0, sizeof(*trace));
+    trace->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace->fd < 0)
+        return errno;
+    struct file_header header = {.magic = TRACE_MAGIC, .version = TRACE_VERSION};
+    int result = write_fully(trace->fd, (const char *) &header, sizeof(header));
+    if (result == 0) {
+        trace->buffer = malloc(MEM_FS_TRACE_BUFFER_SIZE);
+        trace->spare = malloc(MEM_FS_TRACE_BUFFER_SIZE);
+        if (trace->buffer == NULL || trace->spare == NULL)
+            result = ENOMEM;
+    }
+    if (result != 0) {
+        free(trace->buffer);
+        free(trace->spare);
+        close(trace->fd);
+        trace->fd = -1;
+        return result;
+    }
+    trace->epoch = mem_fs_trace_clock();
+    pthread_mutex_init(&trace->mutex, NULL);
+    pthread_cond_init(&trace->cond, NULL);
+    return 0;
+}
+
+int mem_fs_trace_start(struct mem_fs_trace *trace) {
+    int result = pthread_create(&trace->thread, NULL, writer_thread_main, trace);
+    trace->started = result == 0;
+    return result;
+}
+
+void mem_fs_trace_close(struct mem_fs_trace *trace) {
+    pthread_mutex_lock(&trace->mutex);
+    trace->stopping = true;
+    pthread_cond_signal(&trace->cond);
+    pthread_mutex_unlock(&trace->mutex);
+    if (trace->started)
+        pthread_join(trace->thread, NULL);
+    else if (trace->buffer_length != 0 && trace->error == 0) // write the leftovers ourselves
+        write_fully(trace->fd, trace->buffer, trace->buffer_length);
+    close(trace->fd);
+    free(trace->buffer);
+    free(trace->spare);
+    pthread_mutex_destroy(&trace->mutex);
+    pthread_cond_destroy(&trace->cond);
+    trace->fd = -1;
+    trace->buffer = NULL;
+    trace->spare = NULL;
+    trace->started = false;
+}
+
+uint64_t mem_fs_trace_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+void mem_fs_trace_record(struct mem_fs_trace *trace, enum mem_fs_trace_op op, const char *path,
+                         const char *new_path, off_t offset, size_t size, uint32_t flags, int result, uint64_t start) {
+    uint64_t now = mem_fs_trace_clock();
+    // Paths longer than a record can hold are cut. The kernel does not send such paths anyway.
+    size_t path_length = strnlen(path, UINT16_MAX);
+    size_t new_path_length = new_path == NULL ? 0 : strnlen(new_path, UINT16_MAX);
+    size_t record_length = sizeof(struct record_header) + path_length + new_path_length;
+    struct record_header header = {
+            .op = op,
+            .path_length = (uint16_t) path_length,
+            .new_path_length = (uint16_t) new_path_length,
+            .flags = flags,
+            .result = result,
+            .start = start - trace->epoch,
+            .latency = now - start,
+            .offset = (uint64_t) offset,
+            .size = size,
+    };
+    pthread_mutex_lock(&trace->mutex);
+    if (trace->buffer_length + record_length > MEM_FS_TRACE_BUFFER_SIZE) { // the writer is behind
+        trace->stats.dropped++;
+        goto end;
+    }
+    if (thread_trace != trace) {
+        thread_trace = trace;
+        thread_id = ++trace->threads;
+    }
+    header.thread = (uint16_t) thread_id;
+    char *record = trace->buffer + trace->buffer_length;
+    memcpy(record, &header, sizeof(header));
+    record += sizeof(header);
+    memcpy(record, path, path_length);
+    record += path_length;
+    if (new_path_length != 0)
+        memcpy(record, new_path, new_path_length);
+    trace->buffer_length += record_length;
+    trace->stats.recorded++;
+    if (trace->buffer_length >= MEM_FS_TRACE_BUFFER_SIZE / 2)
+        pthread_cond_signal(&trace->cond);
+    end:
+    pthread_mutex_unlock(&trace->mutex);
+}
+
+void mem_fs_trace_stats(struct mem_fs_trace *trace, struct mem_fs_trace_stats *stats) {
+    pthread_mutex_lock(&trace->mutex);
+    *stats = trace->stats;
+    pthread_mutex_unlock(&trace->mutex);
+}
+
+/**
+ * Copies a string of a record and null terminates it
+ * @return The string allocated with malloc or NULL if out of memory
+ */
+static char *copy_string(const char *data, size_t length) {
+    char *string = malloc(length + 1);
+    if (string != NULL) {
+        memcpy(string, data, length);
+        string[length] = '\0';
+    }
+    return string;
+}
+
+int mem_fs_trace_load(const char *path, struct mem_fs_trace_event **events, size_t *count) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return errno;
+    *events = NULL;
+    *count = 0;
+    int result = 0;
+    size_t capacity = 0;
+    char *buffer = malloc(2 * UINT16_MAX);
+    if (buffer == NULL) {
+        fclose(file);
+        return ENOMEM;
+    }
+    struct file_header file_header;
+    if (fread(&file_header, sizeof(file_header), 1, file) != 1 ||
+        memcmp(file_header.magic, TRACE_MAGIC, sizeof(file_header.magic)) != 0 ||
+        file_header.version != TRACE_VERSION) {
+        result = EPROTO;
+        goto end;
+    }
+    // A record which is cut at the end of file means that the recorder was killed. Ignore it.
+    struct record_header header;
+    while (fread(&header, sizeof(header), 1, file) == 1) {
+        size_t strings_length = (size_t) header.path_length + header.new_path_length;
+        if (fread(buffer, 1, strings_length, file) != strings_length)
+            break;
+        if (*count == capacity) {
+            size_t new_capacity = capacity == 0 ? 1024 : capacity * 2;
+            struct mem_fs_trace_event *new_events = realloc(*events, new_capacity * sizeof(**events));
+            if (new_events == NULL) {
+                result = ENOMEM;
+                goto end;
+            }
+            *events = new_events;
+            capacity = new_capacity;
+        }
+        struct mem_fs_trace_event *event = &(*events)[*count];
+        event->op = header.op;
+        event->result = header.result;
+        event->thread = header.thread;
+        event->start = header.start;
+        event->latency = header.latency;
+        event->offset = header.offset;
+        event->size = header.size;
+        event->flags = header.flags;
+        event->path = copy_string(buffer, header.path_length);
+        event->new_path = header.new_path_length == 0 ? NULL :
+                          copy_string(buffer + header.path_length, header.new_path_length);
+        if (event->path == NULL || (header.new_path_length != 0 && event->new_path == NULL)) {
+            free(event->path);
+            free(event->new_path);
+            result = ENOMEM;
+            goto end;
+        }
+        (*count)++;
+    }
+    if (ferror(file))
+        result = EIO;
+    end:
+    free(buffer);
+    fclose(file);
+    if (result != 0) {
+        mem_fs_trace_free_events(*events, *count);
+        *events = NULL;
+        *count = 0;
+    }
+    return result;
+}
+
+void mem_fs_trace_free_events(struct mem_fs_trace_event *events, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(events[i].path);
+        free(events[i].new_path);
+    }
+    free(events);
+}
+
+const char *mem_fs_trace_op_name(enum mem_fs_trace_op op) {
+    if (op <= 0 || op >= MEM_FS_TRACE_OP_COUNT)
+        return "unknown";
+    return op_names[op];
+}
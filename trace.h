@@ -0,0 +1,218 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#ifndef MEMFS_TRACE_H
+#define MEMFS_TRACE_H
+
+/**
+ * Size of each of the two record buffers of the recorder in bytes
+ */
+#define MEM_FS_TRACE_BUFFER_SIZE (4 * 1024 * 1024)
+
+enum mem_fs_trace_op {
+    MEM_FS_TRACE_GETATTR = 1,
+    MEM_FS_TRACE_READDIR,
+    MEM_FS_TRACE_OPEN,
+    MEM_FS_TRACE_READ,
+    MEM_FS_TRACE_WRITE,
+    MEM_FS_TRACE_TRUNCATE,
+    MEM_FS_TRACE_RENAME,
+    MEM_FS_TRACE_FSYNC,
+    MEM_FS_TRACE_RMDIR,
+    MEM_FS_TRACE_UNLINK,
+    MEM_FS_TRACE_GETXATTR,
+    MEM_FS_TRACE_SETXATTR,
+    MEM_FS_TRACE_CREATE,
+    MEM_FS_TRACE_MKDIR,
+    MEM_FS_TRACE_FALLOCATE,
+    MEM_FS_TRACE_LINK,
+    MEM_FS_TRACE_SYMLINK,
+    MEM_FS_TRACE_READLINK,
+    MEM_FS_TRACE_UTIMENS,
+    /**
+     * One more than the last operation
+     */
+    MEM_FS_TRACE_OP_COUNT,
+};
+
+/**
+ * A recorded operation which is loaded from a trace file
+ */
+struct mem_fs_trace_event {
+    enum mem_fs_trace_op op;
+    /**
+     * The value which the operation returned to fuse. Negative errno on failure.
+     */
+    int result;
+    /**
+     * A small number which identifies the thread which served the operation. Starts from 1.
+     */
+    uint32_t thread;
+    /**
+     * Nanoseconds from opening the trace until the operation started
+     */
+    uint64_t start;
+    /**
+     * Nanoseconds which the operation took
+     */
+    uint64_t latency;
+    /**
+     * Offset of read and write
+     */
+    uint64_t offset;
+    /**
+     * Bytes of read and write, new size of truncate, length of fallocate or buffer size of extended attributes
+     * and readlink
+     */
+    uint64_t size;
+    /**
+     * Flags of open, mode of fallocate or datasync of fsync
+     */
+    uint32_t flags;
+    /**
+     * The path which operation was applied to. Null terminated.
+     */
+    char *path;
+    /**
+     * The destination of rename and link, target of symlink or name of extended attribute. NULL for other
+     * operations.
+     */
+    char *new_path;
+};
+
+struct mem_fs_trace_stats {
+    /**
+     * Number of records which are accepted
+     */
+    uint64_t recorded;
+    /**
+     * Number of records which are dropped because the writer thread could not keep up
+     */
+    uint64_t dropped;
+};
+
+/**
+ * Records the operations of file system into a file. Recording never blocks on the disk: records are
+ * appended to a memory buffer and a writer thread writes the full buffers to the file.
+ */
+struct mem_fs_trace {
+    /**
+     * File descriptor of the trace file
+     */
+    int fd;
+    /**
+     * Monotonic time of opening the trace. Start time of records are relative to it.
+     */
+    uint64_t epoch;
+    /**
+     * The buffer which records are appended to
+     */
+    char *buffer;
+    size_t buffer_length;
+    /**
+     * The buffer which the writer thread writes out of lock. Swapped with buffer on each write.
+     */
+    char *spare;
+    /**
+     * Number of threads which have recorded something. Used to give each thread a small id.
+     */
+    uint32_t threads;
+    struct mem_fs_trace_stats stats;
+    /**
+     * Sticky errno of the first failed write. 0 if everything is ok.
+     */
+    int error;
+    /**
+     * True if the writer thread must exit
+     */
+    bool stopping;
+    /**
+     * True if the writer thread is running
+     */
+    bool started;
+    pthread_mutex_t mutex;
+    /**
+     * Signaled when the buffer is half full
+     */
+    pthread_cond_t cond;
+    pthread_t thread;
+};
+
+/**
+ * Creates a trace file. An existing file is truncated.
+ * @param trace The trace to initialize
+ * @param path The path of trace file
+ * @return 0 if everything is ok. Otherwise the error value.
+ */
+int mem_fs_trace_open(struct mem_fs_trace *trace, const char *path);
+
+/**
+ * Starts the writer thread. Call this after the process is daemonized, threads do not survive fork.
+ * Until then, records are kept in the buffer and dropped if it gets full.
+ * @param trace An opened trace
+ * @return 0 if everything is ok. Otherwise the error value.
+ */
+int mem_fs_trace_start(struct mem_fs_trace *trace);
+
+/**
+ * Writes all pending records, stops the writer thread and closes the trace file.
+ * @param trace The trace to close
+ */
+void mem_fs_trace_close(struct mem_fs_trace *trace);
+
+/**
+ * Gets the current time for start of an operation
+ * @return Monotonic time in nanoseconds
+ */
+uint64_t mem_fs_trace_clock(void);
+
+/**
+ * Records a finished operation. The latency is measured from start until now.
+ * @param trace The trace to record in
+ * @param op The operation
+ * @param path The path which operation was applied to
+ * @param new_path The destination of rename and link, target of symlink or name of extended attribute. NULL for
+ * other operations.
+ * @param offset The offset of read and write
+ * @param size Bytes of read and write, new size of truncate, length of fallocate or buffer size of extended attributes
+ * and readlink
+ * @param flags Flags of open, mode of fallocate or datasync of fsync. Zero for other operations.
+ * @param result The value which the operation returned to fuse
+ * @param start The value of mem_fs_trace_clock when the operation started
+ */
+void mem_fs_trace_record(struct mem_fs_trace *trace, enum mem_fs_trace_op op, const char *path,
+                         const char *new_path, off_t offset, size_t size, uint32_t flags, int result, uint64_t start);
+
+/**
+ * Gets the number of recorded and dropped records
+ * @param trace The trace
+ * @param stats Will be filled with the statistics
+ */
+void mem_fs_trace_stats(struct mem_fs_trace *trace, struct mem_fs_trace_stats *stats);
+
+/**
+ * Loads all events of a trace file into memory
+ * @param path The path of trace file
+ * @param events Will be set to the array of events. Free it with mem_fs_trace_free_events.
+ * @param count Will be set to the number of events
+ * @return 0 if everything is ok. EPROTO if the file is not a trace. Otherwise the error value.
+ */
+int mem_fs_trace_load(const char *path, struct mem_fs_trace_event **events, size_t *count);
+
+/**
+ * Frees the events which are loaded with mem_fs_trace_load
+ * @param events The events
+ * @param count Number of events
+ */
+void mem_fs_trace_free_events(struct mem_fs_trace_event *events, size_t count);
+
+/**
+ * Gets the name of an operation
+ * @param op The operation
+ * @return The name like "read". "unknown" if op is not valid.
+ */
+const char *mem_fs_trace_op_name(enum mem_fs_trace_op op);
+
+#endif //MEMFS_TRACE_H